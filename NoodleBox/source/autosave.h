@@ -0,0 +1,284 @@
+//////////////////////////////////////////////////////////////////////////////
+// sixty four pixels 2020                                       CC-NC-BY-SA //
+//                                //  //          //                        //
+//   //////   /////   /////   //////  //   /////  //////   /////  //   //   //
+//   //   // //   // //   // //   //  //  //   // //   // //   //  // //    //
+//   //   // //   // //   // //   //  //  /////// //   // //   //   ///     //
+//   //   // //   // //   // //   //  //  //      //   // //   //  // //    //
+//   //   //  /////   /////   //////   //  /////  //////   /////  //   //   //
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// BACKGROUND AUTOSAVE OF THE WORKING STATE
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+#ifndef AUTOSAVE_H_
+#define AUTOSAVE_H_
+
+//
+// The working state is saved every few seconds while the sequencer runs,
+// using background EEPROM writes so that the DAC and the sequencer are never
+// held up. Only the pages that have changed get written.
+//
+// Two copies are kept (in SLOT_AUTOSAVE and in the spare space after the last
+// slot) and saves alternate between them. Each copy holds a generation number
+// and a checksum, so if the power goes during a save the checksum of that copy
+// fails and the other copy is still good. Because of this the slot is not
+// marked invalid while it is written (see CI2CEeprom), which saves a write of
+// the first page on every autosave. At power up we restore the good copy with
+// the newest generation.
+// This is done through the I2C state machine so the caller can carry on
+// with other things while the data loads.
+//
+// Image layout:
+// [AUTOSAVE_DATA_COOKIE1][generation][patch image]
+// where the patch image is in the same format as a saved patch, with its own
+// checksum (see patch_format.h)
+//
+class CAutosave {
+	enum {
+		INTERVAL_MS = 5000,		// how often to check whether the state has changed
+		SZ_HEADER = 2,
+		NUM_COPIES = 2
+	};
+	static_assert(SLOT_AUTOSAVE_ALT * PATCH_SLOT_SIZE + SZ_HEADER + CPatchCache::SZ_MAX_IMAGE <= EEPROM_SIZE,
+			"Second autosave copy does not fit in the EEPROM");
+	typedef enum:byte {
+		RESTORE_NONE,			// restore not started yet
+		RESTORE_READ,			// reading each copy in turn
+		RESTORE_REREAD,			// reading back the copy to restore
+		RESTORE_DONE			// restore finished, autosave is running
+	} RESTORE_STATE;
+
+	byte m_copy;			// which copy will be written next
+	byte m_generation;		// generation of the newest good copy
+	byte m_saving;			// whether we have a background save in progress
+	uint16_t m_saved_hash;	// hash of the state in the newest good copy
+	uint16_t m_pending_hash;// hash of the state being saved
+	int m_image_size;		// size of the patch image in the EEPROM buffer
+	int m_timeout;			// ms until we next check for changes
+	RESTORE_STATE m_restore;
+	byte m_restore_copy;	// copy being read during restore
+	byte m_copy_valid[NUM_COPIES];
+	byte m_copy_generation[NUM_COPIES];
+
+	///////////////////////////////////////////////////////////////////////////////
+	static int slot(int copy) {
+		return copy? SLOT_AUTOSAVE_ALT : SLOT_AUTOSAVE;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Fletcher-16 over the sequence data. With 32-bit sums and no more than
+	// a slot of data the sums cannot overflow, so they are only reduced at the
+	// end (there is no hardware divide on this CPU)
+	static uint16_t hash(const byte *data, int len) {
+		uint32_t sum1 = 0;
+		uint32_t sum2 = 0;
+		while(len--) {
+			sum1 += *data++;
+			sum2 += sum1;
+		}
+		while(sum1 > 0xFF) {
+			sum1 = (sum1 & 0xFF) + (sum1 >> 8);
+		}
+		while(sum2 > 0xFF) {
+			sum2 = (sum2 & 0xFF) + (sum2 >> 8);
+		}
+		return (uint16_t)((sum2 << 8) | sum1);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Encode the working state into the EEPROM buffer and return its hash
+	uint16_t fill_buf() {
+		m_image_size = g_sequence.encode_patch(g_i2c_eeprom.buf() + SZ_HEADER, CPatchCache::SZ_MAX_IMAGE);
+		return hash(g_i2c_eeprom.buf() + SZ_HEADER, m_image_size);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Start a background save of the image in the EEPROM buffer
+	byte start_save(uint16_t hash) {
+		byte *buf = g_i2c_eeprom.buf();
+		if(!m_image_size) {
+			return 0;
+		}
+		buf[0] = AUTOSAVE_DATA_COOKIE1;
+		buf[1] = m_generation + 1;
+		if(!g_i2c_eeprom.write(slot(m_copy), SZ_HEADER + m_image_size, EEPROM_AUTOSAVE, 0)) {
+			return 0;
+		}
+		m_pending_hash = hash;
+		m_saving = 1;
+		return 1;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Check on a background save once the EEPROM is idle again. If it failed
+	// or was cancelled the same copy is retried next time
+	void save_done() {
+		m_saving = 0;
+		if(g_i2c_eeprom.take_background_result(EEPROM_AUTOSAVE)) {
+			m_saved_hash = m_pending_hash;
+			++m_generation;
+			m_copy = !m_copy;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	void read_copy(int copy) {
+		m_restore_copy = copy;
+		g_i2c_eeprom.read_image(slot(copy), SZ_HEADER + CPatchCache::SZ_MAX_IMAGE, SZ_HEADER, EEPROM_AUTOSAVE);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Check whether the copy that has been read into the EEPROM buffer is good
+	byte check_copy() {
+		if(!g_i2c_eeprom.take_background_result(EEPROM_AUTOSAVE)) {
+			return 0;
+		}
+		byte *buf = g_i2c_eeprom.buf();
+		return (buf[0] == AUTOSAVE_DATA_COOKIE1 &&
+				CPatchCache::check_image(buf + SZ_HEADER, CPatchCache::SZ_MAX_IMAGE));
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Apply the copy in the EEPROM buffer to the sequencer. It is decoded
+	// through the patch cache, which has the only room for a whole patch
+	void apply_copy() {
+		byte *image = g_i2c_eeprom.buf() + SZ_HEADER;
+		const byte *cfg = g_patch_cache.store_image(SLOT_AUTOSAVE, image);
+		if(!cfg) {
+			return;
+		}
+		g_sequence.restore((byte*)cfg);
+		g_patch_cache.invalidate(SLOT_AUTOSAVE);
+		m_saved_hash = hash(image, CPatchCache::check_image(image, CPatchCache::SZ_MAX_IMAGE));
+		m_generation = m_copy_generation[m_restore_copy];
+		m_copy = !m_restore_copy;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Move the restore on when the EEPROM has finished a read
+	void run_restore() {
+		switch(m_restore) {
+		case RESTORE_READ:
+			m_copy_valid[m_restore_copy] = check_copy();
+			m_copy_generation[m_restore_copy] = g_i2c_eeprom.buf()[1];
+			if(m_restore_copy < NUM_COPIES - 1) {
+				read_copy(m_restore_copy + 1);
+			}
+			else if(m_copy_valid[0] && m_copy_valid[1]) {
+				// generations wrap around, so compare them by signed difference
+				if((int8_t)(m_copy_generation[1] - m_copy_generation[0]) > 0) {
+					apply_copy();
+					m_restore = RESTORE_DONE;
+				}
+				else {
+					read_copy(0);
+					m_restore = RESTORE_REREAD;
+				}
+			}
+			else if(m_copy_valid[1]) {
+				apply_copy();
+				m_restore = RESTORE_DONE;
+			}
+			else if(m_copy_valid[0]) {
+				read_copy(0);
+				m_restore = RESTORE_REREAD;
+			}
+			else {
+				m_restore = RESTORE_DONE;
+			}
+			break;
+		case RESTORE_REREAD:
+			if(check_copy()) {
+				apply_copy();
+			}
+			m_restore = RESTORE_DONE;
+			break;
+		default:
+			break;
+		}
+	}
+
+public:
+	///////////////////////////////////////////////////////////////////////////////
+	CAutosave() {
+		m_copy = 0;
+		m_generation = 0;
+		m_saving = 0;
+		m_saved_hash = 0;
+		m_pending_hash = 0;
+		m_image_size = 0;
+		m_timeout = INTERVAL_MS;
+		m_restore = RESTORE_NONE;
+		m_restore_copy = 0;
+		memset(m_copy_valid, 0, sizeof(m_copy_valid));
+		memset(m_copy_generation, 0, sizeof(m_copy_generation));
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Called at power up, once the EEPROM buffer is free, to start restoring the
+	// newest good copy of the working state. Call run() until is_restored()
+	void start_restore() {
+		read_copy(0);
+		m_restore = RESTORE_READ;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	byte is_restored() {
+		return (m_restore == RESTORE_DONE);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Called once per ms
+	void run() {
+		if(g_i2c_eeprom.is_busy()) {
+			return;
+		}
+		if(m_restore != RESTORE_DONE) {
+			run_restore();
+			return;
+		}
+		if(m_saving) {
+			save_done();
+		}
+		if(m_timeout) {
+			--m_timeout;
+			return;
+		}
+		if(!g_i2c_eeprom.is_buf_free()) {
+			// another background result is waiting to be checked
+			return;
+		}
+		m_timeout = INTERVAL_MS;
+		uint16_t hash = fill_buf();
+		if(hash != m_saved_hash) {
+			start_save(hash);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Called at shut down to save any changes since the last autosave
+	void save_now() {
+		if(m_restore != RESTORE_DONE) {
+			// don't overwrite the saved state if we never restored it
+			return;
+		}
+		g_i2c_bus.wait_for_idle();
+		if(m_saving) {
+			save_done();
+		}
+		uint16_t hash = fill_buf();
+		if(hash != m_saved_hash && start_save(hash)) {
+			g_i2c_bus.wait_for_idle();
+			save_done();
+		}
+	}
+};
+
+// define the autosave instance
+CAutosave g_autosave;
+
+#endif /* AUTOSAVE_H_ */
@@ -0,0 +1,167 @@
+//////////////////////////////////////////////////////////////////////////////
+// sixty four pixels 2020                                       CC-NC-BY-SA //
+//                                //  //          //                        //
+//   //////   /////   /////   //////  //   /////  //////   /////  //   //   //
+//   //   // //   // //   // //   //  //  //   // //   // //   //  // //    //
+//   //   // //   // //   // //   //  //  /////// //   // //   //   ///     //
+//   //   // //   // //   // //   //  //  //      //   // //   //  // //    //
+//   //   //  /////   /////   //////   //  /////  //////   /////  //   //   //
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// BULK STEP VALUE TRANSFORMS
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+#ifndef BULK_VALUES_H_
+#define BULK_VALUES_H_
+
+//
+// Whole page operations on the 7 bit step values. The 32 values of a page
+// are handled as 8 words of 4 values each (the value for the lowest step in
+// the lowest byte, since the MKE04 is little endian) so that each operation
+// works on four steps at a time with plain 32 bit arithmetic. Values are
+// never more than 127, so the top bit of each byte is free to catch carries
+// and borrows without them spilling into the next step.
+//
+// Steps are selected with a bitplane in display row order, the same as the
+// point flags held by CSequencePage (step 0 in the top bit)
+//
+class CBulkValues {
+public:
+	enum {
+		NUM_WORDS = 8
+	};
+private:
+	enum : uint32_t {
+		LOW_BITS = 0x01010101U,
+		HIGH_BITS = 0x80808080U,
+		VALUE_BITS = 0x7F7F7F7FU
+	};
+
+	///////////////////////////////////////////////////////////////////////////////
+	// turn the top bit of each byte into a mask of the whole byte
+	static inline uint32_t spread(uint32_t high_bits) {
+		return ((high_bits & HIGH_BITS) >> 7) * 0xFF;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// byte mask of the selected steps in one word
+	static inline uint32_t lanes(uint32_t plane, int word) {
+		static const uint32_t lane_mask[16] = {
+			0x00000000U, 0xFF000000U, 0x00FF0000U, 0xFFFF0000U,
+			0x0000FF00U, 0xFF00FF00U, 0x00FFFF00U, 0xFFFFFF00U,
+			0x000000FFU, 0xFF0000FFU, 0x00FF00FFU, 0xFFFF00FFU,
+			0x0000FFFFU, 0xFF00FFFFU, 0x00FFFFFFU, 0xFFFFFFFFU
+		};
+		return lane_mask[(plane >> (28 - 4*word)) & 0x0F];
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// bitplane of the bytes of one word that have their top bit set
+	static inline uint32_t plane_bits(uint32_t high_bits, int word) {
+		uint32_t nibble = ((high_bits >> 4) & 0x08) |
+				((high_bits >> 13) & 0x04) |
+				((high_bits >> 22) & 0x02) |
+				((high_bits >> 31) & 0x01);
+		return nibble << (28 - 4*word);
+	}
+
+public:
+	///////////////////////////////////////////////////////////////////////////////
+	// set the selected steps to a value
+	static void fill(uint32_t *dest, uint32_t plane, byte value) {
+		uint32_t fill = value * LOW_BITS;
+		for(int i=0; i<NUM_WORDS; ++i) {
+			uint32_t mask = lanes(plane, i);
+			dest[i] = (dest[i] & ~mask) | (fill & mask);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// copy the selected steps from another set of values
+	static void copy(uint32_t *dest, const uint32_t *src, uint32_t plane) {
+		for(int i=0; i<NUM_WORDS; ++i) {
+			uint32_t mask = lanes(plane, i);
+			dest[i] = (dest[i] & ~mask) | (src[i] & mask);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// bitplane of the steps which differ between two sets of values
+	static uint32_t diff(const uint32_t *a, const uint32_t *b) {
+		uint32_t plane = 0;
+		for(int i=0; i<NUM_WORDS; ++i) {
+			uint32_t x = a[i] ^ b[i];
+			plane |= plane_bits(((x & VALUE_BITS) + VALUE_BITS) | x, i);
+		}
+		return plane;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Add delta (-127..127) to the selected steps, clamping the result to the
+	// range 0..max (max no more than 127). Returns the bitplane of the steps
+	// that were clamped
+	static uint32_t add(uint32_t *dest, uint32_t plane, int delta, byte max) {
+		uint32_t clipped = 0;
+		uint32_t add = ((delta < 0)? -delta : delta) * LOW_BITS;
+		uint32_t limit = (127 - max) * LOW_BITS;
+		uint32_t max_value = max * LOW_BITS;
+		for(int i=0; i<NUM_WORDS; ++i) {
+			uint32_t mask = lanes(plane, i);
+			uint32_t result;
+			uint32_t clip;
+			if(delta < 0) {
+				result = (dest[i] | HIGH_BITS) - add;		// top bit cleared by a borrow
+				clip = spread(~result);
+				result &= VALUE_BITS & ~clip;
+			}
+			else {
+				result = dest[i] + add;						// no more than 254 per byte
+				clip = spread(result);						// more than 127
+				result = (result & ~clip) | (VALUE_BITS & clip);
+			}
+			uint32_t over = spread(result + limit);			// more than max
+			result = (result & ~over) | (max_value & over);
+			clip |= over;
+			dest[i] = (dest[i] & ~mask) | (result & mask);
+			clipped |= plane_bits(clip & mask, i);
+		}
+		return clipped;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Add up[] and subtract down[] (each 0..127 per step) for every step,
+	// clamping the results to 0..127
+	static void add(uint32_t *dest, const uint32_t *up, const uint32_t *down) {
+		for(int i=0; i<NUM_WORDS; ++i) {
+			uint32_t sum = dest[i] + up[i];
+			uint32_t over = spread(sum);
+			sum = (sum & ~over) | (VALUE_BITS & over);
+			sum = (sum | HIGH_BITS) - down[i];
+			dest[i] = sum & VALUE_BITS & ~spread(~sum);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// replace the selected steps with the corresponding entries of a table
+	// (only the selected steps are looked up, so the table only needs to
+	// cover the values that they can hold)
+	static void map(uint32_t *dest, uint32_t plane, const byte *table) {
+		for(int i=0; i<NUM_WORDS; ++i) {
+			uint32_t mask = lanes(plane, i);
+			if(mask) {
+				uint32_t x = dest[i];
+				for(int shift = 0; shift < 32; shift += 8) {
+					if(mask & (0xFFU << shift)) {
+						x = (x & ~(0xFFU << shift)) | ((uint32_t)table[(x >> shift) & 0xFF] << shift);
+					}
+				}
+				dest[i] = x;
+			}
+		}
+	}
+};
+
+#endif /* BULK_VALUES_H_ */
@@ -37,6 +37,8 @@ namespace clock {
 
 enum {
 	KBI0_BIT_CLOCKIN = (1<<0),
+	FINE_TIMER_PRESCALE = 4,	// FTM1 fine timer runs at timer clock / 16
+	MAX_SLEW_TICKS = 6144		// phase errors bigger than one beat are corrected with a jump
 };
 // Noodlebox uses the following type for handling "musical time"...
 // TICKS_TYPE is a 32 bit unsigned value where there are 256 * 24ppqn = 6144 LSB
@@ -101,6 +103,211 @@ inline int pp24_per_measure(V_SQL_STEP_RATE step_rate) {
 	return pp24[step_rate];
 }
 
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Number of ticks an external clock is allowed to freewheel beyond its last edge
+inline TICKS_TYPE freewheel_ticks(V_CLOCK_IN_FREEWHEEL freewheel) {
+	switch(freewheel) {
+	case V_CLOCK_IN_FREEWHEEL_1: return pp24_to_ticks(PP24_4);
+	case V_CLOCK_IN_FREEWHEEL_2: return pp24_to_ticks(PP24_2);
+	case V_CLOCK_IN_FREEWHEEL_4: return pp24_to_ticks(PP24_1);
+	default: return 0;
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Tick rate held as an exact fraction, ticks per ms = num / den. The whole and
+// fractional parts are split out when the rate is set, so that the tick count
+// can be advanced once per ms in the ISR with no division or floating point and
+// with no long term drift (the fractional part is carried in an integer error
+// accumulator owned by the caller)
+class CTickRate {
+	uint32_t m_num;		// ticks..
+	uint32_t m_den;		// ..per this many ms
+	uint32_t m_whole;	// whole ticks per ms
+	uint32_t m_frac;	// fractional ticks per ms, in units of 1/m_den
+	uint32_t m_ms_per_tick;	// length of a tick in ms (8.24 fixed point)
+public:
+	////////////////////////////////////////
+	CTickRate() {
+		clear();
+	}
+	////////////////////////////////////////
+	void clear() {
+		m_num = 0;
+		m_den = 1;
+		m_whole = 0;
+		m_frac = 0;
+		m_ms_per_tick = 0;
+	}
+	////////////////////////////////////////
+	void set(uint32_t num, uint32_t den) {
+		if(!den) {
+			clear();
+		}
+		else {
+			m_num = num;
+			m_den = den;
+			m_whole = num / den;
+			m_frac = num - m_whole * den;
+			if(!num) {
+				m_ms_per_tick = 0;
+			}
+			else {
+				// the divide is done here, when the rate changes, so that
+				// conversions in the ms tick only need to multiply. 24 fraction bits
+				// keep a ms worth of ticks within a fine count of the exact value
+				uint64_t ms_per_tick = ((uint64_t)den << 24) / num;
+				m_ms_per_tick = (ms_per_tick > UINT32_MAX)? UINT32_MAX : (uint32_t)ms_per_tick;
+			}
+		}
+	}
+	////////////////////////////////////////
+	inline byte is_zero() {
+		return !m_num;
+	}
+	////////////////////////////////////////
+	// Return the number of whole ticks in the next ms, carrying the
+	// fractional part in the remainder
+	inline TICKS_TYPE next_ms(uint32_t& remainder) {
+		TICKS_TYPE ticks = m_whole;
+		remainder += m_frac;
+		if(remainder >= m_den) {
+			remainder -= m_den;
+			++ticks;
+			if(remainder >= m_den) {
+				// rate has changed since the remainder was accumulated
+				remainder = 0;
+			}
+		}
+		return ticks;
+	}
+	////////////////////////////////////////
+	// Number of ms that a number of ticks will take at this rate
+	int ticks_to_ms(TICKS_TYPE ticks) {
+		if(!m_num) {
+			return INT32_MAX; // no tempo known yet
+		}
+		return (int)(((uint64_t)ticks * m_den) / m_num);
+	}
+	////////////////////////////////////////
+	// Time that a number of ticks will take at this rate, in units
+	// of 1/per_ms of a ms
+	uint32_t ticks_to_fraction(TICKS_TYPE ticks, uint32_t per_ms) {
+		return (uint32_t)(((uint64_t)ticks * m_ms_per_tick * per_ms) >> 24);
+	}
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Second order (alpha-beta) tracker for the period of an incoming clock. Each
+// edge timestamp is compared with the predicted edge time and the phase error
+// is used to correct both the prediction and the period estimate, so that
+// jitter on individual edges is smoothed out. Gains are powers of two so that
+// no division is needed per edge. When the interval changes a lot for more
+// than one edge the tracker snaps straight to the new period to lock quickly
+class CTempoTracker {
+	enum {
+		PERIOD_SHIFT = 8,		// m_period fractional bits
+		NUM_OUTLIERS = 2		// number of consecutive outliers to cause a snap to new period
+	};
+	uint32_t m_period;		// estimated period between edges (us << PERIOD_SHIFT)
+	uint32_t m_next;		// predicted time of the next edge (us)
+	uint32_t m_last;		// time of the previous edge (us)
+	byte m_edges;			// edges since reset (0, 1 or 2+)
+	byte m_outliers;		// consecutive edges far from the prediction
+	byte m_alpha_shift;		// phase gain is 1/2^m_alpha_shift
+	byte m_beta_shift;		// period gain is 1/2^m_beta_shift
+public:
+	////////////////////////////////////////
+	CTempoTracker() {
+		set_filter(V_CLOCK_IN_FILTER_MED);
+		reset();
+	}
+	////////////////////////////////////////
+	void reset() {
+		m_period = 0;
+		m_next = 0;
+		m_last = 0;
+		m_edges = 0;
+		m_outliers = 0;
+	}
+	////////////////////////////////////////
+	// Set the amount of smoothing. The period gain follows the
+	// phase gain so that the loop is close to critically damped
+	void set_filter(V_CLOCK_IN_FILTER filter) {
+		m_alpha_shift = filter;
+		m_beta_shift = filter ? (2 * filter + 1) : 0;
+	}
+	////////////////////////////////////////
+	// Returns nonzero if the period estimate is valid
+	byte is_locked() {
+		return (m_edges > 1);
+	}
+	////////////////////////////////////////
+	uint32_t get_period_us() {
+		return m_period >> PERIOD_SHIFT;
+	}
+	////////////////////////////////////////
+	// Set up a tick rate from the estimated period, given the number
+	// of ticks between edges
+	void get_rate(CTickRate& rate, TICKS_TYPE ticks_per_edge) {
+		if(is_locked() && m_period) {
+			rate.set(ticks_per_edge * (1000<<PERIOD_SHIFT), m_period);
+		}
+	}
+	////////////////////////////////////////
+	// Handle an edge at the specified time, returns nonzero if
+	// the period estimate has been updated
+	byte on_edge(uint32_t us) {
+		if(!m_edges) {
+			m_last = us;
+			m_edges = 1;
+			return 0;
+		}
+
+		uint32_t interval = us - m_last;
+		m_last = us;
+
+		if(m_edges > 1 && m_alpha_shift) {
+			int32_t period = (int32_t)(m_period >> PERIOD_SHIFT);
+			int32_t error = (int32_t)(us - m_next);
+			if(error > period/8 || error < -period/8) {
+				// edge is a long way from where we expected it
+				if(++m_outliers < NUM_OUTLIERS) {
+					// ignore it and expect the next edge a period after
+					// this one should have been, so that a single late
+					// or early edge does not look like a change of tempo
+					m_next += period;
+					return 0;
+				}
+			}
+			else {
+				m_outliers = 0;
+
+				// correct the phase and period by a fraction of the error
+				m_next += (error >> m_alpha_shift);
+				int32_t delta = (error * (1 << PERIOD_SHIFT)) >> m_beta_shift;
+				if(delta < 0 && (uint32_t)-delta >= m_period) {
+					delta = 0;
+				}
+				m_period += delta;
+				m_next += (m_period >> PERIOD_SHIFT);
+				return 1;
+			}
+		}
+
+		// first interval, no filtering, or a sustained change of tempo: lock
+		// on to the last interval
+		if(!interval) {
+			return 0;
+		}
+		m_period = interval << PERIOD_SHIFT;
+		m_next = us + interval;
+		m_edges = 2;
+		m_outliers = 0;
+		return 1;
+	}
+};
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Interface to be implemented by clock sources
 class IClockSource {
@@ -108,7 +315,7 @@ public:
 	virtual void event(int event, uint32_t param) = 0;
 	virtual TICKS_TYPE min_ticks() = 0;
 	virtual TICKS_TYPE max_ticks() = 0;
-	virtual double ticks_per_ms() = 0;
+	virtual CTickRate& ticks_per_ms() = 0;
 };
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -124,20 +331,27 @@ class CPulseClockSource : public IClockSource {
 
 	TICKS_TYPE m_ticks; 	// tick counter incremented by m_period when external clock pulse is received
 	TICKS_TYPE m_period;	// the period of the clock in whole ticks
-	double m_ticks_per_ms;  // calculated tick rate from ext clock
+	CTickRate m_ticks_per_ms;  // calculated tick rate from ext clock
+	CTempoTracker m_tracker;	// used to track the time between incoming pulses
+	TICKS_TYPE m_freewheel_ticks;	// how far the clock can run on beyond the next expected pulse
+	uint32_t m_freewheel_pulses;	// the same, in pulses
 
-	uint32_t m_last_ms;		// used to time between incoming pulses
-	uint32_t m_timeout;		// used to decide when the external clock has stopped
+	volatile uint32_t m_last_us;	// time of the last pulse
+	volatile uint32_t m_timeout;	// us without a pulse before the external clock is considered stopped
 	byte m_state;
 	enum {
 		CLOCK_UNKNOWN,
 		CLOCK_STOPPED,
 		CLOCK_RUNNING
 	};
+	enum {
+		TIMEOUT_PERIODS = 4		// number of missing pulses before clock is stopped
+	};
 
 public:
 	////////////////////////////////////////
 	CPulseClockSource() {
+		m_freewheel_ticks = 0;
 		set_rate(V_CLOCK_IN_RATE_16);
 	}
 	////////////////////////////////////////
@@ -145,8 +359,9 @@ public:
 		switch(event) {
 		case EV_CLOCK_RESET:
 			m_state = CLOCK_UNKNOWN;
-			m_ticks_per_ms = 0;
-			m_last_ms = 0;
+			m_ticks_per_ms.clear();
+			m_tracker.reset();
+			m_timeout = 0;
 			// fallthru
 		case EV_SEQ_RESTART:
 			m_ticks = 0;
@@ -161,11 +376,16 @@ public:
 		return m_ticks;
 	}
 	////////////////////////////////////////
+	// the clock only freewheels while it is running, so that it does not
+	// run on ahead of the source once it has stopped
 	TICKS_TYPE max_ticks() {
+		if(CLOCK_RUNNING == m_state && m_tracker.is_locked()) {
+			return m_ticks + m_period + m_freewheel_ticks;
+		}
 		return m_ticks + m_period;
 	}
 	////////////////////////////////////////
-	double ticks_per_ms() {
+	CTickRate& ticks_per_ms() {
 		return m_ticks_per_ms;
 	}
 	////////////////////////////////////////
@@ -173,34 +393,61 @@ public:
 		const byte rate[V_CLOCK_IN_RATE_MAX] = {PP24_8, PP24_16, PP24_32, PP24_24PPQN};
 		m_cfg.m_clock_in_rate = clock_in_rate;
 		m_period = pp24_to_ticks(rate[clock_in_rate]);
+		m_freewheel_pulses = m_freewheel_ticks / m_period;
 	}
 	////////////////////////////////////////
 	V_CLOCK_IN_RATE get_rate() {
 		return m_cfg.m_clock_in_rate;
 	}
 	////////////////////////////////////////
-	void on_pulse(uint32_t ms) {
+	void set_filter(V_CLOCK_IN_FILTER filter) {
+		m_tracker.set_filter(filter);
+	}
+	////////////////////////////////////////
+	void set_freewheel(V_CLOCK_IN_FREEWHEEL freewheel) {
+		m_freewheel_ticks = freewheel_ticks(freewheel);
+		m_freewheel_pulses = m_freewheel_ticks / m_period;
+	}
+	////////////////////////////////////////
+	// called from the KBI ISR with the pulse time in us
+	void on_pulse(uint32_t us) {
 		if(CLOCK_RUNNING == m_state) {
-			// check we have not rolled over
-			if(ms > m_last_ms) {
-				uint32_t elapsed_ms = (ms - m_last_ms);
-				m_ticks_per_ms = (double)m_period / elapsed_ms;
-				m_timeout = ms + 4 * elapsed_ms;
+			if(m_freewheel_ticks && m_tracker.is_locked()) {
+				// when freewheeling, count any pulses that went missing
+				// so that we pick up at the right position
+				uint32_t period_us = m_tracker.get_period_us();
+				uint32_t interval = us - m_last_us;
+				if(period_us && interval > period_us + period_us/2) {
+					uint32_t missed = (interval + period_us/2)/period_us - 1;
+					if(missed > m_freewheel_pulses) {
+						missed = m_freewheel_pulses;
+					}
+					m_ticks += missed * m_period;
+				}
+			}
+			if(m_tracker.on_edge(us)) {
+				m_tracker.get_rate(m_ticks_per_ms, m_period);
+			}
+			if(m_tracker.is_locked()) {
+				// the stop timeout follows the tracked tempo and allows
+				// for the freewheel period
+				m_timeout = (TIMEOUT_PERIODS + m_freewheel_pulses) * m_tracker.get_period_us();
 			}
 		}
 		else {
 			m_timeout = 0;
 			m_state = CLOCK_RUNNING;
+			m_tracker.reset();
+			m_tracker.on_edge(us);
 			fire_event(EV_SEQ_CONTINUE,0);
 		}
-		m_last_ms = ms;
+		m_last_us = us;
 		m_ticks += m_period;
-
-
 	}
 	////////////////////////////////////////
-	void run(uint32_t ms) {
-		if(CLOCK_RUNNING == m_state && !!m_timeout && ms > m_timeout) {
+	void run(uint32_t us) {
+		// NB: a pulse may arrive after us was read, hence signed comparison
+		if(CLOCK_RUNNING == m_state && !!m_timeout && (int32_t)(us - m_last_us) > (int32_t)m_timeout) {
 			m_timeout = 0;
 			m_state = CLOCK_STOPPED;
 			fire_event(EV_SEQ_STOP,0);
@@ -227,84 +474,128 @@ CPulseClockSource g_pulse_clock_in;
 /////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 class CMidiClockSource 	: public IClockSource {
 	TICKS_TYPE m_ticks; 	// tick counter incremented by m_period when external clock pulse is received
-	double m_ticks_per_ms;  // calculated tick rate from ext clock
-	uint32_t m_last_ms;		// used to time between incoming pulses
+	CTickRate m_ticks_per_ms;  // calculated tick rate from ext clock
+	CTempoTracker m_tracker;	// used to track the time between incoming ticks
+	TICKS_TYPE m_freewheel_ticks;	// how far the clock can run on beyond the next expected tick
 	int m_transport:1;		// whether we should act on MIDI transport messages
+	int m_song_pos:1;		// whether a song position has been received since the last tick
+	int m_running:1;		// whether the transport is running (always when ignoring transport)
 	enum : byte { PENDING_NONE, PENDING_RESTART, PENDING_CONTINUE } m_pending_event;
 	const TICKS_TYPE MIDI_CLOCK_RATE_TICKS = (1<<8);
 public:
 	///////////////////////////////////////////////////////////////////////////////
 	CMidiClockSource() {
 		m_transport = 1;
+		m_song_pos = 0;
+		m_running = 1;
 		m_pending_event = PENDING_NONE;
-		m_ticks_per_ms = 0;
-		m_last_ms = 0;
 		m_ticks = 0;
+		m_freewheel_ticks = 0;
 	}
 	///////////////////////////////////////////////////////////////////////////////
 	void set_transport(byte transport) {
 		m_transport = transport;
+		m_running = 1;
+	}
+	///////////////////////////////////////////////////////////////////////////////
+	void set_filter(V_CLOCK_IN_FILTER filter) {
+		m_tracker.set_filter(filter);
+	}
+	///////////////////////////////////////////////////////////////////////////////
+	void set_freewheel(V_CLOCK_IN_FREEWHEEL freewheel) {
+		m_freewheel_ticks = freewheel_ticks(freewheel);
 	}
 	///////////////////////////////////////////////////////////////////////////////
 	void event(int event, uint32_t param) {
 		switch(event) {
 		case EV_CLOCK_RESET:
-			m_ticks_per_ms = 0;
-			m_last_ms = 0;
+			m_ticks_per_ms.clear();
+			m_tracker.reset();
 			// fall thru
 		case EV_SEQ_RESTART:
 			m_ticks = 0;
+			m_song_pos = 0;
 			break;
 		}
 	}
 	///////////////////////////////////////////////////////////////////////////////
+	void set_ticks(TICKS_TYPE ticks) {
+		m_ticks = ticks;
+	}
+	///////////////////////////////////////////////////////////////////////////////
 	TICKS_TYPE min_ticks() {
 		return m_ticks;
 	};
 	///////////////////////////////////////////////////////////////////////////////
+	// the clock only freewheels while the transport is running, so that it
+	// does not run on ahead of the DAW after a stop
 	TICKS_TYPE max_ticks() {
+		if(m_running && m_tracker.is_locked()) {
+			return m_ticks + MIDI_CLOCK_RATE_TICKS + m_freewheel_ticks;
+		}
 		return m_ticks + MIDI_CLOCK_RATE_TICKS;
 	};
 	///////////////////////////////////////////////////////////////////////////////
-	double ticks_per_ms() {
+	CTickRate& ticks_per_ms() {
 		return m_ticks_per_ms;
 	};
 	///////////////////////////////////////////////////////////////////////////////
-	void on_midi_realtime(byte ch, uint32_t ms) {
+	void on_midi_realtime(byte ch, uint32_t us) {
 		switch(ch) {
 		case midi::MIDI_TICK:
 			if(PENDING_RESTART != m_pending_event) { // the first tick after a MIDI restart is ignored
-				m_ticks += MIDI_CLOCK_RATE_TICKS;
-				if(PENDING_CONTINUE != m_pending_event) {
-					if(ms > m_last_ms) {
-						uint32_t elapsed_ms = (ms - m_last_ms);
-						m_ticks_per_ms = (double)MIDI_CLOCK_RATE_TICKS / elapsed_ms;
-					}
+				// the first tick after a song position message is the
+				// tick at that position, so it does not move the count on
+				if(m_song_pos) {
+					m_song_pos = 0;
+				}
+				else {
+					m_ticks += MIDI_CLOCK_RATE_TICKS;
+				}
+				if(PENDING_CONTINUE == m_pending_event) {
+					// the clock may have been stopped for a while, so start
+					// tracking again but keep the last rate until we lock
+					m_tracker.reset();
+					m_tracker.on_edge(us);
+				}
+				else if(m_tracker.on_edge(us)) {
+					m_tracker.get_rate(m_ticks_per_ms, MIDI_CLOCK_RATE_TICKS);
 				}
-				m_last_ms = ms;
 			}
 			m_pending_event = PENDING_NONE;
 			break;
 		case midi::MIDI_START:
 			if(m_transport) {
+				m_running = 1;
 				fire_event(EV_SEQ_RESTART,0);
 				m_pending_event = PENDING_RESTART;
 			}
 			break;
 		case midi::MIDI_CONTINUE:
 			if(m_transport) {
+				m_running = 1;
 				fire_event(EV_SEQ_CONTINUE,0);
 				m_pending_event = PENDING_CONTINUE;
 			}
 			break;
 		case midi::MIDI_STOP:
 			if(m_transport) {
+				m_running = 0;
 				fire_event(EV_SEQ_STOP,0);
 				m_pending_event = PENDING_NONE;
 			}
 			break;
 		}
 	}
+	///////////////////////////////////////////////////////////////////////////////
+	// Song position (in 16th notes) normally sent by a DAW while stopped, before
+	// it sends a continue message
+	void on_midi_song_position(uint16_t pos) {
+		if(m_transport) {
+			fire_event(EV_SEQ_SONG_POS, pos);
+			m_song_pos = 1;
+		}
+	}
 };
 CMidiClockSource g_midi_clock_in;
 
@@ -320,7 +611,7 @@ class CFixedClockSource	: public IClockSource {
 	} CONFIG;
 	CONFIG m_cfg;
 
-	double m_ticks_per_ms;
+	CTickRate m_ticks_per_ms;
 public:
 	////////////////////////////////////////
 	CFixedClockSource() {
@@ -343,12 +634,13 @@ public:
 		return TICKS_INFINITY;
 	}
 	////////////////////////////////////////
-	double ticks_per_ms() {
+	CTickRate& ticks_per_ms() {
 		return m_ticks_per_ms;
 	}
 	////////////////////////////////////////
 	void set_bpm(int bpm) {
-		m_ticks_per_ms = ((double)bpm * PP24_4 * 256) / (60.0 * 1000.0);
+		// exact rate of bpm * 6144 ticks per 60000 ms
+		m_ticks_per_ms.set(bpm * pp24_to_ticks(PP24_4), 60 * 1000);
 		m_cfg.m_bpm = bpm;
 	}
 	////////////////////////////////////////
@@ -643,6 +935,14 @@ public:
 			}
 			m_is_running = 1;
 			break;
+		case EV_SEQ_SONG_POS:
+			switch(m_cfg.m_mode) {
+			case V_MIDI_CLOCK_OUT_ON_TRAN:
+			case V_MIDI_CLOCK_OUT_GATE_TRAN:
+				g_midi.send(midi::MIDI_SPP, param & 0x7F, (param >> 7) & 0x7F, 3);
+				break;
+			}
+			break;
 		case EV_CLOCK_RESET:
 			break;
 		case EV_REAPPLY_CONFIG:
@@ -705,6 +1005,8 @@ class CClock {
 	typedef struct {
 		V_CLOCK_SRC m_source_mode;
 		V_AUX_IN_MODE m_aux_in_mode;
+		V_CLOCK_IN_FILTER m_clock_in_filter;
+		V_CLOCK_IN_FREEWHEEL m_clock_in_freewheel;
 	} CONFIG;
 	CONFIG m_cfg;
 
@@ -712,10 +1014,68 @@ class CClock {
 	volatile byte m_ms_tick;					// flag set each time 1ms is up
 	volatile uint32_t m_ms;					// ms counter
 	volatile TICKS_TYPE m_ticks;
-	volatile double m_ticks_remainder;
+	volatile uint32_t m_ticks_remainder;	// fractional ticks carried between ms
+	volatile int32_t m_phase_error;			// ticks by which the clock is behind the source (when slewing)
+	volatile TICKS_TYPE m_ref_ticks;		// source tick count when phase error was measured
+	volatile uint16_t m_ms_stamp;			// fine timer count at the last ms boundary
+	uint16_t m_fine_per_ms;					// fine timer counts per ms
+	uint32_t m_us_per_fine;					// us per fine timer count (16.16 fixed point)
 	byte m_aux_in_state;
 
 
+	///////////////////////////////////////////////////////////////////////////////
+	// Work out the tick count at the next ms boundary, given the tick count,
+	// fractional ticks and phase error at this one. When freewheel is enabled
+	// any phase error with the clock source is slewed out by running up to
+	// 50% faster or slower, rather than jumping or stopping. Returns the same
+	// tick count if the clock source does not allow the count to move on, in
+	// which case remainder and phase error should not be updated
+	TICKS_TYPE calc_next_ticks(TICKS_TYPE ticks, uint32_t& remainder, int32_t& phase_error) {
+		TICKS_TYPE min_ticks = m_source->min_ticks();
+		if(ticks < min_ticks && !(m_cfg.m_clock_in_freewheel && phase_error <= MAX_SLEW_TICKS)) {
+			// jump to the source position
+			remainder = 0;
+			phase_error = 0;
+			return min_ticks;
+		}
+		TICKS_TYPE step = m_source->ticks_per_ms().next_ms(remainder);
+		if(phase_error) {
+			int32_t limit = 1 + (step>>1);
+			int32_t correction = phase_error;
+			if(correction > limit) {
+				correction = limit;
+			}
+			else if(correction < -limit) {
+				correction = -limit;
+			}
+			step += correction;
+			phase_error -= correction;
+		}
+		if(ticks + step >= m_source->max_ticks()) {
+			return ticks;
+		}
+		return ticks + step;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Bring the tick count back to the position of an external clock source
+	// if it has run on ahead (e.g. freewheeling after the clock stopped) and
+	// forget any phase error
+	void resync_to_source() {
+		if(m_source == &g_fixed_clock) {
+			return;
+		}
+		uint32_t primask = DisableGlobalIRQ();
+		TICKS_TYPE min_ticks = m_source->min_ticks();
+		if(m_ticks > min_ticks) {
+			m_ticks = min_ticks;
+		}
+		m_ticks_remainder = 0;
+		m_phase_error = 0;
+		m_ref_ticks = min_ticks;
+		EnableGlobalIRQ(primask);
+	}
+
 	///////////////////////////////////////////////////////////////////////////////
 	void set_source_mode(V_CLOCK_SRC source_mode) {
 		switch(source_mode) {
@@ -758,6 +1118,17 @@ public:
 		PIT_SetTimerPeriod(PIT, kPIT_Chnl_0, (uint32_t) MSEC_TO_COUNT(1, CLOCK_GetBusClkFreq()));
 		PIT_StartTimer(PIT, kPIT_Chnl_0);
 
+		// FTM1 (which has no pins in use) is set up as a free running 16-bit
+		// counter that provides sub-ms timing. Channel interrupts are used by
+		// the gate scheduler
+		CLOCK_EnableClock(kCLOCK_Ftm1);
+		FTM1->SC = 0;
+		FTM1->CNT = 0;
+		FTM1->MOD = 0xFFFF;
+		FTM1->SC = FTM_SC_CLKS(1)|FTM_SC_PS(FINE_TIMER_PRESCALE);
+		m_fine_per_ms = CLOCK_GetTimerClkFreq()/(1000<<FINE_TIMER_PRESCALE);
+		m_us_per_fine = (1000<<16)/m_fine_per_ms;
+
 		// configure the KBI peripheral to cause an interrupt when sync pulse in is triggered
 		kbi_config_t kbiConfig;
 		kbiConfig.mode = kKBI_EdgesDetect;
@@ -772,11 +1143,16 @@ public:
 		m_ms_tick = 0;
 		m_ticks = 0;
 		m_ticks_remainder = 0;
+		m_phase_error = 0;
+		m_ref_ticks = 0;
+		m_ms_stamp = 0;
 		m_aux_in_state = 0;
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
 	void init_config() {
+		m_cfg.m_clock_in_filter = V_CLOCK_IN_FILTER_MED;
+		m_cfg.m_clock_in_freewheel = V_CLOCK_IN_FREEWHEEL_OFF;
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -796,6 +1172,17 @@ public:
 				g_pulse_clock_in.set_rate((V_CLOCK_IN_RATE)value);
 				fire_event(EV_CLOCK_RESET, 0);
 				break;
+			case P_CLOCK_IN_FILTER:
+				m_cfg.m_clock_in_filter = (V_CLOCK_IN_FILTER)value;
+				g_pulse_clock_in.set_filter(m_cfg.m_clock_in_filter);
+				g_midi_clock_in.set_filter(m_cfg.m_clock_in_filter);
+				break;
+			case P_CLOCK_IN_FREEWHEEL:
+				m_cfg.m_clock_in_freewheel = (V_CLOCK_IN_FREEWHEEL)value;
+				g_pulse_clock_in.set_freewheel(m_cfg.m_clock_in_freewheel);
+				g_midi_clock_in.set_freewheel(m_cfg.m_clock_in_freewheel);
+				m_phase_error = 0;
+				break;
 			case P_CLOCK_OUT_MODE:
 				g_pulse_clock_out.set_mode((V_CLOCK_OUT_MODE)value);
 				fire_event(EV_CLOCK_RESET, 0);
@@ -829,6 +1216,8 @@ public:
 		case P_CLOCK_SRC: return m_cfg.m_source_mode;
 		case P_AUX_IN_MODE: return m_cfg.m_aux_in_mode;
 		case P_CLOCK_IN_RATE: return g_pulse_clock_in.get_rate();
+		case P_CLOCK_IN_FILTER: return m_cfg.m_clock_in_filter;
+		case P_CLOCK_IN_FREEWHEEL: return m_cfg.m_clock_in_freewheel;
 		case P_CLOCK_OUT_MODE: return g_pulse_clock_out.get_mode();
 		case P_CLOCK_OUT_RATE: return g_pulse_clock_out.get_rate();
 #ifndef NB_PROTOTYPE
@@ -845,6 +1234,8 @@ public:
 		switch(param) {
 		case P_CLOCK_BPM: return !!(m_cfg.m_source_mode == V_CLOCK_SRC_INTERNAL);
 		case P_CLOCK_IN_RATE: return !!(m_cfg.m_source_mode == V_CLOCK_SRC_EXTERNAL);
+		case P_CLOCK_IN_FILTER: return !!(m_cfg.m_source_mode != V_CLOCK_SRC_INTERNAL);
+		case P_CLOCK_IN_FREEWHEEL: return !!(m_cfg.m_source_mode != V_CLOCK_SRC_INTERNAL);
 		case P_CLOCK_OUT_RATE: return !!(g_pulse_clock_out.get_mode() == V_CLOCK_OUT_MODE_CLOCK || g_pulse_clock_out.get_mode() == V_CLOCK_OUT_MODE_GATED_CLOCK);
 #ifndef NB_PROTOTYPE
 		case P_AUX_OUT_RATE: return !!(g_pulse_aux_out.get_mode() == V_CLOCK_OUT_MODE_CLOCK || g_pulse_aux_out.get_mode() == V_CLOCK_OUT_MODE_GATED_CLOCK);
@@ -863,14 +1254,34 @@ public:
 		switch(event) {
 		case EV_SEQ_STOP:
 		case EV_SEQ_CONTINUE:
+			resync_to_source();
 			break;
 		case EV_CLOCK_RESET:
 		case EV_SEQ_RESTART:
 			m_ticks = 0;
 			m_ticks_remainder = 0;
+			m_phase_error = 0;
+			m_ref_ticks = 0;
+			break;
+		case EV_SEQ_SONG_POS:
+			if(m_source == &g_midi_clock_in) {
+				// move the clock source and our own tick count together
+				// so that the ISR does not see a phase error
+				uint32_t primask = DisableGlobalIRQ();
+				m_ticks = pp24_to_ticks(param * PP24_16);
+				g_midi_clock_in.set_ticks(m_ticks);
+				m_ticks_remainder = 0;
+				m_phase_error = 0;
+				m_ref_ticks = m_ticks;
+				EnableGlobalIRQ(primask);
+			}
 			break;
 		case EV_REAPPLY_CONFIG:
 			set_source_mode(m_cfg.m_source_mode);
+			g_pulse_clock_in.set_filter(m_cfg.m_clock_in_filter);
+			g_midi_clock_in.set_filter(m_cfg.m_clock_in_filter);
+			g_pulse_clock_in.set_freewheel(m_cfg.m_clock_in_freewheel);
+			g_midi_clock_in.set_freewheel(m_cfg.m_clock_in_freewheel);
 			break;
 		}
 		g_fixed_clock.event(event, param);
@@ -898,6 +1309,57 @@ public:
 		return m_ticks;
 	}
 
+	///////////////////////////////////////////////////////////////////////////////
+	// Get the tick count at the last ms boundary and the tick count that will
+	// be reached at the next one. Anything scheduled between the two can be
+	// timed within the ms using the fine timer
+	void get_tick_window(TICKS_TYPE& ticks, TICKS_TYPE& next_ticks) {
+		uint32_t primask = DisableGlobalIRQ();
+		ticks = m_ticks;
+		uint32_t ticks_remainder = m_ticks_remainder;
+		int32_t phase_error = m_phase_error;
+		EnableGlobalIRQ(primask);
+		next_ticks = calc_next_ticks(ticks, ticks_remainder, phase_error);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Based on current clock rate, convert a number of ticks to fine timer
+	// counts
+	inline uint32_t ticks_to_fine(TICKS_TYPE ticks) {
+		return m_source->ticks_per_ms().ticks_to_fraction(ticks, m_fine_per_ms);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Return the free running fine timer count
+	inline uint16_t get_fine_count() {
+		return (uint16_t)FTM1->CNT;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Return a free running us count (wraps every ~71 minutes). This is
+	// safe to call from an ISR. If the ms timer interrupt is pending the
+	// fine timer has just run on past the ms boundary, which still gives
+	// the right result
+	uint32_t get_us() {
+		uint32_t primask = DisableGlobalIRQ();
+		uint32_t ms = m_ms;
+		uint16_t elapsed = (uint16_t)FTM1->CNT - m_ms_stamp;
+		EnableGlobalIRQ(primask);
+		return 1000 * ms + ((elapsed * m_us_per_fine)>>16);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Return the fine timer count at the last ms boundary
+	inline uint16_t get_ms_stamp() {
+		return m_ms_stamp;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Return the number of fine timer counts per ms
+	inline uint16_t get_fine_per_ms() {
+		return m_fine_per_ms;
+	}
+
 	///////////////////////////////////////////////////////////////////////////////
 	// Return incrementing number of ms
 	inline uint32_t get_ms() {
@@ -927,7 +1389,7 @@ public:
 	///////////////////////////////////////////////////////////////////////////////
 	// Based on current clock rate, convert PP24 to ms
 	inline int get_ms_for_pp24(int pp24) {
-		return (int)(pp24_to_ticks(pp24)/m_source->ticks_per_ms());
+		return m_source->ticks_per_ms().ticks_to_ms(pp24_to_ticks(pp24));
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -939,7 +1401,7 @@ public:
 	///////////////////////////////////////////////////////////////////////////////
 	// Method called approx once per ms
 	void run() {
-		g_pulse_clock_in.run(m_ms);
+		g_pulse_clock_in.run(get_us());
 		g_pulse_clock_out.run();
 #ifndef NB_PROTOTYPE
 		g_pulse_aux_out.run();
@@ -978,6 +1440,9 @@ public:
 	// Interrupt service routine called exactly once per millisecond
 	void per_ms_isr() {
 
+		// record the fine timer count at the ms boundary
+		m_ms_stamp = (uint16_t)FTM1->CNT;
+
 		// maintain a millisecond counter for general
 		// timing purposes
 		++m_ms;
@@ -988,25 +1453,27 @@ public:
 
 		TICKS_TYPE prev_ticks = m_ticks;
 
-		// update the tick counter used for scheduling the sequencer
-		if(m_ticks < m_source->min_ticks()) {
-			m_ticks = m_source->min_ticks();
-			m_ticks_remainder = 0;
-		}
-		else {
-			// count the appropriate number of ticks for this millisecond
-			// but don't yet save the values
-			double ticks_remainder = m_ticks_remainder + m_source->ticks_per_ms();
-			int whole_ticks = (int)ticks_remainder;
-			ticks_remainder -= whole_ticks;
-			TICKS_TYPE ticks = m_ticks + whole_ticks;
-
-			if(ticks < m_source->max_ticks()) {
-				m_ticks = ticks;
-				m_ticks_remainder = ticks_remainder;
+		// when freewheeling, measure the phase error each time the
+		// clock source moves on to a new edge
+		TICKS_TYPE ref_ticks = m_source->min_ticks();
+		if(ref_ticks != m_ref_ticks) {
+			m_ref_ticks = ref_ticks;
+			if(m_cfg.m_clock_in_freewheel) {
+				m_phase_error = (int32_t)(ref_ticks - m_ticks);
 			}
 		}
 
+		// update the tick counter used for scheduling the sequencer, only
+		// saving the fractional ticks and phase error if it moved on
+		uint32_t ticks_remainder = m_ticks_remainder;
+		int32_t phase_error = m_phase_error;
+		TICKS_TYPE ticks = calc_next_ticks(m_ticks, ticks_remainder, phase_error);
+		if(ticks != m_ticks) {
+			m_ticks = ticks;
+			m_ticks_remainder = ticks_remainder;
+			m_phase_error = phase_error;
+		}
+
 		// check for a rollover into the next 24PPQN tick
 		if((m_ticks ^ prev_ticks)&~0xFF) {
 			int pp24 = m_ticks>>8;
@@ -1020,7 +1487,7 @@ public:
 
 	}
 	inline void ext_clock_isr() {
-		g_pulse_clock_in.on_pulse(m_ms);
+		g_pulse_clock_in.on_pulse(get_us());
 	}
 
 	static int get_cfg_size() {
@@ -23,6 +23,7 @@
 #define MIDDLE_C_OCTAVE 4 		// should middle C (note 60) be C3 or C4 as displayed in editor
 #define MIDI_TRANSPOSE_ZERO 60	// MIDI note that is zero transposition
 #define OFF_SWITCH_MS	500		// how long the power switch is held before power turns off
+#define POWER_UP_FRAME_MS	50	// how long each frame of the power up animation is shown
 #define CAL_SETTING_MIN	(-99)
 #define CAL_SETTING_MAX 99
 
@@ -60,6 +61,7 @@ enum {
 	EV_SEQ_STOP,			// sequencer playback stopped
 	EV_SEQ_CONTINUE,		// sequencer playback resumes from current position
 	EV_SEQ_RUN_STOP,		// send STOP or CONTINUE depending on run state
+	EV_SEQ_SONG_POS,		// move playback to a song position (param is 16th notes)
 	EV_CLOCK_RESET,			// reset clock timing info
 	EV_CHANGE_LAYER,		// change the current editor layer
 	EV_REPAINT_MENU,
@@ -89,16 +91,26 @@ enum {
 	SLOT_PATCH6,
 	SLOT_PATCH7,
 	SLOT_PATCH8,
-	NUM_SLOTS = 12
+	NUM_SLOTS = 12,
+	SLOT_AUTOSAVE_ALT = NUM_SLOTS	// second autosave copy in the space after the last slot
 };
 
+// owners of background EEPROM operations
+enum {
+	EEPROM_FOREGROUND,	// not a background operation
+	EEPROM_BOOT,		// loading the configuration at power up
+	EEPROM_AUTOSAVE,	// autosave and restore of the working state
+	EEPROM_PREFETCH		// patch cache prefetch
+};
+
+#define EEPROM_SIZE					32768
 #define PATCH_SLOT_SIZE				2560
 #define PATCH_DATA_COOKIE1			0xAA
-#define PATCH_DATA_COOKIE2			0x01
 #define CONFIG_DATA_COOKIE1			0xBB
-#define CONFIG_DATA_COOKIE2			0x01
+#define CONFIG_DATA_COOKIE2			0x03
 #define CALIBRATION_DATA_COOKIE1 	0xCC
 #define CALIBRATION_DATA_COOKIE2	0x01
+#define AUTOSAVE_DATA_COOKIE1		0xDD
 
 #ifdef NB_PROTOTYPE
 	#define VERSION_STRING VERSION_NUMBER "P"
@@ -166,6 +178,8 @@ typedef enum:byte {
 	P_CLOCK_BPM,
 	P_CLOCK_SRC,
 	P_CLOCK_IN_RATE,
+	P_CLOCK_IN_FILTER,
+	P_CLOCK_IN_FREEWHEEL,
 	P_CLOCK_OUT_MODE,
 	P_CLOCK_OUT_RATE,
 	P_MIDI_CLOCK_OUT,
@@ -349,6 +363,22 @@ typedef enum:byte {
 	V_CLOCK_IN_RATE_MAX
 } V_CLOCK_IN_RATE;
 
+typedef enum:byte {
+	V_CLOCK_IN_FILTER_OFF,
+	V_CLOCK_IN_FILTER_LOW,
+	V_CLOCK_IN_FILTER_MED,
+	V_CLOCK_IN_FILTER_HIGH,
+	V_CLOCK_IN_FILTER_MAX
+} V_CLOCK_IN_FILTER;
+
+typedef enum:byte {
+	V_CLOCK_IN_FREEWHEEL_OFF,
+	V_CLOCK_IN_FREEWHEEL_1,
+	V_CLOCK_IN_FREEWHEEL_2,
+	V_CLOCK_IN_FREEWHEEL_4,
+	V_CLOCK_IN_FREEWHEEL_MAX
+} V_CLOCK_IN_FREEWHEEL;
+
 typedef enum:byte {
 	V_CLOCK_OUT_RATE_8,
 	V_CLOCK_OUT_RATE_16,
@@ -455,6 +485,7 @@ typedef enum:byte {
 } V_SQL_MIDI_IN_CHAN;
 
 extern void fire_event(int event, uint32_t param);
+extern void handle_event(int event, uint32_t param);
 extern void fire_note(byte midi_note, byte midi_vel);
 extern void force_full_repaint();
 void set(PARAM_ID param, int value);
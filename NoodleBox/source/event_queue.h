@@ -0,0 +1,137 @@
+//////////////////////////////////////////////////////////////////////////////
+// sixty four pixels 2020                                       CC-NC-BY-SA //
+//                                //  //          //                        //
+//   //////   /////   /////   //////  //   /////  //////   /////  //   //   //
+//   //   // //   // //   // //   //  //  //   // //   // //   //  // //    //
+//   //   // //   // //   // //   //  //  /////// //   // //   //   ///     //
+//   //   // //   // //   // //   //  //  //      //   // //   //  // //    //
+//   //   //  /////   /////   //////   //  /////  //////   /////  //   //   //
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// DEFERRED EVENT QUEUE
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+#ifndef EVENT_QUEUE_H_
+#define EVENT_QUEUE_H_
+
+//
+// Events are posted to a fixed size queue rather than being handled right
+// away, so they can safely be fired from an ISR or from deep inside a driver
+// without reentering the event handlers. The main loop drains the queue once
+// per ms. Transport, clock and storage events are queued separately from UI
+// events and are always handled first. The number of UI events handled each
+// ms is limited so that a burst of them cannot hold up the sequencer
+//
+class CEventQueue {
+	enum {
+		SIZE = 16,
+		SIZE_MASK = 0x0F,
+		MAX_UI_EVENTS_PER_MS = 4
+	};
+	typedef struct {
+		byte event;
+		uint32_t param;
+	} EVENT;
+	typedef struct {
+		EVENT buf[SIZE];
+		volatile byte head;
+		volatile byte tail;
+	} RING;
+
+	RING m_high;					// transport, clock and storage events
+	RING m_low;						// UI events
+	volatile byte m_high_water;		// highest number of events waiting in either ring
+	volatile uint16_t m_dropped;	// number of events dropped because a ring was full
+
+	///////////////////////////////////////////////////////////////////////////////
+	static byte is_high_priority(int event) {
+		switch(event) {
+		case EV_SEQ_RESTART:
+		case EV_SEQ_STOP:
+		case EV_SEQ_CONTINUE:
+		case EV_SEQ_RUN_STOP:
+		case EV_SEQ_SONG_POS:
+		case EV_CLOCK_RESET:
+		case EV_LOAD_OK:
+		case EV_LOAD_FAIL:
+		case EV_SAVE_OK:
+		case EV_SAVE_FAIL:
+		case EV_REAPPLY_CAL_VOLTS:
+		case EV_REAPPLY_CONFIG:
+			return 1;
+		default:
+			return 0;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Handle up to max_events events that are waiting in a ring. Events posted
+	// while we are doing this are left until the next call
+	static void drain(RING& ring, int max_events) {
+		byte head = ring.head;
+		while(max_events-- && ring.tail != head) {
+			EVENT& e = ring.buf[ring.tail];
+			handle_event(e.event, e.param);
+			ring.tail = (ring.tail + 1)&SIZE_MASK;
+		}
+	}
+
+public:
+	///////////////////////////////////////////////////////////////////////////////
+	CEventQueue() {
+		m_high.head = 0;
+		m_high.tail = 0;
+		m_low.head = 0;
+		m_low.tail = 0;
+		m_high_water = 0;
+		m_dropped = 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Add an event to the queue. This can be called from an ISR. The main
+	// loop is the only consumer so only the producers need to be protected
+	// from each other
+	void post(int event, uint32_t param) {
+		RING& ring = is_high_priority(event) ? m_high : m_low;
+		uint32_t primask = DisableGlobalIRQ();
+		byte next = (ring.head + 1)&SIZE_MASK;
+		if(next == ring.tail) {
+			++m_dropped;
+		}
+		else {
+			ring.buf[ring.head].event = event;
+			ring.buf[ring.head].param = param;
+			ring.head = next;
+			byte count = (next - ring.tail)&SIZE_MASK;
+			if(count > m_high_water) {
+				m_high_water = count;
+			}
+		}
+		EnableGlobalIRQ(primask);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// called once per ms from the main loop
+	void run() {
+		drain(m_high, SIZE);
+		drain(m_low, MAX_UI_EVENTS_PER_MS);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	byte get_high_water() {
+		return m_high_water;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	uint16_t get_dropped() {
+		return m_dropped;
+	}
+};
+
+// define the event queue instance
+CEventQueue g_event_queue;
+
+#endif /* EVENT_QUEUE_H_ */
@@ -0,0 +1,180 @@
+//////////////////////////////////////////////////////////////////////////////
+// sixty four pixels 2020                                       CC-NC-BY-SA //
+//                                //  //          //                        //
+//   //////   /////   /////   //////  //   /////  //////   /////  //   //   //
+//   //   // //   // //   // //   //  //  //   // //   // //   //  // //    //
+//   //   // //   // //   // //   //  //  /////// //   // //   //   ///     //
+//   //   // //   // //   // //   //  //  //      //   // //   //  // //    //
+//   //   //  /////   /////   //////   //  /////  //////   /////  //   //   //
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// GATE EDGE SCHEDULER
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+#ifndef GATE_SCHEDULER_H_
+#define GATE_SCHEDULER_H_
+
+//
+// The sequencer runs once per ms, but works out each layer step that falls
+// due before the next ms boundary. Gate changes for those steps are queued
+// here with their offset (in fine timer counts) from the ms boundary and are
+// applied from a compare interrupt on the FTM1 fine timer at the exact time
+// they fall due, rather than being rounded to the ms
+//
+// Only gates are scheduled. The CV for a step is written at the start of the
+// ms, so it is always a fraction of a ms ahead of the gate. This is on purpose:
+// the DAC is updated over I2C and needs time to settle, and pitch must not
+// lag the gate that it goes with. MIDI notes also go out at the start of the
+// ms. The most they can lead the gate by is under a ms, which is less than
+// the time to send one note on at 31250 baud, so timing them would gain
+// nothing. Retriggers and gate timeouts within a step are counted in whole ms
+// from the step, and so they keep the step's offset
+//
+class CGateScheduler {
+	enum {
+		MAX_EVENTS = 16,
+		FTM_CHAN = 0
+	};
+	typedef struct {
+		uint16_t due;					// fine timer count when the event falls due
+		byte which;						// gate output
+		COuts::GATE_STATUS gate;		// new gate status
+	} EVENT;
+
+	// pending events in the order they fall due
+	volatile EVENT m_event[MAX_EVENTS];
+	volatile byte m_count;
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Get the number of fine timer counts until an event falls due (negative
+	// if it is overdue). Events are never more than a few ms in the future so
+	// a signed 16 bit difference is good enough to handle timer rollover
+	inline int16_t time_to(uint16_t due) {
+		return (int16_t)(due - g_clock.get_fine_count());
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Apply any events that are due and set up the compare interrupt for the
+	// next pending event. Must be called with interrupts disabled
+	void service() {
+		while(m_count) {
+			if(time_to(m_event[0].due) > 0) {
+				FTM1->CONTROLS[FTM_CHAN].CnV = m_event[0].due;
+				FTM1->CONTROLS[FTM_CHAN].CnSC = FTM_CnSC_MSA_MASK|FTM_CnSC_CHIE_MASK;
+
+				// make sure the counter has not passed the compare value
+				// while we were setting it up
+				if(time_to(m_event[0].due) > 0) {
+					return;
+				}
+			}
+			g_outs.gate(m_event[0].which, m_event[0].gate);
+			--m_count;
+			for(int i=0; i<m_count; ++i) {
+				m_event[i].due = m_event[i+1].due;
+				m_event[i].which = m_event[i+1].which;
+				m_event[i].gate = m_event[i+1].gate;
+			}
+		}
+		FTM1->CONTROLS[FTM_CHAN].CnSC = FTM_CnSC_MSA_MASK;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Remove pending events for one output (or all outputs when which < 0)
+	void remove(int which) {
+		uint32_t primask = DisableGlobalIRQ();
+		int count = 0;
+		for(int i=0; i<m_count; ++i) {
+			if(which >= 0 && m_event[i].which != which) {
+				m_event[count].due = m_event[i].due;
+				m_event[count].which = m_event[i].which;
+				m_event[count].gate = m_event[i].gate;
+				++count;
+			}
+		}
+		m_count = count;
+		service();
+		EnableGlobalIRQ(primask);
+	}
+
+public:
+	///////////////////////////////////////////////////////////////////////////////
+	CGateScheduler() {
+		m_count = 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Called after the fine timer has been started by the clock
+	void init() {
+		FTM1->CONTROLS[FTM_CHAN].CnSC = FTM_CnSC_MSA_MASK; // software compare, no pin
+		EnableIRQ(FTM1_IRQn);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	void event(int event, uint32_t param) {
+		switch(event) {
+		case EV_SEQ_STOP:
+		case EV_SEQ_RESTART:
+		case EV_SEQ_SONG_POS:
+		case EV_CLOCK_RESET:
+			remove(-1);
+			break;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Change the status of a gate output at an offset (in fine timer counts)
+	// from the most recent ms boundary
+	void gate(byte which, COuts::GATE_STATUS gate, uint16_t offset) {
+		uint32_t primask = DisableGlobalIRQ();
+		if(m_count < MAX_EVENTS) {
+			uint16_t due = g_clock.get_ms_stamp() + offset;
+
+			// insert after any events that are due at the same time or earlier
+			int pos = m_count;
+			while(pos > 0 && (int16_t)(m_event[pos-1].due - due) > 0) {
+				m_event[pos].due = m_event[pos-1].due;
+				m_event[pos].which = m_event[pos-1].which;
+				m_event[pos].gate = m_event[pos-1].gate;
+				--pos;
+			}
+			m_event[pos].due = due;
+			m_event[pos].which = which;
+			m_event[pos].gate = gate;
+			++m_count;
+		}
+		else {
+			// queue is full, so change the gate right away
+			g_outs.gate(which, gate);
+		}
+		service();
+		EnableGlobalIRQ(primask);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Change the status of a gate output right away, cancelling any changes
+	// that are pending for the same output
+	void gate_now(byte which, COuts::GATE_STATUS gate) {
+		remove(which);
+		g_outs.gate(which, gate);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	inline void isr() {
+		FTM1->CONTROLS[FTM_CHAN].CnSC &= ~FTM_CnSC_CHF_MASK;
+		service();
+	}
+};
+
+// define the scheduler instance
+CGateScheduler g_gate_scheduler;
+
+// ISR for the fine timer compare
+extern "C" void FTM1_IRQHandler(void) {
+	g_gate_scheduler.isr();
+}
+
+#endif /* GATE_SCHEDULER_H_ */
@@ -30,22 +30,38 @@ class CI2CDac{
 	volatile byte m_data[SZ_DATA];
 	volatile enum { ST_INIT1, ST_INIT2, ST_IDLE, ST_PENDING } m_state;
 	uint16_t m_dac[4];
+
+	// latency measurement, from when a DAC value changes to when
+	// the transfer that updates the DAC has completed
+	uint32_t m_pending_us;				// time the oldest unsent change was made
+	uint32_t m_xfer_us;					// pending time for the transfer in progress
+	volatile byte m_xfer_timed;			// whether the transfer in progress is being timed
+	volatile uint16_t m_max_latency_us;	// worst latency seen
 public:
 	///////////////////////////////////////////////////////////////////////////////
 	CI2CDac() {
 		m_state = ST_INIT1;
 		memset(m_dac,0,sizeof(m_dac));
+		m_pending_us = 0;
+		m_xfer_us = 0;
+		m_xfer_timed = 0;
+		m_max_latency_us = 0;
 	}
 	///////////////////////////////////////////////////////////////////////////////
 	inline void set(byte which, uint16_t value) {
 		if(m_dac[which] != value) {
 			m_dac[which] = value;
 			if(m_state == ST_IDLE) {
+				m_pending_us = g_clock.get_us();
 				m_state = ST_PENDING;
 			}
 		}
 	}
 	///////////////////////////////////////////////////////////////////////////////
+	uint16_t get_max_latency_us() {
+		return m_max_latency_us;
+	}
+	///////////////////////////////////////////////////////////////////////////////
 	byte get_tx(i2c_master_transfer_t& xfer) {
 		switch(m_state) {
 		case ST_INIT1:
@@ -75,6 +91,8 @@ public:
 			m_data[6] = ((m_dac[0]>>8) & 0xF);
 			m_data[7] = (byte)m_dac[0];
 			xfer.dataSize = 8;
+			m_xfer_us = m_pending_us;
+			m_xfer_timed = 1;
 			m_state = ST_IDLE;
 			break;
 		case ST_IDLE:
@@ -94,11 +112,20 @@ public:
 
 	///////////////////////////////////////////////////////////////////////////////
 	void handle_rx(status_t status) {
+		if(m_xfer_timed) {
+			uint32_t latency = g_clock.get_us() - m_xfer_us;
+			if(latency > m_max_latency_us) {
+				m_max_latency_us = (latency > 0xFFFF)? 0xFFFF : latency;
+			}
+			m_xfer_timed = 0;
+		}
 		switch(m_state) {
 		case ST_INIT1:
 			m_state = ST_INIT2;
 			break;
 		case ST_INIT2:
+			// send the values set during init, timed from now
+			m_pending_us = g_clock.get_us();
 			m_state = ST_PENDING;
 			break;
 		case ST_IDLE:
@@ -117,39 +144,189 @@ CI2CDac g_i2c_dac;
 // memory is divided into slots. Each slot is 2560 bytes (40 pages)
 // allowing for a total of 12 slots in 32kB
 //
+// Reads are split into chunks the same size as a page so that the bus is
+// never tied up for long and DAC updates can be sent in between. A patch
+// image is read in two stages: once its header is in, only as many more
+// bytes are read as the image length in the header says
+//
+// After each page write the EEPROM is polled with an empty write until it
+// acknowledges its address, which it does not do while it is busy committing
+// the page (typically under 5ms). If it does not respond within the maximum
+// write cycle time we go ahead anyway
+//
+// Writes only rewrite the pages that have changed. Each page of the slot is
+// read back and compared with the buffer first. The first byte of every slot
+// is a format cookie, which is cleared while changed pages are written and
+// only restored (by rewriting the first page) once all the others are done,
+// so a save that is interrupted by a power loss leaves the slot marked as
+// invalid rather than a mixture of old and new data. Data that carries its
+// own checksum (the autosave image) is written without the marking step,
+// since a mixture of old and new pages already fails its check. The first
+// page is still written last, and only if it has changed
+//
+// Background reads and writes (used for autosave) start at most one transfer
+// per ms, do not fire events when they complete and can be cancelled
+//
 ///////////////////////////////////////////////////////////////////////////////////
 class CI2CEeprom{
 	enum {
 		SZ_PAGE_SIZE = 64,
+		SZ_READ_CHUNK = SZ_PAGE_SIZE,
 		SZ_DATA = PATCH_SLOT_SIZE,
-		WRITE_DELAY = 10
+		SZ_EEPROM = EEPROM_SIZE,
+		MAX_PAGES = SZ_DATA/SZ_PAGE_SIZE,
+		WRITE_TIMEOUT = 10,			// ms to wait for a page write to complete
+		UNCOMMITTED_MARKER = 0x00	// first byte of a slot while a save is in progress
 	};
+	static_assert(MAX_PAGES <= 64, "Too many pages for dirty page mask");
 	volatile byte m_data[SZ_DATA];
+	volatile byte m_page_buf[SZ_PAGE_SIZE];	// page read back from EEPROM for comparison
 	volatile enum {
 		ST_IDLE,
 		ST_READ,
 		ST_READ_COMPLETE,
 		ST_READ_ERROR,
+		ST_WRITE_SCAN,			// reading back pages to find which have changed
 		ST_WRITE,
-		ST_WRITE_DELAY,
+		ST_WRITE_POLL,			// waiting to poll for the end of a page write
+		ST_WRITE_POLLING,		// poll in progress
+		ST_WRITE_COMPLETE,
 		ST_WRITE_ERROR
 	} m_state;
 
+	// stages of writing the changed pages
+	volatile enum {
+		WP_MARK,				// first page with the cookie cleared
+		WP_DATA,				// other changed pages
+		WP_COMMIT				// first page with the real cookie
+	} m_write_phase;
+
 	volatile int m_slot;
 	volatile int m_address;
 	volatile int m_bytes;
 	volatile int m_index;
-	volatile byte m_ms_lsb;
-	volatile byte m_write_delay;
+	volatile int m_image_at;			// where the patch image header is in the data being read (-1 if none)
+	volatile int m_page;				// page being scanned or written
+	volatile int m_num_pages;			// number of pages being saved
+	volatile byte m_mark;				// whether to mark the slot invalid during the save
+	volatile uint64_t m_dirty;			// bit for each page that has changed
+	volatile byte *m_write_src;			// data for the page being written
+	volatile uint32_t m_write_ms;		// when the last page write completed
 	volatile status_t m_status;
+	volatile byte m_background;			// who started the background operation (EEPROM_FOREGROUND if none)
+	volatile byte m_cancel;				// whether the background operation should be abandoned
+	volatile byte m_background_done;	// whether a background operation has finished but not been checked
+	volatile byte m_background_ok;		// whether the last background operation succeeded
+	volatile uint32_t m_xfer_ms;		// when the last transfer completed
+
+	// statistics
+	uint32_t m_save_start_ms;			// when the current save started
+	uint32_t m_save_ms;					// duration of the last complete save
+	volatile byte m_save_pages;			// pages written by the last save
+	volatile uint16_t m_poll_timeouts;	// page writes where polling timed out
+
+	///////////////////////////////////////////////////////////////////////////////
+	void begin_page_write(int page, volatile byte *src) {
+		m_page = page;
+		m_address = m_slot * PATCH_SLOT_SIZE + page * SZ_PAGE_SIZE;
+		m_write_src = src;
+		m_state = ST_WRITE;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Decide what to write once all the pages have been compared
+	void scan_complete() {
+		m_save_pages = 0;
+		if(!m_dirty) {
+			// nothing has changed
+			m_state = ST_WRITE_COMPLETE;
+		}
+		else if(!m_mark) {
+			// the data is self checking, so go straight to the changed pages
+			m_write_phase = WP_DATA;
+			m_page = 0;
+			write_next_page();
+		}
+		else if(m_dirty == 1) {
+			// only the first page has changed, so it can just be written
+			m_write_phase = WP_COMMIT;
+			begin_page_write(0, m_data);
+		}
+		else {
+			// mark the slot as invalid before writing anything else
+			for(int i=0; i<SZ_PAGE_SIZE; ++i) {
+				m_page_buf[i] = m_data[i];
+			}
+			m_page_buf[0] = UNCOMMITTED_MARKER;
+			m_write_phase = WP_MARK;
+			begin_page_write(0, m_page_buf);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Write the next changed page after m_page, then the first page. When the
+	// slot was not marked invalid the first page is only written if changed
+	void write_next_page() {
+		while(++m_page < m_num_pages) {
+			if(m_dirty & ((uint64_t)1<<m_page)) {
+				begin_page_write(m_page, &m_data[m_page * SZ_PAGE_SIZE]);
+				return;
+			}
+		}
+		if(m_mark || (m_dirty & 1)) {
+			m_write_phase = WP_COMMIT;
+			begin_page_write(0, m_data);
+		}
+		else {
+			m_state = ST_WRITE_COMPLETE;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Move on when the EEPROM has committed a page
+	void page_committed() {
+		++m_save_pages;
+		if(m_cancel) {
+			m_state = ST_IDLE;
+			return;
+		}
+		switch(m_write_phase) {
+		case WP_MARK:
+			m_write_phase = WP_DATA;
+			m_page = 0;
+			// fall through
+		case WP_DATA:
+			write_next_page();
+			break;
+		case WP_COMMIT:
+			m_state = ST_WRITE_COMPLETE;
+			break;
+		}
+	}
 public:
 	///////////////////////////////////////////////////////////////////////////////
 	CI2CEeprom() {
 		m_address = 0;
 		m_bytes = 0;
 		m_index = 0;
-		m_ms_lsb = 0;
+		m_image_at = -1;
+		m_page = 0;
+		m_num_pages = 0;
+		m_mark = 1;
+		m_dirty = 0;
+		m_write_src = m_data;
+		m_write_phase = WP_COMMIT;
+		m_write_ms = 0;
 		m_status = -1;
+		m_background = EEPROM_FOREGROUND;
+		m_cancel = 0;
+		m_background_done = 0;
+		m_background_ok = 0;
+		m_xfer_ms = 0;
+		m_save_start_ms = 0;
+		m_save_ms = 0;
+		m_save_pages = 0;
+		m_poll_timeouts = 0;
 	}
 	status_t get_status() {
 		return m_status;
@@ -170,78 +347,180 @@ public:
 	byte is_busy() {
 		return (m_state != ST_IDLE);
 	}
-	byte read(int slot, int size) {
+	byte is_background() {
+		return is_busy() && m_background;
+	}
+	///////////////////////////////////////////////////////////////////////////////
+	// Check the result of a finished background operation. This returns 1 only
+	// if the operation was started by this owner and succeeded
+	byte take_background_result(byte owner) {
+		if(!m_background_done || m_background != owner) {
+			return 0;
+		}
+		m_background_done = 0;
+		return m_background_ok;
+	}
+	///////////////////////////////////////////////////////////////////////////////
+	// Whether a background operation can use the data buffer. It is not free
+	// while a background result is waiting to be checked by its owner
+	byte is_buf_free() {
+		return !is_busy() && !m_background_done;
+	}
+	void cancel_background() {
+		if(m_background) {
+			m_cancel = 1;
+		}
+	}
+	byte read(int slot, int size, byte background = EEPROM_FOREGROUND) {
 		if(m_state != ST_IDLE) {
 			return 0;
 		}
 		ASSERT(size <= SZ_DATA);
+		ASSERT(slot * PATCH_SLOT_SIZE + size <= SZ_EEPROM);
+		m_background = background;
+		m_background_done = 0;
+		m_background_ok = 0;
+		m_cancel = 0;
 		m_status = -1;
 		m_slot = slot;
 		m_address = slot * PATCH_SLOT_SIZE;
 		m_bytes = size;
+		m_index = 0;
+		m_image_at = -1;
 		m_state = ST_READ;
 		return 1;
 	}
-	byte write(int slot, int size) {
+	///////////////////////////////////////////////////////////////////////////////
+	// Read data holding a patch image that starts image_at bytes in. No more
+	// than size bytes are read, and less if the image is shorter
+	byte read_image(int slot, int size, int image_at, byte background = EEPROM_FOREGROUND) {
+		ASSERT(image_at + SZ_PATCH_HEADER <= SZ_READ_CHUNK);
+		if(!read(slot, size, background)) {
+			return 0;
+		}
+		m_image_at = image_at;
+		return 1;
+	}
+	///////////////////////////////////////////////////////////////////////////////
+	// Start writing the data buffer to a slot. Pass mark = 0 only if the data
+	// has a checksum that will show up a partly written slot
+	byte write(int slot, int size, byte background = EEPROM_FOREGROUND, byte mark = 1) {
 		if(m_state != ST_IDLE) {
 			return 0;
 		}
 		ASSERT(size <= SZ_DATA);
+		ASSERT(slot * PATCH_SLOT_SIZE + size <= SZ_EEPROM);
+		m_background = background;
+		m_background_done = 0;
+		m_background_ok = 0;
+		m_cancel = 0;
 		m_status = -1;
 		m_slot = slot;
 		m_address = slot * PATCH_SLOT_SIZE;
-		m_bytes = size;
-		m_index = 0;
-		m_state = ST_WRITE;
+		m_num_pages = (size + SZ_PAGE_SIZE - 1)/SZ_PAGE_SIZE;
+		m_page = 0;
+		m_mark = mark;
+		m_dirty = 0;
+		m_save_start_ms = g_clock.get_ms();
+		m_state = ST_WRITE_SCAN;
 		return 1;
 	}
+	uint32_t get_save_ms() {
+		return m_save_ms;
+	}
+	byte get_save_pages() {
+		return m_save_pages;
+	}
+	uint16_t get_poll_timeouts() {
+		return m_poll_timeouts;
+	}
 	byte get_tx(i2c_master_transfer_t& xfer) {
 		xfer.slaveAddress = I2C_ADDR_EEPROM;
 		xfer.subaddress = m_address;
 		xfer.subaddressSize = 2;
 		xfer.flags = kI2C_TransferDefaultFlag;
+		if(m_background && m_state != ST_IDLE) {
+			if(m_cancel && m_state != ST_WRITE_POLL) {
+				// a page write that has been started is allowed to finish
+				m_state = ST_IDLE;
+				return 0;
+			}
+			if(g_clock.get_ms() == m_xfer_ms) {
+				return 0;
+			}
+		}
 		switch(m_state) {
 			case ST_READ:
 				xfer.direction = kI2C_Read;
-				xfer.data = (byte*)&m_data;
-				xfer.dataSize = m_bytes;
+				xfer.data = (byte*)&m_data[m_index];
+				xfer.dataSize = (m_bytes < SZ_READ_CHUNK)? m_bytes : SZ_READ_CHUNK;
 			    return 1;
-			case ST_WRITE_DELAY:
-				if(m_write_delay) {
-					if((byte)g_clock.get_ms() != m_ms_lsb) {
-						m_ms_lsb = (byte)g_clock.get_ms();
-						--m_write_delay;
-					}
-					return 0;
+			case ST_WRITE_SCAN:
+				xfer.direction = kI2C_Read;
+				xfer.data = (byte*)&m_page_buf;
+				xfer.dataSize = SZ_PAGE_SIZE;
+				return 1;
+			case ST_WRITE_POLL:
+				if(g_clock.get_ms() - m_write_ms <= WRITE_TIMEOUT) {
+					// address the EEPROM with no data. It will not
+					// acknowledge until the page write is complete
+					xfer.subaddress = 0;
+					xfer.subaddressSize = 0;
+					xfer.direction = kI2C_Write;
+					xfer.data = NULL;
+					xfer.dataSize = 0;
+					m_state = ST_WRITE_POLLING;
+					return 1;
 				}
-				else {
-					if(m_bytes <= 0) {
-						// done
-						fire_event(EV_SAVE_OK,m_slot);
-						m_state = ST_IDLE;
-						return 0;
-					}
-					else {
-						// write the next page
-						m_state = ST_WRITE;
-					}
+				++m_poll_timeouts;
+				page_committed();
+				if(m_state != ST_WRITE) {
+					return 0;
 				}
+				xfer.subaddress = m_address;
 				// no break
 			case ST_WRITE:
 				xfer.direction = kI2C_Write;
-				xfer.data = (byte*)&m_data[m_index];
+				xfer.data = (byte*)m_write_src;
 				xfer.dataSize = SZ_PAGE_SIZE;
 				return 1;
 			case ST_READ_COMPLETE:
-				fire_event(EV_LOAD_OK,m_slot);
+				if(m_background) {
+					m_background_ok = 1;
+					m_background_done = 1;
+				}
+				else {
+					fire_event(EV_LOAD_OK,m_slot);
+				}
 				m_state = ST_IDLE;
 				break;
 			case ST_READ_ERROR:
-				fire_event(EV_LOAD_FAIL,m_slot);
+				if(m_background) {
+					m_background_done = 1;
+				}
+				else {
+					fire_event(EV_LOAD_FAIL,m_slot);
+				}
+				m_state = ST_IDLE;
+				break;
+			case ST_WRITE_COMPLETE:
+				m_save_ms = g_clock.get_ms() - m_save_start_ms;
+				if(m_background) {
+					m_background_ok = 1;
+					m_background_done = 1;
+				}
+				else {
+					fire_event(EV_SAVE_OK,m_slot);
+				}
 				m_state = ST_IDLE;
 				break;
 			case ST_WRITE_ERROR:
-				fire_event(EV_SAVE_FAIL,m_slot);
+				if(m_background) {
+					m_background_done = 1;
+				}
+				else {
+					fire_event(EV_SAVE_FAIL,m_slot);
+				}
 				m_state = ST_IDLE;
 				break;
 		}
@@ -251,27 +530,69 @@ public:
 	///////////////////////////////////////////////////////////////////////////////
 	void handle_rx(status_t status) {
 		m_status = status;
+		m_xfer_ms = g_clock.get_ms();
 		switch(m_state) {
 		case ST_READ:
-			m_state = ST_READ_COMPLETE;
+			if(status == kStatus_Success) {
+				int chunk = (m_bytes < SZ_READ_CHUNK)? m_bytes : SZ_READ_CHUNK;
+				m_address += chunk;
+				m_index += chunk;
+				m_bytes -= chunk;
+				if(m_image_at >= 0) {
+					// the first chunk has the image header, so now we
+					// know how much is left to read
+					int left = m_image_at + patch_image_size((byte*)&m_data[m_image_at]) - m_index;
+					if(left < m_bytes) {
+						m_bytes = left;
+					}
+					m_image_at = -1;
+				}
+				if(m_bytes <= 0) {
+					m_state = ST_READ_COMPLETE;
+				}
+			}
+			else {
+				m_state = ST_READ_ERROR;
+			}
 			break;
-		case ST_WRITE:
+		case ST_WRITE_SCAN:
 			if(status == kStatus_Success) {
-
+				volatile byte *src = &m_data[m_page * SZ_PAGE_SIZE];
+				for(int i=0; i<SZ_PAGE_SIZE; ++i) {
+					if(src[i] != m_page_buf[i]) {
+						m_dirty |= ((uint64_t)1<<m_page);
+						break;
+					}
+				}
 				m_address += SZ_PAGE_SIZE;
-				m_index += SZ_PAGE_SIZE;
-				m_bytes -= SZ_PAGE_SIZE;
-
-				// post-write delay allows EEPROM to commit the page
-				m_ms_lsb = (byte)g_clock.get_ms();
-				m_write_delay = WRITE_DELAY;
-				m_state = ST_WRITE_DELAY;
+				if(++m_page >= m_num_pages) {
+					scan_complete();
+				}
+			}
+			else {
+				m_state = ST_WRITE_ERROR;
+			}
+			break;
+		case ST_WRITE:
+			if(status == kStatus_Success) {
+				// wait for the EEPROM to commit the page
+				m_write_ms = g_clock.get_ms();
+				m_state = ST_WRITE_POLL;
 			}
 			else {
 				// error
 				m_state = ST_WRITE_ERROR;
 			}
 			break;
+		case ST_WRITE_POLLING:
+			if(status != kStatus_Success) {
+				// still busy, poll again
+				m_state = ST_WRITE_POLL;
+			}
+			else {
+				page_committed();
+			}
+			break;
 		}
 	}
 };
@@ -320,19 +641,21 @@ public:
 
 	}
 	///////////////////////////////////////////////////////////////////////////////
+	// Start the next transfer when the bus is free. A DAC update always goes
+	// first, so it never has to wait for more than one EEPROM transfer (a single
+	// page write or read chunk)
 	void run() {
 		if(m_state == ST_IDLE) {
-			if(g_i2c_eeprom.get_tx(m_xfer)) {
-				I2C_MasterTransferCreateHandle(I2C_EEPROM, &m_handle, i2c_master_callback, NULL);
-				I2C_MasterTransferNonBlocking(I2C_EEPROM, &m_handle, &m_xfer);
-				m_state = ST_EEPROM_BUSY;
-			}
-			else if(g_i2c_dac.get_tx(m_xfer)) {
+			if(g_i2c_dac.get_tx(m_xfer)) {
 				I2C_MasterTransferCreateHandle(I2C_DAC, &m_handle, i2c_master_callback, NULL);
 				I2C_MasterTransferNonBlocking(I2C_DAC, &m_handle, &m_xfer);
-
 				m_state = ST_DAC_BUSY;
 			}
+			else if(g_i2c_eeprom.get_tx(m_xfer)) {
+				I2C_MasterTransferCreateHandle(I2C_EEPROM, &m_handle, i2c_master_callback, NULL);
+				I2C_MasterTransferNonBlocking(I2C_EEPROM, &m_handle, &m_xfer);
+				m_state = ST_EEPROM_BUSY;
+			}
 		}
 	}
 	///////////////////////////////////////////////////////////////////////////////
@@ -342,6 +665,15 @@ public:
 		} while(is_busy());
 	}
 	///////////////////////////////////////////////////////////////////////////////
+	// Abandon any background EEPROM operation so that the EEPROM can be used
+	// right away. Only blocks for the transfer or page write in progress
+	void cancel_background() {
+		if(g_i2c_eeprom.is_background()) {
+			g_i2c_eeprom.cancel_background();
+			wait_for_idle();
+		}
+	}
+	///////////////////////////////////////////////////////////////////////////////
 	inline void on_txn_complete(I2C_Type *base, i2c_master_handle_t *handle, status_t status, void *userData) {
 		switch(m_state) {
 		case ST_EEPROM_BUSY:
@@ -31,20 +31,28 @@
 // APPLICATION INCLUDES
 //
 #include "defs.h"
+#include "event_queue.h"
 #include "digital_out.h"
 #include "chars.h"
 #include "ui_driver.h"
 #include "leds.h"
 #include "midi.h"
 #include "clock.h"
+#include "patch_format.h"
 #include "i2c_bus.h"
 #include "popup.h"
 #include "scale.h"
 #include "outs.h"
+#include "gate_scheduler.h"
+#include "prng.h"
+#include "bulk_values.h"
 #include "sequence_step.h"
 #include "sequence_page.h"
 #include "sequence_layer.h"
+#include "patch_cache.h"
 #include "sequence.h"
+#include "autosave.h"
+#include "metrics.h"
 #include "sequence_editor.h"
 #include "params.h"
 #include "menu.h"
@@ -71,6 +79,19 @@ typedef enum:byte {
  } VIEW_TYPE;
 VIEW_TYPE g_view = VIEW_SEQUENCER;
 
+// Boot sequence. The power up animation runs while the stored data loads, and
+// the sequencer starts as soon as the data has been validated
+typedef enum:byte {
+	 BOOT_CONFIG,		// loading the configuration
+	 BOOT_RESTORE,		// restoring the autosaved working state
+	 BOOT_ANIMATE,		// sequencer running, waiting for the animation to finish
+	 BOOT_DONE			// editor running
+ } BOOT_STATE;
+
+// boot time measurements, in ms from reset
+uint32_t g_first_output_ms = 0;	// when the sequencer first runs
+uint32_t g_boot_ms = 0;			// when the editor becomes active
+
 /////////////////////////////////////////////////////////////////////////////////////////////
 void midi::handle_note(byte chan, byte note, byte vel) {
 	g_midi_led.blink(g_midi_led.SHORT_BLINK);
@@ -78,14 +99,26 @@ void midi::handle_note(byte chan, byte note, byte vel) {
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
-void midi::handle_realtime(byte ch) {
+uint32_t midi::get_timestamp() {
+	return g_clock.get_us();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+void midi::handle_realtime(byte ch, uint32_t us) {
+	g_midi_led.blink(g_midi_led.SHORT_BLINK);
+	clock::g_midi_clock_in.on_midi_realtime(ch, us);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+void midi::handle_song_position(uint16_t pos) {
 	g_midi_led.blink(g_midi_led.SHORT_BLINK);
-	clock::g_midi_clock_in.on_midi_realtime(ch, g_clock.get_ms());
+	clock::g_midi_clock_in.on_midi_song_position(pos);
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
 void midi::handle_nrpn(byte nrpn_hi, byte nrpn_lo, byte value_hi, byte value_lo) {
 	g_midi_led.blink(g_midi_led.SHORT_BLINK);
+	g_metrics.handle_nrpn(nrpn_hi, nrpn_lo);
 	g_sequence.handle_nrpn(nrpn_hi, nrpn_lo, value_hi, value_lo);
 }
 
@@ -170,7 +203,14 @@ void switch_to_view(VIEW_TYPE view) {
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
+// Queue an event to be handled by the main loop
 void fire_event(int event, uint32_t param) {
+	g_event_queue.post(event, param);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Called from the main loop to handle an event from the queue
+void handle_event(int event, uint32_t param) {
 
 	switch(event) {
 	///////////////////////////////////
@@ -240,11 +280,13 @@ void fire_event(int event, uint32_t param) {
 	case EV_SEQ_STOP:
 	case EV_SEQ_RESTART:
 	case EV_SEQ_CONTINUE:
+	case EV_SEQ_SONG_POS:
 	case EV_CLOCK_RESET:
 	case EV_REAPPLY_CONFIG:
 	case EV_SAVE_OK:
 	case EV_LOAD_OK:
 		g_clock.event(event, param);
+		g_gate_scheduler.event(event, param);
 		g_outs.event(event, param);
 		g_sequence.event(event, param);
 		g_sequence_editor.event(event, param);
@@ -293,10 +335,19 @@ int is_cal_mode() {
 	return g_sequence.is_cal_mode();
 }
 
+/////////////////////////////////////////////////////////////////////////////////////////////
+int get_config_size() {
+	return 2 + g_outs.get_cfg_size() + 2 + g_clock.get_cfg_size();
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////
 void save_config() {
+	// make sure nothing else is using the EEPROM buffer
+	g_i2c_bus.cancel_background();
+	g_i2c_bus.wait_for_idle();
+
 	byte *ptr = g_i2c_eeprom.buf();
-	int len = 2 + g_outs.get_cfg_size() + 2 + g_clock.get_cfg_size();
+	int len = get_config_size();
 
 	// first gather the calibration data
 	*ptr++ = CALIBRATION_DATA_COOKIE1;
@@ -312,20 +363,21 @@ void save_config() {
 	*ptr++ = g_i2c_eeprom.buf_checksum(len);
 
 	// save all the data
-	g_i2c_bus.wait_for_idle();
 	g_i2c_eeprom.write(SLOT_CONFIG, len + 1);
 	g_i2c_bus.wait_for_idle();
 	g_popup.text("CFG SAVE");
 }
 /////////////////////////////////////////////////////////////////////////////////////////////
-void load_config() {
+// Start loading data from EEPROM. This runs through the I2C state machine and
+// load_config() should be called once the EEPROM is idle again
+void start_load_config() {
+	g_i2c_eeprom.read(SLOT_CONFIG, get_config_size() + 1, EEPROM_BOOT);
+}
 
-	// load data from EEPROM
+/////////////////////////////////////////////////////////////////////////////////////////////
+void load_config() {
 	byte *buf = g_i2c_eeprom.buf();
-	int len = 2 + g_outs.get_cfg_size() + 2 + g_clock.get_cfg_size();
-
-	g_i2c_eeprom.read(SLOT_CONFIG, len + 1);
-	g_i2c_bus.wait_for_idle();
+	int len = get_config_size();
 
 	byte expected_checksum = buf[len];
 
@@ -358,21 +410,36 @@ void load_config() {
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
-void power_up_screen() {
-    for(int i=15; i>=0; --i) {
-        g_ui.lock_for_update();
-        for(int j=0; j<16; ++j) {
-        	g_ui.raster(j) = 0xFFFFFFFF;
-        	if(j>=i) {
-        		g_ui.hilite(j) = 0xFFFFFFFF;
-        	}
-        	else {
-        		g_ui.hilite(j) = 0;
-        	}
-        }
-        g_ui.unlock_for_update();
-        g_clock.wait_ms(50);
+// Draw one frame of the power up animation. Frames count down from 15 to 0
+void power_up_screen(int frame) {
+	g_ui.lock_for_update();
+	for(int j=0; j<16; ++j) {
+		g_ui.raster(j) = 0xFFFFFFFF;
+		if(j>=frame) {
+			g_ui.hilite(j) = 0xFFFFFFFF;
+		}
+		else {
+			g_ui.hilite(j) = 0;
+		}
+	}
+	g_ui.unlock_for_update();
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Called when the power up animation has finished and the sequencer is running
+void finish_boot() {
+    PowerControl.set(1);
+
+    // diagnostic mode
+    if(g_ui.is_key_down(KEY_R1) &&
+       g_ui.is_key_down(KEY_R2) &&
+       g_ui.is_key_down(KEY_R3)) {
+    	g_diagnostics.run();
     }
+
+    // prepare to display the editor
+    g_sequence_editor.activate();
+    g_boot_ms = g_clock.get_ms();
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
@@ -406,62 +473,90 @@ int main(void) {
     BOARD_InitBootPeripherals();
 
     g_clock.init();
+    g_gate_scheduler.init();
     g_ui.init();
-    power_up_screen();
-    PowerControl.set(1);
-    g_popup.text(VERSION_STRING);
-
     g_i2c_bus.init();
     g_midi.init();
     g_sequence.init();
-    load_config();
-    g_i2c_bus.wait_for_idle();
-
-    // diagnostic mode
-    if(g_ui.is_key_down(KEY_R1) &&
-       g_ui.is_key_down(KEY_R2) &&
-       g_ui.is_key_down(KEY_R3)) {
-    	g_diagnostics.run();
-    }
-
-    // prepare to display the editor
-    g_sequence_editor.activate();
+    g_popup.text(VERSION_STRING);
+    start_load_config();
 
+    BOOT_STATE boot_state = BOOT_CONFIG;
+    int boot_frame = 15;
+    int frame_timeout = 0;
 	int off_count =  OFF_SWITCH_MS;
     while(1) {
 
     	if(g_clock.is_ms_tick()) {
 
+    		g_event_queue.run();
         	g_clock.run();
-       		g_sequence.run();
+        	switch(boot_state) {
+        	case BOOT_CONFIG:
+        		if(!g_i2c_eeprom.is_busy()) {
+        			load_config();
+        			g_autosave.start_restore();
+        			boot_state = BOOT_RESTORE;
+        		}
+        		break;
+        	case BOOT_RESTORE:
+        		if(g_autosave.is_restored()) {
+        			g_first_output_ms = g_clock.get_ms();
+        			boot_state = BOOT_ANIMATE;
+        		}
+        		break;
+        	default:
+        		break;
+        	}
+        	if(boot_state >= BOOT_ANIMATE) {
+        		g_sequence.run();
+        	}
         	g_outs.run();
         	g_midi.run();
-
-       		g_sequence_editor.run();
-        	g_ui.run();
-    		g_popup.run();
-
-			g_ui.lock_for_update();
-			switch(g_view) {
-			case VIEW_SEQUENCER:
-				g_sequence_editor.repaint();
-				break;
-			case VIEW_MENU_A:
-			case VIEW_MENU_B:
-				g_menu.repaint();
-				break;
-			}
-			g_popup.repaint();
-			g_ui.unlock_for_update();
-
-    		if(!OffSwitch.get()) {
-    			if(!--off_count) {
-    				break;
-    			}
-    		}
-    		else {
-    			off_count = OFF_SWITCH_MS;
-    		}
+        	g_patch_cache.run();
+        	g_autosave.run();
+        	g_metrics.run();
+
+        	if(boot_state != BOOT_DONE) {
+        		if(frame_timeout) {
+        			--frame_timeout;
+        		}
+        		else if(boot_frame >= 0) {
+        			power_up_screen(boot_frame--);
+        			frame_timeout = POWER_UP_FRAME_MS - 1;
+        		}
+        		else if(boot_state == BOOT_ANIMATE) {
+        			finish_boot();
+        			boot_state = BOOT_DONE;
+        		}
+        	}
+        	else {
+	       		g_sequence_editor.run();
+	        	g_ui.run();
+	    		g_popup.run();
+
+				g_ui.lock_for_update();
+				switch(g_view) {
+				case VIEW_SEQUENCER:
+					g_sequence_editor.repaint();
+					break;
+				case VIEW_MENU_A:
+				case VIEW_MENU_B:
+					g_menu.repaint();
+					break;
+				}
+				g_popup.repaint();
+				g_ui.unlock_for_update();
+
+	    		if(!OffSwitch.get()) {
+	    			if(!--off_count) {
+	    				break;
+	    			}
+	    		}
+	    		else {
+	    			off_count = OFF_SWITCH_MS;
+	    		}
+        	}
 
     		g_midi_led.run();
     		g_gate_led.run();
@@ -475,6 +570,7 @@ int main(void) {
     	g_clock.poll_aux_in();
     }
     g_sequence.silence();
+    g_autosave.save_now();
     save_config();
 	shut_down_screen();
 	PowerControl.set(0);
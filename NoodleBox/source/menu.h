@@ -61,13 +61,15 @@ public:
 	};
 
 
-	static const int NUM_MENU_B_OPTS = 21;
+	static const int NUM_MENU_B_OPTS = 23;
 	const OPTION m_menu_b[NUM_MENU_B_OPTS] = {
 			{"SCA", P_SEQ_SCALE_TYPE, PT_ENUMERATED, "IONI|DORI|PHRY|LYDI|MIXO|AEOL|LOCR"},
 			{"ROO", P_SEQ_SCALE_ROOT, PT_ENUMERATED, "C|C#|D|D#|E|F|F#|G|G#|A|A#|B"},
 			{0},
 			{"CLK", P_CLOCK_SRC, PT_ENUMERATED, "INT|MCLK|MTRN|PCLK"},
 			{"SYI",  P_CLOCK_IN_RATE, PT_ENUMERATED, "8|16|32|24PP"},
+			{"FLT",  P_CLOCK_IN_FILTER, PT_ENUMERATED, "OFF|LOW|MED|HIGH"},
+			{"FWL",  P_CLOCK_IN_FREEWHEEL, PT_ENUMERATED, "OFF|1|2|4"},
 			{"SYO", P_CLOCK_OUT_MODE, PT_ENUMERATED, "OFF|ON|RUN|STAR|STOP|STST|RES|RNNG|ACC"},
 			{"SCK", P_CLOCK_OUT_RATE, PT_ENUMERATED, "8|16|32|24PP"},
 			{0,P_AUX_IN_MODE},
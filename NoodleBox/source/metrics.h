@@ -0,0 +1,149 @@
+//////////////////////////////////////////////////////////////////////////////
+// sixty four pixels 2020                                       CC-NC-BY-SA //
+//                                //  //          //                        //
+//   //////   /////   /////   //////  //   /////  //////   /////  //   //   //
+//   //   // //   // //   // //   //  //  //   // //   // //   //  // //    //
+//   //   // //   // //   // //   //  //  /////// //   // //   //   ///     //
+//   //   // //   // //   // //   //  //  //      //   // //   //  // //    //
+//   //   //  /////   /////   //////   //  /////  //////   /////  //   //   //
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// RUN TIME STATISTICS
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+#ifndef METRICS_H_
+#define METRICS_H_
+
+// boot time measurements (see main.cpp)
+extern uint32_t g_first_output_ms;
+extern uint32_t g_boot_ms;
+
+//
+// The counters kept by the drivers can be read back over MIDI. Sending
+// NRPN 1/101 (with any value) starts a report, which goes out on MIDI
+// channel 1 as one NRPN per counter:
+//   2/<counter>/<value MSB>/<value LSB>
+// where the counter is one of the METRIC values below. Values are 14 bits
+// and anything larger is sent as 16383. The counters are sent one at a
+// time, a few ms apart, so that the report never fills the transmit lanes
+//
+class CMetrics {
+	enum {
+		NRPNH_REQUEST = 1,
+		NRPNL_REQUEST = 101,
+		NRPNH_REPORT = 2,
+		REPORT_INTERVAL = 4,	// ms between counters (an NRPN is up to 12 bytes at 31250 baud)
+		MAX_VALUE = 0x3FFF,
+		NO_REPORT = 0xFF
+	};
+public:
+	typedef enum:byte {
+		METRIC_MIDI_RX_OVERFLOW,	// MIDI messages lost because the RX queue was full
+		METRIC_MIDI_RX_OVERRUN,		// MIDI bytes lost because the UART was not serviced in time
+		METRIC_MIDI_TX_OVERFLOW,	// MIDI bytes not sent because a TX lane was full
+		METRIC_MIDI_TX_SAVED,		// MIDI bytes saved by running status
+		METRIC_MIDI_CC_COALESCED,	// MIDI CCs replaced by a later value before being sent
+		METRIC_MIDI_TX_HIGH_WATER,	// most messages ever waiting in a MIDI TX lane
+		METRIC_MIDI_RX_HIGH_WATER,	// most messages ever waiting in the MIDI RX queue
+		METRIC_MIDI_RT_LATENCY,		// longest wait (us) of a MIDI realtime byte
+		METRIC_EVENT_HIGH_WATER,	// most events ever waiting in the event queue
+		METRIC_EVENT_DROPPED,		// events lost because the event queue was full
+		METRIC_DAC_LATENCY,			// longest time (us) from a DAC change to the DAC being updated
+		METRIC_EEPROM_SAVE_MS,		// duration of the last EEPROM save
+		METRIC_EEPROM_SAVE_PAGES,	// EEPROM pages written by the last save
+		METRIC_EEPROM_POLL_TIMEOUTS, // EEPROM page writes where polling timed out
+		METRIC_FIRST_OUTPUT_MS,		// ms from reset until the sequencer first ran
+		METRIC_BOOT_MS,				// ms from reset until the editor became active
+		METRIC_PATCH_CACHE_HITS,	// patch loads served from the patch cache
+		METRIC_PATCH_CACHE_MISSES,	// patch loads that needed an EEPROM read
+		METRIC_PATCH_SWITCH_MS,		// ms from the last patch load request to the switch
+		METRIC_PLAN_HITS,			// layer outputs taken from the step output plan
+		METRIC_PLAN_MISSES,			// planned layer outputs worked out in full
+		METRIC_MAX
+	} METRIC;
+private:
+	byte m_next;		// next counter to report (NO_REPORT if none)
+	byte m_timeout;		// ms until the next counter is sent
+
+	///////////////////////////////////////////////////////////////////////////////
+	static uint32_t get_value(int metric) {
+		switch(metric) {
+		case METRIC_MIDI_RX_OVERFLOW: return g_midi.get_rx_overflow();
+		case METRIC_MIDI_RX_OVERRUN: return g_midi.get_rx_overrun();
+		case METRIC_MIDI_TX_OVERFLOW: return g_midi.get_tx_overflow();
+		case METRIC_MIDI_TX_SAVED: return g_midi.get_tx_saved();
+		case METRIC_MIDI_CC_COALESCED: return g_midi.get_cc_coalesced();
+		case METRIC_MIDI_TX_HIGH_WATER: return g_midi.get_tx_high_water();
+		case METRIC_MIDI_RX_HIGH_WATER: return g_midi.get_rx_high_water();
+		case METRIC_MIDI_RT_LATENCY: return g_midi.get_rt_tx_latency();
+		case METRIC_EVENT_HIGH_WATER: return g_event_queue.get_high_water();
+		case METRIC_EVENT_DROPPED: return g_event_queue.get_dropped();
+		case METRIC_DAC_LATENCY: return g_i2c_dac.get_max_latency_us();
+		case METRIC_EEPROM_SAVE_MS: return g_i2c_eeprom.get_save_ms();
+		case METRIC_EEPROM_SAVE_PAGES: return g_i2c_eeprom.get_save_pages();
+		case METRIC_EEPROM_POLL_TIMEOUTS: return g_i2c_eeprom.get_poll_timeouts();
+		case METRIC_FIRST_OUTPUT_MS: return g_first_output_ms;
+		case METRIC_BOOT_MS: return g_boot_ms;
+		case METRIC_PATCH_CACHE_HITS: return g_patch_cache.get_hits();
+		case METRIC_PATCH_CACHE_MISSES: return g_patch_cache.get_misses();
+		case METRIC_PATCH_SWITCH_MS: return g_sequence.get_switch_ms();
+		case METRIC_PLAN_HITS: return g_sequence.get_plan_hits();
+		case METRIC_PLAN_MISSES: return g_sequence.get_plan_misses();
+		default: return 0;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// The CCs go straight to the transmit lane, since send_cc() would merge
+	// the repeated NRPN and data entry controllers of successive counters
+	static void send_cc(byte cc, byte value) {
+		g_midi.send(0xB0, cc, value, 3);
+	}
+
+public:
+	///////////////////////////////////////////////////////////////////////////////
+	CMetrics() {
+		m_next = NO_REPORT;
+		m_timeout = 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	void handle_nrpn(int nrpn_hi, int nrpn_lo) {
+		if(nrpn_hi == NRPNH_REQUEST && nrpn_lo == NRPNL_REQUEST) {
+			m_next = 0;
+			m_timeout = 0;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Called once per ms
+	void run() {
+		if(m_next == NO_REPORT) {
+			return;
+		}
+		if(m_timeout) {
+			--m_timeout;
+			return;
+		}
+		uint32_t value = get_value(m_next);
+		if(value > MAX_VALUE) {
+			value = MAX_VALUE;
+		}
+		send_cc(midi::MIDI_CC_NRPN_HI, NRPNH_REPORT);
+		send_cc(midi::MIDI_CC_NRPN_LO, m_next);
+		send_cc(midi::MIDI_CC_DATA_HI, value >> 7);
+		send_cc(midi::MIDI_CC_DATA_LO, value & 0x7F);
+		m_timeout = REPORT_INTERVAL;
+		if(++m_next >= METRIC_MAX) {
+			m_next = NO_REPORT;
+		}
+	}
+};
+
+// define the metrics instance
+CMetrics g_metrics;
+
+#endif /* METRICS_H_ */
@@ -18,16 +18,32 @@
 #define MIDI_H_
 
 namespace midi {
-extern void handle_realtime(byte ch);
+extern uint32_t get_timestamp();
+extern void handle_realtime(byte ch, uint32_t us);
+extern void handle_song_position(uint16_t pos);
 extern void handle_note(byte ch, byte note, byte vel);
 extern void handle_nrpn(byte nrpn_hi, byte nrpn_lo, byte value_hi, byte value_lo);
+// Buffer sizes must be powers of 2 (up to 256, since indexes are bytes) so
+// that ring indexes can be masked rather than needing a division
 enum {
-	RXBUF_SIZE = 64,
-	RXBUF_SIZE_MASK = 0x3F,
+	RXQ_SIZE = 32,						// decoded messages waiting for the main loop
+	RXQ_SIZE_MASK = RXQ_SIZE-1,
 
-	TXBUF_SIZE = 64,
-	TXBUF_SIZE_MASK = 0x3F
+	TX_LANE_SIZE = 16,					// messages per transmit lane
+	TX_LANE_SIZE_MASK = TX_LANE_SIZE-1,
+
+	RT_TXBUF_SIZE = 8,
+	RT_TXBUF_SIZE_MASK = RT_TXBUF_SIZE-1,
+
+	MAX_PENDING_CC = 8,					// CC messages that can be held back while TX is busy
+	CC_TX_INTERVAL_MS = 2,				// at most one CC every 2ms, which is about half of the MIDI bandwidth
+	RUNNING_STATUS_REFRESH_MS = 300		// how often a status byte is sent even if it is unchanged
 };
+static_assert(!(RXQ_SIZE & RXQ_SIZE_MASK), "RXQ_SIZE must be a power of 2");
+static_assert(!(TX_LANE_SIZE & TX_LANE_SIZE_MASK), "TX_LANE_SIZE must be a power of 2");
+static_assert(!(RT_TXBUF_SIZE & RT_TXBUF_SIZE_MASK), "RT_TXBUF_SIZE must be a power of 2");
+static_assert(RXQ_SIZE <= 256 && TX_LANE_SIZE <= 256 && RT_TXBUF_SIZE <= 256, "Buffer too big for byte index");
+
 enum {
 	MIDI_TICK		   = 0xF8,
 	MIDI_START		   = 0xFA,
@@ -42,13 +58,24 @@ enum {
 	MIDI_CC_NRPN_HI    = 99,
 	MIDI_CC_NRPN_LO    = 98,
 	MIDI_CC_DATA_HI    = 6,
-	MIDI_CC_DATA_LO    = 38
+	MIDI_CC_DATA_LO    = 38,
+
+	MIDI_OMNI		   = 16
 };
 
+// Types of message that are decoded from the input
+typedef enum : byte {
+	MSG_NOTE,			// channel, note, velocity (zero for note off)
+	MSG_NRPN,			// NRPN number (MSB, LSB) and value (MSB, LSB)
+	MSG_REALTIME,		// clock or transport message with arrival time (us)
+	MSG_SPP				// song position in 16th notes
+} MSG_TYPE;
+
 //////////////////////////////////////////////////////////////////////////////
 class CMidi {
 
-	// State flags used while receiving MIDI data
+	// State flags used while receiving MIDI data. These are only
+	// used by the UART ISR
 	byte m_midi_status;			// current MIDI message status (running status)
 	byte m_midi_num_params;		// number of parameters needed by current MIDI message
 	byte m_midi_params[2];		// parameter values of current MIDI message
@@ -57,23 +84,196 @@ class CMidi {
 	byte m_nrpn_hi;				// track last NRPN (MSB)
 	byte m_nrpn_lo;				// track last NRPN (LSB)
 	byte m_nrpn_value_hi;		// track last NRPN value (MSB)
+
+	// Input filters. Messages that are not wanted are dropped by the
+	// ISR so they never take up space in the queue
+	volatile uint16_t m_note_chan_mask;	// bit for each channel that notes are accepted on
+	volatile byte m_accept;				// bit for each MSG_TYPE that is wanted
 public:
 
-	volatile byte m_rxbuf[RXBUF_SIZE];
+	// The rings are single producer, single consumer. The producer writes
+	// the data before moving the head index and the consumer reads the data
+	// before moving the tail index, so no locking is needed. The exception
+	// is the TX lanes which can be written from the main loop and from the
+	// clock ISR, so writers protect themselves from each other
+
+	// Incoming bytes are decoded by the UART ISR as they arrive and only
+	// complete messages of interest are queued for the main loop
+	typedef struct {
+		MSG_TYPE type;
+		byte param[4];
+		uint32_t value;		// arrival time (us) for realtime, song position for SPP
+	} RX_MSG;
+	RX_MSG m_rxq[RXQ_SIZE];
 	volatile byte m_rx_head;
 	volatile byte m_rx_tail;
 
-	volatile byte m_txbuf[TXBUF_SIZE];
-	volatile byte m_tx_head;
-	volatile byte m_tx_tail;
+	// Outgoing messages are queued in separate lanes by priority. The UART
+	// ISR always finishes the message it is sending before it starts one
+	// from another lane, except that realtime bytes are sent as soon as the
+	// current byte has gone out (MIDI allows them to appear anywhere)
+	enum {
+		LANE_NOTE_OFF,		// note off (or note on with zero velocity) that can overtake
+		LANE_NOTE,			// note on, pitch bend and other channel messages
+		LANE_CC,			// continuous controllers
+		NUM_TX_LANES
+	};
+	typedef struct {
+		byte status;
+		byte param1;
+		byte param2;
+		byte len;
+	} TX_MSG;
+	typedef struct {
+		TX_MSG msg[TX_LANE_SIZE];
+		volatile byte head;
+		volatile byte tail;
+	} TX_LANE;
+	TX_LANE m_tx_lane[NUM_TX_LANES];
+
+	// realtime bytes waiting to go out along with the time (us) they were queued
+	volatile byte m_rt_txbuf[RT_TXBUF_SIZE];
+	volatile uint32_t m_rt_txbuf_us[RT_TXBUF_SIZE];
+	volatile byte m_rt_tx_head;
+	volatile byte m_rt_tx_tail;
+
+	// the message currently being sent by the UART ISR
+	byte m_tx_msg[3];
+	byte m_tx_len;
+	byte m_tx_pos;
+
+	// Running status of the output. Messages do not go out in the order
+	// they are queued so this is tracked by the UART ISR as each message
+	// is started
+	volatile byte m_tx_status;
+	int m_tx_status_age;
+
+	// CC messages waiting to be sent, these are held back while the CC lane
+	// is busy so that only the latest value for each controller is sent
+	typedef struct {
+		byte chan;
+		byte cc;
+		byte value;
+		byte pending;
+	} PENDING_CC;
+	PENDING_CC m_cc[MAX_PENDING_CC];
+
+	// error counters
+	volatile uint16_t m_rx_overflow;	// messages lost because the RX queue was full
+	volatile uint16_t m_rx_overrun;		// bytes lost because UART was not serviced in time
+	volatile uint16_t m_tx_overflow;	// bytes not sent because a TX lane was full
+
+	// statistics
+	volatile uint32_t m_tx_saved;		// bytes saved by running status
+	uint32_t m_cc_coalesced;			// CC messages replaced by a later value before being sent
+	volatile byte m_tx_high_water;		// most messages ever waiting in a TX lane
+	volatile byte m_rx_high_water;		// most messages ever waiting in the RX queue
+	volatile uint16_t m_rt_tx_latency;	// longest time (us) a realtime byte has waited to go out
+
+	int m_cc_tx_wait;					// ms until the next CC can be passed to the CC lane
+
+	////////////////////////////////////////////////////
+	// Whether a lane has a channel message waiting for a
+	// MIDI channel. Called with interrupts disabled
+	byte is_chan_waiting(TX_LANE& lane, byte chan) {
+		for(byte i = lane.tail; i != lane.head; i = (i+1)&TX_LANE_SIZE_MASK) {
+			if(lane.msg[i].status < 0xF0 && (lane.msg[i].status & 0x0F) == chan) {
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	////////////////////////////////////////////////////
+	// Send the next held back CC if the CC lane is empty
+	// and the bandwidth cap allows it
+	void flush_cc() {
+		if(m_cc_tx_wait) {
+			return;
+		}
+		TX_LANE& lane = m_tx_lane[LANE_CC];
+		if(lane.head != lane.tail) {
+			return;
+		}
+		for(int i=0; i<MAX_PENDING_CC; ++i) {
+			if(m_cc[i].pending) {
+				m_cc[i].pending = 0;
+				m_cc_tx_wait = CC_TX_INTERVAL_MS;
+				send(0xB0 | m_cc[i].chan, m_cc[i].cc, m_cc[i].value, 3);
+				break;
+			}
+		}
+	}
+
+	////////////////////////////////////////////////////
+	// Get the next byte to transmit, or -1 if there is
+	// nothing waiting. Called from the UART ISR
+	int next_tx_byte() {
+		if(m_rt_tx_tail != m_rt_tx_head) {
+			byte ch = m_rt_txbuf[m_rt_tx_tail];
+			uint32_t latency = get_timestamp() - m_rt_txbuf_us[m_rt_tx_tail];
+			if(latency > m_rt_tx_latency) {
+				m_rt_tx_latency = (latency > 0xFFFF)? 0xFFFF : latency;
+			}
+			m_rt_tx_tail = (m_rt_tx_tail+1)&RT_TXBUF_SIZE_MASK;
+			return ch;
+		}
+		if(m_tx_pos >= m_tx_len) {
+			// start the next message from the highest priority lane
+			int i;
+			for(i=0; i<NUM_TX_LANES; ++i) {
+				if(m_tx_lane[i].head != m_tx_lane[i].tail) {
+					break;
+				}
+			}
+			if(i >= NUM_TX_LANES) {
+				return -1;
+			}
+			TX_LANE& lane = m_tx_lane[i];
+			TX_MSG& msg = lane.msg[lane.tail];
+			m_tx_msg[0] = msg.status;
+			m_tx_msg[1] = msg.param1;
+			m_tx_msg[2] = msg.param2;
+			m_tx_len = msg.len;
+			m_tx_pos = 0;
+			lane.tail = (lane.tail+1)&TX_LANE_SIZE_MASK;
+			if(msg.status >= 0xF0) {
+				// system common messages cancel running status
+				m_tx_status = 0;
+			}
+			else if(msg.status == m_tx_status) {
+				++m_tx_pos;
+				++m_tx_saved;
+			}
+			else {
+				m_tx_status = msg.status;
+			}
+		}
+		return m_tx_msg[m_tx_pos++];
+	}
 
 
 	////////////////////////////////////////////////////
 	CMidi() {
 		m_rx_head = 0;
 		m_rx_tail = 0;
-		m_tx_head = 0;
-		m_tx_tail = 0;
+		memset(m_tx_lane, 0, sizeof(m_tx_lane));
+		m_rt_tx_head = 0;
+		m_rt_tx_tail = 0;
+		m_tx_len = 0;
+		m_tx_pos = 0;
+		m_tx_status = 0;
+		m_tx_status_age = 0;
+		memset(m_cc, 0, sizeof(m_cc));
+		m_rx_overflow = 0;
+		m_rx_overrun = 0;
+		m_tx_overflow = 0;
+		m_tx_saved = 0;
+		m_cc_coalesced = 0;
+		m_tx_high_water = 0;
+		m_rx_high_water = 0;
+		m_rt_tx_latency = 0;
+		m_cc_tx_wait = 0;
 
 		m_midi_status = 0;
 		m_midi_num_params = 0;
@@ -82,6 +282,150 @@ public:
 		m_nrpn_hi = 0;
 		m_nrpn_lo = 0;
 		m_nrpn_value_hi = 0;
+		m_note_chan_mask = 0xFFFF;
+		m_accept = (1<<MSG_NOTE)|(1<<MSG_NRPN)|(1<<MSG_REALTIME)|(1<<MSG_SPP);
+	}
+
+	////////////////////////////////////////////////////
+	// Select the channel that notes are accepted on, or
+	// MIDI_OMNI for all channels
+	void set_note_chan(byte chan) {
+		m_note_chan_mask = (chan < MIDI_OMNI)? (1<<chan) : 0xFFFF;
+	}
+
+	////////////////////////////////////////////////////
+	// Queue a decoded message. Called from the UART ISR
+	void push(MSG_TYPE type, byte p0, byte p1, byte p2, byte p3, uint32_t value) {
+		if(!(m_accept & (1<<type))) {
+			return;
+		}
+		byte next = (m_rx_head+1)&RXQ_SIZE_MASK;
+		if(next == m_rx_tail) {
+			++m_rx_overflow;
+			return;
+		}
+		RX_MSG& msg = m_rxq[m_rx_head];
+		msg.type = type;
+		msg.param[0] = p0;
+		msg.param[1] = p1;
+		msg.param[2] = p2;
+		msg.param[3] = p3;
+		msg.value = value;
+		m_rx_head = next;
+		byte count = (next - m_rx_tail)&RXQ_SIZE_MASK;
+		if(count > m_rx_high_water) {
+			m_rx_high_water = count;
+		}
+	}
+
+	////////////////////////////////////////////////////
+	// Decode a received byte. Called from the UART ISR
+	void rx_byte(byte ch) {
+		if(ch >= 0xF8) {
+			// realtime messages can appear anywhere, even in the middle
+			// of another message, and do not affect running status. Clock
+			// and transport messages are timestamped on arrival
+			switch(ch) {
+			case MIDI_TICK:
+			case MIDI_START:
+			case MIDI_CONTINUE:
+			case MIDI_STOP:
+				push(MSG_REALTIME, ch, 0, 0, 0, get_timestamp());
+				break;
+			}
+			// Ignoring....
+			//	0xF9	RESERVED
+			//	0xFD	RESERVED
+			//	0xFE	ACTIVE SENSING
+			//	0xFF	RESET
+		}
+		else if(ch & 0x80) {
+			// a status byte ends any sysex
+			m_in_sysex = (ch == MIDI_SYSEX_BEGIN);
+			m_midi_param = 0;
+			m_midi_status = ch;
+			switch(ch & 0xF0)
+			{
+			case 0xF0:
+				switch(ch) {
+				case MIDI_MTC_QTR_FRAME:	// 1 param byte follows
+				case MIDI_SONG_SELECT:		// 1 param byte follows
+					m_midi_num_params = 1;
+					break;
+				case MIDI_SPP:				// 2 param bytes follow
+					m_midi_num_params = 2;
+					break;
+				default:
+					// sysex, tune request and undefined
+					// messages cancel running status
+					m_midi_status = 0;
+					break;
+				}
+				break;
+			case 0xC0: //  Patch change  1  instrument #
+			case 0xD0: //  Channel Pressure  1  pressure
+				m_midi_num_params = 1;
+				break;
+			case 0xA0: //  Polyphonic aftertouch  2  key  touch
+			case 0x80: //  Note-off  2  key  velocity
+			case 0x90: //  Note-on  2  key  veolcity
+			case 0xB0: //  Continuous controller  2  controller #  controller value
+			case 0xE0: //  Pitch bend  2  lsb (7 bits)  msb (7 bits)
+			default:
+				m_midi_num_params = 2;
+				break;
+			}
+		}
+		else if(m_in_sysex || !m_midi_status) {
+			// sysex data, or data without a status byte, is skipped
+		}
+		else {
+			// gathering parameters
+			m_midi_params[m_midi_param++] = ch;
+			if(m_midi_param >= m_midi_num_params) {
+				// we have a complete message.. is it one we care about?
+				m_midi_param = 0;
+				byte chan = m_midi_status & 0x0F;
+				switch(m_midi_status & 0xF0) {
+				case 0x80: // note off
+					if(m_note_chan_mask & (1<<chan)) {
+						push(MSG_NOTE, chan, m_midi_params[0], 0, 0, 0);
+					}
+					break;
+				case 0x90: // note on
+					if(m_note_chan_mask & (1<<chan)) {
+						push(MSG_NOTE, chan, m_midi_params[0], m_midi_params[1], 0, 0);
+					}
+					break;
+				case 0xB0: // cc
+					switch(m_midi_params[0]) {
+						case MIDI_CC_NRPN_HI:
+							m_nrpn_hi = m_midi_params[1];
+							m_nrpn_lo = 0;
+							m_nrpn_value_hi = 0;
+							break;
+						case MIDI_CC_NRPN_LO:
+							m_nrpn_lo = m_midi_params[1];
+							m_nrpn_value_hi = 0;
+							break;
+						case MIDI_CC_DATA_HI:
+							m_nrpn_value_hi = m_midi_params[1];
+							break;
+						case MIDI_CC_DATA_LO:
+							push(MSG_NRPN, m_nrpn_hi, m_nrpn_lo, m_nrpn_value_hi, m_midi_params[1], 0);
+							break;
+					}
+					break;
+				case 0xF0: // system common
+					if(m_midi_status == MIDI_SPP) {
+						push(MSG_SPP, 0, 0, 0, 0, m_midi_params[0] | ((uint32_t)m_midi_params[1]<<7));
+					}
+					// no running status for system common messages
+					m_midi_status = 0;
+					break;
+				}
+			}
+		}
 	}
 
 	////////////////////////////////////////////////////
@@ -98,35 +442,124 @@ public:
 	}
 
 	////////////////////////////////////////////////////
-	// TRANSMIT A CHARACTER (BLOCKING)
-	void send_byte(byte ch) {
-		int tx_head = (m_tx_head+1)%TXBUF_SIZE_MASK;
-		if(tx_head != m_tx_tail) {
-			m_txbuf[m_tx_head] = ch;
-			m_tx_head = tx_head;
+	// QUEUE A REALTIME BYTE FOR TRANSMIT. IT WILL GO OUT
+	// AS SOON AS THE UART IS FREE. SAFE TO CALL FROM AN ISR
+	void send_realtime(byte ch) {
+		uint32_t primask = DisableGlobalIRQ();
+		byte next = (m_rt_tx_head+1)&RT_TXBUF_SIZE_MASK;
+		if(next == m_rt_tx_tail) {
+			++m_tx_overflow;
+		}
+		else {
+			m_rt_txbuf[m_rt_tx_head] = ch;
+			m_rt_txbuf_us[m_rt_tx_head] = get_timestamp();
+			m_rt_tx_head = next;
+		    UART_EnableInterrupts(UART0, kUART_TxDataRegEmptyInterruptEnable);
 		}
-	    UART_EnableInterrupts(UART0, kUART_TxDataRegEmptyInterruptEnable);
+		EnableGlobalIRQ(primask);
 	}
 
 	////////////////////////////////////////////////////
+	// QUEUE A MESSAGE FOR TRANSMIT IN THE LANE FOR ITS
+	// TYPE. THE WHOLE MESSAGE IS DROPPED IF THERE IS NOT
+	// ROOM FOR IT. SAFE TO CALL FROM AN ISR
+	//
+	// A note off only jumps ahead of the note lane when
+	// nothing is waiting there for the same channel, so
+	// that it can never go out before its own note on
+	// and the note on / note off order of a tie is kept
+	void send(byte b0, byte b1, byte b2, int len) {
+		if(b0 >= 0xF8) {
+			send_realtime(b0);
+			return;
+		}
+		int which;
+		switch(b0 & 0xF0) {
+		case 0x80:
+			which = LANE_NOTE_OFF;
+			break;
+		case 0x90:
+			which = b2? LANE_NOTE : LANE_NOTE_OFF;
+			break;
+		case 0xB0:
+			which = LANE_CC;
+			break;
+		default:
+			which = LANE_NOTE;
+			break;
+		}
+		uint32_t primask = DisableGlobalIRQ();
+		if(which == LANE_NOTE_OFF && is_chan_waiting(m_tx_lane[LANE_NOTE], b0 & 0x0F)) {
+			which = LANE_NOTE;
+		}
+		TX_LANE& lane = m_tx_lane[which];
+		byte head = lane.head;
+		byte next = (head+1)&TX_LANE_SIZE_MASK;
+		if(next == lane.tail) {
+			m_tx_overflow += len;
+		}
+		else {
+			lane.msg[head].status = b0;
+			lane.msg[head].param1 = b1;
+			lane.msg[head].param2 = b2;
+			lane.msg[head].len = len;
+			lane.head = next;
+			byte count = (next - lane.tail)&TX_LANE_SIZE_MASK;
+			if(count > m_tx_high_water) {
+				m_tx_high_water = count;
+			}
+		    UART_EnableInterrupts(UART0, kUART_TxDataRegEmptyInterruptEnable);
+		}
+		EnableGlobalIRQ(primask);
+	}
+
+	////////////////////////////////////////////////////
+	void send_byte(byte ch) {
+		send(ch, 0, 0, 1);
+	}
+
+	////////////////////////////////////////////////////
+	// CCs are sent right away unless the CC lane is busy
+	// or the bandwidth cap has been reached, in which case
+	// only the latest value for the same controller will
+	// be sent once there is room
 	void send_cc(byte chan, byte cc, byte value) {
-		send_byte(0xB0 | chan);
-		send_byte(cc & 0x7F);
-		send_byte(value & 0x7F);
+		cc &= 0x7F;
+		value &= 0x7F;
+		int slot = -1;
+		for(int i=0; i<MAX_PENDING_CC; ++i) {
+			if(m_cc[i].pending) {
+				if(m_cc[i].chan == chan && m_cc[i].cc == cc) {
+					m_cc[i].value = value;
+					++m_cc_coalesced;
+					return;
+				}
+			}
+			else if(slot < 0) {
+				slot = i;
+			}
+		}
+		if(slot < 0) {
+			// nowhere to hold the message
+			send(0xB0 | chan, cc, value, 3);
+		}
+		else {
+			m_cc[slot].chan = chan;
+			m_cc[slot].cc = cc;
+			m_cc[slot].value = value;
+			m_cc[slot].pending = 1;
+			flush_cc();
+		}
 	}
 
 	////////////////////////////////////////////////////
 	void start_note(byte chan, byte note, byte velocity) {
-		send_byte(0x90 | chan);
-		send_byte(note & 0x7F);
-		send_byte(velocity & 0x7F);
+		send(0x90 | chan, note & 0x7F, velocity & 0x7F, 3);
 	}
 
 	////////////////////////////////////////////////////
 	void stop_note(byte chan, byte note) {
-		send_byte(0x90 | chan);
-		send_byte(note & 0x7F);
-		send_byte(0x00);
+		send(0x90 | chan, note & 0x7F, 0x00, 3);
 	}
 
 	////////////////////////////////////////////////////
@@ -138,9 +571,7 @@ public:
 		else if(amount > 0x3FFF) {
 			amount = 0x3FFF;
 		}
-		send_byte(0xe0 | chan);
-		send_byte(amount&0x7F);
-		send_byte((amount>>7)&0x7F);
+		send(0xe0 | chan, amount&0x7F, (amount>>7)&0x7F, 3);
 	}
 
 	////////////////////////////////////////////////////
@@ -150,18 +581,15 @@ public:
 	    // character received at UART
 	    if (flags & (kUART_RxDataRegFullFlag | kUART_RxOverrunFlag))
 	    {
-	        byte data = UART_ReadByte(UART0); // clears the status flags
-	        byte next = (m_rx_head+1)%RXBUF_SIZE_MASK;
-			if(next != m_rx_tail) {
-				m_rxbuf[m_rx_head] = data;
-				m_rx_head = next;
-				// TODO: flag overflow!
-			}
+	    	if(flags & kUART_RxOverrunFlag) {
+	    		++m_rx_overrun;
+	    	}
+	        rx_byte(UART_ReadByte(UART0)); // clears the status flags
 	    }
 	    if(flags & kUART_TxDataRegEmptyFlag) {
-	    	if(m_tx_head != m_tx_tail) {
-		        UART_WriteByte(UART0, m_txbuf[m_tx_tail]);
-	    		m_tx_tail = (m_tx_tail+1)%TXBUF_SIZE_MASK;
+	    	int data = next_tx_byte();
+	    	if(data >= 0) {
+		        UART_WriteByte(UART0, (byte)data);
 	    	}
 	    	else {
 	    		UART_DisableInterrupts(UART0, kUART_TxDataRegEmptyInterruptEnable);
@@ -172,106 +600,64 @@ public:
 	/////////////////////////////////////////////////////////////////////////////////
 	// once per ms
 	void run() {
-		while(m_rx_tail != m_rx_head) {
-			byte ch = m_rxbuf[m_rx_tail];
-			if((ch & 0xf0) == 0xf0) {
-				switch(ch) {
-				case MIDI_TICK:
-				case MIDI_START:
-				case MIDI_CONTINUE:
-				case MIDI_STOP:
-					handle_realtime(ch);
-					break;
-				case MIDI_MTC_QTR_FRAME:	// 1 param byte follows
-				case MIDI_SONG_SELECT:		// 1 param byte follows
-				case MIDI_SPP:				// 2 param bytes follow
-					m_midi_param = 0;
-					m_midi_status = ch;
-					m_midi_num_params = (ch==MIDI_SPP)? 2:1;
-					break;
-				case MIDI_SYSEX_BEGIN:
-					m_in_sysex = 1;
-					break;
-				case MIDI_SYSEX_END:
-					m_in_sysex = 0;
-					break;
-				}
-				// Ignoring....
-				//  0xF4	RESERVED
-				//  0xF5	RESERVED
-				//  0xF6	TUNE REQUEST
-				//	0xF9	RESERVED
-				//	0xFD	RESERVED
-				//	0xFE	ACTIVE SENSING
-				//	0xFF	RESET
-			}
-			else if(!!(ch & 0x80))
-			{
-				// a status byte cancels sysex state
-				m_in_sysex = 0;
+		// periodically send a status byte even when running status
+		// would allow it to be left out
+		if(++m_tx_status_age >= RUNNING_STATUS_REFRESH_MS) {
+			m_tx_status_age = 0;
+			m_tx_status = 0;
+		}
 
-				m_midi_param = 0;
-				m_midi_status = ch;
-				switch(ch & 0xF0)
-				{
-				case 0xC0: //  Patch change  1  instrument #
-				case 0xD0: //  Channel Pressure  1  pressure
-					m_midi_num_params = 1;
-					break;
-				case 0xA0: //  Polyphonic aftertouch  2  key  touch
-				case 0x80: //  Note-off  2  key  velocity
-				case 0x90: //  Note-on  2  key  veolcity
-				case 0xB0: //  Continuous controller  2  controller #  controller value
-				case 0xE0: //  Pitch bend  2  lsb (7 bits)  msb (7 bits)
-				default:
-					m_midi_num_params = 2;
-					break;
-				}
-			}
-			else if(!m_in_sysex)
-			{
-				if(m_midi_status)
-				{
-					// gathering parameters
-					m_midi_params[m_midi_param++] = ch;
-					if(m_midi_param >= m_midi_num_params)
-					{
-						// we have a complete message.. is it one we care about?
-						m_midi_param = 0;
-						switch(m_midi_status&0xF0)
-						{
-						case 0x80: // note off
-							handle_note(m_midi_status&0x0F, m_midi_params[0], 0);
-							break;
-						case 0x90: // note on
-							handle_note(m_midi_status&0x0F, m_midi_params[0], m_midi_params[1]);
-							break;
-						case 0xB0: // cc
-							switch(m_midi_params[0]) {
-								case MIDI_CC_NRPN_HI:
-									m_nrpn_hi = m_midi_params[1];
-									m_nrpn_lo = 0;
-									m_nrpn_value_hi = 0;
-									break;
-								case MIDI_CC_NRPN_LO:
-									m_nrpn_lo = m_midi_params[1];
-									m_nrpn_value_hi = 0;
-									break;
-								case MIDI_CC_DATA_HI:
-									m_nrpn_value_hi = m_midi_params[1];
-									break;
-								case MIDI_CC_DATA_LO:
-									handle_nrpn(m_nrpn_hi, m_nrpn_lo, m_nrpn_value_hi, m_midi_params[1]);
-									break;
-							}
-							break;
-						}
-					}
-				}
+		if(m_cc_tx_wait) {
+			--m_cc_tx_wait;
+		}
+		flush_cc();
+
+		while(m_rx_tail != m_rx_head) {
+			RX_MSG& msg = m_rxq[m_rx_tail];
+			switch(msg.type) {
+			case MSG_NOTE:
+				handle_note(msg.param[0], msg.param[1], msg.param[2]);
+				break;
+			case MSG_NRPN:
+				handle_nrpn(msg.param[0], msg.param[1], msg.param[2], msg.param[3]);
+				break;
+			case MSG_REALTIME:
+				handle_realtime(msg.param[0], msg.value);
+				break;
+			case MSG_SPP:
+				handle_song_position(msg.value);
+				break;
 			}
-			m_rx_tail = (m_rx_tail+1)%RXBUF_SIZE_MASK;
+			m_rx_tail = (m_rx_tail+1)&RXQ_SIZE_MASK;
 		}
 	}
+
+	////////////////////////////////////////////////////
+	// COUNTERS AND STATISTICS (see metrics.h)
+	uint16_t get_rx_overflow() {
+		return m_rx_overflow;
+	}
+	uint16_t get_rx_overrun() {
+		return m_rx_overrun;
+	}
+	uint16_t get_tx_overflow() {
+		return m_tx_overflow;
+	}
+	uint32_t get_tx_saved() {
+		return m_tx_saved;
+	}
+	uint32_t get_cc_coalesced() {
+		return m_cc_coalesced;
+	}
+	byte get_tx_high_water() {
+		return m_tx_high_water;
+	}
+	byte get_rx_high_water() {
+		return m_rx_high_water;
+	}
+	uint16_t get_rt_tx_latency() {
+		return m_rt_tx_latency;
+	}
 };
 
 }; // namespace
@@ -340,13 +340,16 @@ public:
 			}
 
 
-			// handle pre-trig delay
+			// handle pre-trig delay (gate status can be changed by the gate
+			// scheduler interrupt)
+			uint32_t primask = DisableGlobalIRQ();
 			if(m_chan[i].gate_status == GATE_TRIG && m_chan[i].trig_delay) {
 				if(!--m_chan[i].trig_delay) {
 					m_chan[i].gate_status = GATE_OPEN;
 					impl_set_gate(i,1);
 				}
 			}
+			EnableGlobalIRQ(primask);
 		}
 	}
 
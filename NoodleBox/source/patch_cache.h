@@ -0,0 +1,326 @@
+//////////////////////////////////////////////////////////////////////////////
+// sixty four pixels 2020                                       CC-NC-BY-SA //
+//                                //  //          //                        //
+//   //////   /////   /////   //////  //   /////  //////   /////  //   //   //
+//   //   // //   // //   // //   //  //  //   // //   // //   //  // //    //
+//   //   // //   // //   // //   //  //  /////// //   // //   //   ///     //
+//   //   // //   // //   // //   //  //  //      //   // //   //  // //    //
+//   //   //  /////   /////   //////   //  /////  //////   /////  //   //   //
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// RAM CACHE OF USER PATCHES
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+#ifndef PATCH_CACHE_H_
+#define PATCH_CACHE_H_
+
+//
+// Keeps a copy of the sequence data from recently used patch slots so that a
+// patch can be switched to without waiting for an EEPROM read. The slot that
+// is likely to be wanted next can be prefetched in the background. Each entry
+// is about 1.6KB so only two fit in RAM alongside everything else. Entries
+// are replaced least recently used first. The entry holding the patch that is
+// waiting to be switched to is pinned until the switch happens, and a pinned
+// entry is never replaced or invalidated
+//
+// Patch images are decoded from the EEPROM format (see patch_format.h) into
+// the native cfg layout when they are stored, so every patch that gets loaded
+// passes through the cache
+//
+class CPatchCache {
+public:
+	enum {
+		NUM_ENTRIES = 2,
+		NUM_LAYERS = 4,		// must match CSequence::NUM_LAYERS
+		NUM_PAGES = CSequenceLayer::NUM_PAGES,
+		SZ_PATCH = CScale::get_cfg_size() + NUM_LAYERS * CSequenceLayer::get_cfg_size(),
+		// the largest packed image is under 1.6KB, so room for a version 1
+		// image always holds the whole patch
+		SZ_MAX_IMAGE = SZ_IMAGE_V1,
+		ALL_SECTIONS = (1UL << (1 + NUM_LAYERS + NUM_LAYERS * NUM_PAGES)) - 1,
+		NO_SLOT = 0xFF
+	};
+private:
+	typedef struct {
+		byte slot;
+		byte age;			// number of uses of other entries since this one was used
+		byte pinned;		// holds the patch waiting to be switched to
+		byte data[SZ_PATCH];
+	} ENTRY;
+
+	ENTRY m_entry[NUM_ENTRIES];
+	byte m_prefetch_slot;	// slot to prefetch when the EEPROM is free
+	byte m_fetch_slot;		// slot being prefetched (NO_SLOT if none)
+
+	// statistics
+	uint16_t m_hits;
+	uint16_t m_misses;
+
+	///////////////////////////////////////////////////////////////////////////////
+	static constexpr int get_layer_offset(int layer) {
+		return CScale::get_cfg_size() + layer * CSequenceLayer::get_cfg_size();
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Decode the patch data of a checked packed image. Every section that
+	// makes up the patch must be present
+	static byte decode_packed(const byte *src, int len, byte *dest) {
+		CPatchReader r(src, len);
+		uint32_t found = 0;
+		byte tag;
+		while(r.open_section(tag)) {
+			switch(tag) {
+			case PATCH_SECTION_SCALE:
+				CScale::decode(r, dest);
+				found |= 1;
+				break;
+			case PATCH_SECTION_LAYER: {
+					byte layer = r.get_max(8, NUM_LAYERS);
+					CSequenceLayer::decode(r, dest + get_layer_offset(layer), PATCH_FORMAT_PACKED);
+					found |= (1UL << (1 + layer));
+				}
+				break;
+			case PATCH_SECTION_PAGE: {
+					byte index = r.get_max(8, NUM_LAYERS * NUM_PAGES);
+					CSequencePage::decode(r, dest + get_layer_offset(index>>2) + CSequenceLayer::get_page_cfg_offset(index&3));
+					found |= (1UL << (1 + NUM_LAYERS + index));
+				}
+				break;
+			default:
+				// a section added by a later version
+				break;
+			}
+			r.close_section();
+		}
+		return (!r.is_error() && found == ALL_SECTIONS);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Decode a checked image of len bytes
+	static byte decode_image(const byte *src, int len, byte *dest) {
+		if(src[1] == PATCH_FORMAT_RAW) {
+			return decode_v1(src + SZ_PATCH_HEADER_V1, dest);
+		}
+		return decode_packed(src + SZ_PATCH_HEADER, len - SZ_PATCH_HEADER - 1, dest);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Convert the patch data of a checked version 1 image
+	static byte decode_v1(const byte *src, byte *dest) {
+		CPatchReader r(src, SZ_PATCH_V1);
+		CScale::decode(r, dest);
+		for(int i=0; i<NUM_LAYERS; ++i) {
+			CSequenceLayer::decode_v1(r, dest + get_layer_offset(i));
+		}
+		return !r.is_error();
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	ENTRY *lookup(int slot) {
+		for(int i=0; i<NUM_ENTRIES; ++i) {
+			if(m_entry[i].slot == slot) {
+				return &m_entry[i];
+			}
+		}
+		return NULL;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	void touch(ENTRY *entry) {
+		for(int i=0; i<NUM_ENTRIES; ++i) {
+			if(m_entry[i].age < 0xFF) {
+				++m_entry[i].age;
+			}
+		}
+		entry->age = 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Get the entry to use for a slot, which is either the entry already
+	// holding that slot or the least recently used one that is not pinned
+	ENTRY *alloc(int slot) {
+		ENTRY *entry = lookup(slot);
+		if(!entry) {
+			for(int i=0; i<NUM_ENTRIES; ++i) {
+				if(!m_entry[i].pinned && (!entry || m_entry[i].age > entry->age)) {
+					entry = &m_entry[i];
+				}
+			}
+		}
+		entry->slot = slot;
+		touch(entry);
+		return entry;
+	}
+
+public:
+	///////////////////////////////////////////////////////////////////////////////
+	CPatchCache() {
+		for(int i=0; i<NUM_ENTRIES; ++i) {
+			m_entry[i].slot = NO_SLOT;
+			m_entry[i].age = 0xFF;
+			m_entry[i].pinned = 0;
+		}
+		m_prefetch_slot = NO_SLOT;
+		m_fetch_slot = NO_SLOT;
+		m_hits = 0;
+		m_misses = 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	static byte is_cached_slot(int slot) {
+		return (slot >= SLOT_TEMPLATE && slot <= SLOT_PATCH8);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Check the header and checksum of a patch image. Returns the size of the
+	// whole image, or 0 if it is not good
+	static int check_image(const byte *src, int size) {
+		if(size < SZ_PATCH_HEADER) {
+			return 0;
+		}
+		int len = patch_image_size(src);
+		if(!len || len > size || src[len - 1] != patch_checksum(src, len - 1)) {
+			return 0;
+		}
+		return len;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Decode a patch image into the native cfg layout. Returns 0 if the image
+	// is not good
+	static byte decode(const byte *src, int size, byte *dest) {
+		int len = check_image(src, size);
+		return len? decode_image(src, len, dest) : 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Return the cached data for a slot, or NULL if it is not cached
+	const byte *get(int slot) {
+		ENTRY *entry = lookup(slot);
+		if(!entry) {
+			return NULL;
+		}
+		touch(entry);
+		return entry->data;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// As get() but counted as a hit or a miss
+	const byte *find(int slot) {
+		ENTRY *entry = lookup(slot);
+		if(!entry) {
+			++m_misses;
+			return NULL;
+		}
+		++m_hits;
+		touch(entry);
+		return entry->data;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Decode the patch image in the EEPROM buffer (or at src) into the cache.
+	// Returns the cached data, or NULL if the image is not good. A pinned
+	// slot is left as it is (the slot cannot have been saved since it was
+	// pinned, as a save unpins it first)
+	const byte *store_image(int slot, const byte *src = NULL) {
+		ENTRY *pinned = lookup(slot);
+		if(pinned && pinned->pinned) {
+			touch(pinned);
+			return pinned->data;
+		}
+		if(!src) {
+			src = g_i2c_eeprom.buf();
+		}
+		int len = check_image(src, SZ_MAX_IMAGE);
+		if(!len) {
+			invalidate(slot);
+			return NULL;
+		}
+		ENTRY *entry = alloc(slot);
+		if(!decode_image(src, len, entry->data)) {
+			invalidate(slot);
+			return NULL;
+		}
+		return entry->data;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	void invalidate(int slot) {
+		ENTRY *entry = lookup(slot);
+		if(entry && !entry->pinned) {
+			entry->slot = NO_SLOT;
+			entry->age = 0xFF;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Keep a cached slot in RAM until unpin() is called. Only one slot is
+	// pinned at a time. Returns the cached data, or NULL if it is not cached
+	const byte *pin(int slot) {
+		unpin();
+		ENTRY *entry = lookup(slot);
+		if(!entry) {
+			return NULL;
+		}
+		entry->pinned = 1;
+		return entry->data;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	void unpin() {
+		for(int i=0; i<NUM_ENTRIES; ++i) {
+			m_entry[i].pinned = 0;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Ask for a slot to be read into the cache when the EEPROM is free
+	void prefetch(int slot) {
+		if(slot >= SLOT_PATCH1 && slot <= SLOT_PATCH8) {
+			m_prefetch_slot = slot;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Called once per ms
+	void run() {
+		if(g_i2c_eeprom.is_busy()) {
+			return;
+		}
+		if(m_fetch_slot != NO_SLOT) {
+			if(g_i2c_eeprom.take_background_result(EEPROM_PREFETCH)) {
+				store_image(m_fetch_slot);
+			}
+			m_fetch_slot = NO_SLOT;
+		}
+		else if(m_prefetch_slot != NO_SLOT) {
+			if(lookup(m_prefetch_slot)) {
+				m_prefetch_slot = NO_SLOT;
+			}
+			else if(g_i2c_eeprom.is_buf_free()) {
+				if(g_i2c_eeprom.read_image(m_prefetch_slot, SZ_MAX_IMAGE, 0, EEPROM_PREFETCH)) {
+					m_fetch_slot = m_prefetch_slot;
+					m_prefetch_slot = NO_SLOT;
+				}
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	uint16_t get_hits() {
+		return m_hits;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	uint16_t get_misses() {
+		return m_misses;
+	}
+};
+
+// define the patch cache instance
+CPatchCache g_patch_cache;
+
+#endif /* PATCH_CACHE_H_ */
@@ -0,0 +1,279 @@
+//////////////////////////////////////////////////////////////////////////////
+// sixty four pixels 2020                                       CC-NC-BY-SA //
+//                                //  //          //                        //
+//   //////   /////   /////   //////  //   /////  //////   /////  //   //   //
+//   //   // //   // //   // //   //  //  //   // //   // //   //  // //    //
+//   //   // //   // //   // //   //  //  /////// //   // //   //   ///     //
+//   //   // //   // //   // //   //  //  //      //   // //   //  // //    //
+//   //   //  /////   /////   //////   //  /////  //////   /////  //   //   //
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// PATCH STORAGE FORMAT
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+#ifndef PATCH_FORMAT_H_
+#define PATCH_FORMAT_H_
+
+//
+// Patches are stored in EEPROM in an explicit packed format that does not
+// depend on how the compiler lays out the sequencer structures. The reader
+// and writer here only need <stdint.h>, the byte typedef and the cookie from
+// defs.h, so they can be shared with host tools that read patches.
+//
+// Patch image:
+//   [PATCH_DATA_COOKIE1][version][length lo][length hi][sections...][checksum]
+// The length counts the section bytes and the checksum is the 8 bit sum of
+// every byte before it.
+//
+// Version 1 (PATCH_FORMAT_RAW) images hold a raw copy of the structures as
+// laid out by the ARM GCC build (no length bytes, fixed size data). They
+// are still read and converted, but are never written.
+//
+// Version 2 (PATCH_FORMAT_PACKED) images hold tagged sections:
+//   [tag][payload length][payload...]
+// Readers skip sections with tags that they do not know about, and every
+// section starts on a byte boundary. Within a section, fields are packed
+// least significant bit first. The sections are
+//   PATCH_SECTION_SCALE	scale type (8), root (8)
+//   PATCH_SECTION_LAYER	layer number (8), layer settings (see CSequenceLayer)
+//   PATCH_SECTION_PAGE		layer number << 2 | page number (8), steps (see CSequencePage)
+// A patch must have the scale section and one section for each layer and
+// for each page of each layer. New fields go on the end of a section, and
+// readers use defaults for any that an older writer did not include (see
+// CPatchReader::has_field).
+//
+enum {
+	PATCH_FORMAT_RAW = 1,
+	PATCH_FORMAT_PACKED = 2,
+	PATCH_SECTION_SCALE = 1,
+	PATCH_SECTION_LAYER = 2,
+	PATCH_SECTION_PAGE = 3,
+	SZ_PATCH_HEADER = 4,
+	SZ_PATCH_HEADER_V1 = 2,
+	SZ_PATCH_V1 = 1746,		// patch data in a version 1 image (layout of the old structures)
+	SZ_IMAGE_V1 = SZ_PATCH_HEADER_V1 + SZ_PATCH_V1 + 1	// cookies, patch data, checksum
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Get the size of a whole patch image from its header, or 0 if the header is
+// not good. Only the first SZ_PATCH_HEADER bytes of the image are looked at,
+// so this can be used to find out how much more of an image to read
+inline int patch_image_size(const byte *src) {
+	if(src[0] != PATCH_DATA_COOKIE1) {
+		return 0;
+	}
+	switch(src[1]) {
+	case PATCH_FORMAT_RAW:
+		return SZ_IMAGE_V1;
+	case PATCH_FORMAT_PACKED:
+		return SZ_PATCH_HEADER + (src[2] | (src[3] << 8)) + 1;
+	default:
+		return 0;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+inline byte patch_checksum(const byte *data, int len) {
+	byte result = 0;
+	while(len--) {
+		result += *data++;
+	}
+	return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Packs fields into a buffer
+class CPatchWriter {
+	byte *m_buf;
+	int m_size;
+	int m_pos;
+	int m_section;			// position of the length byte of the open section
+	uint32_t m_acc;			// bits waiting to be written
+	byte m_bits;			// number of bits waiting
+	byte m_overflow;		// whether the buffer has run out
+
+	///////////////////////////////////////////////////////////////////////////////
+	void put_byte(byte value) {
+		if(m_pos < m_size) {
+			m_buf[m_pos++] = value;
+		}
+		else {
+			m_overflow = 1;
+		}
+	}
+
+public:
+	///////////////////////////////////////////////////////////////////////////////
+	CPatchWriter(byte *buf, int size) {
+		m_buf = buf;
+		m_size = size;
+		m_pos = 0;
+		m_section = -1;
+		m_acc = 0;
+		m_bits = 0;
+		m_overflow = 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// write a field of up to 24 bits
+	void put(uint32_t value, int bits) {
+		m_acc |= (value & ((1UL<<bits)-1)) << m_bits;
+		m_bits += bits;
+		while(m_bits >= 8) {
+			put_byte((byte)m_acc);
+			m_acc >>= 8;
+			m_bits -= 8;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	void put32(uint32_t value) {
+		put(value & 0xFFFF, 16);
+		put(value >> 16, 16);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// pad out to a byte boundary
+	void align() {
+		if(m_bits) {
+			put(0, 8 - m_bits);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	void begin_section(byte tag) {
+		align();
+		put_byte(tag);
+		m_section = m_pos;
+		put_byte(0);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	void end_section() {
+		align();
+		int len = m_pos - m_section - 1;
+		if(len > 0xFF) {
+			m_overflow = 1;
+		}
+		else if(!m_overflow) {
+			m_buf[m_section] = (byte)len;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	int get_pos() {
+		return m_pos;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	byte is_overflow() {
+		return m_overflow;
+	}
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Unpacks fields from a buffer. Reading past the end of the data (or the
+// end of the open section) or reading a value out of range flags an error
+// and returns zero
+class CPatchReader {
+	const byte *m_buf;
+	int m_size;
+	int m_pos;
+	int m_limit;			// end of the open section
+	uint32_t m_acc;
+	byte m_bits;
+	byte m_error;
+
+public:
+	///////////////////////////////////////////////////////////////////////////////
+	CPatchReader(const byte *buf, int size) {
+		m_buf = buf;
+		m_size = size;
+		m_pos = 0;
+		m_limit = size;
+		m_acc = 0;
+		m_bits = 0;
+		m_error = 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// read a field of up to 24 bits
+	uint32_t get(int bits) {
+		while(m_bits < bits) {
+			if(m_pos >= m_limit) {
+				m_error = 1;
+				return 0;
+			}
+			m_acc |= (uint32_t)m_buf[m_pos++] << m_bits;
+			m_bits += 8;
+		}
+		uint32_t value = m_acc & ((1UL<<bits)-1);
+		m_acc >>= bits;
+		m_bits -= bits;
+		return value;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	uint32_t get32() {
+		uint32_t value = get(16);
+		return value | (get(16) << 16);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// read a field which must be less than max
+	uint32_t get_max(int bits, uint32_t max) {
+		uint32_t value = get(bits);
+		if(value >= max) {
+			m_error = 1;
+			return 0;
+		}
+		return value;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Move on to the next section. Returns 0 if there are no more
+	byte open_section(byte& tag) {
+		m_acc = 0;
+		m_bits = 0;
+		m_limit = m_size;
+		if(m_pos + 2 > m_size) {
+			return 0;
+		}
+		tag = m_buf[m_pos++];
+		m_limit = m_pos + 1 + m_buf[m_pos];
+		++m_pos;
+		if(m_limit > m_size) {
+			m_error = 1;
+			return 0;
+		}
+		return 1;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Whether the open section has room for a field of this many bits. This
+	// counts the bits already buffered, which include the padding at the end
+	// of the section, so a field added on the end must read as its default
+	// when it is zero
+	byte has_field(int bits) {
+		return (m_limit - m_pos) * 8 + m_bits >= bits;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// skip anything left in the open section
+	void close_section() {
+		m_pos = m_limit;
+		m_limit = m_size;
+		m_acc = 0;
+		m_bits = 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	byte is_error() {
+		return m_error;
+	}
+};
+
+#endif /* PATCH_FORMAT_H_ */
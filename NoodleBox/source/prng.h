@@ -0,0 +1,61 @@
+//////////////////////////////////////////////////////////////////////////////
+// sixty four pixels 2020                                       CC-NC-BY-SA //
+//                                //  //          //                        //
+//   //////   /////   /////   //////  //   /////  //////   /////  //   //   //
+//   //   // //   // //   // //   //  //  //   // //   // //   //  // //    //
+//   //   // //   // //   // //   //  //  /////// //   // //   //   ///     //
+//   //   // //   // //   // //   //  //  //      //   // //   //  // //    //
+//   //   //  /////   /////   //////   //  /////  //////   /////  //   //   //
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// PSEUDO RANDOM NUMBER GENERATOR
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+#ifndef PRNG_H_
+#define PRNG_H_
+
+//
+// A 32 bit xorshift generator. Each user has its own so that the sequence
+// of numbers it sees depends only on its own seed, and not on whatever else
+// has been drawing from the libc rand() state. Numbers in a range are taken
+// by scaling rather than with %, since the M0+ has no divide instruction
+//
+class CPrng {
+	enum : uint32_t {
+		SEED_MIX = 0x9E3779B9U,		// spreads small seeds over the whole state
+		ZERO_SEED = 0x6A09E667U		// used in place of a zero state, which would stick
+	};
+	uint32_t m_state;
+public:
+	///////////////////////////////////////////////////////////////////////////////
+	CPrng(uint32_t seed = 0) {
+		set_seed(seed);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	void set_seed(uint32_t seed) {
+		m_state = seed * SEED_MIX;
+		if(!m_state) {
+			m_state = ZERO_SEED;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	uint32_t next() {
+		m_state ^= m_state << 13;
+		m_state ^= m_state >> 17;
+		m_state ^= m_state << 5;
+		return m_state;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// number from 0 to count-1 (count no more than 65536)
+	inline uint32_t range(uint32_t count) {
+		return ((next() >> 16) * count) >> 16;
+	}
+};
+
+#endif /* PRNG_H_ */
@@ -133,6 +133,15 @@ public:
 		return m_index_to_note[index];
 	}
 
+	/////////////////////////////////////////////////////////////////
+	// the mapping tables themselves, for converting a whole page at once
+	inline const byte *get_note_to_index() {
+		return m_note_to_index;
+	}
+	inline const byte *get_index_to_note() {
+		return m_index_to_note;
+	}
+
 	/////////////////////////////////////////////////////////////////
 	inline byte inc_note_in_scale(int& note, int dir) {
 		int index = (int)m_note_to_index[note] + dir;
@@ -144,7 +153,7 @@ public:
 	}
 
 	/////////////////////////////////////////////////////////////////////////////////////////////
-	static int get_cfg_size() {
+	static constexpr int get_cfg_size() {
 		return sizeof(CONFIG);
 	}
 
@@ -159,6 +168,24 @@ public:
 		memcpy(&m_cfg, (*src), sizeof m_cfg);
 		(*src) += sizeof m_cfg;
 	}
+
+	/////////////////////////////////////////////////////////////////
+	// Write the scale to a packed patch. Type and root are a byte each
+	void encode(CPatchWriter& w) {
+		w.put(m_cfg.m_type, 8);
+		w.put(m_cfg.m_root, 8);
+	}
+
+	/////////////////////////////////////////////////////////////////
+	// Read the scale from a packed patch (or a version 1 patch, which has
+	// the same layout) into a native cfg image
+	static void decode(CPatchReader& r, byte *dest) {
+		CONFIG cfg;
+		memset(&cfg, 0, sizeof cfg);
+		cfg.m_type = (V_SQL_SCALE_TYPE)r.get_max(8, V_SQL_SCALE_TYPE_MAX);
+		cfg.m_root = (V_SQL_SCALE_ROOT)r.get_max(8, 12);
+		memcpy(dest, &cfg, sizeof cfg);
+	}
 };
 CScale *CScale::m_instance = NULL;
 
@@ -50,6 +50,8 @@ private:
 	// four layers, regardless of whether the layer has advanced to a
 	// new step or whether the layer is muted
 	CSequenceStep m_step_value[NUM_LAYERS];
+	byte m_step_page[NUM_LAYERS];		// page and play position each step
+	byte m_step_pos[NUM_LAYERS];		// value came from
 	CV_TYPE m_step_output[NUM_LAYERS];
 
 	// whether the sequencer is running
@@ -62,6 +64,58 @@ private:
 	// calibration voltage
 	V_SEQ_OUT_CAL m_cal_mode;
 
+	// patch waiting to be switched to at the next bar (its patch cache entry
+	// is pinned until then)
+	const byte *m_pending_patch;
+	byte m_pending_slot;
+	uint32_t m_switch_request_ms;	// when the patch change was asked for
+	uint32_t m_switch_ms;			// how long the last patch change took
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Get the tick at which the next bar starts. A bar line that falls exactly
+	// on ticks counts as the next one
+	static clock::TICKS_TYPE get_next_bar(clock::TICKS_TYPE ticks) {
+		const clock::TICKS_TYPE ticks_per_bar = clock::pp24_to_ticks(clock::PP24_1);
+		return ticks_per_bar * ((ticks + ticks_per_bar - 1)/ticks_per_bar);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Switch to the pending patch. The outputs are not silenced and the clock
+	// is left alone. The layers start playing the new patch from the top, with
+	// the first step at start_time (TICKS_INFINITY to play it right away).
+	// The old patch keeps playing right up to this point, and the new patch
+	// is already decoded in the patch cache, so the switch is just a copy
+	void apply_patch(clock::TICKS_TYPE start_time) {
+		byte *src = (byte*)m_pending_patch;
+		m_scale.set_cfg(&src);
+		int muted = 0;
+		for(int i=0; i<NUM_LAYERS; ++i) {
+			m_layers[i]->switch_content(&src, start_time);
+			if(m_layers[i]->is_muted()) {
+				muted = 1;
+			}
+		}
+		m_scale.build();
+		m_pending_patch = NULL;
+		g_patch_cache.unpin();
+		m_switch_ms = g_clock.get_ms() - m_switch_request_ms;
+		g_popup.text(muted? "OK MUTES": "OK");
+
+		// get the following patch ready
+		g_patch_cache.prefetch((m_pending_slot < SLOT_PATCH8)? m_pending_slot + 1 : SLOT_PATCH1);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Queue a patch to be switched to at the next bar, or right away if the
+	// sequencer is stopped
+	void queue_patch(int slot) {
+		m_pending_patch = g_patch_cache.pin(slot);
+		m_pending_slot = slot;
+		if(!m_is_running) {
+			apply_patch(clock::TICKS_INFINITY);
+		}
+	}
+
 public:
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -77,6 +131,11 @@ public:
 		}
 		m_is_running = 0;
 		m_cal_mode = V_SEQ_OUT_CAL_NONE;
+		m_pending_patch = NULL;
+		g_patch_cache.unpin();
+		m_pending_slot = 0;
+		m_switch_request_ms = 0;
+		m_switch_ms = 0;
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -278,110 +337,160 @@ public:
 	}
 
 	/////////////////////////////////////////////////////////////////////////////////////////////
-	// Called once each millisecond, this is the entry point of the sequencing engine
-	void run() {
+	// Play the steps which fall due before next_ticks (ticks is the tick count
+	// at this ms) and update the outputs
+	void play_layers(clock::TICKS_TYPE ticks, clock::TICKS_TYPE next_ticks) {
+		///////////////////////////////////////////////////////////////////////////////
+		// 1 - CHECK THE SCHEDULING OF EACH LAYER TO SEE IF ANY LAYER HAS
+		// MOVED TO A NEW STEP
+		///////////////////////////////////////////////////////////////////////////////
+
+		byte layer_update[NUM_LAYERS] = {0}; 			// whether individual layer has updated
+		int any_layer_updated = 0;						// whether any layer has updated
+		for(int i=0; i<NUM_LAYERS; ++i) {
+			int update;
+			CSequenceStep step_value;
+			CSequenceLayer& layer = *m_layers[i];
+			if(m_rec_layer == i) {
+				update = layer.play(ticks, next_ticks, &m_rec, step_value);
+			}
+			else {
+				update = layer.play(ticks, next_ticks, NULL, step_value);
+			}
+			// If this is an ignore point (due to probability) then we
+			// keep the same step value as before
+			if(update && !step_value.is(CSequenceStep::IGNORE_POINT)) {
+				m_step_value[i] = step_value;
+				m_step_page[i] = layer.get_play_page();
+				m_step_pos[i] = layer.get_pos();
+				layer_update[i] = 1;
+				any_layer_updated = 1;
+			}
+		}
 
-		// ensure the sequencer is running
-		if(m_is_running) {
+		// is there anything to update?
+		if(any_layer_updated) {
 
 			///////////////////////////////////////////////////////////////////////////////
-			// 1 - CHECK THE SCHEDULING OF EACH LAYER TO SEE IF ANY LAYER HAS
-			// MOVED TO A NEW STEP
+			// 2 - RECALCULATE THE CV OUTPUT VALUES FOR EACH LAYER EACH TIME ANY
+			// LAYER IS UPDATED
 			///////////////////////////////////////////////////////////////////////////////
 
-			byte layer_update[NUM_LAYERS] = {0}; 			// whether individual layer has updated
-			int any_layer_updated = 0;						// whether any layer has updated
-			int dice_roll = 1+rand()%16;		 			// random value for gate probability
-			clock::TICKS_TYPE ticks = g_clock.get_ticks(); 	// get the current clock tick count
+			// a planned layer gets its own output from its plan, so its step
+			// output is only needed when another layer takes it as CV source
+			// or combines with it
+			byte step_output_needed = 0;
 			for(int i=0; i<NUM_LAYERS; ++i) {
-				int update;
-				CSequenceStep step_value;
 				CSequenceLayer& layer = *m_layers[i];
-				if(m_rec_layer == i) {
-					update = layer.play(ticks, dice_roll, &m_rec, step_value);
+				if(!layer.is_planned()) {
+					step_output_needed |= (1<<layer.get_cv_source_layer());
 				}
-				else {
-					update = layer.play(ticks, dice_roll, NULL, step_value);
-				}
-				// If this is an ignore point (due to probability) then we
-				// keep the same step value as before
-				if(update && !step_value.is(CSequenceStep::IGNORE_POINT)) {
-					m_step_value[i] = step_value;
-					layer_update[i] = 1;
-					any_layer_updated = 1;
+				if(i && layer.is_combined()) {
+					step_output_needed |= (1<<(i-1));
 				}
 			}
 
-			// is there anything to update?
-			if(any_layer_updated) {
-
-				///////////////////////////////////////////////////////////////////////////////
-				// 2 - RECALCULATE THE CV OUTPUT VALUES FOR EACH LAYER EACH TIME ANY
-				// LAYER IS UPDATED
-				///////////////////////////////////////////////////////////////////////////////
-
-				int any_accented_step = 0;	// we will track if any accent gate is active
-				CV_TYPE output_value = 0; 	// used to pass output from one layer as input to the next
-				for(int i=0; i<NUM_LAYERS; ++i) {
-					CSequenceLayer& layer = *m_layers[i];
+			int any_accented_step = 0;	// we will track if any accent gate is active
+			CV_TYPE output_value = 0; 	// used to pass output from one layer as input to the next
+			for(int i=0; i<NUM_LAYERS; ++i) {
+				CSequenceLayer& layer = *m_layers[i];
 
-					// update output values based on current step vaues
+				// update output values based on current step vaues
+				if(step_output_needed & (1<<i)) {
 					m_step_output[i] = layer.get_step_output(output_value, m_step_value[i]);
 					output_value = m_step_output[i];
+				}
 
-					// check if any mapped layer has an accent point (NB: need to establish this before any layer gates are
-					// triggered, since accent triggers first)
-					if(!layer.is_muted() && m_step_value[layer.get_gate_source_layer()].is(CSequenceStep::ACCENT_POINT)) {
-						any_accented_step = 1;
-					}
+				// check if any mapped layer has an accent point (NB: need to establish this before any layer gates are
+				// triggered, since accent triggers first)
+				if(!layer.is_muted() && m_step_value[layer.get_gate_source_layer()].is(CSequenceStep::ACCENT_POINT)) {
+					any_accented_step = 1;
 				}
+			}
 
-				// set accent gate if required
-				g_clock.set_accent(any_accented_step);
+			// set accent gate if required
+			g_clock.set_accent(any_accented_step);
 
-				///////////////////////////////////////////////////////////////////////////////
-				// 3 - UPDATE THE OUTPUTS ANALOG OUTPUTS AND MIDI OUTPUTS FOR EACH LAYER.
-				// THESE MIGHT ACTUALLY BE BE TAKING INPUT FROM OTHER LAYERS
-				///////////////////////////////////////////////////////////////////////////////
-				for(int i=0; i<NUM_LAYERS; ++i) {
+			///////////////////////////////////////////////////////////////////////////////
+			// 3 - UPDATE THE OUTPUTS ANALOG OUTPUTS AND MIDI OUTPUTS FOR EACH LAYER.
+			// THESE MIGHT ACTUALLY BE BE TAKING INPUT FROM OTHER LAYERS
+			///////////////////////////////////////////////////////////////////////////////
+			for(int i=0; i<NUM_LAYERS; ++i) {
 
-					// we only need to do this for layers that are not muted
-					CSequenceLayer& layer = *m_layers[i];
-					if(!layer.is_muted()) {
+				// we only need to do this for layers that are not muted
+				CSequenceLayer& layer = *m_layers[i];
+				if(!layer.is_muted()) {
 
-						// Lookup the CV and gate value that should be output from this layer
-						CSequenceStep& step_value = m_step_value[layer.get_gate_source_layer()];
-						CV_TYPE step_output = m_step_output[layer.get_cv_source_layer()];
+					// Lookup the CV and gate value that should be output from this layer
+					CSequenceStep& step_value = m_step_value[layer.get_gate_source_layer()];
+					CV_TYPE step_output = m_step_output[layer.get_cv_source_layer()];
 
-						// transpose and quantize to get the layer output from step output
-						CV_TYPE layer_output = layer.get_layer_output(step_output, step_value);
+					// transpose and quantize to get the layer output from step output,
+					// or look it up in the plan when it only depends on this layer's step
+					CV_TYPE layer_output;
+					if(layer.is_planned()) {
+						layer_output = layer.get_planned_output(m_step_page[i], m_step_pos[i], m_step_value[i]);
+					}
+					else {
+						layer_output = layer.get_layer_output(step_output, step_value);
+					}
 
-						if(m_cal_mode == V_SEQ_OUT_CAL_NONE) {
-							// Update the analog CV output
-							layer.process_cv(layer_output, step_value);
+					if(m_cal_mode == V_SEQ_OUT_CAL_NONE) {
+						// Update the analog CV output
+						layer.process_cv(layer_output, step_value);
 
-						}
+					}
 
-						// Update the MIDI CC output if needed
-						if(V_SQL_MIDI_OUT_CC == layer.get_midi_out_mode()) {
-							layer.process_midi_cc(layer_output);
-						}
+					// Update the MIDI CC output if needed
+					if(V_SQL_MIDI_OUT_CC == layer.get_midi_out_mode()) {
+						layer.process_midi_cc(layer_output);
+					}
 
-						// Check if there is a change to the output on the gate source layer
-						if(layer_update[layer.get_gate_source_layer()]) {
+					// Check if there is a change to the output on the gate source layer
+					if(layer_update[layer.get_gate_source_layer()]) {
 
-							// Update the analog gate output
-							layer.process_gate(step_value);
+						// Update the analog gate output
+						layer.process_gate(step_value);
 
-							// Update MIDI note if appropriate
-							if(V_SQL_MIDI_OUT_NOTE == layer.get_midi_out_mode()) {
-								layer.process_midi_note(layer_output, step_value);
-							}
+						// Update MIDI note if appropriate
+						if(V_SQL_MIDI_OUT_NOTE == layer.get_midi_out_mode()) {
+							layer.process_midi_note(layer_output, step_value);
 						}
 					}
 				}
 			}
 		}
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////////////////
+	// Called once each millisecond, this is the entry point of the sequencing engine
+	void run() {
+
+		// a patch change can happen right away if we're stopped
+		if(m_pending_patch && !m_is_running) {
+			apply_patch(clock::TICKS_INFINITY);
+		}
+
+		// ensure the sequencer is running
+		if(m_is_running) {
+			clock::TICKS_TYPE ticks;						// clock tick count at this ms..
+			clock::TICKS_TYPE next_ticks;					// ..and at the next ms
+			g_clock.get_tick_window(ticks, next_ticks);
+
+			// switch patch if a bar starts in this ms. The old patch plays
+			// any steps that fall due before the bar line, and the first
+			// step of the new patch plays on the exact tick of the bar line
+			if(m_pending_patch && next_ticks != ticks) {
+				clock::TICKS_TYPE bar = get_next_bar(ticks);
+				if(bar < next_ticks) {
+					if(bar > ticks) {
+						play_layers(ticks, bar);
+					}
+					apply_patch(bar);
+				}
+			}
+			play_layers(ticks, next_ticks);
+		}
 
 		// finally do once per ms housekeeping for layers
 		for(int i=0; i<NUM_LAYERS; ++i) {
@@ -391,10 +500,35 @@ public:
 	}
 
 	/////////////////////////////////////////////////////////////////////////////////////////////
-	static int get_cfg_size() {
+	static constexpr int get_cfg_size() {
 		return CScale::get_cfg_size() + NUM_LAYERS * CSequenceLayer::get_cfg_size();
 	}
 
+	/////////////////////////////////////////////////////////////////////////////////////////////
+	uint32_t get_switch_ms() {
+		return m_switch_ms;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////////////////
+	// layer outputs taken from the plan, over all layers
+	uint32_t get_plan_hits() {
+		uint32_t hits = 0;
+		for(int i=0; i<NUM_LAYERS; ++i) {
+			hits += m_layers[i]->get_plan_hits();
+		}
+		return hits;
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////////////////
+	// planned layer outputs that had to be worked out in full
+	uint32_t get_plan_misses() {
+		uint32_t misses = 0;
+		for(int i=0; i<NUM_LAYERS; ++i) {
+			misses += m_layers[i]->get_plan_misses();
+		}
+		return misses;
+	}
+
 	/////////////////////////////////////////////////////////////////////////////////////////////
 	void get_cfg(byte **dest) {
 		m_scale.get_cfg(dest);
@@ -411,73 +545,112 @@ public:
 		}
 	}
 
+	/////////////////////////////////////////////////////////////////////////////////////////////
+	// Write the patch as a packed image (see patch_format.h). Returns the
+	// size of the image, or 0 if it does not fit
+	int encode_patch(byte *dest, int size) {
+		CPatchWriter w(dest + SZ_PATCH_HEADER, size - SZ_PATCH_HEADER - 1);
+		w.begin_section(PATCH_SECTION_SCALE);
+		m_scale.encode(w);
+		w.end_section();
+		for(int i=0; i<NUM_LAYERS; ++i) {
+			m_layers[i]->encode(w, i);
+		}
+		if(w.is_overflow()) {
+			return 0;
+		}
+		int len = w.get_pos();
+		dest[0] = PATCH_DATA_COOKIE1;
+		dest[1] = PATCH_FORMAT_PACKED;
+		dest[2] = (byte)len;
+		dest[3] = (byte)(len >> 8);
+		len += SZ_PATCH_HEADER;
+		dest[len] = patch_checksum(dest, len);
+		return len + 1;
+	}
+
 	/////////////////////////////////////////////////////////////////////////////////////////////
 	byte save_patch(int slot) {
-		byte *ptr = g_i2c_eeprom.buf();
-		int len = get_cfg_size();
-		*ptr++ = PATCH_DATA_COOKIE1;
-		*ptr++ = PATCH_DATA_COOKIE2;
-		get_cfg(&ptr);
-		*ptr++ = g_i2c_eeprom.buf_checksum(len + 2);
-		return g_i2c_eeprom.write(slot, len + 3);
+		g_i2c_bus.cancel_background();
+		if(m_pending_patch && m_pending_slot == slot) {
+			m_pending_patch = NULL;
+			g_patch_cache.unpin();
+		}
+		g_patch_cache.invalidate(slot);
+		int len = encode_patch(g_i2c_eeprom.buf(), CPatchCache::SZ_MAX_IMAGE);
+		if(!len) {
+			return 0;
+		}
+		return g_i2c_eeprom.write(slot, len);
 	}
 
 	/////////////////////////////////////////////////////////////////////////////////////////////
 	void save_patch_complete(int slot) {
+		g_patch_cache.store_image(slot);
 		g_popup.text("OK");
 	}
 	/////////////////////////////////////////////////////////////////////////////////////////////
+	// User patches are switched to at the next bar without silencing the
+	// outputs. If the patch is in the cache the EEPROM is not read at all
 	byte load_patch(int slot) {
-		return g_i2c_eeprom.read(slot, get_cfg_size() + 3);
+		if(slot == SLOT_TEMPLATE) {
+			silence();
+		}
+		else {
+			m_switch_request_ms = g_clock.get_ms();
+		}
+		if(g_patch_cache.find(slot)) {
+			fire_event(EV_LOAD_OK, slot);
+			return 1;
+		}
+		g_i2c_bus.cancel_background();
+		return g_i2c_eeprom.read_image(slot, CPatchCache::SZ_MAX_IMAGE, 0);
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////////////////
+	// restore the working state from an autosave image
+	void restore(byte *src) {
+		set_cfg(&src);
+		init_state();
+		m_scale.build();
+		fire_event(EV_CLOCK_RESET,0);
 	}
 
 	/////////////////////////////////////////////////////////////////////////////////////////////
 	void load_patch_complete(int slot) {
-		byte *buf = g_i2c_eeprom.buf();
-		int len = get_cfg_size();
-		byte checksum = g_i2c_eeprom.buf_checksum(len + 2);
-		if(buf[0] == PATCH_DATA_COOKIE1 && buf[1] == PATCH_DATA_COOKIE2 && buf[len+2] == checksum) {
-			buf+=2;
-			set_cfg(&buf);
-			init_state();
-			switch(slot) {
-			case SLOT_CONFIG:
-				break;
-			case SLOT_TEMPLATE:
-				clear();
-				g_popup.text("INIT");
-				break;
-			default:
-				int i;
-				for(i=0; i<NUM_LAYERS; ++i) {
-					if(m_layers[i]->is_muted())
-						break;
-				}
-				g_popup.text(i<NUM_LAYERS? "OK MUTES": "OK");
-				break;
+		// the patch is either in the cache or has just been read into the
+		// EEPROM buffer
+		const byte *cfg = g_patch_cache.get(slot);
+		if(!cfg) {
+			cfg = g_patch_cache.store_image(slot);
+		}
+		if(slot != SLOT_TEMPLATE) {
+			if(cfg) {
+				queue_patch(slot);
 			}
-
+			else {
+				g_popup.text("EMPTY");
+			}
+			return;
+		}
+		if(cfg) {
+			byte *src = (byte*)cfg;
+			set_cfg(&src);
+			init_state();
+			clear();
 			// build the scale mappings
 			m_scale.build();
 		}
 		else {
-			switch(slot) {
-			case SLOT_CONFIG:
-				break;
-			case SLOT_TEMPLATE:
-				init();
-				g_popup.text("INIT");
-				break;
-			default:
-				g_popup.text("EMPTY");
-				break;
-			}
+			init();
 		}
+		g_popup.text("INIT");
 		fire_event(EV_CLOCK_RESET,0);
 	}
 
 };
 
+static_assert(CSequence::get_cfg_size() == CPatchCache::SZ_PATCH, "Patch cache entry size does not match the sequence");
 CSequence g_sequence;
 
 #endif /* SEQUENCE_H_ */
@@ -64,13 +64,6 @@ class CSequenceEditor {
 		GATE_VIEW_MAX = GATE_VIEW_RETRIG
 	};
 
-	enum {
-		BRIGHT_OFF,
-		BRIGHT_LOW,
-		BRIGHT_MED,
-		BRIGHT_HIGH
-	};
-
 	enum {
 		CLONE_MARKED	= 0x01,				// a clone point has been marked
 		CLONE_ACTIONED  = 0x02,				// data has been cloned from clone point
@@ -108,6 +101,7 @@ class CSequenceEditor {
 	const char *m_cmd_values;
 	int m_num_values;
 	int m_rand_seed;
+	CPrng m_prng;				// source of seeds for randomise, add noise and layer playback
 
 	int m_sel_from;				// start of selection range
 	int m_sel_to;				// end of selection range
@@ -619,7 +613,6 @@ class CSequenceEditor {
 		case CMD_MEMORY:
 			if(m_memo_slot) {
 				if(value == 1) {
-					g_sequence.silence();
 					g_sequence.load_patch(m_memo_slot);
 				}
 				else if(value == 2) {
@@ -999,7 +992,7 @@ class CSequenceEditor {
 		case ACTION_BEGIN:
 			// capture the page state so we can revert back to it
 			layer.get_page_content(m_cur_page, m_save_page);
-			m_rand_seed = g_clock.get_ms();
+			m_rand_seed = m_prng.next() + g_clock.get_ms();
 			m_edit_value = 0;
 			break;
 		////////////////////////////////////////////////
@@ -1045,6 +1038,7 @@ class CSequenceEditor {
 						// commit to current page slot. This needs to update the saved
 						// page image and reset the level parameter
 						layer.get_page_content(m_cur_page, m_save_page);
+						layer.set_rand_seed(m_prng.next());
 						m_edit_value = 0;
 						g_popup.text("DONE");
 						g_popup.avoid(m_cursor);
@@ -1057,6 +1051,7 @@ class CSequenceEditor {
 						CSequencePage this_page;
 						layer.get_page_content(m_cur_page, this_page);
 						layer.set_page_content(page_no, this_page);
+						layer.set_rand_seed(m_prng.next());
 						g_popup.text("DONE");
 						g_popup.avoid(m_cursor);
 					}
@@ -1355,6 +1350,8 @@ class CSequenceEditor {
 			case KEY_MEMO|KEY2_MEMO_TEMPLATE: m_memo_slot = SLOT_TEMPLATE; break;
 			}
 			if(m_memo_slot) {
+				// the patch is likely to be loaded, so get it ready
+				g_patch_cache.prefetch(m_memo_slot);
 				command_mode(CMD_MEMORY);
 			}
 			break;
@@ -1618,6 +1615,7 @@ public:
 			break;
 		case EV_MIDI_IN_RESET:
 			m_num_midi_in_notes = 0;
+			g_midi.set_note_chan(m_cfg.m_midi_in_chan);
 			break;
 		}
 	}
@@ -1756,68 +1754,54 @@ public:
 				}
 			}
 
-			// determine how the gate point should be displayed
-			byte bri = BRIGHT_OFF;
-			byte trig_or_tie = step.is(CSequenceStep::TRIG_POINT)||step.is(CSequenceStep::TIE_POINT);
-			switch(m_gate_view) {
-				case GATE_VIEW_GATE_TIE:
-					if(step.is(CSequenceStep::TRIG_POINT)) {
-						bri = step.is(CSequenceStep::TIE_POINT)? BRIGHT_HIGH : BRIGHT_MED;
-					}
-					else if(step.is(CSequenceStep::TIE_POINT)){
-						bri = BRIGHT_LOW;
-					}
-					break;
-				case GATE_VIEW_PROB:
-					if(!!step.get_prob()) {
-						bri = trig_or_tie? BRIGHT_HIGH : BRIGHT_MED;
-					}
-					else if(trig_or_tie){
-						bri = BRIGHT_LOW;
-					}
-					break;
-				case GATE_VIEW_RETRIG:
-					if(!!step.get_retrig()) {
-						bri = trig_or_tie? BRIGHT_HIGH : BRIGHT_MED;
-					}
-					else if(trig_or_tie){
-						bri = BRIGHT_LOW;
-					}
-					break;
-				case GATE_VIEW_ACCENT:
-					if(step.is(CSequenceStep::ACCENT_POINT)) {
-						bri = trig_or_tie? BRIGHT_HIGH : BRIGHT_MED;
-					}
-					else if(trig_or_tie){
-						bri = BRIGHT_LOW;
-					}
-					break;
-			}
-
-			// gates at current position are highlighted
-			if(bri != BRIGHT_OFF && show_active_pos) {
-				bri = BRIGHT_HIGH;
-			}
+			mask>>=1;
+		}
 
-			// plot the gate info
-			switch(bri) {
-			case BRIGHT_LOW:
-				g_ui.raster(14) &= ~mask;
-				g_ui.hilite(14) |= mask;
-				break;
-			case BRIGHT_MED:
-				g_ui.raster(14) |= mask;
-				g_ui.hilite(14) &= ~mask;
+		// the gate row is worked out for all steps at once from the gate
+		// bitplanes of the page, which are in display row order
+		uint32_t trig = layer.get_mask(m_cur_page, CSequenceStep::TRIG_POINT);
+		uint32_t tie = layer.get_mask(m_cur_page, CSequenceStep::TIE_POINT);
+		uint32_t trig_or_tie = trig|tie;
+		uint32_t other;
+		uint32_t high = 0;
+		uint32_t med = 0;
+		uint32_t low = 0;
+		switch(m_gate_view) {
+			case GATE_VIEW_GATE_TIE:
+				high = trig & tie;
+				med = trig & ~tie;
+				low = tie & ~trig;
 				break;
-			case BRIGHT_HIGH:
-				g_ui.raster(14) |= mask;
-				g_ui.hilite(14) |= mask;
+			case GATE_VIEW_PROB:
+			case GATE_VIEW_RETRIG:
+			case GATE_VIEW_ACCENT:
+				if(m_gate_view == GATE_VIEW_PROB) {
+					other = layer.get_prob_mask(m_cur_page);
+				}
+				else if(m_gate_view == GATE_VIEW_RETRIG) {
+					other = layer.get_retrig_mask(m_cur_page);
+				}
+				else {
+					other = layer.get_mask(m_cur_page, CSequenceStep::ACCENT_POINT);
+				}
+				high = other & trig_or_tie;
+				med = other & ~trig_or_tie;
+				low = trig_or_tie & ~other;
 				break;
-			}
+		}
 
-			mask>>=1;
+		// gates at current position are highlighted
+		if(g_sequence.is_running() && layer.get_play_page() == m_cur_page) {
+			mask = g_ui.bit(layer.get_pos());
+			if((high|med|low) & mask) {
+				high |= mask;
+			}
 		}
 
+		// plot the gate info
+		g_ui.raster(14) |= med|high;
+		g_ui.hilite(14) |= low|high;
+
 		// scrollbar
 		if(m_show_scrollbar) {
 			int thumb = layer.get_scroll_ofs();
@@ -1855,7 +1839,7 @@ public:
 			}
 		}
 
-		if(g_i2c_eeprom.is_busy()) {
+		if(g_i2c_eeprom.is_busy() && !g_i2c_eeprom.is_background()) {
 			g_ui.raster(0) |= 0b11;
 			g_ui.raster(1) |= 0b11;
 			g_ui.hilite(0) |= 0b11;
@@ -103,6 +103,7 @@ private:
 		int 			m_muted:1;
 		V_SQL_CV_ALIAS 	m_cv_alias;
 		V_SQL_GATE_ALIAS m_gate_alias;
+		uint16_t		m_rand_seed;		// seed for random playback (probability, off grid, cueing)
 
 	} CONFIG;
 	CSequencePage 	m_page[NUM_PAGES];	// sequencer page
@@ -126,12 +127,29 @@ private:
 		uint32_t m_retrig_ms;			// this is the number of ms between retriggers
 		uint32_t m_retrig_timeout;		// this is the time remaining until the next retrigger
 		uint32_t m_trig_dur;					// the duration of the current trigger
+		uint16_t m_gate_offset;			// fine timer offset of gate changes from the ms boundary
 		clock::TICKS_TYPE m_next_step_time;
 	} STATE;
 
 	CONFIG m_cfg;				// instance of config
 	STATE m_state;
 	byte m_id;
+	CPrng m_prng;				// random numbers for playback, restarted from the seed on reset
+
+	// The planned output of the layer for the step at each position of each
+	// page. An entry holds the quantized note before octave shift, tagged
+	// with the step value it was worked out for. A step that has been edited
+	// or recorded does not match its tag and is worked out again, so only the
+	// steps that change are replanned. A change to the layer settings or the
+	// scale clears the whole plan. Only notes within the scale tables are
+	// planned
+	byte m_plan_value[NUM_PAGES][CSequencePage::MAX_STEPS];
+	byte m_plan_note[NUM_PAGES][CSequencePage::MAX_STEPS];
+	uint32_t m_plan_valid[NUM_PAGES];	// one bit for each entry that is in use
+	V_SQL_SCALE_TYPE m_plan_scale_type;	// scale the plan was made for
+	V_SQL_SCALE_ROOT m_plan_scale_root;
+	uint16_t m_plan_hits;		// outputs taken from the plan..
+	uint16_t m_plan_misses;		// ..and worked out in full
 
 	//
 	// PRIVATE METHODS
@@ -169,11 +187,7 @@ private:
 		if(step_no == loop_to) {
 			// do we have a cue list?
 			if(m_cfg.m_cue_list_count) {
-				byte cue_list_pos = m_state.m_cue_list_next;
-				if(++cue_list_pos >= m_cfg.m_cue_list_count - 1) {
-					cue_list_pos = 0;
-				}
-				page_no = m_cfg.m_cue_list[cue_list_pos];
+				page_no = m_cfg.m_cue_list[m_state.m_cue_list_next];
 			}
 			// back to first step (poss page change)
 			step_no = get_loop_from(page_no);
@@ -217,7 +231,7 @@ private:
 				}
 				break;
 			case CUE_RANDOM:
-				m_cfg.m_cue_list[0] = random()%(m_cfg.m_max_page_no+1);
+				m_cfg.m_cue_list[0] = m_prng.range(m_cfg.m_max_page_no+1);
 				break;
 			case CUE_MANUAL:
 				if(++m_state.m_cue_list_next >= m_cfg.m_cue_list_count) {
@@ -227,6 +241,11 @@ private:
 		}
 	}
 
+	///////////////////////////////////////////////////////////////////////////////
+	inline void clear_plan() {
+		memset(m_plan_valid, 0, sizeof m_plan_valid);
+	}
+
 	///////////////////////////////////////////////////////////////////////////////
 	void recalc_data_points_all_pages() {
 		for(int i=0; i<NUM_PAGES; ++i) {
@@ -241,6 +260,8 @@ public:
 	void init() {
 		init_config();
 		init_state();
+		m_plan_hits = 0;
+		m_plan_misses = 0;
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -278,6 +299,7 @@ public:
 		m_cfg.m_gate_alias = V_SQL_GATE_ALIAS_NONE;
 		set_mode(m_cfg.m_mode);
 		clear();
+		clear_plan();
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -290,6 +312,10 @@ public:
 		m_cfg.m_cue_list_count = 0;
 		m_cfg.m_cue_mode = CUE_NONE;
 		set_scroll_for(get_default_value(),1);
+
+		// a cleared layer gets a new random seed. The generator is restarted
+		// from a fixed seed on reset, so the time is mixed in too
+		set_rand_seed(m_prng.next() + g_clock.get_ms());
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -308,6 +334,21 @@ public:
 	}
 
 
+	///////////////////////////////////////////////////////////////////////////////
+	// Change the seed for random playback, which takes effect right away
+	void set_rand_seed(uint16_t seed) {
+		m_cfg.m_rand_seed = seed;
+		reseed();
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Restart the random numbers used for playback, so that the random
+	// parts of a patch play the same each time. Each layer gets its own
+	// sequence from the seed
+	void reseed() {
+		m_prng.set_seed(((uint32_t)m_cfg.m_rand_seed << 2) | m_id);
+	}
+
 	///////////////////////////////////////////////////////////////////////////////
 	// Reset the playback state of the layer
 	void reset() {
@@ -318,13 +359,46 @@ public:
 		m_state.m_retrig_ms = 0;
 		m_state.m_retrig_timeout = 0;
 		m_state.m_trig_dur = 0;
+		m_state.m_gate_offset = 0;
 		m_state.m_first_step = 1;
+		reseed();
 
 		silence();	// kill outputs
 		cue_reset(); // go to first page in the cued sequence
 		m_state.m_play_pos = get_loop_from(m_state.m_play_page_no); // position at start of loop window
 	}
 
+	///////////////////////////////////////////////////////////////////////////////
+	// Replace the content of the layer and play it from the start, without
+	// silencing the outputs. A gate or note that is playing carries on until
+	// the first step of the new content takes over. The first step plays at
+	// start_time, or right away if this is TICKS_INFINITY
+	void switch_content(byte **src, clock::TICKS_TYPE start_time) {
+		CONFIG cfg;
+		memcpy(&cfg, *src, sizeof cfg);
+		if(cfg.m_midi_out != m_cfg.m_midi_out || cfg.m_midi_out_chan != m_cfg.m_midi_out_chan) {
+			stop_midi_note(); // the note would not get stopped on the new channel
+		}
+		set_cfg(src);
+		if(m_cfg.m_muted) {
+			silence(); // a muted layer does not update its outputs
+		}
+
+		m_state.m_play_page_no = 0;
+		for(int i=0; i<NUM_PAGES; ++i) {
+			m_page[i].init_state();
+		}
+		m_state.m_next_step_time = start_time;
+		m_state.m_step_timeout = 0;
+		m_state.m_page_advanced = 0;
+		m_state.m_retrig_ms = 0;
+		m_state.m_retrig_timeout = 0;
+		m_state.m_first_step = 1;
+		reseed();
+		cue_reset();
+		m_state.m_play_pos = get_loop_from(m_state.m_play_page_no);
+	}
+
 	///////////////////////////////////////////////////////////////////////////////
 	void event(int event, uint32_t param) {
 		switch(event) {
@@ -337,10 +411,110 @@ public:
 			break;
 		case EV_SEQ_CONTINUE:
 			break;
-		case EV_LOAD_OK:
-			init_state();
+		case EV_SEQ_SONG_POS:
+			chase(param);
+			break;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Set up the playback state as if the layer had played from the start up
+	// to a song position (in 16th notes). Rather than stepping through the whole
+	// sequence, whole cycles of the page sequence are skipped and then at most
+	// one pass of each page in the cycle, so this is quick for any position
+	void chase(int song_pos) {
+		reset();
+		clock::TICKS_TYPE ticks = clock::pp24_to_ticks(song_pos * clock::PP24_16);
+		if(!ticks) {
+			return;
+		}
+
+		// number of steps the layer has moved on from the first step before
+		// reaching the song position (a step falling exactly on the song
+		// position is played when the sequencer continues)
+		clock::TICKS_TYPE ticks_per_step = clock::pp24_to_ticks(clock::pp24_per_measure(m_cfg.m_step_rate));
+		uint32_t num_steps = (ticks - 1)/ticks_per_step;
+
+		// Each pass of a page ends with a move to the next page, which
+		// is the same page unless there is a cue list. The sequence of
+		// pages repeats after a number of passes
+		int cycle_passes;
+		switch(m_cfg.m_cue_mode) {
+		case CUE_AUTO:
+			cycle_passes = m_cfg.m_max_page_no + 1;
+			break;
+		case CUE_MANUAL:
+			cycle_passes = m_cfg.m_cue_list_count? m_cfg.m_cue_list_count : 1;
 			break;
+		case CUE_RANDOM:
+			// random cueing cannot be repeated, so the layer just
+			// stays on the page it has been cued to
+			cycle_passes = 0;
+			break;
+		default:
+			cycle_passes = 1;
+			break;
+		}
+
+		// skip over whole cycles. The cue state is the same at the start
+		// of each cycle (auto cueing starts from page A after a reset)
+		uint32_t steps = num_steps;
+		if(cycle_passes) {
+			uint32_t cycle_steps = 0;
+			for(int i=0; i<cycle_passes; ++i) {
+				int page_no = m_state.m_play_page_no;
+				if(CUE_AUTO == m_cfg.m_cue_mode) {
+					page_no = i;
+				}
+				else if(CUE_MANUAL == m_cfg.m_cue_mode && m_cfg.m_cue_list_count) {
+					page_no = m_cfg.m_cue_list[i];
+				}
+				cycle_steps += get_loop_span(page_no);
+			}
+			steps %= cycle_steps;
+		}
+		else {
+			steps %= get_loop_span(m_state.m_play_page_no);
+		}
+
+		// step through the remaining page passes
+		int span;
+		while(steps >= (uint32_t)(span = get_loop_span(m_state.m_play_page_no))) {
+			steps -= span;
+			if(m_cfg.m_cue_list_count) {
+				m_state.m_play_page_no = m_cfg.m_cue_list[m_state.m_cue_list_next];
+			}
+			cue_update();
+		}
+
+		// position within the loop on the current page
+		int loop_from = get_loop_from(m_state.m_play_page_no);
+		if(get_loop_to(m_state.m_play_page_no) < loop_from) {
+			m_state.m_play_pos = loop_from - steps;
+		}
+		else {
+			m_state.m_play_pos = loop_from + steps;
+		}
+		if(num_steps) {
+			m_state.m_page_advanced = !steps;
+		}
+
+		// schedule the next step as if we had just played this one
+		m_state.m_first_step = 0;
+		clock::TICKS_TYPE next_step_time = ticks_per_step * (num_steps + 1) + get_ticks_offset(1+m_state.m_play_pos, ticks_per_step/2);
+
+		// the next grid step is at or after the song position, but if it is
+		// pulled early by swing or slide then it has already been played
+		if((int32_t)next_step_time < (int32_t)ticks) {
+			++num_steps;
+			m_state.m_page_advanced = 0;
+			if(calc_next_step(m_state.m_play_page_no, m_state.m_play_pos)) {
+				cue_update();
+				m_state.m_page_advanced = 1;
+			}
+			next_step_time = ticks_per_step * (num_steps + 1) + get_ticks_offset(1+m_state.m_play_pos, ticks_per_step/2);
 		}
+		m_state.m_next_step_time = ((int32_t)next_step_time < 0)? 0 : next_step_time;
 	}
 
 	//
@@ -349,6 +523,7 @@ public:
 
 	///////////////////////////////////////////////////////////////////////////////
 	void set(PARAM_ID param, int value) {
+		clear_plan();
 		switch(param) {
 		case P_SQL_SEQ_MODE: set_mode((V_SQL_SEQ_MODE)value); break;
 		case P_SQL_QUANTIZE: m_cfg.m_quantize = (V_SQL_QUANTIZE)value; break;
@@ -565,6 +740,19 @@ public:
 		return page.count_of(type, from, to);
 	}
 
+	///////////////////////////////////////////////////////////////////////////////
+	// masks of the steps on a page that have a type of point, probability or
+	// retrig, in display row order
+	uint32_t get_mask(byte page_no, CSequenceStep::POINT_TYPE type) {
+		return get_page(page_no).get_mask(type);
+	}
+	uint32_t get_prob_mask(byte page_no) {
+		return get_page(page_no).get_prob_mask();
+	}
+	uint32_t get_retrig_mask(byte page_no) {
+		return get_page(page_no).get_retrig_mask();
+	}
+
 	///////////////////////////////////////////////////////////////////////////////
 	int any_of(byte page_no, CSequenceStep::POINT_TYPE type, int from=0, int to=CSequencePage::MAX_STEPS-1) {
 		CSequencePage& page = get_page(page_no);
@@ -836,6 +1024,7 @@ public:
 	void set_content(CSequenceLayer& other) {
 		m_cfg = other.m_cfg;
 		m_state = other.m_state;
+		clear_plan();
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -873,7 +1062,7 @@ public:
 
 	///////////////////////////////////////////////////////////////////////////////
 	void silence() {
-		g_outs.gate(m_id, COuts::GATE_CLOSED);
+		g_gate_scheduler.gate_now(m_id, COuts::GATE_CLOSED);
 		m_state.m_retrig_ms = 0;
 		m_state.m_retrig_timeout = 0;
 		stop_midi_note();
@@ -923,7 +1112,15 @@ public:
 		int offset = 0;
 
 		// mod amount has  a range 25 thru 75.. map this to between -1 and +1 with 50=0
-		float amp = (m_cfg.m_off_grid_amount-50.0)/26.0; // -1.0 >> 1.0
+		// as a 16.16 fixed point multiplier (1/26 is 2521/65536)
+		int amount = m_cfg.m_off_grid_amount;
+		if(amount < MOD_AMOUNT_MIN) {
+			amount = MOD_AMOUNT_MIN;
+		}
+		else if(amount > MOD_AMOUNT_MAX) {
+			amount = MOD_AMOUNT_MAX;
+		}
+		int32_t amp = (amount - 50) * 2521; // -1.0 >> 1.0
 		switch(m_cfg.m_off_grid_mode) {
 			case V_SQL_OFF_GRID_MODE_SWING: {
 				// work out the 'equivalent step' (i.e. step number withing
@@ -933,15 +1130,15 @@ public:
 					equiv_step += 4;
 				}
 				if(equiv_step&1) {
-					offset = max_offset*amp;
+					offset = (max_offset*amp)>>16;
 				}
 				return offset;
 			}
 			case V_SQL_OFF_GRID_MODE_SLIDE:
-				return max_offset*amp;
+				return (max_offset*amp)>>16;
 			case V_SQL_OFF_GRID_MODE_RANDOM:
-				offset = -amp*(random()%max_offset);
-				if(random()&1) {
+				offset = -(((int32_t)m_prng.range(max_offset)*amp)>>16);
+				if(m_prng.next() & 0x80000000U) {
 					return -offset;
 				}
 				else {
@@ -967,18 +1164,36 @@ public:
 	// The maximum offset from grid is +/- half of a grid step, so it is never
 	// possible for steps to be scheduled out of order
 	//
-	byte play(clock::TICKS_TYPE ticks, int dice_roll, REC_SESSION *rec, CSequenceStep& step_value) {
+	// ticks is the tick count at the current ms boundary and next_ticks is the
+	// count at the next one. A step falling due between the two is played now and
+	// its gate changes are timed within the ms by the gate scheduler
+	//
+	byte play(clock::TICKS_TYPE ticks, clock::TICKS_TYPE next_ticks, REC_SESSION *rec, CSequenceStep& step_value) {
 
 		auto do_advance = 0; 	// flag says if the play position moved at this call
 		auto do_play = 0; 		// flag says if we started playing a step at this call
+		clock::TICKS_TYPE step_time = ticks; // when the step falls due
 		if(m_state.m_first_step) {
-			// the very first step.. we'll play it now and schedule the next
-			do_play = 1;
-			m_state.m_first_step = 0;
+			// the very first step.. we'll play it now (or when it has been
+			// scheduled for, after a patch change) and schedule the next
+			if(m_state.m_next_step_time == clock::TICKS_INFINITY) {
+				do_play = 1;
+				m_state.m_first_step = 0;
+			}
+			else if(m_state.m_next_step_time < next_ticks) {
+				do_play = 1;
+				m_state.m_first_step = 0;
+				if(m_state.m_next_step_time > ticks) {
+					step_time = m_state.m_next_step_time;
+				}
+			}
 		}
-		else if(m_state.m_next_step_time <= ticks) {
+		else if(m_state.m_next_step_time < next_ticks || m_state.m_next_step_time <= ticks) {
 			do_advance = 1;
 			do_play = 1;
+			if(m_state.m_next_step_time > ticks) {
+				step_time = m_state.m_next_step_time;
+			}
 		}
 
 		// move to the next step, unless this is the very first step following
@@ -986,9 +1201,6 @@ public:
 		if(do_advance) {
 			m_state.m_page_advanced = 0;
 			if(calc_next_step(m_state.m_play_page_no, m_state.m_play_pos)) {
-				if(m_cfg.m_cue_mode != CUE_NONE) {
-					m_state.m_play_page_no = m_cfg.m_cue_list[m_state.m_cue_list_next];
-				}
 				cue_update();
 				m_state.m_page_advanced = 1;
 			}
@@ -1006,7 +1218,7 @@ public:
 			m_state.m_step_timeout = g_clock.get_ms_per_measure(m_cfg.m_step_rate);
 			//m_state.m_suppress_step = 0;
 			if(step_value.get_prob()) { // nonzero probability?
-				if(dice_roll>step_value.get_prob()) {
+				if(1 + (int)m_prng.range(16) > step_value.get_prob()) {
 					// dice roll is between 1 and 16, if this number is greater
 					// than the step probability (1-15) then the step will
 					// be suppressed
@@ -1022,8 +1234,9 @@ public:
 			ASSERT(rate_pp24);
 			clock::TICKS_TYPE ticks_per_step = clock::pp24_to_ticks(rate_pp24);
 
-			// work out the next "grid" step position
-			clock::TICKS_TYPE next_step_grid_time = ticks_per_step * (int)(1.5+(double)ticks/ticks_per_step);
+			// work out the next "grid" step position: the grid step after the
+			// one closest to this step
+			clock::TICKS_TYPE next_step_grid_time = ticks_per_step * ((step_time + ticks_per_step/2)/ticks_per_step + 1);
 
 			// apply timing adjustments for swing etc
 			clock::TICKS_TYPE next_step_time = next_step_grid_time + get_ticks_offset(1+m_state.m_play_pos, ticks_per_step/2);
@@ -1033,6 +1246,13 @@ public:
 			else {
 				m_state.m_next_step_time = next_step_time;
 			}
+
+			// gate changes for this step happen at the same point within
+			// each ms as the step itself
+			m_state.m_gate_offset = g_clock.ticks_to_fine(step_time - ticks);
+			if(m_state.m_gate_offset >= g_clock.get_fine_per_ms()) {
+				m_state.m_gate_offset = g_clock.get_fine_per_ms() - 1;
+			}
 		}
 		return do_play;
 	}
@@ -1045,7 +1265,7 @@ public:
 		if(!m_cfg.m_muted) {
 			if(m_state.m_gate_timeout) {
 				if(!--m_state.m_gate_timeout) {
-					g_outs.gate(m_id, COuts::GATE_CLOSED);
+					g_gate_scheduler.gate(m_id, COuts::GATE_CLOSED, m_state.m_gate_offset);
 					stop_midi_note();
 				}
 			}
@@ -1080,7 +1300,7 @@ public:
 				}
 				else {
 					// retrigger the gate
-					g_outs.gate(m_id, COuts::GATE_TRIG);
+					g_gate_scheduler.gate(m_id, COuts::GATE_TRIG, m_state.m_gate_offset);
 					m_state.m_gate_timeout = m_state.m_trig_dur;
 
 					// retrigger the MIDI note
@@ -1145,7 +1365,8 @@ public:
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
-	CV_TYPE get_layer_output(CV_TYPE step_output, CSequenceStep& step_value) {
+	// transpose and quantize the step output
+	CV_TYPE get_quantized_output(CV_TYPE step_output) {
 
 		// apply transposition
 		CV_TYPE output = step_output + COuts::SCALING * (int)m_cfg.m_cv_transpose;
@@ -1165,15 +1386,81 @@ public:
 			output = COuts::SCALING * CScale::instance().force_to_scale(output/COuts::SCALING);
 			break;
 		}
+		return output;
+	}
 
-		// apply octave shift
+	///////////////////////////////////////////////////////////////////////////////
+	// apply octave shift
+	inline CV_TYPE shift_octave(CV_TYPE output) {
 		if(m_cfg.m_cv_octave != V_SQL_CVSHIFT_NONE) {
 			output += 12 * COuts::SCALING * (m_cfg.m_cv_octave - V_SQL_CVSHIFT_NONE);
 		}
-
 		return output;
 	}
 
+	///////////////////////////////////////////////////////////////////////////////
+	CV_TYPE get_layer_output(CV_TYPE step_output, CSequenceStep& step_value) {
+		return shift_octave(get_quantized_output(step_output));
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Whether the step output is combined with the previous layer's
+	inline byte is_combined() {
+		return (m_cfg.m_combine_prev != V_SQL_COMBINE_OFF);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Whether the layer output can come from the plan. This is when it is
+	// quantized and depends on nothing but the layer's own step value
+	inline byte is_planned() {
+		return (m_cfg.m_quantize != V_SQL_SEQ_QUANTIZE_OFF &&
+			!is_combined() &&
+			m_cfg.m_cv_alias == V_SQL_CV_ALIAS_NONE);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Get the layer output of a planned layer for a step that was played from
+	// position pos of a page. This is the same as working it out with
+	// get_step_output() and get_layer_output(), which is done when the step
+	// is not in the plan
+	CV_TYPE get_planned_output(int page_no, int pos, CSequenceStep& step_value) {
+		CScale& scale = CScale::instance();
+		if(m_plan_scale_type != scale.get_type() || m_plan_scale_root != scale.get_root()) {
+			m_plan_scale_type = scale.get_type();
+			m_plan_scale_root = scale.get_root();
+			clear_plan();
+		}
+		byte value = step_value.get_value();
+		uint32_t bit = 1U<<pos;
+		CV_TYPE output;
+		if((m_plan_valid[page_no] & bit) && m_plan_value[page_no][pos] == value) {
+			output = COuts::SCALING * m_plan_note[page_no][pos];
+			++m_plan_hits;
+		}
+		else {
+			CV_TYPE step_output = get_step_output(0, step_value);
+			output = get_quantized_output(step_output);
+			++m_plan_misses;
+			// the scale tables only cover MIDI notes
+			if(step_output + COuts::SCALING * (int)m_cfg.m_cv_transpose < COuts::SCALING * 128) {
+				m_plan_value[page_no][pos] = value;
+				m_plan_note[page_no][pos] = output/COuts::SCALING;
+				m_plan_valid[page_no] |= bit;
+			}
+		}
+		return shift_octave(output);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	inline uint16_t get_plan_hits() {
+		return m_plan_hits;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	inline uint16_t get_plan_misses() {
+		return m_plan_misses;
+	}
+
 	///////////////////////////////////////////////////////////////////////////////
 	void process_cv(CV_TYPE output, CSequenceStep& step_value) {
 
@@ -1200,7 +1487,7 @@ public:
 		m_state.m_retrig_ms = 0;
 		if(step_value.is(CSequenceStep::IGNORE_POINT)) {
 			if(!m_state.m_gate_timeout) {
-				g_outs.gate(m_id, COuts::GATE_CLOSED);
+				g_gate_scheduler.gate(m_id, COuts::GATE_CLOSED, m_state.m_gate_offset);
 			}
 		}
 		else if(step_value.is(CSequenceStep::TRIG_POINT) || step_value.get_retrig()>0) {
@@ -1230,15 +1517,15 @@ public:
 				m_state.m_retrig_ms = 0;
 			}
 			m_state.m_retrig_timeout = m_state.m_retrig_ms;
-			g_outs.gate(m_id, COuts::GATE_TRIG);
+			g_gate_scheduler.gate(m_id, COuts::GATE_TRIG, m_state.m_gate_offset);
 		}
 		else if(step_value.is(CSequenceStep::TIE_POINT)) {
 			m_state.m_gate_timeout = 0;
-			g_outs.gate(m_id, COuts::GATE_OPEN);
+			g_gate_scheduler.gate(m_id, COuts::GATE_OPEN, m_state.m_gate_offset);
 		}
 		else {
 			if(!m_state.m_gate_timeout) {
-				g_outs.gate(m_id, COuts::GATE_CLOSED);
+				g_gate_scheduler.gate(m_id, COuts::GATE_CLOSED, m_state.m_gate_offset);
 			}
 		}
 	}
@@ -1289,7 +1576,7 @@ public:
 	}
 
 	/////////////////////////////////////////////////////////////////////////////////////////////
-	static int get_cfg_size() {
+	static constexpr int get_cfg_size() {
 		return sizeof(CONFIG) + NUM_PAGES * CSequencePage::get_cfg_size();
 	}
 
@@ -1308,6 +1595,124 @@ public:
 		for(int i=0; i<NUM_PAGES; ++i) {
 			m_page[i].set_cfg(src);
 		}
+		clear_plan();
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////////////////
+	// offset of a page within the cfg image of the layer
+	static constexpr int get_page_cfg_offset(int page_no) {
+		return sizeof(CONFIG) + page_no * CSequencePage::get_cfg_size();
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////////////////
+	// Write the layer to a packed patch, as a layer section followed by a
+	// section for each page. The layer section holds
+	//   cue list entries (2 each), cue list count (5), cue mode (2), then the
+	//   settings a byte each apart from cv transpose (16), max page no (2) and
+	//   the scaled view, loop per page and muted flags (1 each), then the
+	//   random seed (16), which older patches do not have
+	void encode(CPatchWriter& w, int layer_no) {
+		w.begin_section(PATCH_SECTION_LAYER);
+		w.put(layer_no, 8);
+		for(int i=0; i<MAX_CUE_LIST; ++i) {
+			w.put(m_cfg.m_cue_list[i], 2);
+		}
+		w.put(m_cfg.m_cue_list_count, 5);
+		w.put(m_cfg.m_cue_mode, 2);
+		w.put(m_cfg.m_mode, 8);
+		w.put(m_cfg.m_quantize, 8);
+		w.put(m_cfg.m_step_rate, 8);
+		w.put(m_cfg.m_off_grid_mode, 8);
+		w.put(m_cfg.m_off_grid_amount, 8);
+		w.put((byte)m_cfg.m_transpose, 8);
+		w.put(m_cfg.m_trig_dur, 8);
+		w.put(m_cfg.m_midi_out, 8);
+		w.put(m_cfg.m_midi_out_chan, 8);
+		w.put(m_cfg.m_midi_cc, 8);
+		w.put(m_cfg.m_midi_cc_smooth, 8);
+		w.put(m_cfg.m_cv_scale, 8);
+		w.put(m_cfg.m_cv_octave, 8);
+		w.put((uint16_t)m_cfg.m_cv_transpose, 16);
+		w.put(m_cfg.m_cv_glide, 8);
+		w.put(m_cfg.m_combine_prev, 8);
+		w.put(m_cfg.m_midi_vel, 8);
+		w.put(m_cfg.m_midi_acc_vel, 8);
+		w.put(m_cfg.m_max_page_no, 2);
+		w.put(m_cfg.m_fill_mode, 8);
+		w.put(m_cfg.m_scroll_ofs, 8);
+		w.put(!!m_cfg.m_scaled_view, 1);
+		w.put(!!m_cfg.m_loop_per_page, 1);
+		w.put(!!m_cfg.m_muted, 1);
+		w.put(m_cfg.m_cv_alias, 8);
+		w.put(m_cfg.m_gate_alias, 8);
+		w.put(m_cfg.m_rand_seed, 16);
+		w.end_section();
+		for(int i=0; i<NUM_PAGES; ++i) {
+			w.begin_section(PATCH_SECTION_PAGE);
+			w.put((layer_no<<2)|i, 8);
+			m_page[i].encode(w);
+			w.end_section();
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////////////////
+	// Read the layer settings into the start of a native cfg image. The
+	// fields are in the same order in a version 1 patch, but each takes a
+	// whole byte and there is padding before cv transpose
+	static void decode(CPatchReader& r, byte *dest, byte version) {
+		byte raw = (version == PATCH_FORMAT_RAW);
+		CONFIG cfg;
+		memset(&cfg, 0, sizeof cfg);
+		for(int i=0; i<MAX_CUE_LIST; ++i) {
+			cfg.m_cue_list[i] = r.get_max(raw? 8:2, NUM_PAGES);
+		}
+		cfg.m_cue_list_count = r.get_max(raw? 8:5, MAX_CUE_LIST + 1);
+		cfg.m_cue_mode = r.get(raw? 8:2);
+		cfg.m_mode = (V_SQL_SEQ_MODE)r.get_max(8, V_SQL_SEQ_MODE_MAX);
+		cfg.m_quantize = (V_SQL_QUANTIZE)r.get(8);
+		cfg.m_step_rate = (V_SQL_STEP_RATE)r.get_max(8, V_SQL_STEP_RATE_MAX);
+		cfg.m_off_grid_mode = (V_SQL_OFF_GRID_MODE)r.get(8);
+		cfg.m_off_grid_amount = r.get(8);
+		cfg.m_transpose = (char)r.get(8);
+		cfg.m_trig_dur = (V_SQL_TRIG_DUR)r.get(8);
+		cfg.m_midi_out = (V_SQL_MIDI_OUT)r.get_max(8, V_SQL_MIDI_OUT_MAX);
+		cfg.m_midi_out_chan = r.get(8);
+		cfg.m_midi_cc = r.get(8);
+		cfg.m_midi_cc_smooth = r.get(8);
+		cfg.m_cv_scale = (V_SQL_CVSCALE)r.get(8);
+		cfg.m_cv_octave = (V_SQL_CVSHIFT)r.get(8);
+		if(raw) {
+			r.get(8);
+		}
+		cfg.m_cv_transpose = (int16_t)r.get(16);
+		cfg.m_cv_glide = (V_SQL_CVGLIDE)r.get(8);
+		cfg.m_combine_prev = (V_SQL_COMBINE)r.get(8);
+		cfg.m_midi_vel = r.get(8);
+		cfg.m_midi_acc_vel = r.get(8);
+		cfg.m_max_page_no = r.get_max(raw? 8:2, NUM_PAGES);
+		cfg.m_fill_mode = (V_SQL_FILL_MODE)r.get_max(8, V_SQL_FILL_MODE_MAX);
+		cfg.m_scroll_ofs = r.get(8);
+		cfg.m_scaled_view = r.get(1);
+		cfg.m_loop_per_page = r.get(1);
+		cfg.m_muted = r.get(1);
+		if(raw) {
+			r.get(5);
+		}
+		cfg.m_cv_alias = (V_SQL_CV_ALIAS)r.get(8);
+		cfg.m_gate_alias = (V_SQL_GATE_ALIAS)r.get(8);
+		if(!raw && r.has_field(16)) {
+			cfg.m_rand_seed = r.get(16);
+		}
+		memcpy(dest, &cfg, sizeof cfg);
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////////////////
+	// Read a whole layer (settings then pages) from a version 1 patch
+	static void decode_v1(CPatchReader& r, byte *dest) {
+		decode(r, dest, PATCH_FORMAT_RAW);
+		for(int i=0; i<NUM_PAGES; ++i) {
+			CSequencePage::decode_v1(r, dest + get_page_cfg_offset(i));
+		}
 	}
 };
 
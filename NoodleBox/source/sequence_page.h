@@ -28,15 +28,109 @@ public:
 		MAX_STEPS = 32,					// number of steps in page
 	};
 private:
+	// The point flags are held as a bitplane for each type of point, with
+	// one bit per step in the same order as a display row (step 0 in the top
+	// bit), so that whole page operations work on all steps at once
 	typedef struct {
-		CSequenceStep 	m_step[MAX_STEPS];	// data value and gate for each step
+		uint32_t		m_point[CSequenceStep::NUM_POINT_TYPES];	// bitplane for each type of point
+		union {
+			byte		m_value[MAX_STEPS];	// data value for each step
+			uint32_t	m_value_word[CBulkValues::NUM_WORDS];	// .. as words for CBulkValues
+		};
+		byte			m_prob_retrig[MAX_STEPS];	// probability (low nibble) and retrig (high nibble) for each step
 		byte 			m_loop_from;		// loop start point
 		byte 			m_loop_to;			// loop end point
 	} CONFIG;
 	CONFIG m_cfg;
 
 	///////////////////////////////////////////////////////////////////////////////
-	// Create interpolated points between two waypoints
+	static inline uint32_t bit(int index) {
+		return 0x80000000U >> index;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// mask of the steps from..to inclusive
+	static uint32_t range_mask(int from, int to) {
+		if(to >= MAX_STEPS) {
+			to = MAX_STEPS - 1;
+		}
+		if(from < 0) {
+			from = 0;
+		}
+		if(from > to) {
+			return 0;
+		}
+		return (0xFFFFFFFFU >> from) & ~((0xFFFFFFFFU >> to) >> 1);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// move each step later (dir > 0) or earlier (dir < 0) by count steps,
+	// wrapping around the page
+	static inline uint32_t rotate(uint32_t mask, int dir, int count) {
+		count &= (MAX_STEPS - 1);
+		if(!count) {
+			return mask;
+		}
+		if(dir < 0) {
+			count = MAX_STEPS - count;
+		}
+		return (mask >> count) | (mask << (MAX_STEPS - count));
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// number of set bits, without a loop (there is no popcount instruction
+	// on this CPU)
+	static inline int popcount(uint32_t mask) {
+		mask = mask - ((mask >> 1) & 0x55555555U);
+		mask = (mask & 0x33333333U) + ((mask >> 2) & 0x33333333U);
+		mask = (mask + (mask >> 4)) & 0x0F0F0F0FU;
+		return (mask * 0x01010101U) >> 24;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// convert between the display bit order and the patch format, which has
+	// step 0 in the lowest bit
+	static uint32_t reverse_bits(uint32_t mask) {
+		mask = ((mask >> 1) & 0x55555555U) | ((mask & 0x55555555U) << 1);
+		mask = ((mask >> 2) & 0x33333333U) | ((mask & 0x33333333U) << 2);
+		mask = ((mask >> 4) & 0x0F0F0F0FU) | ((mask & 0x0F0F0F0FU) << 4);
+		mask = ((mask >> 8) & 0x00FF00FFU) | ((mask & 0x00FF00FFU) << 8);
+		return (mask >> 16) | (mask << 16);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	inline byte is(int index, CSequenceStep::POINT_TYPE type) {
+		return !!(m_cfg.m_point[type] & bit(index));
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	static void put_step(CONFIG& cfg, int index, CSequenceStep& step) {
+		uint32_t mask = bit(index);
+		for(int type = 0; type < CSequenceStep::NUM_POINT_TYPES; ++type) {
+			if(step.is((CSequenceStep::POINT_TYPE)type)) {
+				cfg.m_point[type] |= mask;
+			}
+			else {
+				cfg.m_point[type] &= ~mask;
+			}
+		}
+		cfg.m_value[index] = step.m_cv.m_value;
+		cfg.m_prob_retrig[index] = step.m_gate.m_prob | (step.m_gate.m_retrig << 4);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// clear the data points and gates of all steps
+	static void clear_steps(CONFIG& cfg) {
+		memset(cfg.m_point, 0, sizeof cfg.m_point);
+		memset(cfg.m_value, 0, sizeof cfg.m_value);
+		memset(cfg.m_prob_retrig, 0, sizeof cfg.m_prob_retrig);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Create interpolated points between two waypoints. Each point is the
+	// exact line value rounded half up, stepped along in integers as a whole
+	// part and a remainder over 2 * num_points, so the only division is the
+	// one to get the gradient
 	void interpolate_section(int pos, int end)
 	{
 		// calculate the number of new points that we will need to
@@ -47,20 +141,103 @@ private:
 		}
 		if(num_points > 0) {
 
-			// starting point and gradient
-			double value =  m_cfg.m_step[pos].get_value();
-			double gradient = (m_cfg.m_step[end].get_value() - value)/num_points;
+			// starting point (plus a half for the rounding) and gradient
+			int denom = 2 * num_points;
+			int value = m_cfg.m_value[pos];
+			int rem = num_points;
+			int delta = 2 * ((int)m_cfg.m_value[end] - value);
+			int gradient = delta / denom;
+			int gradient_rem = delta - gradient * denom;
 			while(--num_points > 0) {
 				// wrap around the column
 				if(++pos >= MAX_STEPS) {
 					pos = 0;
 				}
 				value += gradient;
-				m_cfg.m_step[pos].set_value((byte)(value+0.5));
+				rem += gradient_rem;
+				if(rem >= denom) {
+					rem -= denom;
+					++value;
+				}
+				else if(rem < 0) {
+					rem += denom;
+					--value;
+				}
+				m_cfg.m_value[pos] = (byte)value;
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Find the nearest data point before (dir = -1) or after (dir = 1) a step,
+	// wrapping around the page. Returns -1 if no other step is a data point
+	int find_data_point(int pos, int dir) {
+		for(int i=1; i<MAX_STEPS; ++i) {
+			pos += dir;
+			if(pos < 0) {
+				pos = MAX_STEPS - 1;
+			}
+			else if(pos >= MAX_STEPS) {
+				pos = 0;
+			}
+			if(is(pos, CSequenceStep::DATA_POINT)) {
+				return pos;
 			}
 		}
+		return -1;
 	}
 
+	///////////////////////////////////////////////////////////////////////////////
+	// Recalculate the fill points after a change to one step. The rest of the
+	// page is already filled, so only the span between the data points either
+	// side of the step can change
+	void recalc_step(int index, V_SQL_FILL_MODE fill_mode, byte zero_value) {
+		byte is_data_point = is(index, CSequenceStep::DATA_POINT);
+		int prev = find_data_point(index, -1);
+		switch(fill_mode) {
+		case V_SQL_FILL_MODE_PAD:
+			if(prev < 0 && !is_data_point) {
+				// no data points left
+				pad(zero_value);
+			}
+			else {
+				// the step (if it is a fill point) and the fill points after it
+				// take the value of the data point at or before the step
+				byte value = m_cfg.m_value[is_data_point? index : prev];
+				int pos = index;
+				for(int i=0; i<MAX_STEPS; ++i) {
+					if(i && is(pos, CSequenceStep::DATA_POINT)) {
+						break;
+					}
+					m_cfg.m_value[pos] = value;
+					if(++pos >= MAX_STEPS) {
+						pos = 0;
+					}
+				}
+			}
+			break;
+		case V_SQL_FILL_MODE_INTERPOLATE: {
+				int next = find_data_point(index, 1);
+				if(prev < 0 || (prev == next && !is_data_point)) {
+					// fewer than two data points, so there are no sections
+					interpolate(zero_value);
+				}
+				else if(is_data_point) {
+					interpolate_section(prev, index);
+					interpolate_section(index, next);
+				}
+				else {
+					interpolate_section(prev, next);
+				}
+			}
+			break;
+		case V_SQL_FILL_MODE_OFF:
+			if(!is_data_point) {
+				m_cfg.m_value[index] = zero_value;
+			}
+			break;
+		}
+	}
 
 	///////////////////////////////////////////////////////////////////////////////
 	// create interpolated points between all user data points in pattern
@@ -70,7 +247,7 @@ private:
 		int first_waypoint = -1;
 		int prev_waypoint = -1;
 		for(i=0; i<MAX_STEPS; ++i) {
-			if(m_cfg.m_step[i].is(CSequenceStep::DATA_POINT)) {
+			if(is(i, CSequenceStep::DATA_POINT)) {
 				if(prev_waypoint < 0) {
 					first_waypoint = i;
 				}
@@ -83,17 +260,11 @@ private:
 
 		if(first_waypoint < 0) {
 			// no waypoints defined
-			for(i=0; i<MAX_STEPS; ++i) {
-				m_cfg.m_step[i].set_value(value);
-			}
+			CBulkValues::fill(m_cfg.m_value_word, 0xFFFFFFFFU, value);
 		}
 		else if(prev_waypoint == first_waypoint) {
 			// only one waypoint defined
-			for(i=0; i<MAX_STEPS; ++i) {
-				if(i!=prev_waypoint) {
-					m_cfg.m_step[i].set_value(m_cfg.m_step[first_waypoint].get_value());
-				}
-			}
+			CBulkValues::fill(m_cfg.m_value_word, ~bit(first_waypoint), m_cfg.m_value[first_waypoint]);
 		}
 		else {
 			// multiple waypoints defined
@@ -102,40 +273,42 @@ private:
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
+	// each data point value carries on up to the next data point, with the
+	// last one wrapping round to the start of the page
 	void pad(byte value)
 	{
-		int i;
+		uint32_t data_points = m_cfg.m_point[CSequenceStep::DATA_POINT];
+		if(!data_points) {
+			CBulkValues::fill(m_cfg.m_value_word, 0xFFFFFFFFU, value);
+			return;
+		}
 		int first_data_point = -1;
-		for(i=0; i<MAX_STEPS; ++i) {
-			if(m_cfg.m_step[i].is(CSequenceStep::DATA_POINT)) {
-				if(first_data_point < 0) {
+		int prev = -1;
+		for(int i=0; i<MAX_STEPS; ++i) {
+			if(data_points & bit(i)) {
+				if(prev < 0) {
 					first_data_point = i;
 				}
-				value = m_cfg.m_step[i].get_value();
-			}
-			else {
-				m_cfg.m_step[i].set_value(value);
-			}
-		}
-		if(first_data_point >= 0) {
-			for(i=0; i<first_data_point; ++i) {
-				m_cfg.m_step[i].set_value(value);
+				else if(i > prev + 1) {
+					CBulkValues::fill(m_cfg.m_value_word, range_mask(prev+1, i-1), m_cfg.m_value[prev]);
+				}
+				prev = i;
 			}
 		}
+		CBulkValues::fill(m_cfg.m_value_word,
+			range_mask(prev+1, MAX_STEPS-1) | range_mask(0, first_data_point-1),
+			m_cfg.m_value[prev]);
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
 	void zero_fill(byte zero_value)
 	{
-		for(int i=0; i<MAX_STEPS; ++i) {
-			if(!m_cfg.m_step[i].is(CSequenceStep::DATA_POINT)) {
-				m_cfg.m_step[i].set_value(zero_value);
-			}
-		}
+		CBulkValues::fill(m_cfg.m_value_word, ~m_cfg.m_point[CSequenceStep::DATA_POINT], zero_value);
 	}
 
 public:
 	CSequencePage() {
+		clear_steps(m_cfg);
 		m_cfg.m_loop_from = DEFAULT_LOOP_FROM;
 		m_cfg.m_loop_to = DEFAULT_LOOP_TO;
 	}
@@ -158,34 +331,47 @@ public:
 	///////////////////////////////////////////////////////////////////////////////
 	inline CSequenceStep get_step(int index) {
 		ASSERT(index>=0 && index < MAX_STEPS);
-		return m_cfg.m_step[index];
+		CSequenceStep step;
+		step.m_gate.m_trig = is(index, CSequenceStep::TRIG_POINT);
+		step.m_gate.m_tie = is(index, CSequenceStep::TIE_POINT);
+		step.m_gate.m_accent = is(index, CSequenceStep::ACCENT_POINT);
+		step.m_gate.m_ignore = is(index, CSequenceStep::IGNORE_POINT);
+		step.m_gate.m_prob = m_cfg.m_prob_retrig[index] & 0x0F;
+		step.m_gate.m_retrig = m_cfg.m_prob_retrig[index] >> 4;
+		step.m_cv.m_value = m_cfg.m_value[index];
+		step.m_cv.m_is_data_point = is(index, CSequenceStep::DATA_POINT);
+		return step;
 	}
 
 
 	///////////////////////////////////////////////////////////////////////////////
 	void set_step(byte index, CSequenceStep& source, V_SQL_FILL_MODE fill_mode, byte zero_value, CSequenceStep::DATA what, byte auto_data_point) {
 		ASSERT(index>=0 && index < MAX_STEPS);
-		CSequenceStep& dest = m_cfg.m_step[index];
+		CSequenceStep dest = get_step(index);
 
 		// see if we might need to promote a fill point to a data point so that it can retain its value
 		if(auto_data_point && (what&CSequenceStep::CV_DATA) && (source.get_value() != dest.get_value())) {
 			// create a new data point
 			dest.copy(source, what);
 			dest.set(CSequenceStep::DATA_POINT, 1);
-			recalc(fill_mode, zero_value);
+			put_step(m_cfg, index, dest);
+			recalc_step(index, fill_mode, zero_value);
 		}
 		else {
 			// paste the new step value and recalc fill points
 			dest.copy(source, what);
-			recalc(fill_mode, zero_value);
+			put_step(m_cfg, index, dest);
+			recalc_step(index, fill_mode, zero_value);
 		}
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
 	void clear_step(byte index, V_SQL_FILL_MODE fill_mode, byte zero_value, CSequenceStep::DATA what) {
 		ASSERT(index>=0 && index < MAX_STEPS);
-		m_cfg.m_step[index].clear(what);
-		recalc(fill_mode, zero_value);
+		CSequenceStep step = get_step(index);
+		step.clear(what);
+		put_step(m_cfg, index, step);
+		recalc_step(index, fill_mode, zero_value);
 	}
 
 	///////////////////////////////////////////////////////////////////////////////
@@ -200,9 +386,7 @@ public:
 
 	///////////////////////////////////////////////////////////////////////////////
 	void clear(byte zero_value, byte loop_from, byte loop_to) {
-		for(int i=0; i<MAX_STEPS; ++i) {
-			m_cfg.m_step[i].clear(CSequenceStep::ALL_DATA);
-		}
+		clear_steps(m_cfg);
 		recalc(V_SQL_FILL_MODE_OFF, zero_value);
 		m_cfg.m_loop_from = loop_from;
 		m_cfg.m_loop_to = loop_to;
@@ -210,46 +394,34 @@ public:
 
 	///////////////////////////////////////////////////////////////////////////////
 	// shift pattern vertically up or down by one space
+	// (points that would go out of range stay where they are)
 	byte shift_vertical(int dir, CScale *scale, V_SQL_FILL_MODE fill_mode, byte zero_value, byte allow_clip) {
-		int value[MAX_STEPS];
-		byte changed = 0;
-		for(int i=0; i<MAX_STEPS; ++i) {
-			if(m_cfg.m_step[i].is(CSequenceStep::DATA_POINT)) {
-				value[i] = m_cfg.m_step[i].get_value();
-				if(scale) {
-					if(scale->inc_note_in_scale(value[i],dir)) {
-						changed = 1;
-					}
-					else if(!allow_clip) {
-						return 0;
-					}
-				}
-				else {
-					int new_value = value[i] + dir;
-					if(new_value >= 0 && new_value <= 127) {
-						value[i] = new_value;
-						changed = 1;
-					}
-					else if(!allow_clip) {
-						return 0;
-					}
-				}
-			}
-			else {
-				value[i] = 0;
-			}
+		uint32_t data_points = m_cfg.m_point[CSequenceStep::DATA_POINT];
+		uint32_t value[CBulkValues::NUM_WORDS];
+		uint32_t clipped;
+		memcpy(value, m_cfg.m_value_word, sizeof value);
+		if(scale) {
+			// move through the scale indexes, putting back any points that
+			// hit the end of the scale since they might not be in the scale
+			CBulkValues::map(value, data_points, scale->get_note_to_index());
+			clipped = CBulkValues::add(value, data_points, dir, scale->max_index());
+			CBulkValues::map(value, data_points, scale->get_index_to_note());
+			CBulkValues::copy(value, m_cfg.m_value_word, clipped);
+		}
+		else {
+			clipped = CBulkValues::add(value, data_points, dir, CSequenceStep::VALUE_MAX);
 		}
 
 		// any point changed?
-		if(!changed) {
+		if(clipped && !allow_clip) {
 			return 0;
 		}
-
-		// perform the actual shift of all the data points
-		for(int i = 0; i<MAX_STEPS; ++i) {
-			m_cfg.m_step[i].set_value(value[i]);
+		if(!(data_points & ~clipped)) {
+			return 0;
 		}
 
+		// perform the actual shift of all the data points
+		CBulkValues::copy(m_cfg.m_value_word, value, data_points);
 		recalc(fill_mode, zero_value);
 		return 1;
 	}
@@ -258,20 +430,26 @@ public:
 	///////////////////////////////////////////////////////////////////////////////
 	// shift pattern horizontally by one step
 	void shift_horizontal(int dir) {
-		CSequenceStep step;
+		for(int type = 0; type < CSequenceStep::NUM_POINT_TYPES; ++type) {
+			m_cfg.m_point[type] = rotate(m_cfg.m_point[type], dir, 1);
+		}
+		byte value;
+		byte prob_retrig;
 		if(dir<0) {
-			step = m_cfg.m_step[0];
-			for(int i = 0; i<MAX_STEPS-1; ++i) {
-				m_cfg.m_step[i] = m_cfg.m_step[i+1];
-			}
-			m_cfg.m_step[MAX_STEPS-1] = step;
+			value = m_cfg.m_value[0];
+			prob_retrig = m_cfg.m_prob_retrig[0];
+			memmove(&m_cfg.m_value[0], &m_cfg.m_value[1], MAX_STEPS-1);
+			memmove(&m_cfg.m_prob_retrig[0], &m_cfg.m_prob_retrig[1], MAX_STEPS-1);
+			m_cfg.m_value[MAX_STEPS-1] = value;
+			m_cfg.m_prob_retrig[MAX_STEPS-1] = prob_retrig;
 		}
 		else {
-			step = m_cfg.m_step[MAX_STEPS-1];
-			for(int i = MAX_STEPS-1; i>0; --i) {
-				m_cfg.m_step[i] = m_cfg.m_step[i-1];
-			}
-			m_cfg.m_step[0] = step;
+			value = m_cfg.m_value[MAX_STEPS-1];
+			prob_retrig = m_cfg.m_prob_retrig[MAX_STEPS-1];
+			memmove(&m_cfg.m_value[1], &m_cfg.m_value[0], MAX_STEPS-1);
+			memmove(&m_cfg.m_prob_retrig[1], &m_cfg.m_prob_retrig[0], MAX_STEPS-1);
+			m_cfg.m_value[0] = value;
+			m_cfg.m_prob_retrig[0] = prob_retrig;
 		}
 	}
 
@@ -280,8 +458,8 @@ public:
 		int sum = 0;
 		int count = 0;
 		for(int i = 0; i<MAX_STEPS-1; ++i) {
-			if(m_cfg.m_step[i].is(CSequenceStep::DATA_POINT)) {
-				sum += m_cfg.m_step[i].get_value();
+			if(is(i, CSequenceStep::DATA_POINT)) {
+				sum += m_cfg.m_value[i];
 				++count;
 			}
 		}
@@ -290,78 +468,91 @@ public:
 
 	/////////////////////////////////////////////////////////////////////////////////////////////
 	byte any_of(CSequenceStep::POINT_TYPE type, int from=0, int to=MAX_STEPS-1) {
-		while(from<to && from < MAX_STEPS) {
-			if(m_cfg.m_step[from].is(type)) {
-				return 1;
-			}
-			++from;
-		}
-		return 0;
+		// NB: the step at "to" is not included
+		return !!(m_cfg.m_point[type] & range_mask(from, to-1));
 	}
 
 	/////////////////////////////////////////////////////////////////////////////////////////////
 	int count_of(CSequenceStep::POINT_TYPE type, int from=0, int to=MAX_STEPS-1) {
-		int count = 0;
-		while(from<=to && from < MAX_STEPS) {
-			if(m_cfg.m_step[from].is(type)) {
-				++count;
+		return popcount(m_cfg.m_point[type] & range_mask(from, to));
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////////////////
+	// steps with a type of point, in display row order
+	inline uint32_t get_mask(CSequenceStep::POINT_TYPE type) {
+		return m_cfg.m_point[type];
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////////////////
+	// steps with a probability, or with retrig, in display row order
+	uint32_t get_prob_mask() {
+		uint32_t mask = 0;
+		for(int i=0; i<MAX_STEPS; ++i) {
+			if(m_cfg.m_prob_retrig[i] & 0x0F) {
+				mask |= bit(i);
 			}
-			++from;
 		}
-		return count;
+		return mask;
+	}
+	uint32_t get_retrig_mask() {
+		uint32_t mask = 0;
+		for(int i=0; i<MAX_STEPS; ++i) {
+			if(m_cfg.m_prob_retrig[i] & 0xF0) {
+				mask |= bit(i);
+			}
+		}
+		return mask;
 	}
 
 	/////////////////////////////////////////////////////////////////////////////////////////////
 	void add_noise(int seed, int level, byte default_value, V_SQL_FILL_MODE fill_mode, byte zero_value) {
-		int old_seed = rand();
-		srand(seed);
+		CPrng prng(seed);
+		union {
+			byte b[MAX_STEPS];
+			uint32_t w[CBulkValues::NUM_WORDS];
+		} up, down, value;
 		for(int i=0; i<MAX_STEPS; ++i) {
-
-			CSequenceStep& step = m_cfg.m_step[i];
-			int value = step.get_value();
-			value += (level * ((rand()&255)-(rand()&255)))/(255);
-			if(value<0) {
-				value = 0;
-			}
-			if(value>127) {
-				value = 127;
-			}
-			if(step.get_value() != value) {
-				step.set(CSequenceStep::DATA_POINT, 1);
-				step.set_value(value);
-			}
+			int noise = prng.next() & 255;
+			noise -= prng.next() & 255;
+			int delta = (level * noise)/(255);
+			up.b[i] = (delta > 0)? ((delta > 127)? 127 : delta) : 0;
+			down.b[i] = (delta < 0)? ((delta < -127)? 127 : -delta) : 0;
 		}
+		memcpy(value.w, m_cfg.m_value_word, sizeof value.w);
+		CBulkValues::add(value.w, up.w, down.w);
+
+		// any step whose value changes becomes a data point
+		m_cfg.m_point[CSequenceStep::DATA_POINT] |= CBulkValues::diff(value.w, m_cfg.m_value_word);
+		memcpy(m_cfg.m_value_word, value.w, sizeof value.w);
 		recalc(fill_mode, zero_value);
-		srand(old_seed);
 	}
 
 	/////////////////////////////////////////////////////////////////////////////////////////////
 	void randomise(int seed, byte default_value, V_SQL_FILL_MODE fill_mode, byte zero_value) {
-		int old_seed = rand();
-		srand(seed);
+		CPrng prng(seed);
+		clear_steps(m_cfg);
 		for(int i=0; i<MAX_STEPS; ++i) {
-			CSequenceStep& step = m_cfg.m_step[i];
-			step.clear(CSequenceStep::ALL_DATA);
-			if((rand()%10)<5) {
-				step.set_value(default_value+(rand()%12)-(rand()%12));
-				step.set(CSequenceStep::DATA_POINT, 1);
+			if(prng.range(10)<5) {
+				int value = default_value + prng.range(12);
+				value -= prng.range(12);
+				m_cfg.m_value[i] = value & CSequenceStep::VALUE_MAX;
+				m_cfg.m_point[CSequenceStep::DATA_POINT] |= bit(i);
 			}
-			if((rand()%10)<2) {
-				step.set(CSequenceStep::TRIG_POINT, 1);
+			if(prng.range(10)<2) {
+				m_cfg.m_point[CSequenceStep::TRIG_POINT] |= bit(i);
 			}
-			if((rand()%10)<2) {
-				step.set(CSequenceStep::TIE_POINT, 1);
+			if(prng.range(10)<2) {
+				m_cfg.m_point[CSequenceStep::TIE_POINT] |= bit(i);
 			}
 		}
 		recalc(fill_mode, zero_value);
-		srand(old_seed);
 	}
 
 
 	/////////////////////////////////////////////////////////////////////////////////////////////
 	void replace_gates(int onsets, int positions, int column) {
 
-		if(positions<0 || onsets<0) {
+		if(positions<=0 || onsets<0) {
 			return;
 		}
 
@@ -376,21 +567,25 @@ public:
 			}
 		}
 
-		// copy into the page, starting at the provided
-		// column position and repeating the same pattern
-		// until all columns in the page have been filled
+		// repeat the same pattern until all columns in the page have
+		// been filled, then rotate it round to the provided column
+		uint32_t mask = 0;
 		int source = positions-1;
 		for(int i=0; i<MAX_STEPS; ++i) {
-			CSequenceStep& step = m_cfg.m_step[column];
-			step.clear(CSequenceStep::GATE_DATA);
-			step.set(CSequenceStep::TRIG_POINT, trigs[source]);
-			if(++column >= MAX_STEPS) {
-				column = 0;
+			if(trigs[source]) {
+				mask |= bit(i);
 			}
 			if(++source >= positions) {
 				source = 0;
 			}
 		}
+
+		// the pattern replaces all gate information
+		m_cfg.m_point[CSequenceStep::TRIG_POINT] = rotate(mask, 1, column);
+		m_cfg.m_point[CSequenceStep::TIE_POINT] = 0;
+		m_cfg.m_point[CSequenceStep::ACCENT_POINT] = 0;
+		m_cfg.m_point[CSequenceStep::IGNORE_POINT] = 0;
+		memset(m_cfg.m_prob_retrig, 0, sizeof m_cfg.m_prob_retrig);
 	}
 
 	/////////////////////////////////////////////////////////////////////////////////////////////
@@ -399,7 +594,7 @@ public:
 	}
 
 	/////////////////////////////////////////////////////////////////////////////////////////////
-	static int get_cfg_size() {
+	static constexpr int get_cfg_size() {
 		return sizeof(CONFIG);
 	}
 
@@ -415,6 +610,129 @@ public:
 		(*src) += sizeof m_cfg;
 	}
 
+	/////////////////////////////////////////////////////////////////////////////////////////////
+	// Write the page to a packed patch:
+	//   loop from (5), loop to (5)
+	//   for each point type (data, trig, tie, accent, ignore) a flag (1), then
+	//     a mask of the steps with that point (32) if the flag is set
+	//   a flag (1), then if set a mask of the steps which have probability or
+	//     retrig (32) followed by probability (4) and retrig (4) for those steps
+	//   a flag (1), then either the value of each step (7) when clear, or runs
+	//     of the same value when set: run length less one (5), value (7)
+	void encode(CPatchWriter& w) {
+		w.put(m_cfg.m_loop_from, 5);
+		w.put(m_cfg.m_loop_to, 5);
+		for(int type = 0; type < CSequenceStep::NUM_POINT_TYPES; ++type) {
+			uint32_t mask = reverse_bits(m_cfg.m_point[type]);
+			w.put(!!mask, 1);
+			if(mask) {
+				w.put32(mask);
+			}
+		}
+
+		uint32_t mask = reverse_bits(get_prob_mask() | get_retrig_mask());
+		w.put(!!mask, 1);
+		if(mask) {
+			w.put32(mask);
+			for(int i=0; i<MAX_STEPS; ++i) {
+				if(mask & (1UL<<i)) {
+					w.put(m_cfg.m_prob_retrig[i] & 0x0F, 4);
+					w.put(m_cfg.m_prob_retrig[i] >> 4, 4);
+				}
+			}
+		}
+
+		int runs = 1;
+		for(int i=1; i<MAX_STEPS; ++i) {
+			if(m_cfg.m_value[i] != m_cfg.m_value[i-1]) {
+				++runs;
+			}
+		}
+		if(runs * 12 < MAX_STEPS * 7) {
+			w.put(1, 1);
+			int start = 0;
+			for(int i=1; i<=MAX_STEPS; ++i) {
+				if(i == MAX_STEPS || m_cfg.m_value[i] != m_cfg.m_value[start]) {
+					w.put(i - start - 1, 5);
+					w.put(m_cfg.m_value[start], 7);
+					start = i;
+				}
+			}
+		}
+		else {
+			w.put(0, 1);
+			for(int i=0; i<MAX_STEPS; ++i) {
+				w.put(m_cfg.m_value[i], 7);
+			}
+		}
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////////////////
+	// Read a page written by encode() into a native cfg image
+	static void decode(CPatchReader& r, byte *dest) {
+		CONFIG cfg;
+		memset(&cfg, 0, sizeof cfg);
+		clear_steps(cfg);
+		cfg.m_loop_from = r.get(5);
+		cfg.m_loop_to = r.get(5);
+		for(int type = 0; type < CSequenceStep::NUM_POINT_TYPES; ++type) {
+			if(r.get(1)) {
+				cfg.m_point[type] = reverse_bits(r.get32());
+			}
+		}
+
+		if(r.get(1)) {
+			uint32_t mask = r.get32();
+			for(int i=0; i<MAX_STEPS; ++i) {
+				if(mask & (1UL<<i)) {
+					byte prob = r.get(4);
+					byte retrig = r.get(4);
+					cfg.m_prob_retrig[i] = prob | (retrig << 4);
+					if(retrig) {
+						// a step with retrig is always a trig point
+						cfg.m_point[CSequenceStep::TRIG_POINT] |= bit(i);
+					}
+				}
+			}
+		}
+
+		if(r.get(1)) {
+			int pos = 0;
+			while(pos < MAX_STEPS && !r.is_error()) {
+				int len = r.get(5) + 1;
+				byte value = r.get(7);
+				if(pos + len > MAX_STEPS) {
+					len = MAX_STEPS - pos;
+				}
+				while(len--) {
+					cfg.m_value[pos++] = value;
+				}
+			}
+		}
+		else {
+			for(int i=0; i<MAX_STEPS; ++i) {
+				cfg.m_value[i] = r.get(7);
+			}
+		}
+		memcpy(dest, &cfg, sizeof cfg);
+	}
+
+	/////////////////////////////////////////////////////////////////////////////////////////////
+	// Read a page from a version 1 patch (raw steps then the loop points)
+	static void decode_v1(CPatchReader& r, byte *dest) {
+		CONFIG cfg;
+		memset(&cfg, 0, sizeof cfg);
+		clear_steps(cfg);
+		for(int i=0; i<MAX_STEPS; ++i) {
+			CSequenceStep step;
+			step.decode_v1(r);
+			put_step(cfg, i, step);
+		}
+		cfg.m_loop_from = r.get_max(8, MAX_STEPS);
+		cfg.m_loop_to = r.get_max(8, MAX_STEPS);
+		memcpy(dest, &cfg, sizeof cfg);
+	}
+
 };
 
 #define SEQUENCE_PAGE_H_
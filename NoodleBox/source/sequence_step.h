@@ -25,6 +25,7 @@
 // layer type
 //
 class CSequenceStep {
+	friend class CSequencePage;	// which stores steps in its own packed form
 
 	typedef struct {
 		byte m_trig:1;
@@ -47,6 +48,7 @@ public:
 		VALUE_MAX = 127,
 		PROB_MAX = 15,
 		RETRIG_MAX = 15,
+		NUM_POINT_TYPES = 5
 	};
 
 	typedef enum: byte {
@@ -165,6 +167,21 @@ public:
 		}
 	}
 
+	///////////////////////////////////////////////////////////////////////////////////
+	// read a step from a version 1 patch, where steps are stored as the raw
+	// bitfields laid out by the ARM build (gate in two bytes then cv)
+	void decode_v1(CPatchReader& r) {
+		m_gate.m_trig = r.get(1);
+		m_gate.m_tie = r.get(1);
+		m_gate.m_accent = r.get(1);
+		m_gate.m_prob = r.get(4);
+		r.get(1);
+		m_gate.m_retrig = r.get(4);
+		m_gate.m_ignore = r.get(1);
+		r.get(3);
+		m_cv.m_value = r.get(7);
+		m_cv.m_is_data_point = r.get(1);
+	}
 };
 
 #endif /* SEQUENCE_STEP_H_ */
@@ -0,0 +1,59 @@
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// HOST BUILD REPLACEMENT FOR CMSIS cmsis_gcc.h
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+#ifndef CMSIS_HOST_H_
+#define CMSIS_HOST_H_
+
+//
+// Included ahead of everything else in the host test build (-include). It
+// takes the place of cmsis_gcc.h, whose intrinsics are ARM instructions, by
+// defining its include guard and giving host versions of what the firmware
+// and the SDK headers use. The interrupt mask is just a variable
+//
+#define __CMSIS_GCC_H
+
+#include <stdint.h>
+
+#define __ASM						__asm
+#define __INLINE					inline
+#define __STATIC_INLINE				static inline
+#define __STATIC_FORCEINLINE		static inline
+#define __NO_RETURN					__attribute__((__noreturn__))
+#define __USED						__attribute__((used))
+#define __WEAK						__attribute__((weak))
+#define __PACKED					__attribute__((packed, aligned(1)))
+#define __PACKED_STRUCT				struct __attribute__((packed, aligned(1)))
+#define __PACKED_UNION				union __attribute__((packed, aligned(1)))
+#define __ALIGNED(x)				__attribute__((aligned(x)))
+#define __RESTRICT					__restrict
+#define __COMPILER_BARRIER()		__asm volatile("" ::: "memory")
+
+#define __NOP()						((void)0)
+#define __WFI()						((void)0)
+#define __WFE()						((void)0)
+#define __SEV()						((void)0)
+#define __ISB()						__COMPILER_BARRIER()
+#define __DSB()						__COMPILER_BARRIER()
+#define __DMB()						__COMPILER_BARRIER()
+#define __BKPT(value)				__builtin_trap()
+#define __CLZ(x)					((uint8_t)__builtin_clz(x))
+#define __REV(x)					__builtin_bswap32(x)
+
+extern volatile uint32_t g_host_primask;
+
+__STATIC_INLINE void __enable_irq(void) {
+	g_host_primask = 0;
+}
+__STATIC_INLINE void __disable_irq(void) {
+	g_host_primask = 1;
+}
+__STATIC_INLINE uint32_t __get_PRIMASK(void) {
+	return g_host_primask;
+}
+__STATIC_INLINE void __set_PRIMASK(uint32_t primask) {
+	g_host_primask = primask;
+}
+
+#endif /* CMSIS_HOST_H_ */
@@ -0,0 +1,224 @@
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// HOST TEST HARNESS
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+#ifndef HOST_H_
+#define HOST_H_
+
+//
+// Each test is a single translation unit, like the firmware itself (see
+// main.cpp). This header pulls in the SDK and the firmware headers in the
+// same order as main.cpp, then provides what main.cpp and the SDK driver
+// sources would normally provide:
+//
+// - The peripheral register blocks are backed by ordinary memory mapped at
+//   their real addresses before any constructors run. Code that touches the
+//   hardware reads and writes that memory, and tests can read it back (for
+//   example the bytes written to the UART data register)
+// - SDK driver functions that the firmware calls are stubbed out
+// - The glue that main.cpp provides (event dispatch, MIDI callbacks) is
+//   cut down to the transport and load/save events that the engine handles,
+//   since the editor and menus are not built
+//
+// The interrupt mask is a variable (see cmsis_host.h) and time only moves
+// when a test calls host_tick_ms()
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "board.h"
+#include "peripherals.h"
+#include "pin_mux.h"
+#include "clock_config.h"
+#include "MKE04Z1284.h"
+#include "fsl_clock.h"
+#include "fsl_spi.h"
+#include "fsl_pit.h"
+#include "fsl_common.h"
+#include "fsl_kbi.h"
+#include "fsl_gpio.h"
+#include "fsl_i2c.h"
+#include "fsl_uart.h"
+
+#include "defs.h"
+#include "event_queue.h"
+#include "digital_out.h"
+#include "chars.h"
+#include "ui_driver.h"
+#include "leds.h"
+#include "midi.h"
+#include "clock.h"
+#include "patch_format.h"
+#include "i2c_bus.h"
+#include "popup.h"
+#include "scale.h"
+#include "outs.h"
+#include "gate_scheduler.h"
+#include "prng.h"
+#include "bulk_values.h"
+#include "sequence_step.h"
+#include "sequence_page.h"
+#include "sequence_layer.h"
+#include "patch_cache.h"
+#include "sequence.h"
+#include "autosave.h"
+#include "metrics.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// PERIPHERAL MEMORY
+volatile uint32_t g_host_primask = 0;
+
+__attribute__((constructor(101))) static void host_map_peripherals() {
+	static const struct {
+		uintptr_t base;
+		size_t size;
+	} region[] = {
+		{ 0x40000000U, 0x00100000U },	// peripheral bridge and GPIO
+		{ 0xE0000000U, 0x00100000U },	// system control space
+		{ 0xF0000000U, 0x00010000U },	// ROM table and MCM
+		{ 0xF8000000U, 0x00001000U }	// fast GPIO
+	};
+	for(unsigned int i=0; i<sizeof(region)/sizeof(region[0]); ++i) {
+		void *p = mmap((void*)region[i].base, region[i].size, PROT_READ|PROT_WRITE,
+				MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED_NOREPLACE, -1, 0);
+		if(p != (void*)region[i].base) {
+			fprintf(stderr, "cannot map peripheral memory at %08lx\n", (unsigned long)region[i].base);
+			exit(2);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SDK DRIVER STUBS
+extern "C" {
+uint32_t CLOCK_GetBusClkFreq(void) {
+	return BOARD_BOOTCLOCKRUN_CORE_CLOCK / 2;
+}
+uint32_t CLOCK_GetTimerClkFreq(void) {
+	return BOARD_BOOTCLOCKRUN_CORE_CLOCK;
+}
+void PIT_Init(PIT_Type *base, const pit_config_t *config) {
+}
+void KBI_Init(KBI_Type *base, kbi_config_t *configure) {
+}
+void GPIO_PinInit(gpio_port_num_t port, uint8_t pin, const gpio_pin_config_t *config) {
+}
+void GPIO_PinWrite(gpio_port_num_t port, uint8_t pin, uint8_t output) {
+}
+void UART_EnableInterrupts(UART_Type *base, uint32_t mask) {
+}
+void UART_DisableInterrupts(UART_Type *base, uint32_t mask) {
+}
+uint32_t UART_GetStatusFlags(UART_Type *base) {
+	return kUART_TxDataRegEmptyFlag;
+}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FIRMWARE GLUE (see main.cpp)
+uint32_t g_first_output_ms = 0;
+uint32_t g_boot_ms = 0;
+
+void fire_event(int event, uint32_t param) {
+	g_event_queue.post(event, param);
+}
+
+void handle_event(int event, uint32_t param) {
+	switch(event) {
+	case EV_SEQ_STOP:
+	case EV_SEQ_RESTART:
+	case EV_SEQ_CONTINUE:
+	case EV_SEQ_SONG_POS:
+	case EV_CLOCK_RESET:
+	case EV_REAPPLY_CONFIG:
+	case EV_SAVE_OK:
+	case EV_LOAD_OK:
+		g_clock.event(event, param);
+		g_gate_scheduler.event(event, param);
+		g_outs.event(event, param);
+		g_sequence.event(event, param);
+		break;
+	default:
+		break;
+	}
+}
+
+void fire_note(byte midi_note, byte midi_vel) {
+}
+
+void force_full_repaint() {
+}
+
+uint32_t midi::get_timestamp() {
+	return g_clock.get_us();
+}
+
+void midi::handle_realtime(byte ch, uint32_t us) {
+	clock::g_midi_clock_in.on_midi_realtime(ch, us);
+}
+
+void midi::handle_song_position(uint16_t pos) {
+	clock::g_midi_clock_in.on_midi_song_position(pos);
+}
+
+// tests can watch the notes that CMidi::run() passes on
+void (*g_host_note_handler)(byte chan, byte note, byte vel) = nullptr;
+void midi::handle_note(byte chan, byte note, byte vel) {
+	if(g_host_note_handler) {
+		g_host_note_handler(chan, note, vel);
+	}
+}
+
+void midi::handle_nrpn(byte nrpn_hi, byte nrpn_lo, byte value_hi, byte value_lo) {
+	g_metrics.handle_nrpn(nrpn_hi, nrpn_lo);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Set up the clock as main() does
+void host_init() {
+	g_clock.init();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Move time on by one ms, as the PIT interrupt would, with the fine timer
+// having counted through the ms before it
+void host_tick_ms() {
+	FTM1->CNT = (uint16_t)(FTM1->CNT + g_clock.get_fine_per_ms());
+	PIT_CH0_IRQHandler();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CHECKS
+static int g_host_failures = 0;
+
+#define CHECK(cond) do { \
+		if(!(cond)) { \
+			printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+			++g_host_failures; \
+		} \
+	} while(0)
+
+#define CHECK_EQUAL(expected, actual) do { \
+		long long host_e = (long long)(expected); \
+		long long host_a = (long long)(actual); \
+		if(host_e != host_a) { \
+			printf("%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, host_a, host_e); \
+			++g_host_failures; \
+		} \
+	} while(0)
+
+///////////////////////////////////////////////////////////////////////////////
+// Return value for main()
+int test_result(const char *name) {
+	if(g_host_failures) {
+		printf("%s: %d check(s) failed\n", name, g_host_failures);
+		return 1;
+	}
+	printf("%s: ok\n", name);
+	return 0;
+}
+
+#endif /* HOST_H_ */
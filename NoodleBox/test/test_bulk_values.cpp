@@ -0,0 +1,181 @@
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// TEST: BULK STEP VALUE TRANSFORMS (CBulkValues)
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+#include "host.h"
+
+enum {
+	MAX_STEPS = CSequencePage::MAX_STEPS
+};
+
+// a page of values as bytes (one per step) and as words
+typedef union {
+	byte b[MAX_STEPS];
+	uint32_t w[CBulkValues::NUM_WORDS];
+} VALUES;
+
+static CPrng g_prng(1);
+
+///////////////////////////////////////////////////////////////////////////////
+static uint32_t bit(int index) {
+	return 0x80000000U >> index;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void random_values(VALUES& v) {
+	for(int i=0; i<MAX_STEPS; ++i) {
+		v.b[i] = g_prng.range(128);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static uint32_t random_plane() {
+	switch(g_prng.range(4)) {
+	case 0:
+		return 0;
+	case 1:
+		return 0xFFFFFFFFU;
+	default:
+		return g_prng.next();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static bool same(const VALUES& a, const VALUES& b) {
+	return !memcmp(a.b, b.b, MAX_STEPS);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Only the selected steps are filled or copied
+static void test_fill_copy() {
+	for(int trial=0; trial<10000; ++trial) {
+		VALUES v, src, expected;
+		random_values(v);
+		random_values(src);
+		uint32_t plane = random_plane();
+		byte value = g_prng.range(128);
+
+		expected = v;
+		for(int i=0; i<MAX_STEPS; ++i) {
+			if(plane & bit(i)) {
+				expected.b[i] = value;
+			}
+		}
+		CBulkValues::fill(v.w, plane, value);
+		CHECK(same(expected, v));
+
+		for(int i=0; i<MAX_STEPS; ++i) {
+			if(plane & bit(i)) {
+				expected.b[i] = src.b[i];
+			}
+		}
+		CBulkValues::copy(v.w, src.w, plane);
+		CHECK(same(expected, v));
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The plane of differences has a bit for each step whose value differs,
+// however small the difference
+static void test_diff() {
+	for(int trial=0; trial<10000; ++trial) {
+		VALUES a, b;
+		random_values(a);
+		b = a;
+		uint32_t plane = random_plane();
+		for(int i=0; i<MAX_STEPS; ++i) {
+			if(plane & bit(i)) {
+				b.b[i] = (a.b[i] + 1 + g_prng.range(127)) & 0x7F;
+			}
+		}
+		CHECK_EQUAL(plane, CBulkValues::diff(a.w, b.w));
+		CHECK_EQUAL(plane, CBulkValues::diff(b.w, a.w));
+		CHECK_EQUAL(0, CBulkValues::diff(a.w, a.w));
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Adding to the selected steps clamps each to 0..max and reports the steps
+// that were clamped, for every delta and maximum
+static void test_add() {
+	for(int delta=-127; delta<=127; ++delta) {
+		for(int max=0; max<=127; ++max) {
+			VALUES v, expected;
+			random_values(v);
+			uint32_t plane = random_plane();
+			expected = v;
+			uint32_t expected_clipped = 0;
+			for(int i=0; i<MAX_STEPS; ++i) {
+				if(plane & bit(i)) {
+					int x = v.b[i] + delta;
+					if(x < 0 || x > max) {
+						expected_clipped |= bit(i);
+						x = (x < 0)? 0 : max;
+					}
+					expected.b[i] = x;
+				}
+			}
+			uint32_t clipped = CBulkValues::add(v.w, plane, delta, max);
+			if(clipped != expected_clipped || !same(expected, v)) {
+				printf("add %d with a maximum of %d\n", delta, max);
+				++g_host_failures;
+				return;
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Adding up[] then subtracting down[] clamps at each end
+static void test_add_up_down() {
+	for(int trial=0; trial<10000; ++trial) {
+		VALUES v, up, down, expected;
+		random_values(v);
+		for(int i=0; i<MAX_STEPS; ++i) {
+			up.b[i] = g_prng.range(2)? g_prng.range(128) : 0;
+			down.b[i] = g_prng.range(2)? g_prng.range(128) : 0;
+			int x = v.b[i] + up.b[i];
+			if(x > 127) {
+				x = 127;
+			}
+			x -= down.b[i];
+			expected.b[i] = (x < 0)? 0 : x;
+		}
+		CBulkValues::add(v.w, up.w, down.w);
+		CHECK(same(expected, v));
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Only the selected steps are looked up in the table
+static void test_map() {
+	byte table[128];
+	for(int trial=0; trial<10000; ++trial) {
+		for(int i=0; i<128; ++i) {
+			table[i] = g_prng.range(128);
+		}
+		VALUES v, expected;
+		random_values(v);
+		uint32_t plane = random_plane();
+		expected = v;
+		for(int i=0; i<MAX_STEPS; ++i) {
+			if(plane & bit(i)) {
+				expected.b[i] = table[v.b[i]];
+			}
+		}
+		CBulkValues::map(v.w, plane, table);
+		CHECK(same(expected, v));
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main() {
+	host_init();
+	test_fill_copy();
+	test_diff();
+	test_add();
+	test_add_up_down();
+	test_map();
+	return test_result("bulk_values");
+}
@@ -0,0 +1,475 @@
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// TEST: EEPROM SAVES, AUTOSAVE AND DAC LATENCY (CI2CEeprom, CAutosave, CI2CBus)
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+#include "host.h"
+#include <new>
+
+//
+// The EEPROM is simulated behind the SDK I2C transfer functions. A transfer
+// is completed (and the bus callback called) by the next call to
+// CEepromSim::complete(), as the I2C interrupt would do later on.
+//
+// Like the M24256, a page write takes a few ms to commit, during which the
+// EEPROM does not acknowledge its address. Page writes are taken to be
+// atomic, and a power loss is simulated by ignoring every page write after
+// a given number of them.
+//
+// For timing, a transfer takes as long as it would at the bus speed, and
+// CEepromSim::is_done() says when it would have finished
+//
+class CEepromSim {
+public:
+	enum {
+		SZ_PAGE = 64,
+		WRITE_MS = 3,
+		US_PER_BYTE = 18	// 9 bit times at 500kHz
+	};
+	byte m_mem[EEPROM_SIZE];
+	uint32_t m_busy_until;		// ms when the page being written has been committed
+	int m_page_writes;			// number of page writes done
+	int m_power_fail_at;		// page writes to allow before the power fails (-1 never)
+	int m_bytes_read;
+	int m_busy_naks;			// polls that were not acknowledged
+	byte m_write_when_busy;		// whether a page write has been started too soon
+
+	i2c_master_transfer_callback_t m_callback;
+	i2c_master_handle_t *m_handle;
+	i2c_master_transfer_t m_xfer;
+	uint32_t m_started_us;		// when the pending transfer was started
+	byte m_pending;
+
+	///////////////////////////////////////////////////////////////////////////////
+	void reset() {
+		memset(m_mem, 0xFF, sizeof m_mem);
+		power_up();
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	void power_up() {
+		m_busy_until = 0;
+		m_page_writes = 0;
+		m_power_fail_at = -1;
+		m_bytes_read = 0;
+		m_busy_naks = 0;
+		m_write_when_busy = 0;
+		m_pending = 0;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	byte is_power_failed() {
+		return m_power_fail_at >= 0 && m_page_writes >= m_power_fail_at;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	status_t transfer(const i2c_master_transfer_t& xfer) {
+		if(xfer.slaveAddress != I2C_ADDR_EEPROM) {
+			return kStatus_Success;		// DAC update
+		}
+		if(g_clock.get_ms() < m_busy_until) {
+			if(xfer.dataSize) {
+				m_write_when_busy = 1;
+			}
+			else {
+				++m_busy_naks;
+			}
+			return kStatus_I2C_Addr_Nak;
+		}
+		if(xfer.direction == kI2C_Read) {
+			for(unsigned int i=0; i<xfer.dataSize; ++i) {
+				xfer.data[i] = m_mem[(xfer.subaddress + i) % EEPROM_SIZE];
+			}
+			m_bytes_read += xfer.dataSize;
+		}
+		else if(xfer.dataSize) {
+			if(!is_power_failed()) {
+				// writes wrap around within the page
+				uint32_t page = xfer.subaddress & ~(SZ_PAGE - 1);
+				for(unsigned int i=0; i<xfer.dataSize; ++i) {
+					m_mem[page + ((xfer.subaddress + i) & (SZ_PAGE - 1))] = xfer.data[i];
+				}
+				++m_page_writes;
+			}
+			m_busy_until = g_clock.get_ms() + WRITE_MS;
+		}
+		return kStatus_Success;
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	// Bytes on the bus for a transfer: slave address, subaddress and data,
+	// plus the repeated start and slave address of a read
+	static int xfer_bytes(const i2c_master_transfer_t& xfer) {
+		return 1 + xfer.subaddressSize + xfer.dataSize + (xfer.direction == kI2C_Read);
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	byte is_done() {
+		return m_pending && g_clock.get_us() - m_started_us >= (uint32_t)(US_PER_BYTE * xfer_bytes(m_xfer));
+	}
+
+	///////////////////////////////////////////////////////////////////////////////
+	void complete() {
+		if(m_pending) {
+			m_pending = 0;
+			m_callback(I2C1, m_handle, transfer(m_xfer), NULL);
+		}
+	}
+};
+static CEepromSim g_sim;
+
+extern "C" {
+void I2C_MasterTransferCreateHandle(I2C_Type *base, i2c_master_handle_t *handle,
+		i2c_master_transfer_callback_t callback, void *userData) {
+	g_sim.m_handle = handle;
+	g_sim.m_callback = callback;
+}
+status_t I2C_MasterTransferNonBlocking(I2C_Type *base, i2c_master_handle_t *handle, i2c_master_transfer_t *xfer) {
+	g_sim.m_xfer = *xfer;
+	g_sim.m_started_us = g_clock.get_us();
+	g_sim.m_pending = 1;
+	return kStatus_Success;
+}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Run the I2C bus for one ms, as the main loop would
+static void pump_ms() {
+	host_tick_ms();
+	for(int i=0; i<8; ++i) {
+		g_i2c_bus.run();
+		if(!g_sim.m_pending) {
+			break;
+		}
+		g_sim.complete();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Run the I2C bus for one ms in steps of step_us, with transfers taking as
+// long as they would on the bus and DAC values being changed at random
+static void pump_timed_ms(CPrng& prng, int step_us) {
+	uint16_t stamp = (uint16_t)FTM1->CNT;
+	uint16_t fine_per_ms = g_clock.get_fine_per_ms();
+	for(int us = step_us; us <= 1000; us += step_us) {
+		FTM1->CNT = (uint16_t)(stamp + (us * fine_per_ms) / 1000);
+		if(us == 1000) {
+			PIT_CH0_IRQHandler();
+		}
+		if(!prng.range(4)) {
+			g_i2c_dac.set(prng.range(4), prng.range(4096));
+		}
+		if(g_sim.is_done()) {
+			g_sim.complete();
+		}
+		g_i2c_bus.run();
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void wait_for_eeprom() {
+	for(int ms = 0; ms < 10000 && g_i2c_bus.is_busy(); ++ms) {
+		pump_ms();
+	}
+	CHECK(!g_i2c_bus.is_busy());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Construct a global again, in zeroed memory as at power up
+template<class T> static void reconstruct(T& object) {
+	memset((void*)&object, 0, sizeof object);
+	new (&object) T();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Start up from cold with whatever is in the EEPROM
+static void power_up() {
+	g_sim.power_up();
+	reconstruct(g_i2c_eeprom);
+	reconstruct(g_i2c_bus);
+	reconstruct(g_autosave);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void random_data(CPrng& prng, byte *data, int size) {
+	for(int i=0; i<size; ++i) {
+		data[i] = prng.next();
+	}
+	data[0] = PATCH_DATA_COOKIE1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Save data to a slot, returning the number of pages that were written
+static int save(int slot, const byte *data, int size, byte mark = 1) {
+	int writes = g_sim.m_page_writes;
+	memcpy(g_i2c_eeprom.buf(), data, size);
+	CHECK(g_i2c_eeprom.write(slot, size, EEPROM_FOREGROUND, mark));
+	wait_for_eeprom();
+	CHECK(!g_sim.m_write_when_busy);
+	CHECK(!memcmp(g_sim.m_mem + slot * PATCH_SLOT_SIZE, data, size));
+	CHECK_EQUAL(g_sim.m_page_writes - writes, g_i2c_eeprom.get_save_pages());
+	return g_sim.m_page_writes - writes;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Data is written and read back, and only the pages that have changed are
+// rewritten
+static void test_write() {
+	enum { SIZE = 1000, PAGES = (SIZE + 63)/64 };
+	static byte data[SIZE];
+	CPrng prng(1);
+	g_sim.reset();
+	power_up();
+	random_data(prng, data, SIZE);
+
+	// a blank slot is marked invalid, then the first page is written last
+	CHECK_EQUAL(PAGES + 1, save(SLOT_PATCH3, data, SIZE));
+	CHECK(g_sim.m_busy_naks > 0);
+	CHECK(!memcmp(g_sim.m_mem + SLOT_PATCH2 * PATCH_SLOT_SIZE + PATCH_SLOT_SIZE - 64,
+			"\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF", 8));
+
+	memset(g_i2c_eeprom.buf(), 0, SIZE);
+	CHECK(g_i2c_eeprom.read(SLOT_PATCH3, SIZE));
+	wait_for_eeprom();
+	CHECK(!memcmp(g_i2c_eeprom.buf(), data, SIZE));
+
+	// nothing changed
+	CHECK_EQUAL(0, save(SLOT_PATCH3, data, SIZE));
+
+	// one page changed: mark, page, commit
+	data[5*64 + 10] ^= 1;
+	CHECK_EQUAL(3, save(SLOT_PATCH3, data, SIZE));
+
+	// only the first page changed
+	data[10] ^= 1;
+	CHECK_EQUAL(1, save(SLOT_PATCH3, data, SIZE));
+
+	// self checking data is not marked invalid, and the first page is only
+	// written if it has changed
+	data[7*64] ^= 1;
+	CHECK_EQUAL(1, save(SLOT_PATCH3, data, SIZE, 0));
+	data[7*64] ^= 1;
+	data[1] ^= 1;
+	CHECK_EQUAL(2, save(SLOT_PATCH3, data, SIZE, 0));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Whenever the power fails during a save, the slot is left either with the
+// old data, the new data, or with its cookie cleared
+static void test_power_loss() {
+	enum { SIZE = 1500 };
+	static byte old_data[SIZE];
+	static byte new_data[SIZE];
+	CPrng prng(2);
+	random_data(prng, old_data, SIZE);
+	memcpy(new_data, old_data, SIZE);
+	for(int i=0; i<SIZE; i+=200) {
+		new_data[i + 1] ^= 0x55;
+	}
+	byte *slot = g_sim.m_mem + SLOT_PATCH5 * PATCH_SLOT_SIZE;
+
+	int invalid = 0;
+	for(int fail_at = 0; ; ++fail_at) {
+		g_sim.reset();
+		power_up();
+		save(SLOT_PATCH5, old_data, SIZE);
+
+		power_up();
+		g_sim.m_power_fail_at = fail_at;
+		memcpy(g_i2c_eeprom.buf(), new_data, SIZE);
+		CHECK(g_i2c_eeprom.write(SLOT_PATCH5, SIZE));
+		for(int ms = 0; ms < 1000 && g_i2c_bus.is_busy() && !g_sim.is_power_failed(); ++ms) {
+			pump_ms();
+		}
+		byte completed = !g_sim.is_power_failed();
+		if(slot[0] == PATCH_DATA_COOKIE1) {
+			CHECK(!memcmp(slot, old_data, SIZE) || !memcmp(slot, new_data, SIZE));
+		}
+		else {
+			CHECK_EQUAL(0, slot[0]);
+			++invalid;
+		}
+		if(completed) {
+			CHECK(!memcmp(slot, new_data, SIZE));
+			break;
+		}
+	}
+	CHECK(invalid > 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A patch image is read only as far as the length in its header
+static void test_read_image() {
+	static byte image[CPatchCache::SZ_MAX_IMAGE];
+	g_sim.reset();
+	power_up();
+	g_sequence.init();
+	int len = g_sequence.encode_patch(image, sizeof image);
+	CHECK(len > 64);
+
+	static const int image_at[] = { 0, 2 };
+	for(unsigned int i=0; i<sizeof(image_at)/sizeof(image_at[0]); ++i) {
+		memset(g_sim.m_mem, 0x5A, image_at[i]);
+		memcpy(g_sim.m_mem + image_at[i], image, len);
+		g_sim.m_bytes_read = 0;
+		CHECK(g_i2c_eeprom.read_image(0, image_at[i] + CPatchCache::SZ_MAX_IMAGE, image_at[i]));
+		wait_for_eeprom();
+		CHECK_EQUAL(image_at[i] + len, g_sim.m_bytes_read);
+		CHECK_EQUAL(len, CPatchCache::check_image(g_i2c_eeprom.buf() + image_at[i], CPatchCache::SZ_MAX_IMAGE));
+	}
+
+	// a bad header stops after the first chunk
+	g_sim.m_mem[0] = 0;
+	g_sim.m_bytes_read = 0;
+	CHECK(g_i2c_eeprom.read_image(0, CPatchCache::SZ_MAX_IMAGE, 0));
+	wait_for_eeprom();
+	CHECK_EQUAL(64, g_sim.m_bytes_read);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void get_patch(byte *dest) {
+	memset(dest, 0, CPatchCache::SZ_PATCH);
+	g_sequence.get_cfg(&dest);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void restore() {
+	g_sequence.init();
+	g_autosave.start_restore();
+	for(int ms = 0; ms < 1000 && !g_autosave.is_restored(); ++ms) {
+		pump_ms();
+		g_autosave.run();
+	}
+	CHECK(g_autosave.is_restored());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Run autosave until it has saved the working state (or the power fails)
+static void autosave() {
+	int writes = g_sim.m_page_writes;
+	for(int ms = 0; ms < 20000 && !g_sim.is_power_failed(); ++ms) {
+		pump_ms();
+		g_autosave.run();
+		if(g_sim.m_page_writes != writes && !g_i2c_bus.is_busy()) {
+			break;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Change some steps and settings of the working state
+static void edit(int seed) {
+	CPrng prng(seed);
+	for(int i=0; i<4; ++i) {
+		CSequenceLayer& layer = g_sequence.get_layer(prng.range(CSequence::NUM_LAYERS));
+		CSequenceStep step;
+		step.set_value(prng.range(128));
+		step.set(CSequenceStep::TRIG_POINT, 1);
+		layer.set_step(0, prng.range(32), step);
+		layer.set(P_SQL_MIDI_VEL, prng.range(128));
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// When the power fails during an autosave, the last state that was saved
+// or the state being saved is restored at power up
+static void test_autosave() {
+	static byte saved[CPatchCache::SZ_PATCH];
+	static byte saving[CPatchCache::SZ_PATCH];
+	static byte restored[CPatchCache::SZ_PATCH];
+
+	int older = 0;
+	for(int fail_at = 0; ; ++fail_at) {
+		g_sim.reset();
+		power_up();
+		restore();
+
+		// save to both copies so that an edit only changes a few pages
+		edit(1);
+		autosave();
+		edit(2);
+		autosave();
+		edit(3);
+		autosave();
+		get_patch(saved);
+
+		edit(4);
+		get_patch(saving);
+		g_sim.m_power_fail_at = g_sim.m_page_writes + fail_at;
+		autosave();
+		byte completed = !g_sim.is_power_failed();
+
+		power_up();
+		restore();
+		get_patch(restored);
+		if(completed) {
+			CHECK(!memcmp(restored, saving, sizeof restored));
+			break;
+		}
+		if(!memcmp(restored, saved, sizeof restored)) {
+			++older;
+		}
+		else {
+			CHECK(!memcmp(restored, saving, sizeof restored));
+		}
+	}
+	CHECK(older > 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Run the bus in real time until the EEPROM is done
+static void wait_timed(CPrng& prng, int step_us) {
+	for(int ms = 0; ms < 10000 && g_i2c_bus.is_busy(); ++ms) {
+		pump_timed_ms(prng, step_us);
+	}
+	CHECK(!g_i2c_bus.is_busy());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// While a patch is being saved and read back, a DAC change waits at most
+// for one EEPROM transfer (a page or a read chunk) and its own transfer,
+// plus the time until the main loop next gets to the bus
+static void test_dac_latency() {
+	enum {
+		SIZE = 2000,
+		STEP_US = 50,
+		DAC_BYTES = 9,
+		MAX_LATENCY_US = CEepromSim::US_PER_BYTE * (CEepromSim::SZ_PAGE + 4 + DAC_BYTES) + 2 * STEP_US
+	};
+	static byte data[SIZE];
+	CPrng prng(3);
+	g_sim.reset();
+	power_up();
+	reconstruct(g_i2c_dac);
+	random_data(prng, data, SIZE);
+
+	memcpy(g_i2c_eeprom.buf(), data, SIZE);
+	CHECK(g_i2c_eeprom.write(SLOT_PATCH4, SIZE));
+	wait_timed(prng, STEP_US);
+	CHECK(!g_sim.m_write_when_busy);
+	CHECK(!memcmp(g_sim.m_mem + SLOT_PATCH4 * PATCH_SLOT_SIZE, data, SIZE));
+
+	memset(g_i2c_eeprom.buf(), 0, SIZE);
+	CHECK(g_i2c_eeprom.read(SLOT_PATCH4, SIZE));
+	wait_timed(prng, STEP_US);
+	CHECK(!memcmp(g_i2c_eeprom.buf(), data, SIZE));
+
+	uint16_t latency = g_i2c_dac.get_max_latency_us();
+	CHECK(latency > CEepromSim::US_PER_BYTE * DAC_BYTES);
+	if(latency > MAX_LATENCY_US) {
+		printf("DAC latency %d us\n", latency);
+		++g_host_failures;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main() {
+	host_init();
+	g_sequence.init();
+	test_write();
+	test_power_loss();
+	test_read_image();
+	test_autosave();
+	test_dac_latency();
+	return test_result("eeprom");
+}
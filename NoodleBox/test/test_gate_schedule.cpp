@@ -0,0 +1,138 @@
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// TEST: SUB-MS GATE TIMING (CTickRate::ticks_to_fraction, CGateScheduler)
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+#include "host.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// The multiply-only conversion from ticks to fine timer counts stays within
+// one count of the exact divide, for any number of ticks that can fall
+// within one ms
+static void test_fraction() {
+	const uint32_t per_ms = g_clock.get_fine_per_ms();
+	CPrng prng(1);
+	for(int i=0; i<10000; ++i) {
+		// 30 to 300 BPM, from the internal clock or a 24ppqn clock with
+		// a period of 1..2 ms jitter
+		uint32_t num = 6144 * (30 + prng.range(271));
+		uint32_t den = 60000 + prng.range(2000);
+		clock::CTickRate r;
+		r.set(num, den);
+		uint32_t max_ticks = num/den + 1;
+		for(uint32_t ticks = 0; ticks <= max_ticks; ++ticks) {
+			int64_t exact = ((uint64_t)ticks * den * per_ms) / num;
+			int64_t error = exact - (int64_t)r.ticks_to_fraction(ticks, per_ms);
+			CHECK(error >= 0 && error <= 1);
+		}
+	}
+	clock::CTickRate r;
+	CHECK_EQUAL(0, r.ticks_to_fraction(10, per_ms));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Gate changes are applied when the fine timer reaches them and not before,
+// in the order they fall due rather than the order they were queued
+static void test_order() {
+	const uint16_t per_ms = g_clock.get_fine_per_ms();
+	g_outs.close_all_gates();
+	host_tick_ms();
+
+	g_gate_scheduler.gate(2, COuts::GATE_OPEN, per_ms/2);
+	g_gate_scheduler.gate(0, COuts::GATE_OPEN, per_ms/4);
+	g_gate_scheduler.gate(1, COuts::GATE_OPEN, 3*per_ms/4);
+	g_gate_scheduler.gate(3, COuts::GATE_OPEN, 0);
+
+	// an offset of zero is already due
+	CHECK_EQUAL(COuts::GATE_OPEN, g_outs.m_chan[3].gate_status);
+	CHECK_EQUAL(COuts::GATE_CLOSED, g_outs.m_chan[0].gate_status);
+
+	static const struct {
+		uint16_t at;
+		byte open[3];	// gates 0..2 open after the compare interrupt
+	} step[] = {
+		{ 1, { 0, 0, 0 } },
+		{ (uint16_t)(1*per_ms/4 - 1), { 0, 0, 0 } },
+		{ (uint16_t)(1*per_ms/4), { 1, 0, 0 } },
+		{ (uint16_t)(2*per_ms/4 - 1), { 1, 0, 0 } },
+		{ (uint16_t)(2*per_ms/4), { 1, 0, 1 } },
+		{ (uint16_t)(3*per_ms/4), { 1, 1, 1 } }
+	};
+	uint16_t stamp = g_clock.get_ms_stamp();
+	for(unsigned int i=0; i<sizeof(step)/sizeof(step[0]); ++i) {
+		FTM1->CNT = (uint16_t)(stamp + step[i].at);
+		FTM1_IRQHandler();
+		for(int which=0; which<3; ++which) {
+			CHECK_EQUAL(step[i].open[which]? COuts::GATE_OPEN : COuts::GATE_CLOSED,
+					g_outs.m_chan[which].gate_status);
+		}
+	}
+	// nothing left to fire
+	CHECK(!(FTM1->CONTROLS[0].CnSC & FTM_CnSC_CHIE_MASK));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Changes queued for the same time are applied in the order they were queued,
+// so a close and reopen at the same point leaves the gate open
+static void test_same_time() {
+	const uint16_t per_ms = g_clock.get_fine_per_ms();
+	g_outs.close_all_gates();
+	host_tick_ms();
+	uint16_t stamp = g_clock.get_ms_stamp();
+
+	g_gate_scheduler.gate(0, COuts::GATE_OPEN, per_ms/2);
+	g_gate_scheduler.gate(0, COuts::GATE_CLOSED, per_ms/2);
+	g_gate_scheduler.gate(0, COuts::GATE_OPEN, per_ms/2);
+	FTM1->CNT = (uint16_t)(stamp + per_ms/2);
+	FTM1_IRQHandler();
+	CHECK_EQUAL(COuts::GATE_OPEN, g_outs.m_chan[0].gate_status);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Events still fall due in order when the fine timer wraps between them
+static void test_wrap() {
+	const uint16_t per_ms = g_clock.get_fine_per_ms();
+	g_outs.close_all_gates();
+	while((uint16_t)(g_clock.get_ms_stamp() + per_ms) > g_clock.get_ms_stamp()) {
+		host_tick_ms();
+	}
+	uint16_t stamp = g_clock.get_ms_stamp();
+	uint16_t before = (uint16_t)(0x10000 - stamp - 1);
+	g_gate_scheduler.gate(1, COuts::GATE_OPEN, before + 2);
+	g_gate_scheduler.gate(0, COuts::GATE_OPEN, before);
+
+	FTM1->CNT = (uint16_t)(stamp + before);
+	FTM1_IRQHandler();
+	CHECK_EQUAL(COuts::GATE_OPEN, g_outs.m_chan[0].gate_status);
+	CHECK_EQUAL(COuts::GATE_CLOSED, g_outs.m_chan[1].gate_status);
+
+	FTM1->CNT = (uint16_t)(stamp + before + 2);
+	FTM1_IRQHandler();
+	CHECK_EQUAL(COuts::GATE_OPEN, g_outs.m_chan[1].gate_status);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Stopping the sequencer drops anything still pending
+static void test_stop() {
+	const uint16_t per_ms = g_clock.get_fine_per_ms();
+	g_outs.close_all_gates();
+	host_tick_ms();
+	uint16_t stamp = g_clock.get_ms_stamp();
+
+	g_gate_scheduler.gate(0, COuts::GATE_OPEN, per_ms/2);
+	g_gate_scheduler.event(EV_SEQ_STOP, 0);
+	FTM1->CNT = (uint16_t)(stamp + per_ms - 1);
+	FTM1_IRQHandler();
+	CHECK_EQUAL(COuts::GATE_CLOSED, g_outs.m_chan[0].gate_status);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main() {
+	host_init();
+	test_fraction();
+	test_order();
+	test_same_time();
+	test_wrap();
+	test_stop();
+	return test_result("gate_schedule");
+}
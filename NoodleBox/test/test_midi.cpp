@@ -0,0 +1,1139 @@
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// TEST: MIDI DRIVER (midi::CMidi)
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+#include "host.h"
+
+using midi::CMidi;
+
+enum {
+	MAX_OUTPUT = 1024,
+	BYTE_US = 320,			// one byte at 31250 baud
+	MAX_EXPECTED = 256		// notes in flight in the timed tests
+};
+
+// a message taken back out of the transmitted bytes
+typedef struct {
+	byte status;
+	byte param1;
+	byte param2;
+} MSG;
+
+static CPrng g_prng(1);
+
+///////////////////////////////////////////////////////////////////////////////
+// Take up to max bytes from the transmit side, as the UART ISR would
+static int transmit(CMidi& m, byte *out, int max = MAX_OUTPUT) {
+	int len = 0;
+	int ch;
+	while(len < max && (ch = m.next_tx_byte()) >= 0) {
+		out[len++] = (byte)ch;
+	}
+	return len;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static int num_params(byte status) {
+	switch(status & 0xF0) {
+	case 0xC0:
+	case 0xD0:
+		return 1;
+	case 0xF0:
+		return (status == midi::MIDI_SPP)? 2 : 1;
+	default:
+		return 2;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Split transmitted bytes back into messages, applying running status
+// (status holds the running status from the bytes decoded before). Realtime
+// bytes come out as messages of their own, ahead of a message they interrupt
+static int decode(const byte *data, int len, MSG *msg, byte& status) {
+	int count = 0;
+	int param = 0;
+	MSG part = {0};
+	for(int i=0; i<len; ++i) {
+		byte ch = data[i];
+		if(ch >= 0xF8) {
+			msg[count].status = ch;
+			msg[count].param1 = 0;
+			msg[count].param2 = 0;
+			++count;
+		}
+		else if(ch & 0x80) {
+			status = ch;
+			param = 0;
+		}
+		else {
+			CHECK(status);
+			if(!param) {
+				part.status = status;
+				part.param1 = ch;
+				part.param2 = 0;
+			}
+			else {
+				part.param2 = ch;
+			}
+			if(++param >= num_params(status)) {
+				msg[count++] = part;
+				param = 0;
+				if(status >= 0xF0) {
+					status = 0;
+				}
+			}
+		}
+	}
+	CHECK_EQUAL(0, param);
+	return count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Notes received by the main loop
+static MSG g_notes[MAX_OUTPUT];
+static int g_num_notes;
+static void on_note(byte chan, byte note, byte vel) {
+	if(g_num_notes < MAX_OUTPUT) {
+		g_notes[g_num_notes].status = 0x90 | chan;
+		g_notes[g_num_notes].param1 = note;
+		g_notes[g_num_notes].param2 = vel;
+		++g_num_notes;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The receive queue holds one less than its size, drops and counts messages
+// when it is full, and passes messages on in order as its indexes wrap
+static void test_rx_ring() {
+	CMidi m;
+	g_host_note_handler = on_note;
+	g_num_notes = 0;
+	for(int i=0; i<midi::RXQ_SIZE + 2; ++i) {
+		m.push(midi::MSG_NOTE, 0, i, 1, 0, 0);
+	}
+	CHECK_EQUAL(3, m.get_rx_overflow());
+	CHECK_EQUAL(midi::RXQ_SIZE - 1, m.get_rx_high_water());
+	m.run();
+	CHECK_EQUAL(midi::RXQ_SIZE - 1, g_num_notes);
+	for(int i=0; i<g_num_notes; ++i) {
+		CHECK_EQUAL(i, g_notes[i].param1);
+	}
+
+	// random amounts in and out, many times round the ring
+	int sent = 0;
+	for(int round=0; round<200; ++round) {
+		g_num_notes = 0;
+		int count = 1 + g_prng.range(midi::RXQ_SIZE - 1);
+		for(int i=0; i<count; ++i, ++sent) {
+			m.push(midi::MSG_NOTE, (sent >> 7) & 0x0F, sent & 0x7F, 1, 0, 0);
+		}
+		m.run();
+		CHECK_EQUAL(count, g_num_notes);
+		for(int i=0; i<g_num_notes; ++i) {
+			int expected = sent - count + i;
+			CHECK_EQUAL(expected & 0x7F, g_notes[i].param1);
+			CHECK_EQUAL(0x90 | ((expected >> 7) & 0x0F), g_notes[i].status);
+		}
+	}
+	CHECK_EQUAL(3, m.get_rx_overflow());
+	g_host_note_handler = nullptr;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A transmit lane drops whole messages when it is full, counting the bytes,
+// and sends what it holds in order as its indexes wrap, even when the UART
+// takes bytes while messages are still being queued
+static void test_tx_ring() {
+	static byte out[MAX_OUTPUT];
+	static MSG msg[MAX_OUTPUT];
+	CMidi m;
+	for(int i=0; i<midi::TX_LANE_SIZE + 1; ++i) {
+		m.send(0x90 | (i & 1), i, 100, 3);
+	}
+	CHECK_EQUAL(6, m.get_tx_overflow());
+	CHECK_EQUAL(midi::TX_LANE_SIZE - 1, m.get_tx_high_water());
+	byte status = 0;
+	int count = decode(out, transmit(m, out), msg, status);
+	CHECK_EQUAL(midi::TX_LANE_SIZE - 1, count);
+	for(int i=0; i<count; ++i) {
+		CHECK_EQUAL(0x90 | (i & 1), msg[i].status);
+		CHECK_EQUAL(i, msg[i].param1);
+		CHECK_EQUAL(100, msg[i].param2);
+	}
+
+	// the decoder starts without a running status, so carry on with another
+	CMidi wrap;
+	int sent = 0;
+	int len = 0;
+	for(int round=0; round<200; ++round) {
+		for(int n = g_prng.range(5); n; --n, ++sent) {
+			wrap.send(0x90 | (sent & 3), sent & 0x7F, 1 + g_prng.range(127), 3);
+		}
+		len += transmit(wrap, out + len, 12 + g_prng.range(30));
+		if(len > MAX_OUTPUT - 64) {
+			break;
+		}
+	}
+	len += transmit(wrap, out + len);
+	status = 0;
+	count = decode(out, len, msg, status);
+	CHECK_EQUAL(sent, count);
+	for(int i=0; i<count; ++i) {
+		CHECK_EQUAL(0x90 | (i & 3), msg[i].status);
+		CHECK_EQUAL(i & 0x7F, msg[i].param1);
+	}
+	CHECK_EQUAL(0, wrap.get_tx_overflow());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The realtime ring counts a byte that does not fit
+static void test_realtime_ring() {
+	static byte out[MAX_OUTPUT];
+	CMidi m;
+	for(int i=0; i<midi::RT_TXBUF_SIZE; ++i) {
+		m.send_realtime(midi::MIDI_TICK);
+	}
+	CHECK_EQUAL(1, m.get_tx_overflow());
+	CHECK_EQUAL(midi::RT_TXBUF_SIZE - 1, transmit(m, out));
+	for(int i=0; i<midi::RT_TXBUF_SIZE - 1; ++i) {
+		CHECK_EQUAL(midi::MIDI_TICK, out[i]);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The status byte is left out when it is the same as the last one sent, but
+// not after a system common message or once the refresh time has passed.
+// Realtime bytes do not change the running status
+static void test_running_status() {
+	static byte out[MAX_OUTPUT];
+	static MSG msg[MAX_OUTPUT];
+	CMidi m;
+	for(int i=0; i<4; ++i) {
+		m.start_note(0, 60 + i, 100);
+	}
+	int len = transmit(m, out);
+	static const byte notes[] = { 0x90, 60, 100, 61, 100, 62, 100, 63, 100 };
+	CHECK_EQUAL(sizeof notes, len);
+	CHECK(!memcmp(notes, out, sizeof notes));
+	CHECK_EQUAL(3, m.get_tx_saved());
+
+	// a note off is sent as a note on with zero velocity, so it shares the
+	// running status
+	m.stop_note(0, 60);
+	m.send_realtime(midi::MIDI_TICK);
+	len = transmit(m, out);
+	static const byte note_off[] = { midi::MIDI_TICK, 60, 0 };
+	CHECK_EQUAL(sizeof note_off, len);
+	CHECK(!memcmp(note_off, out, sizeof note_off));
+
+	// another channel, then a system common message
+	m.start_note(1, 60, 100);
+	m.send(midi::MIDI_SPP, 0, 0, 3);
+	m.start_note(1, 61, 100);
+	len = transmit(m, out);
+	static const byte common[] = { 0x91, 60, 100, midi::MIDI_SPP, 0, 0, 0x91, 61, 100 };
+	CHECK_EQUAL(sizeof common, len);
+	CHECK(!memcmp(common, out, sizeof common));
+	CHECK_EQUAL(4, m.get_tx_saved());
+
+	// refresh
+	CMidi r;
+	r.start_note(0, 60, 100);
+	transmit(r, out);
+	for(int i=0; i<midi::RUNNING_STATUS_REFRESH_MS - 1; ++i) {
+		r.run();
+	}
+	r.start_note(0, 61, 100);
+	CHECK_EQUAL(2, transmit(r, out));
+	r.run();
+	r.start_note(0, 62, 100);
+	CHECK_EQUAL(3, transmit(r, out));
+
+	// a random mix of messages comes out the same after compression
+	CMidi mix;
+	byte status = 0;
+	MSG sent[200];
+	for(int i=0; i<200; ++i) {
+		static const byte types[] = { 0x90, 0x91, 0xE0, 0xB0 };
+		sent[i].status = types[g_prng.range(g_prng.range(2)? 1 : 4)];
+		sent[i].param1 = g_prng.range(128);
+		sent[i].param2 = g_prng.range(128);
+		mix.send(sent[i].status, sent[i].param1, sent[i].param2, 3);
+		len = transmit(mix, out);
+		CHECK_EQUAL(1, decode(out, len, msg, status));
+		if(i && sent[i].status == sent[i-1].status) {
+			CHECK_EQUAL(2, len);
+		}
+		else {
+			CHECK_EQUAL(sent[i].status, msg[0].status);
+			CHECK_EQUAL(3, len);
+		}
+		CHECK_EQUAL(sent[i].param1, msg[0].param1);
+		CHECK_EQUAL(sent[i].param2, msg[0].param2);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Collect the CC messages sent over a number of ms
+static int transmit_cc(CMidi& m, int ms, MSG *msg, byte& status) {
+	static byte out[MAX_OUTPUT];
+	int len = transmit(m, out);
+	for(int i=0; i<ms; ++i) {
+		m.run();
+		len += transmit(m, out + len);
+	}
+	return decode(out, len, msg, status);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CCs go out at most once every CC_TX_INTERVAL_MS, and a CC that is still
+// waiting is replaced by a later value for the same controller
+static void test_cc_coalescing() {
+	static MSG msg[MAX_OUTPUT];
+	byte status = 0;
+	CMidi m;
+	m.send_cc(0, 7, 1);
+	m.send_cc(0, 7, 2);
+	m.send_cc(0, 10, 5);
+	m.send_cc(0, 7, 3);
+	m.send_cc(1, 7, 4);
+	CHECK_EQUAL(1, m.get_cc_coalesced());
+
+	// the first goes straight out
+	CHECK_EQUAL(1, transmit_cc(m, 0, msg, status));
+	CHECK_EQUAL(1, msg[0].param2);
+	CHECK_EQUAL(0, transmit_cc(m, midi::CC_TX_INTERVAL_MS - 1, msg, status));
+	CHECK_EQUAL(1, transmit_cc(m, 1, msg, status));
+	CHECK_EQUAL(7, msg[0].param1);
+	CHECK_EQUAL(3, msg[0].param2);
+	CHECK_EQUAL(2, transmit_cc(m, 2 * midi::CC_TX_INTERVAL_MS, msg, status));
+	CHECK_EQUAL(0xB0, msg[0].status);
+	CHECK_EQUAL(10, msg[0].param1);
+	CHECK_EQUAL(5, msg[0].param2);
+	CHECK_EQUAL(0xB1, msg[1].status);
+	CHECK_EQUAL(7, msg[1].param1);
+	CHECK_EQUAL(4, msg[1].param2);
+	CHECK_EQUAL(0, transmit_cc(m, 10, msg, status));
+
+	// a sweep of one controller at 1 value per ms sends about one value
+	// in every CC_TX_INTERVAL_MS and always ends on the last value
+	CMidi sweep;
+	status = 0;
+	int count = 0;
+	for(int value=0; value<128; ++value) {
+		sweep.send_cc(2, 74, value);
+		count += transmit_cc(sweep, 1, msg + count, status);
+	}
+	count += transmit_cc(sweep, midi::CC_TX_INTERVAL_MS, msg + count, status);
+	CHECK(count <= 128/midi::CC_TX_INTERVAL_MS + 2);
+	CHECK_EQUAL(127, msg[count-1].param2);
+	CHECK_EQUAL(128 - count, sweep.get_cc_coalesced());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Check that bytes taken from the transmit side are as expected
+static void check_bytes(CMidi& m, const byte *expected, int len, int max = MAX_OUTPUT) {
+	static byte out[MAX_OUTPUT];
+	CHECK_EQUAL(len, transmit(m, out, max));
+	CHECK(!memcmp(expected, out, len));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Note offs overtake waiting notes unless a message for the same channel is
+// waiting, CCs wait for notes, a message that has started is finished
+// before any other, and realtime bytes go out between any two bytes
+static void test_lanes() {
+	CMidi overtake;
+	overtake.start_note(0, 60, 100);
+	overtake.start_note(0, 61, 100);
+	overtake.send_cc(3, 7, 20);
+	overtake.stop_note(1, 50);
+	overtake.send(0x82, 40, 64, 3);
+	static const byte overtake_out[] = {
+		0x91, 50, 0, 0x82, 40, 64, 0x90, 60, 100, 61, 100, 0xB3, 7, 20
+	};
+	check_bytes(overtake, overtake_out, sizeof overtake_out);
+
+	// a note off for a channel with a note waiting, or a pitch bend waiting,
+	// stays behind it
+	CMidi same;
+	same.start_note(0, 60, 100);
+	same.bend(1, 0);
+	same.stop_note(0, 60);
+	same.stop_note(1, 50);
+	same.stop_note(2, 40);
+	static const byte same_out[] = {
+		0x92, 40, 0, 0x90, 60, 100, 0xE1, 0, 64, 0x90, 60, 0, 0x91, 50, 0
+	};
+	check_bytes(same, same_out, sizeof same_out);
+
+	// started messages are finished first, realtime bytes go straight out
+	CMidi started;
+	started.start_note(0, 60, 100);
+	static const byte first[] = { 0x90 };
+	check_bytes(started, first, sizeof first, 1);
+	started.stop_note(1, 50);
+	started.send_realtime(midi::MIDI_TICK);
+	static const byte started_out[] = { midi::MIDI_TICK, 60, 100, 0x91, 50, 0 };
+	check_bytes(started, started_out, sizeof started_out);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// However the lanes reorder messages, the channel messages for any one
+// channel go out in the order they were queued
+static void test_channel_order() {
+	static byte out[MAX_OUTPUT];
+	static MSG msg[MAX_OUTPUT];
+	static MSG queued[MAX_OUTPUT];
+	CMidi m;
+	byte status = 0;
+	int num_queued = 0;
+	int num_sent = 0;
+	for(int round=0; round<100 && num_sent < MAX_OUTPUT - 32; ++round) {
+		for(int n = g_prng.range(5); n; --n) {
+			MSG& q = queued[num_queued++];
+			byte chan = g_prng.range(4);
+			q.param1 = g_prng.range(128);
+			switch(g_prng.range(4)) {
+			case 0:
+				q.status = 0x90 | chan;
+				q.param2 = 1 + g_prng.range(127);
+				break;
+			case 1:
+				q.status = 0x90 | chan;
+				q.param2 = 0;
+				break;
+			case 2:
+				q.status = 0x80 | chan;
+				q.param2 = g_prng.range(128);
+				break;
+			default:
+				q.status = 0xE0 | chan;
+				q.param2 = g_prng.range(128);
+				break;
+			}
+			m.send(q.status, q.param1, q.param2, 3);
+			if(!g_prng.range(4)) {
+				m.send_realtime(midi::MIDI_TICK);
+			}
+		}
+		// stop between messages, since decode() does not carry part messages
+		int len = transmit(m, out, 6 + g_prng.range(12));
+		while(m.m_tx_pos < m.m_tx_len) {
+			len += transmit(m, out + len, 1);
+		}
+		num_sent += decode(out, len, msg + num_sent, status);
+	}
+	num_sent += decode(out, transmit(m, out), msg + num_sent, status);
+	CHECK_EQUAL(0, m.get_tx_overflow());
+
+	for(int chan=0; chan<4; ++chan) {
+		int j = 0;
+		for(int i=0; i<num_queued; ++i) {
+			if((queued[i].status & 0x0F) != chan) {
+				continue;
+			}
+			while(j < num_sent && (msg[j].status >= 0xF0 || (msg[j].status & 0x0F) != chan)) {
+				++j;
+			}
+			CHECK(j < num_sent);
+			if(j < num_sent) {
+				CHECK_EQUAL(queued[i].status, msg[j].status);
+				CHECK_EQUAL(queued[i].param1, msg[j].param1);
+				CHECK_EQUAL(queued[i].param2, msg[j].param2);
+				++j;
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The longest time a realtime byte waits to go out is recorded
+static void test_realtime_latency() {
+	static byte out[MAX_OUTPUT];
+	CMidi m;
+	m.send_realtime(midi::MIDI_TICK);
+	transmit(m, out);
+	CHECK(m.get_rt_tx_latency() < 10);
+	m.send_realtime(midi::MIDI_TICK);
+	host_tick_ms();
+	host_tick_ms();
+	transmit(m, out);
+	CHECK(m.get_rt_tx_latency() >= 1990 && m.get_rt_tx_latency() <= 2010);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Feed bytes to the receive side, as the UART ISR would
+static void receive(CMidi& m, const byte *data, int len) {
+	for(int i=0; i<len; ++i) {
+		m.rx_byte(data[i]);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Take the decoded messages from the receive queue
+static int received(CMidi& m, CMidi::RX_MSG *msg) {
+	int count = 0;
+	while(m.m_rx_tail != m.m_rx_head) {
+		msg[count++] = m.m_rxq[m.m_rx_tail];
+		m.m_rx_tail = (m.m_rx_tail + 1) & midi::RXQ_SIZE_MASK;
+	}
+	return count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void check_msg(const CMidi::RX_MSG& msg, midi::MSG_TYPE type, byte p0, byte p1, byte p2, byte p3, uint32_t value) {
+	CHECK_EQUAL(type, msg.type);
+	CHECK_EQUAL(p0, msg.param[0]);
+	CHECK_EQUAL(p1, msg.param[1]);
+	CHECK_EQUAL(p2, msg.param[2]);
+	CHECK_EQUAL(p3, msg.param[3]);
+	CHECK_EQUAL(value, msg.value);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Messages are decoded with running status, realtime bytes in the middle of
+// a message, and sysex and other messages skipped
+static void test_parser() {
+	static CMidi::RX_MSG msg[midi::RXQ_SIZE];
+	CMidi m;
+	host_tick_ms();
+	uint32_t us = g_clock.get_us();
+	static const byte notes[] = {
+		0x90, 60, 100, 61, 0, 0x80, 62, 5, 0xC1, 7, 8, 0x9F, 63, midi::MIDI_TICK, 64,
+		0xFE, midi::MIDI_STOP, 0xD0, 1, 0xE0, 1, 2, 0xA0, 3, 4
+	};
+	receive(m, notes, sizeof notes);
+	CHECK_EQUAL(6, received(m, msg));
+	check_msg(msg[0], midi::MSG_NOTE, 0, 60, 100, 0, 0);
+	check_msg(msg[1], midi::MSG_NOTE, 0, 61, 0, 0, 0);
+	check_msg(msg[2], midi::MSG_NOTE, 0, 62, 0, 0, 0);
+	check_msg(msg[3], midi::MSG_REALTIME, midi::MIDI_TICK, 0, 0, 0, us);
+	check_msg(msg[4], midi::MSG_NOTE, 15, 63, 64, 0, 0);
+	check_msg(msg[5], midi::MSG_REALTIME, midi::MIDI_STOP, 0, 0, 0, us);
+
+	// NRPN, with the value LSB completing it
+	static const byte nrpn[] = {
+		0xB0, midi::MIDI_CC_NRPN_HI, 1, midi::MIDI_CC_NRPN_LO, 2, 7, 100,
+		midi::MIDI_CC_DATA_HI, 3, midi::MIDI_CC_DATA_LO, 4,
+		midi::MIDI_CC_DATA_LO, 5,
+		midi::MIDI_CC_NRPN_HI, 6, midi::MIDI_CC_DATA_LO, 7
+	};
+	receive(m, nrpn, sizeof nrpn);
+	CHECK_EQUAL(3, received(m, msg));
+	check_msg(msg[0], midi::MSG_NRPN, 1, 2, 3, 4, 0);
+	check_msg(msg[1], midi::MSG_NRPN, 1, 2, 3, 5, 0);
+	check_msg(msg[2], midi::MSG_NRPN, 6, 0, 0, 7, 0);
+
+	// song position, which cancels running status
+	static const byte spp[] = { 0x90, 1, 1, midi::MIDI_SPP, 0x10, 0x02, 60, 100, 0x90, 2, 2 };
+	receive(m, spp, sizeof spp);
+	CHECK_EQUAL(3, received(m, msg));
+	check_msg(msg[0], midi::MSG_NOTE, 0, 1, 1, 0, 0);
+	check_msg(msg[1], midi::MSG_SPP, 0, 0, 0, 0, 0x10 | (0x02 << 7));
+	check_msg(msg[2], midi::MSG_NOTE, 0, 2, 2, 0, 0);
+
+	// sysex data is skipped, and a status byte ends it even without an end
+	static const byte sysex[] = {
+		0x90, midi::MIDI_SYSEX_BEGIN, 1, 2, 3, midi::MIDI_SYSEX_END, 4, 5,
+		midi::MIDI_SYSEX_BEGIN, 6, midi::MIDI_TICK, 7, 0x91, 8, 9
+	};
+	receive(m, sysex, sizeof sysex);
+	CHECK_EQUAL(2, received(m, msg));
+	check_msg(msg[0], midi::MSG_REALTIME, midi::MIDI_TICK, 0, 0, 0, us);
+	check_msg(msg[1], midi::MSG_NOTE, 1, 8, 9, 0, 0);
+
+	// notes on other channels are dropped
+	m.set_note_chan(3);
+	static const byte chan[] = { 0x93, 1, 1, 0x94, 2, 2, 0x83, 3, 3 };
+	receive(m, chan, sizeof chan);
+	CHECK_EQUAL(2, received(m, msg));
+	check_msg(msg[0], midi::MSG_NOTE, 3, 1, 1, 0, 0);
+	check_msg(msg[1], midi::MSG_NOTE, 3, 3, 0, 0, 0);
+	m.set_note_chan(midi::MIDI_OMNI);
+	receive(m, chan, sizeof chan);
+	CHECK_EQUAL(3, received(m, msg));
+	CHECK_EQUAL(0, m.get_rx_overflow());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A random stream, using running status wherever it can and with realtime
+// bytes anywhere, decodes to the messages that were put into it
+static void test_parser_stream() {
+	static CMidi::RX_MSG msg[midi::RXQ_SIZE];
+	static CMidi::RX_MSG expected[midi::RXQ_SIZE];
+	CMidi m;
+	byte status = 0;
+	byte nrpn[3] = {0};
+	uint32_t us = g_clock.get_us();
+	int failures = g_host_failures;
+	for(int round=0; round<2000; ++round) {
+		int num_expected = 0;
+		byte data[64];
+		int len = 0;
+		for(int n = g_prng.range(8); n; --n) {
+			byte chan = g_prng.range(16);
+			byte p1 = g_prng.range(128);
+			byte p2 = g_prng.range(128);
+			byte s;
+			switch(g_prng.range(9)) {
+			case 0:
+				// system common and sysex
+				if(g_prng.range(2)) {
+					data[len++] = midi::MIDI_SPP;
+					data[len++] = p1;
+					data[len++] = p2;
+					expected[num_expected++] = { midi::MSG_SPP, {0, 0, 0, 0}, p1 | ((uint32_t)p2 << 7) };
+				}
+				else {
+					data[len++] = midi::MIDI_SYSEX_BEGIN;
+					data[len++] = p1;
+					data[len++] = p2;
+					if(g_prng.range(2)) {
+						data[len++] = midi::MIDI_SYSEX_END;
+					}
+				}
+				status = 0;
+				continue;
+			case 1:
+				s = 0xC0 | chan;
+				break;
+			case 2:
+				s = 0xE0 | chan;
+				break;
+			case 3:
+				s = 0x80 | chan;
+				expected[num_expected++] = { midi::MSG_NOTE, {chan, p1, 0, 0}, 0 };
+				break;
+			case 4:
+			case 5: {
+					static const byte cc[] = {
+						midi::MIDI_CC_NRPN_HI, midi::MIDI_CC_NRPN_LO, midi::MIDI_CC_DATA_HI, midi::MIDI_CC_DATA_LO, 7
+					};
+					s = 0xB0 | chan;
+					p1 = cc[g_prng.range(5)];
+					switch(p1) {
+					case midi::MIDI_CC_NRPN_HI:
+						nrpn[0] = p2;
+						nrpn[1] = 0;
+						nrpn[2] = 0;
+						break;
+					case midi::MIDI_CC_NRPN_LO:
+						nrpn[1] = p2;
+						nrpn[2] = 0;
+						break;
+					case midi::MIDI_CC_DATA_HI:
+						nrpn[2] = p2;
+						break;
+					case midi::MIDI_CC_DATA_LO:
+						expected[num_expected++] = { midi::MSG_NRPN, {nrpn[0], nrpn[1], nrpn[2], p2}, 0 };
+						break;
+					}
+				}
+				break;
+			default:
+				s = 0x90 | chan;
+				expected[num_expected++] = { midi::MSG_NOTE, {chan, p1, p2, 0}, 0 };
+				break;
+			}
+			if(s != status || !g_prng.range(4)) {
+				data[len++] = s;
+			}
+			status = s;
+			data[len++] = p1;
+			if((s & 0xF0) != 0xC0) {
+				data[len++] = p2;
+			}
+		}
+
+		// realtime bytes in between any of the others, these are checked
+		// separately since they are queued as soon as they arrive
+		byte rt[64];
+		int num_rt = 0;
+		for(int i=0; i<len; ++i) {
+			if(!g_prng.range(5)) {
+				static const byte realtime[] = {
+					midi::MIDI_TICK, midi::MIDI_START, midi::MIDI_CONTINUE, midi::MIDI_STOP, 0xFE
+				};
+				byte ch = realtime[g_prng.range(5)];
+				m.rx_byte(ch);
+				if(ch != 0xFE) {
+					rt[num_rt++] = ch;
+				}
+			}
+			m.rx_byte(data[i]);
+		}
+
+		int count = received(m, msg);
+		CHECK_EQUAL(num_expected + num_rt, count);
+		int next = 0;
+		int next_rt = 0;
+		for(int i=0; i<count; ++i) {
+			if(msg[i].type == midi::MSG_REALTIME) {
+				CHECK(next_rt < num_rt);
+				check_msg(msg[i], midi::MSG_REALTIME, rt[next_rt++], 0, 0, 0, us);
+			}
+			else {
+				CHECK(next < num_expected);
+				CMidi::RX_MSG& e = expected[next++];
+				check_msg(msg[i], e.type, e.param[0], e.param[1], e.param[2], e.param[3], e.value);
+			}
+		}
+		if(g_host_failures != failures) {
+			printf("stream does not decode in round %d\n", round);
+			return;
+		}
+	}
+	CHECK_EQUAL(0, m.get_rx_overflow());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Set the fine timer to a time within the current ms
+static void set_time_in_ms(uint32_t us) {
+	FTM1->CNT = (uint16_t)(g_clock.get_ms_stamp() + us * g_clock.get_fine_per_ms() / 1000);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The timed tests move time on one byte time at a time, which is when the
+// UART ISR can take a received byte and give the UART a byte to send
+static uint32_t g_uart_us;	// time within the ms of the last byte time
+static void start_byte_times() {
+	g_uart_us = 0;
+	set_time_in_ms(0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Move time on to the next byte time, firing the PIT interrupt on the way
+// if a ms boundary is passed. Returns true when it is, so the caller can run
+// the main loop
+static bool next_byte_time() {
+	g_uart_us += BYTE_US;
+	if(g_uart_us < 1000) {
+		set_time_in_ms(g_uart_us);
+		return false;
+	}
+	g_uart_us -= 1000;
+	set_time_in_ms(1000);
+	PIT_CH0_IRQHandler();
+	set_time_in_ms(g_uart_us);
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Notes that the timed tests have sent to the receive side, which the main
+// loop should pass on in the same order
+static MSG g_expected[MAX_EXPECTED];
+static int g_expected_head;
+static int g_expected_tail;
+static int g_notes_checked;
+static void expect_note(byte chan, byte note, byte vel) {
+	MSG& e = g_expected[g_expected_head];
+	e.status = 0x90 | chan;
+	e.param1 = note;
+	e.param2 = vel;
+	g_expected_head = (g_expected_head + 1) % MAX_EXPECTED;
+	CHECK(g_expected_head != g_expected_tail);
+}
+static void check_note(byte chan, byte note, byte vel) {
+	CHECK(g_expected_tail != g_expected_head);
+	MSG& e = g_expected[g_expected_tail];
+	CHECK_EQUAL(e.status, 0x90 | chan);
+	CHECK_EQUAL(e.param1, note);
+	CHECK_EQUAL(e.param2, vel);
+	g_expected_tail = (g_expected_tail + 1) % MAX_EXPECTED;
+	++g_notes_checked;
+}
+static void start_expected() {
+	g_expected_head = 0;
+	g_expected_tail = 0;
+	g_notes_checked = 0;
+	g_host_note_handler = check_note;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A stream of notes comes in at the full line rate while the main loop
+// sends a note every ms and a clock tick every pp24 at 120 BPM, which is as
+// much as the line can carry. Serviced one byte at a time, as the UART
+// does, and by the main loop once per ms, nothing is dropped on either side
+// and the queues stay short
+static void test_line_rate() {
+	static byte out[4 * MAX_OUTPUT];
+	static MSG msg[2 * MAX_OUTPUT];
+	enum {
+		RUN_MS = 1000,
+		TICK_US = 60000000 / (120 * 24)
+	};
+	CMidi m;
+	start_byte_times();
+	start_expected();
+	byte rx[3];
+	int rx_pos = 0;
+	int rx_len = 0;
+	int rx_sent = 0;
+	int rx_bytes = 0;
+	byte rx_status = 0;
+	int tx_sent = 0;
+	int len = 0;
+	uint32_t start_us = g_clock.get_us();
+	uint32_t tick_us = start_us;
+	int ms = 0;
+	while(ms < RUN_MS) {
+		if(next_byte_time()) {
+			m.run();
+			// alternate channels so that running status saves nothing
+			m.start_note(tx_sent & 1, tx_sent & 0x7F, 100);
+			++tx_sent;
+			++ms;
+		}
+		if(g_clock.get_us() >= tick_us) {
+			m.send_realtime(midi::MIDI_TICK);
+			tick_us += TICK_US;
+		}
+
+		// the next byte of a note in, with running status for runs of
+		// three notes on a channel
+		if(rx_pos >= rx_len) {
+			byte status = 0x90 | ((rx_sent / 3) & 0x0F);
+			rx_len = 0;
+			if(status != rx_status) {
+				rx[rx_len++] = status;
+				rx_status = status;
+			}
+			rx[rx_len++] = rx_sent & 0x7F;
+			rx[rx_len++] = 1 + rx_sent % 127;
+			expect_note(status & 0x0F, rx_sent & 0x7F, 1 + rx_sent % 127);
+			rx_pos = 0;
+			++rx_sent;
+		}
+		m.rx_byte(rx[rx_pos++]);
+		++rx_bytes;
+
+		int ch = m.next_tx_byte();
+		if(ch >= 0 && len < (int)sizeof out) {
+			out[len++] = (byte)ch;
+		}
+	}
+	m.run();
+	len += transmit(m, out + len, sizeof out - len);
+	g_host_note_handler = nullptr;
+
+	// notes are received as fast as they can come in
+	CHECK(rx_sent >= RUN_MS * 1000 / (3 * BYTE_US));
+	CHECK(g_notes_checked >= rx_sent - 1);
+	CHECK_EQUAL(0, m.get_rx_overflow());
+	CHECK(m.get_rx_high_water() <= 2);
+
+	// and the notes sent all go out, with the clock ticks in between
+	byte status = 0;
+	int count = decode(out, len, msg, status);
+	int notes = 0;
+	int ticks = 0;
+	for(int i=0; i<count; ++i) {
+		if(msg[i].status == midi::MIDI_TICK) {
+			++ticks;
+		}
+		else {
+			CHECK_EQUAL(0x90 | (notes & 1), msg[i].status);
+			CHECK_EQUAL(notes & 0x7F, msg[i].param1);
+			++notes;
+		}
+	}
+	CHECK_EQUAL(tx_sent, notes);
+	CHECK_EQUAL((int)((tick_us - start_us) / TICK_US), ticks);
+	CHECK_EQUAL(0, m.get_tx_overflow());
+	CHECK(m.get_tx_high_water() <= 2);
+	printf("line rate: %d bytes in, %d bytes out in %d ms, high water rx %d tx %d\n",
+		rx_bytes, len, RUN_MS, m.get_rx_high_water(), m.get_tx_high_water());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Bytes waiting in the transmit lanes, counting a status byte for each
+// message whether or not running status leaves it out
+static int tx_waiting(CMidi& m) {
+	int count = m.m_tx_len - m.m_tx_pos;
+	for(int i=0; i<CMidi::NUM_TX_LANES; ++i) {
+		CMidi::TX_LANE& lane = m.m_tx_lane[i];
+		for(byte j = lane.tail; j != lane.head; j = (j + 1) & midi::TX_LANE_SIZE_MASK) {
+			count += lane.msg[j].len;
+		}
+	}
+	return count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Set up a layer to play a random value with a trig on every 32nd note. CC
+// layers swing widely, so that smoothing changes the value every ms
+static void make_layer(int index, V_SQL_SEQ_MODE mode, V_SQL_MIDI_OUT out, byte cc) {
+	CSequenceLayer& layer = g_sequence.get_layer(index);
+	layer.set(P_SQL_SEQ_MODE, mode);
+	layer.set(P_SQL_STEP_RATE, V_SQL_STEP_RATE_32);
+	layer.set(P_SQL_TRIG_DUR, V_SQL_NOTE_DUR_TRIG);
+	layer.set(P_SQL_MIDI_OUT, out);
+	layer.set(P_SQL_MIDI_OUT_CHAN, index);
+	layer.set(P_SQL_MIDI_CC, cc);
+	layer.set(P_SQL_MIDI_CC_SMOOTH, 1);
+	for(int i=0; i<CSequencePage::MAX_STEPS; ++i) {
+		CSequenceStep step;
+		if(cc) {
+			// swing from one end of the range to the other on each step
+			step.set_value((i & 1)? 100 + g_prng.range(28) : g_prng.range(28));
+		}
+		else {
+			step.set_value(36 + g_prng.range(60));
+		}
+		step.set(CSequenceStep::DATA_POINT, 1);
+		step.set(CSequenceStep::TRIG_POINT, 1);
+		step.set(CSequenceStep::ACCENT_POINT, g_prng.range(2));
+		layer.set_step(0, i, step);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Four layers play a step every 32nd note at 300 BPM. Two play MIDI notes
+// and two play smoothed CCs, which ask for a CC every ms on each of them.
+// The main loop runs the sequencer once per ms and the UART takes the bytes
+// at the line rate. Running status saves bytes, CC coalescing keeps the
+// queues short, and nothing is dropped. Prints the bytes saved and the
+// longest that a message waits in the lanes
+static void test_layer_replay() {
+	enum {
+		BPM = 300,
+		RUN_MS = 10000
+	};
+	g_sequence.init();
+	g_sequence.init_state();
+	make_layer(0, V_SQL_SEQ_MODE_PITCH, V_SQL_MIDI_OUT_NOTE, 0);
+	make_layer(1, V_SQL_SEQ_MODE_PITCH, V_SQL_MIDI_OUT_NOTE, 0);
+	make_layer(2, V_SQL_SEQ_MODE_MOD, V_SQL_MIDI_OUT_CC, 1);
+	make_layer(3, V_SQL_SEQ_MODE_MOD, V_SQL_MIDI_OUT_CC, 74);
+	g_clock.set(P_CLOCK_BPM, BPM);
+	handle_event(EV_SEQ_RESTART, 0);
+
+	start_byte_times();
+	int sent = 0;
+	int max_waiting = 0;
+	int ms = 0;
+	while(ms < RUN_MS) {
+		if(next_byte_time()) {
+			g_event_queue.run();
+			g_sequence.run();
+			// fire the gate changes that were scheduled in this ms
+			while(FTM1->CONTROLS[0].CnSC & FTM_CnSC_CHIE_MASK) {
+				FTM1->CNT = FTM1->CONTROLS[0].CnV;
+				FTM1_IRQHandler();
+			}
+			set_time_in_ms(g_uart_us);
+			g_outs.run();
+			g_midi.run();
+			int waiting = tx_waiting(g_midi);
+			if(waiting > max_waiting) {
+				max_waiting = waiting;
+			}
+			++ms;
+		}
+		if(g_midi.next_tx_byte() >= 0) {
+			++sent;
+		}
+	}
+	handle_event(EV_SEQ_STOP, 0);
+
+	// more is asked for than the line can carry..
+	int asked = sent + g_midi.get_tx_saved() + 3 * g_midi.get_cc_coalesced();
+	CHECK(asked > RUN_MS * 1000 / BYTE_US);
+	CHECK(g_midi.get_tx_saved() > 0);
+	// ..but nothing is lost and no message waits more than a few ms
+	CHECK_EQUAL(0, g_midi.get_tx_overflow());
+	CHECK(max_waiting * BYTE_US <= 5000);
+	printf("replay: %d bytes asked for and %d sent in %d ms, %d saved by running status, %d CCs coalesced\n",
+		asked, sent, RUN_MS, (int)g_midi.get_tx_saved(), (int)g_midi.get_cc_coalesced());
+	printf("replay: at most %d bytes waiting (%d us), lane high water %d\n",
+		max_waiting, max_waiting * BYTE_US, g_midi.get_tx_high_water());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// With more messages queued than the line can carry, so that every lane is
+// full, the MIDI clock sent from the 1 ms clock interrupt at 300 BPM still
+// goes out with the next byte the UART takes. No tick waits more than one
+// byte time however the ticks fall against the bytes
+static void test_clock_out_latency() {
+	enum {
+		BPM = 300,
+		RUN_MS = 10000
+	};
+	g_midi = CMidi();
+	clock::g_midi_clock_out.set_mode(V_MIDI_CLOCK_OUT_ON);
+	g_clock.set(P_CLOCK_BPM, BPM);
+	handle_event(EV_SEQ_RESTART, 0);
+
+	start_byte_times();
+	int lane_max[CMidi::NUM_TX_LANES] = {0};
+	int ticks = 0;
+	int ms = 0;
+	while(ms < RUN_MS) {
+		if(next_byte_time()) {
+			// the main loop, with note offs on two channels, note ons on
+			// two others and CCs straight into the CC lane
+			for(int i=0; i<2; ++i) {
+				byte note = (ms + i) & 0x7F;
+				g_midi.stop_note(i, note);
+				g_midi.start_note(2 + i, note, 100);
+				g_midi.send(0xB4 + i, 1, note, 3);
+			}
+			g_midi.run();
+			for(int i=0; i<CMidi::NUM_TX_LANES; ++i) {
+				CMidi::TX_LANE& lane = g_midi.m_tx_lane[i];
+				int count = (lane.head - lane.tail) & midi::TX_LANE_SIZE_MASK;
+				if(count > lane_max[i]) {
+					lane_max[i] = count;
+				}
+			}
+			++ms;
+		}
+		if(g_midi.next_tx_byte() == midi::MIDI_TICK) {
+			++ticks;
+		}
+	}
+	handle_event(EV_SEQ_STOP, 0);
+	clock::g_midi_clock_out.set_mode(V_MIDI_CLOCK_OUT_NONE);
+
+	for(int i=0; i<CMidi::NUM_TX_LANES; ++i) {
+		CHECK_EQUAL(midi::TX_LANE_SIZE - 1, lane_max[i]);
+	}
+	CHECK(g_midi.get_tx_overflow() > 0);
+	CHECK(abs(ticks - RUN_MS * BPM * 24 / 60000) <= 1);
+	CHECK(g_midi.get_rt_tx_latency() <= BYTE_US);
+	printf("clock out: %d ticks in %d ms, worst latency %d us with %d bytes dropped\n",
+		ticks, RUN_MS, g_midi.get_rt_tx_latency(), g_midi.get_tx_overflow());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Make up a random message for the timed parser test, using running status
+// where it can, and expect the notes that should come out of it. Returns
+// the number of bytes and counts the messages that will be queued
+static int random_message(byte *data, byte& status, int& queued) {
+	int len = 0;
+	byte chan = g_prng.range(16);
+	byte p1 = g_prng.range(128);
+	byte p2 = g_prng.range(128);
+	byte s;
+	switch(g_prng.range(12)) {
+	case 0:
+		// a short sysex dump
+		data[len++] = midi::MIDI_SYSEX_BEGIN;
+		for(int n = g_prng.range(20); n; --n) {
+			data[len++] = g_prng.range(128);
+		}
+		data[len++] = midi::MIDI_SYSEX_END;
+		status = 0;
+		return len;
+	case 1:
+		data[len++] = 0xFE;	// active sensing
+		return len;
+	case 2:
+		data[len++] = midi::MIDI_TICK;
+		++queued;
+		return len;
+	case 3:
+		s = 0xA0 | chan;	// aftertouch
+		break;
+	case 4:
+		s = 0xD0 | chan;	// channel pressure
+		break;
+	case 5:
+		s = 0xB0 | chan;
+		p1 = 16 + g_prng.range(16);	// a controller that is not part of an NRPN
+		break;
+	case 6:
+		s = 0xC0 | chan;
+		break;
+	case 7:
+		s = 0xE0 | chan;
+		break;
+	default:
+		s = 0x90 | chan;
+		expect_note(chan, p1, p2);
+		++queued;
+		break;
+	}
+	if(s != status) {
+		data[len++] = s;
+		status = s;
+	}
+	data[len++] = p1;
+	if(num_params(s) > 1) {
+		data[len++] = p2;
+	}
+	return len;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A dense random stream at the full line rate, with sysex dumps, active
+// sensing, aftertouch and other messages that are not queued, then a burst
+// of nothing but clock ticks, which is the most messages the line can carry.
+// With the main loop taking the queue once per ms, nothing is dropped, the
+// queue is never more than a ms deep and the notes come out in order
+static void test_parser_line_rate() {
+	enum {
+		RUN_MS = 10000,
+		BURST_MS = 1000		// clock ticks only, at the end of the run
+	};
+	CMidi m;
+	start_byte_times();
+	start_expected();
+	byte data[32];
+	int pos = 0;
+	int len = 0;
+	byte status = 0;
+	int bytes = 0;
+	int queued = 0;
+	int ms = 0;
+	while(ms < RUN_MS) {
+		if(next_byte_time()) {
+			m.run();
+			++ms;
+		}
+		if(pos >= len) {
+			pos = 0;
+			if(ms < RUN_MS - BURST_MS) {
+				len = random_message(data, status, queued);
+			}
+			else {
+				data[0] = midi::MIDI_TICK;
+				len = 1;
+				++queued;
+			}
+		}
+		m.rx_byte(data[pos++]);
+		++bytes;
+	}
+	m.run();
+	g_host_note_handler = nullptr;
+
+	CHECK_EQUAL(RUN_MS * 1000 / BYTE_US, bytes);
+	CHECK_EQUAL(g_expected_head, g_expected_tail);
+	CHECK_EQUAL(0, m.get_rx_overflow());
+	CHECK(m.get_rx_high_water() <= (1000 + BYTE_US - 1) / BYTE_US);
+	printf("parser: %d bytes in %d ms, %d messages queued, %d notes checked, high water %d\n",
+		bytes, RUN_MS, queued, g_notes_checked, m.get_rx_high_water());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main() {
+	host_init();
+	test_rx_ring();
+	test_tx_ring();
+	test_realtime_ring();
+	test_running_status();
+	test_cc_coalescing();
+	test_lanes();
+	test_channel_order();
+	test_realtime_latency();
+	test_parser();
+	test_parser_stream();
+	test_line_rate();
+	test_layer_replay();
+	test_clock_out_latency();
+	test_parser_line_rate();
+	return test_result("midi");
+}
@@ -0,0 +1,243 @@
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// TEST: STEP OUTPUT PLAN (CSequenceLayer::get_planned_output, CSequence::run)
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+// time.h declares a clock() function, which would clash with the firmware's
+// clock namespace
+#define clock libc_clock
+#include <time.h>
+#undef clock
+#include "host.h"
+
+//
+// A layer whose output is quantized and depends only on its own steps
+// keeps a plan of the quantized note for each step of each page. The plan must
+// always give the same output as working the step out in full, whatever
+// has changed since the entry was made. The benchmark plays four planned
+// layers and times CSequence::run() with the plan in use, and with it
+// cleared before every ms so that each step is worked out in full as it was
+// before there was a plan
+//
+enum {
+	BPM = 300,
+	BENCH_MS = 100000,
+	NUM_LAYERS = CSequence::NUM_LAYERS
+};
+
+static CPrng g_prng(1);
+
+// the DAC is not written, since COuts::run() is not called
+extern "C" {
+void I2C_MasterTransferCreateHandle(I2C_Type *base, i2c_master_handle_t *handle,
+		i2c_master_transfer_callback_t callback, void *userData) {
+}
+status_t I2C_MasterTransferNonBlocking(I2C_Type *base, i2c_master_handle_t *handle, i2c_master_transfer_t *xfer) {
+	CHECK(0);
+	return kStatus_Fail;
+}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fill a page with random data points and a trig on every step
+static void fill_page(CSequenceLayer& layer, byte page_no) {
+	for(int i=0; i<CSequencePage::MAX_STEPS; ++i) {
+		CSequenceStep step;
+		step.set_value(24 + g_prng.range(80));
+		step.set(CSequenceStep::DATA_POINT, 1);
+		step.set(CSequenceStep::TRIG_POINT, 1);
+		layer.set_step(page_no, i, step);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Random settings for a layer that the plan is used for
+static void random_settings(CSequenceLayer& layer) {
+	static const V_SQL_SEQ_MODE mode[] = {
+		V_SQL_SEQ_MODE_PITCH, V_SQL_SEQ_MODE_OFFSET, V_SQL_SEQ_MODE_MOD
+	};
+	layer.set(P_SQL_SEQ_MODE, mode[g_prng.range(3)]);
+	layer.set(P_SQL_CVSCALE, g_prng.range(V_SQL_CVSCALE_MAX));
+	layer.set(P_SQL_CV_OCTAVE, g_prng.range(V_SQL_CVSHIFT_MAX));
+	layer.set(P_SQL_QUANTIZE, g_prng.range(2)? V_SQL_SEQ_QUANTIZE_CHROMATIC : V_SQL_SEQ_QUANTIZE_SCALE);
+	layer.set(P_SQL_CV_TRANSPOSE, (int)g_prng.range(49) - 24);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The plan gives the same output as get_step_output() and get_layer_output()
+// for any step at any position of any page, through changes to the steps, the
+// layer settings and the scale, and it is only used for the layers that it
+// can be
+static void test_plan_output() {
+	g_sequence.init();
+	g_sequence.init_state();
+	CSequenceLayer& layer = g_sequence.get_layer(0);
+	CHECK(layer.is_planned());
+	layer.set(P_SQL_QUANTIZE, V_SQL_SEQ_QUANTIZE_OFF);
+	CHECK(!layer.is_planned());
+	layer.set(P_SQL_QUANTIZE, V_SQL_SEQ_QUANTIZE_SCALE);
+	layer.set(P_SQL_MIX, V_SQL_COMBINE_ADD);
+	CHECK(!layer.is_planned());
+	layer.set(P_SQL_MIX, V_SQL_COMBINE_OFF);
+	layer.set(P_SQL_CV_ALIAS, V_SQL_CV_ALIAS_NONE + 2);
+	CHECK(!layer.is_planned());
+	layer.set(P_SQL_CV_ALIAS, V_SQL_CV_ALIAS_NONE);
+	CHECK(layer.is_planned());
+
+	byte values[CSequenceLayer::NUM_PAGES][CSequencePage::MAX_STEPS] = {{0}};
+	int failures = g_host_failures;
+	for(int round=0; round<5000; ++round) {
+		switch(g_prng.range(8)) {
+		case 0:
+			random_settings(layer);
+			break;
+		case 1:
+			CScale::instance().set((V_SQL_SCALE_TYPE)g_prng.range(V_SQL_SCALE_TYPE_MAX),
+				(V_SQL_SCALE_ROOT)g_prng.range(12));
+			break;
+		}
+		for(int n=0; n<64; ++n) {
+			// mostly steps that have been played from the same position
+			// before, as a loop plays them
+			int page_no = g_prng.range(CSequenceLayer::NUM_PAGES);
+			int pos = g_prng.range(CSequencePage::MAX_STEPS);
+			if(!g_prng.range(4)) {
+				values[page_no][pos] = g_prng.range(128);
+			}
+			CSequenceStep step;
+			step.set_value(values[page_no][pos]);
+			CV_TYPE expected = layer.get_layer_output(layer.get_step_output(0, step), step);
+			CHECK_EQUAL(expected, layer.get_planned_output(page_no, pos, step));
+		}
+		if(g_host_failures != failures) {
+			printf("plan output is wrong in round %d\n", round);
+			return;
+		}
+	}
+	CScale::instance().set(V_SQL_SCALE_TYPE_IONIAN, V_SQL_SCALE_ROOT_C);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Run the sequencer for one ms as the main loop does, timing CSequence::run()
+static long long run_ms() {
+	host_tick_ms();
+	g_event_queue.run();
+	timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	g_sequence.run();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	uint16_t stamp = g_clock.get_ms_stamp();
+	while(FTM1->CONTROLS[0].CnSC & FTM_CnSC_CHIE_MASK) {
+		FTM1->CNT = FTM1->CONTROLS[0].CnV;
+		FTM1_IRQHandler();
+	}
+	FTM1->CNT = stamp;
+	return (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Time spent in CSequence::run() over all ms, and over the ms in which the
+// layers played a step, with the layer outputs taken from the plan and
+// those worked out in full
+typedef struct {
+	long long ns;
+	long long step_ns;
+	int step_ms;
+	uint32_t hits;
+	uint32_t misses;
+} TIMES;
+
+///////////////////////////////////////////////////////////////////////////////
+// Play four planned layers of 32nd notes, two of them chaining through all
+// four pages, and time CSequence::run(). The CV output for each layer at
+// each ms is kept
+static void bench(byte clear_plan, CV_TYPE (*cv)[NUM_LAYERS], TIMES& times) {
+	g_sequence.init();
+	g_sequence.init_state();
+	g_prng.set_seed(2);
+	for(int i=0; i<NUM_LAYERS; ++i) {
+		CSequenceLayer& layer = g_sequence.get_layer(i);
+		layer.set(P_SQL_STEP_RATE, V_SQL_STEP_RATE_32);
+		layer.set(P_SQL_QUANTIZE, V_SQL_SEQ_QUANTIZE_SCALE);
+		layer.set(P_SQL_TRIG_DUR, V_SQL_NOTE_DUR_TRIG);
+		layer.set(P_SQL_CV_OCTAVE, V_SQL_CVSHIFT_NONE + 1);
+		if(i & 1) {
+			layer.set_max_page_no(CSequenceLayer::NUM_PAGES - 1);
+			layer.cue_all();
+		}
+		for(int page=0; page<CSequenceLayer::NUM_PAGES; ++page) {
+			fill_page(layer, page);
+		}
+	}
+	CScale::instance().set(V_SQL_SCALE_TYPE_DORIAN, V_SQL_SCALE_ROOT_D);
+	g_clock.set(P_CLOCK_BPM, BPM);
+	handle_event(EV_SEQ_RESTART, 0);
+
+	memset(&times, 0, sizeof times);
+	for(int ms=0; ms<BENCH_MS; ++ms) {
+		if(clear_plan) {
+			for(int i=0; i<NUM_LAYERS; ++i) {
+				CSequenceLayer& layer = g_sequence.get_layer(i);
+				layer.set(P_SQL_CV_OCTAVE, layer.get(P_SQL_CV_OCTAVE));
+			}
+		}
+		int pos = g_sequence.get_layer(0).get_pos();
+		long long ns = run_ms();
+		times.ns += ns;
+		if(g_sequence.get_layer(0).get_pos() != pos) {
+			times.step_ns += ns;
+			++times.step_ms;
+		}
+		for(int i=0; i<NUM_LAYERS; ++i) {
+			cv[ms][i] = g_outs.m_chan[i].pitch;
+		}
+	}
+	times.hits = g_sequence.get_plan_hits();
+	times.misses = g_sequence.get_plan_misses();
+	handle_event(EV_SEQ_STOP, 0);
+	CScale::instance().set(V_SQL_SCALE_TYPE_IONIAN, V_SQL_SCALE_ROOT_C);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The outputs are the same with the plan in use and change on most steps,
+// and once each page has been played the output of every step comes from
+// the plan. The times are printed rather than checked, since they depend
+// on the host
+static void test_bench() {
+	static CV_TYPE cv_before[BENCH_MS][NUM_LAYERS];
+	static CV_TYPE cv_after[BENCH_MS][NUM_LAYERS];
+	TIMES before;
+	TIMES after;
+	// each is run twice, keeping the second time, so that neither pays for
+	// warming up the host caches
+	bench(1, cv_before, before);
+	bench(1, cv_before, before);
+	bench(0, cv_after, after);
+	bench(0, cv_after, after);
+	CHECK(!memcmp(cv_before, cv_after, sizeof cv_before));
+	for(int i=0; i<NUM_LAYERS; ++i) {
+		int changes = 0;
+		for(int ms=1; ms<BENCH_MS; ++ms) {
+			changes += (cv_after[ms][i] != cv_after[ms-1][i]);
+		}
+		CHECK(changes > after.step_ms/2);
+	}
+	CHECK(after.step_ms > 0);
+	CHECK_EQUAL(before.step_ms, after.step_ms);
+	CHECK_EQUAL(0, before.hits);
+	CHECK_EQUAL(before.misses, after.hits + after.misses);
+	CHECK(after.misses <= NUM_LAYERS * CSequenceLayer::NUM_PAGES * CSequencePage::MAX_STEPS);
+
+	printf("CSequence::run() without the plan: %.1f ns per ms, %.1f ns per ms with a step, %u outputs worked out\n",
+		(double)before.ns / BENCH_MS, (double)before.step_ns / before.step_ms, before.misses);
+	printf("CSequence::run() with the plan:    %.1f ns per ms, %.1f ns per ms with a step, %u outputs worked out, %u from the plan\n",
+		(double)after.ns / BENCH_MS, (double)after.step_ns / after.step_ms, after.misses, after.hits);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main() {
+	host_init();
+	test_plan_output();
+	test_bench();
+	return test_result("output_plan");
+}
@@ -0,0 +1,166 @@
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// TEST: FILL POINTS (CSequencePage::recalc_step, CSequencePage::recalc)
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+#include "host.h"
+
+enum {
+	MAX_STEPS = CSequencePage::MAX_STEPS
+};
+
+static CPrng g_prng(1);
+
+///////////////////////////////////////////////////////////////////////////////
+// The exact line value at point i of n between values a and b, rounded half
+// up (floor division, since the numerator can be negative)
+static int line_value(int a, int b, int i, int n) {
+	int num = 2 * (a * n + i * (b - a)) + n;
+	int denom = 2 * n;
+	return (num >= 0)? num / denom : -((denom - 1 - num) / denom);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Work out the value of every step from the data points alone
+static void expected_fill(const byte *data_point, const byte *value, V_SQL_FILL_MODE fill_mode, byte zero_value, byte *result) {
+	int count = 0;
+	for(int i=0; i<MAX_STEPS; ++i) {
+		count += data_point[i];
+	}
+	for(int i=0; i<MAX_STEPS; ++i) {
+		if(data_point[i]) {
+			result[i] = value[i];
+			continue;
+		}
+		if(!count || fill_mode == V_SQL_FILL_MODE_OFF) {
+			result[i] = zero_value;
+			continue;
+		}
+		int prev = i;
+		int back = 0;
+		do {
+			prev = (prev + MAX_STEPS - 1) % MAX_STEPS;
+			++back;
+		} while(!data_point[prev]);
+		if(fill_mode == V_SQL_FILL_MODE_PAD || count == 1) {
+			result[i] = value[prev];
+			continue;
+		}
+		int next = i;
+		int ahead = 0;
+		do {
+			next = (next + 1) % MAX_STEPS;
+			++ahead;
+		} while(!data_point[next]);
+		result[i] = (byte)line_value(value[prev], value[next], back, back + ahead);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Check the page values against the data points and against a full recalc
+static bool check_page(CSequencePage& page, const byte *data_point, const byte *value, V_SQL_FILL_MODE fill_mode, byte zero_value) {
+	byte expected[MAX_STEPS];
+	expected_fill(data_point, value, fill_mode, zero_value, expected);
+	CSequencePage full = page;
+	full.recalc(fill_mode, zero_value);
+	int failures = g_host_failures;
+	for(int i=0; i<MAX_STEPS; ++i) {
+		CHECK_EQUAL(data_point[i], page.get_step(i).is(CSequenceStep::DATA_POINT));
+		CHECK_EQUAL(expected[i], page.get_step(i).get_value());
+		CHECK_EQUAL(expected[i], full.get_step(i).get_value());
+	}
+	return g_host_failures == failures;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// After any sequence of step edits the incrementally updated fill points are
+// the same as filling the whole page again
+static void test_edits() {
+	for(int trial=0; trial<600; ++trial) {
+		V_SQL_FILL_MODE fill_mode = (V_SQL_FILL_MODE)(trial % V_SQL_FILL_MODE_MAX);
+		byte zero_value = (trial & 4)? 64 : 0;
+		byte data_point[MAX_STEPS] = {0};
+		byte value[MAX_STEPS] = {0};
+		CSequencePage page;
+		page.clear(zero_value, 0, 15);
+		page.recalc(fill_mode, zero_value);
+
+		// sparse and dense pages
+		int edits = (trial & 8)? 80 : 20;
+		for(int e=0; e<edits; ++e) {
+			int index = g_prng.range(MAX_STEPS);
+			CSequenceStep step;
+			switch(g_prng.range(5)) {
+			case 0:
+				page.clear_step(index, fill_mode, zero_value, CSequenceStep::ALL_DATA);
+				data_point[index] = 0;
+				break;
+			case 1:
+				page.clear_step(index, fill_mode, zero_value, CSequenceStep::CV_DATA);
+				data_point[index] = 0;
+				break;
+			case 2:
+				// gates only, the fill points are unchanged
+				step.set(CSequenceStep::TRIG_POINT, 1);
+				page.set_step(index, step, fill_mode, zero_value, CSequenceStep::GATE_DATA, 1);
+				break;
+			default: {
+					// a new value makes the step a data point
+					byte new_value = g_prng.range(128);
+					byte old_value = page.get_step(index).get_value();
+					byte is_data_point = g_prng.range(2);
+					step.set_value(new_value);
+					step.set(CSequenceStep::DATA_POINT, is_data_point);
+					page.set_step(index, step, fill_mode, zero_value, CSequenceStep::CV_DATA, 1);
+					data_point[index] = is_data_point || new_value != old_value;
+					value[index] = new_value;
+				}
+				break;
+			}
+			if(!check_page(page, data_point, value, fill_mode, zero_value)) {
+				printf("fill mode %d: page differs after edit %d of trial %d\n", fill_mode, e, trial);
+				return;
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Interpolated points are the exact line value rounded half up, for every
+// pair of values and section length, including sections that wrap around
+// the end of the page
+static void test_interpolate() {
+	for(int a=0; a<=CSequenceStep::VALUE_MAX; ++a) {
+		for(int b=0; b<=CSequenceStep::VALUE_MAX; ++b) {
+			for(int n=2; n<MAX_STEPS; ++n) {
+				int from = (a + b + n) % MAX_STEPS;
+				int to = (from + n) % MAX_STEPS;
+				CSequencePage page;
+				page.clear(0, 0, 15);
+				CSequenceStep step;
+				step.set(CSequenceStep::DATA_POINT, 1);
+				step.set_value(a);
+				page.set_step(from, step, V_SQL_FILL_MODE_INTERPOLATE, 0, CSequenceStep::CV_DATA, 1);
+				step.set_value(b);
+				page.set_step(to, step, V_SQL_FILL_MODE_INTERPOLATE, 0, CSequenceStep::CV_DATA, 1);
+				for(int i=1; i<n; ++i) {
+					int expected = line_value(a, b, i, n);
+					if(expected != page.get_step((from + i) % MAX_STEPS).get_value()) {
+						printf("from %d to %d over %d steps: point %d is %d, expected %d\n",
+								a, b, n, i, page.get_step((from + i) % MAX_STEPS).get_value(), expected);
+						++g_host_failures;
+						return;
+					}
+				}
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main() {
+	host_init();
+	test_edits();
+	test_interpolate();
+	return test_result("page_fill");
+}
@@ -0,0 +1,494 @@
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// TEST: POINT BITPLANES (CSequencePage point masks, shift, gates, encode)
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+// time.h declares a clock() function, which would clash with the firmware's
+// clock namespace
+#define clock libc_clock
+#include <time.h>
+#undef clock
+#include "host.h"
+
+//
+// The benchmark at the end times count_of(), shift_horizontal(),
+// replace_gates() and the gate row of the editor display against the same
+// work done the way it was before the bitplanes, over an array of steps
+//
+enum {
+	MAX_STEPS = CSequencePage::MAX_STEPS,
+	NUM_POINT_TYPES = CSequenceStep::NUM_POINT_TYPES,
+	BENCH_CALLS = 200000
+};
+
+// gate row views of the editor display
+enum {
+	VIEW_GATE_TIE,
+	VIEW_PROB,
+	VIEW_RETRIG,
+	VIEW_ACCENT,
+	NUM_VIEWS
+};
+
+static CPrng g_prng(1);
+
+///////////////////////////////////////////////////////////////////////////////
+static uint32_t bit(int index) {
+	return 0x80000000U >> index;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static CSequenceStep random_step() {
+	CSequenceStep step;
+	step.set_value(g_prng.range(128));
+	step.set(CSequenceStep::DATA_POINT, g_prng.range(2));
+	step.set(CSequenceStep::TRIG_POINT, g_prng.range(2));
+	step.set(CSequenceStep::TIE_POINT, !g_prng.range(3));
+	step.set(CSequenceStep::ACCENT_POINT, !g_prng.range(4));
+	step.set(CSequenceStep::IGNORE_POINT, !g_prng.range(5));
+	step.set_prob(g_prng.range(2)? 0 : g_prng.range(16));
+	step.set_retrig(g_prng.range(3)? 0 : g_prng.range(16));
+	return step;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fill a page with random steps, keeping a copy of each step. The fill mode
+// is off, so only data points keep their values
+static void random_page(CSequencePage& page, CSequenceStep *steps) {
+	page.clear(0, 0, 15);
+	for(int i=0; i<MAX_STEPS; ++i) {
+		steps[i] = random_step();
+		page.set_step(i, steps[i], V_SQL_FILL_MODE_OFF, 0, CSequenceStep::ALL_DATA, 0);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static bool same_gate(CSequenceStep& a, CSequenceStep& b) {
+	for(int type=0; type<NUM_POINT_TYPES; ++type) {
+		if(a.is((CSequenceStep::POINT_TYPE)type) != b.is((CSequenceStep::POINT_TYPE)type)) {
+			return false;
+		}
+	}
+	return a.get_prob() == b.get_prob() && a.get_retrig() == b.get_retrig();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static bool same_step(CSequenceStep& a, CSequenceStep& b) {
+	return same_gate(a, b) && a.get_value() == b.get_value();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Each step reads back as it was written, and the masks, counts and range
+// tests agree with the individual steps
+static void test_steps() {
+	for(int trial=0; trial<200; ++trial) {
+		CSequenceStep steps[MAX_STEPS];
+		CSequencePage page;
+		random_page(page, steps);
+
+		uint32_t prob_mask = 0;
+		uint32_t retrig_mask = 0;
+		for(int i=0; i<MAX_STEPS; ++i) {
+			CSequenceStep step = page.get_step(i);
+			CHECK(same_gate(steps[i], step));
+			CHECK_EQUAL(steps[i].is(CSequenceStep::DATA_POINT)? steps[i].get_value() : 0, step.get_value());
+			if(steps[i].get_prob()) {
+				prob_mask |= bit(i);
+			}
+			if(steps[i].get_retrig()) {
+				retrig_mask |= bit(i);
+			}
+		}
+		CHECK_EQUAL(prob_mask, page.get_prob_mask());
+		CHECK_EQUAL(retrig_mask, page.get_retrig_mask());
+
+		for(int type=0; type<NUM_POINT_TYPES; ++type) {
+			CSequenceStep::POINT_TYPE t = (CSequenceStep::POINT_TYPE)type;
+			uint32_t mask = 0;
+			for(int i=0; i<MAX_STEPS; ++i) {
+				if(steps[i].is(t)) {
+					mask |= bit(i);
+				}
+			}
+			CHECK_EQUAL(mask, page.get_mask(t));
+
+			// any_of excludes the step at the end of the range, count_of
+			// includes it
+			for(int from=0; from<MAX_STEPS; ++from) {
+				for(int to=from; to<MAX_STEPS; ++to) {
+					int count = 0;
+					for(int i=from; i<=to; ++i) {
+						count += steps[i].is(t);
+					}
+					CHECK_EQUAL(count, page.count_of(t, from, to));
+					CHECK_EQUAL(count - steps[to].is(t) > 0, page.any_of(t, from, to));
+				}
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A horizontal shift moves every part of every step one place along,
+// wrapping around the page
+static void test_shift() {
+	for(int trial=0; trial<100; ++trial) {
+		CSequenceStep steps[MAX_STEPS];
+		CSequencePage page;
+		random_page(page, steps);
+		CSequenceStep before[MAX_STEPS];
+		for(int i=0; i<MAX_STEPS; ++i) {
+			before[i] = page.get_step(i);
+		}
+		int dir = (trial & 1)? 1 : -1;
+		page.shift_horizontal(dir);
+		for(int i=0; i<MAX_STEPS; ++i) {
+			CSequenceStep after = page.get_step((i + dir + MAX_STEPS) % MAX_STEPS);
+			CHECK(same_step(before[i], after));
+		}
+		page.shift_horizontal(-dir);
+		for(int i=0; i<MAX_STEPS; ++i) {
+			CSequenceStep after = page.get_step(i);
+			CHECK(same_step(before[i], after));
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The Euclidean pattern spreads the onsets as evenly as possible over each
+// repeat, starts each repeat with an onset, and is moved along to the
+// column. All other gate information is cleared and the values are kept
+static void test_replace_gates() {
+	for(int positions=1; positions<=MAX_STEPS; ++positions) {
+		for(int onsets=0; onsets<=positions; ++onsets) {
+			CSequenceStep steps[MAX_STEPS];
+			CSequencePage page;
+			random_page(page, steps);
+			int column = g_prng.range(MAX_STEPS);
+			page.replace_gates(onsets, positions, column);
+
+			int failures = g_host_failures;
+			for(int i=0; i<MAX_STEPS; ++i) {
+				// position in the pattern before it was moved to the column
+				int k = ((i - column + MAX_STEPS) % MAX_STEPS) % positions;
+				byte trig = k? ((k * onsets) / positions > ((k - 1) * onsets) / positions) : (onsets > 0);
+				CSequenceStep step = page.get_step(i);
+				CHECK_EQUAL(trig, step.is(CSequenceStep::TRIG_POINT));
+				CHECK(!step.is(CSequenceStep::TIE_POINT));
+				CHECK(!step.is(CSequenceStep::ACCENT_POINT));
+				CHECK(!step.is(CSequenceStep::IGNORE_POINT));
+				CHECK_EQUAL(0, step.get_prob());
+				CHECK_EQUAL(0, step.get_retrig());
+				CHECK_EQUAL(steps[i].is(CSequenceStep::DATA_POINT), step.is(CSequenceStep::DATA_POINT));
+				CHECK_EQUAL(steps[i].is(CSequenceStep::DATA_POINT)? steps[i].get_value() : 0, step.get_value());
+			}
+			if(positions <= MAX_STEPS - column) {
+				CHECK_EQUAL(onsets, page.count_of(CSequenceStep::TRIG_POINT, column, column + positions - 1));
+			}
+			if(g_host_failures != failures) {
+				printf("%d onsets over %d positions at column %d\n", onsets, positions, column);
+				return;
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A page written to a packed patch reads back with the same steps
+static void test_encode() {
+	for(int trial=0; trial<500; ++trial) {
+		CSequenceStep steps[MAX_STEPS];
+		CSequencePage page;
+		random_page(page, steps);
+		page.loop_from() = g_prng.range(MAX_STEPS);
+		page.loop_to() = g_prng.range(MAX_STEPS);
+		if(trial & 1) {
+			// runs of values
+			page.recalc(V_SQL_FILL_MODE_PAD, 0);
+		}
+
+		byte buf[256];
+		CPatchWriter w(buf, sizeof buf);
+		page.encode(w);
+		w.align();
+		CHECK(!w.is_overflow());
+
+		byte cfg[CSequencePage::get_cfg_size()];
+		CPatchReader r(buf, w.get_pos());
+		CSequencePage::decode(r, cfg);
+		CHECK(!r.is_error());
+		CSequencePage decoded;
+		byte *src = cfg;
+		decoded.set_cfg(&src);
+
+		for(int i=0; i<MAX_STEPS; ++i) {
+			CSequenceStep expected = page.get_step(i);
+			CSequenceStep step = decoded.get_step(i);
+			CHECK(same_step(expected, step));
+		}
+		CHECK_EQUAL(page.loop_from(), decoded.loop_from());
+		CHECK_EQUAL(page.loop_to(), decoded.loop_to());
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+// A page as it was before the bitplanes, with the step operations as they
+// were then
+typedef struct {
+	CSequenceStep step[MAX_STEPS];
+} STEP_PAGE;
+
+///////////////////////////////////////////////////////////////////////////////
+static int step_count_of(STEP_PAGE& page, CSequenceStep::POINT_TYPE type, int from, int to) {
+	int count = 0;
+	while(from<=to && from < MAX_STEPS) {
+		if(page.step[from].is(type)) {
+			++count;
+		}
+		++from;
+	}
+	return count;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void step_shift_horizontal(STEP_PAGE& page, int dir) {
+	CSequenceStep step;
+	if(dir<0) {
+		step = page.step[0];
+		for(int i = 0; i<MAX_STEPS-1; ++i) {
+			page.step[i] = page.step[i+1];
+		}
+		page.step[MAX_STEPS-1] = step;
+	}
+	else {
+		step = page.step[MAX_STEPS-1];
+		for(int i = MAX_STEPS-1; i>0; --i) {
+			page.step[i] = page.step[i-1];
+		}
+		page.step[0] = step;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void step_replace_gates(STEP_PAGE& page, int onsets, int positions, int column) {
+	byte trigs[MAX_STEPS] = {0};
+	int remainder = 0;
+	for(int i=0; i<positions; ++i) {
+		remainder += onsets;
+		if(remainder >= positions) {
+			remainder -= positions;
+			trigs[i] = 1;
+		}
+	}
+	int source = positions-1;
+	for(int i=0; i<MAX_STEPS; ++i) {
+		CSequenceStep& step = page.step[column];
+		step.clear(CSequenceStep::GATE_DATA);
+		step.set(CSequenceStep::TRIG_POINT, trigs[source]);
+		if(++column >= MAX_STEPS) {
+			column = 0;
+		}
+		if(++source >= positions) {
+			source = 0;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The gate row of the editor display, worked out a step at a time as the
+// editor did before the bitplanes: the high, medium and low brightness rows
+// in display bit order
+static void step_gate_row(STEP_PAGE& page, int view, uint32_t *row) {
+	row[0] = row[1] = row[2] = 0;
+	for(int i=0; i<MAX_STEPS; ++i) {
+		CSequenceStep& step = page.step[i];
+		byte trig_or_tie = step.is(CSequenceStep::TRIG_POINT)||step.is(CSequenceStep::TIE_POINT);
+		byte other;
+		int bri = -1;
+		if(view == VIEW_GATE_TIE) {
+			if(step.is(CSequenceStep::TRIG_POINT)) {
+				bri = step.is(CSequenceStep::TIE_POINT)? 0 : 1;
+			}
+			else if(step.is(CSequenceStep::TIE_POINT)) {
+				bri = 2;
+			}
+		}
+		else {
+			if(view == VIEW_PROB) {
+				other = !!step.get_prob();
+			}
+			else if(view == VIEW_RETRIG) {
+				other = !!step.get_retrig();
+			}
+			else {
+				other = step.is(CSequenceStep::ACCENT_POINT);
+			}
+			if(other) {
+				bri = trig_or_tie? 0 : 1;
+			}
+			else if(trig_or_tie) {
+				bri = 2;
+			}
+		}
+		if(bri >= 0) {
+			row[bri] |= bit(i);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The gate row worked out from the bitplanes, as CSequenceEditor::repaint()
+// does it (the editor is not part of the host build)
+static void plane_gate_row(CSequencePage& page, int view, uint32_t *row) {
+	uint32_t trig = page.get_mask(CSequenceStep::TRIG_POINT);
+	uint32_t tie = page.get_mask(CSequenceStep::TIE_POINT);
+	uint32_t trig_or_tie = trig|tie;
+	uint32_t other;
+	if(view == VIEW_GATE_TIE) {
+		row[0] = trig & tie;
+		row[1] = trig & ~tie;
+		row[2] = tie & ~trig;
+		return;
+	}
+	if(view == VIEW_PROB) {
+		other = page.get_prob_mask();
+	}
+	else if(view == VIEW_RETRIG) {
+		other = page.get_retrig_mask();
+	}
+	else {
+		other = page.get_mask(CSequenceStep::ACCENT_POINT);
+	}
+	row[0] = other & trig_or_tie;
+	row[1] = other & ~trig_or_tie;
+	row[2] = trig_or_tie & ~other;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static long long now_ns() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void print_times(const char *name, long long before, long long after) {
+	printf("%-18s %6.1f ns per call over steps, %6.1f ns over bitplanes\n", name,
+		(double)before / BENCH_CALLS, (double)after / BENCH_CALLS);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The bitplanes give the same results as the step array for each operation.
+// The times are printed rather than checked, since they depend on the host
+static void test_bench() {
+	CSequenceStep steps[MAX_STEPS];
+	CSequencePage page;
+	random_page(page, steps);
+	STEP_PAGE step_page;
+	for(int i=0; i<MAX_STEPS; ++i) {
+		step_page.step[i] = page.get_step(i);
+	}
+	volatile int sink = 0;
+	long long start;
+	long long before;
+	long long after;
+
+	// count_of over random ranges
+	int sum_before = 0;
+	int sum_after = 0;
+	g_prng.set_seed(3);
+	start = now_ns();
+	for(int n=0; n<BENCH_CALLS; ++n) {
+		CSequenceStep::POINT_TYPE type = (CSequenceStep::POINT_TYPE)(n % NUM_POINT_TYPES);
+		int from = n % MAX_STEPS;
+		sum_before += step_count_of(step_page, type, from, from + (n>>5) % MAX_STEPS);
+	}
+	before = now_ns() - start;
+	start = now_ns();
+	for(int n=0; n<BENCH_CALLS; ++n) {
+		CSequenceStep::POINT_TYPE type = (CSequenceStep::POINT_TYPE)(n % NUM_POINT_TYPES);
+		int from = n % MAX_STEPS;
+		sum_after += page.count_of(type, from, from + (n>>5) % MAX_STEPS);
+	}
+	after = now_ns() - start;
+	CHECK_EQUAL(sum_before, sum_after);
+	print_times("count_of", before, after);
+
+	// shift_horizontal, back and forth
+	start = now_ns();
+	for(int n=0; n<BENCH_CALLS; ++n) {
+		step_shift_horizontal(step_page, (n & 2)? -1 : 1);
+	}
+	before = now_ns() - start;
+	start = now_ns();
+	for(int n=0; n<BENCH_CALLS; ++n) {
+		page.shift_horizontal((n & 2)? -1 : 1);
+	}
+	after = now_ns() - start;
+	for(int i=0; i<MAX_STEPS; ++i) {
+		CSequenceStep step = page.get_step(i);
+		CHECK(same_step(step_page.step[i], step));
+	}
+	print_times("shift_horizontal", before, after);
+
+	// replace_gates over every pattern
+	start = now_ns();
+	for(int n=0; n<BENCH_CALLS; ++n) {
+		int positions = 1 + n % MAX_STEPS;
+		step_replace_gates(step_page, (n>>5) % (positions+1), positions, (n>>3) % MAX_STEPS);
+		sink += step_page.step[n % MAX_STEPS].is(CSequenceStep::TRIG_POINT);
+	}
+	before = now_ns() - start;
+	start = now_ns();
+	for(int n=0; n<BENCH_CALLS; ++n) {
+		int positions = 1 + n % MAX_STEPS;
+		page.replace_gates((n>>5) % (positions+1), positions, (n>>3) % MAX_STEPS);
+		sink += !!(page.get_mask(CSequenceStep::TRIG_POINT) & bit(n % MAX_STEPS));
+	}
+	after = now_ns() - start;
+	for(int i=0; i<MAX_STEPS; ++i) {
+		CSequenceStep step = page.get_step(i);
+		CHECK(same_step(step_page.step[i], step));
+	}
+	print_times("replace_gates", before, after);
+
+	// the gate row of the display, in each view
+	random_page(page, steps);
+	for(int i=0; i<MAX_STEPS; ++i) {
+		step_page.step[i] = page.get_step(i);
+	}
+	uint32_t row_before[3];
+	uint32_t row_after[3];
+	for(int view=0; view<NUM_VIEWS; ++view) {
+		step_gate_row(step_page, view, row_before);
+		plane_gate_row(page, view, row_after);
+		CHECK_EQUAL(row_before[0], row_after[0]);
+		CHECK_EQUAL(row_before[1], row_after[1]);
+		CHECK_EQUAL(row_before[2], row_after[2]);
+	}
+	start = now_ns();
+	for(int n=0; n<BENCH_CALLS; ++n) {
+		step_gate_row(step_page, n % NUM_VIEWS, row_before);
+		sink += row_before[0];
+	}
+	before = now_ns() - start;
+	start = now_ns();
+	for(int n=0; n<BENCH_CALLS; ++n) {
+		plane_gate_row(page, n % NUM_VIEWS, row_after);
+		sink += row_after[0];
+	}
+	after = now_ns() - start;
+	print_times("repaint gate row", before, after);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main() {
+	host_init();
+	test_steps();
+	test_shift();
+	test_replace_gates();
+	test_encode();
+	test_bench();
+	return test_result("page_points");
+}
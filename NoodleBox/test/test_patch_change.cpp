@@ -0,0 +1,214 @@
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// TEST: PATCH CHANGE ON THE BAR LINE (CSequence::run, CSequenceLayer::switch_content)
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+#include "host.h"
+
+//
+// The sequencer runs from the internal clock at 170 BPM, one ms at a time
+// as the main loop runs it. At this tempo the bar lines fall at different
+// points within the ms. Layer 1 of the old patch plays a trig on every 32nd
+// note on MIDI channel 1, slid early by less than a ms so that the step on
+// the bar line is played by the old patch just before it. Layer 1 of the
+// new patch plays a trig on every 8th note on channel 2. Each note on and
+// gate edge shows which patch played it and when
+//
+enum {
+	BPM = 170,
+	OLD_CHAN = 0,
+	NEW_CHAN = 1,
+	OLD_SLIDE_AMOUNT = 49,
+	OLD_SLIDE = -15,		// ticks, for a 32nd note step
+	MAX_MS = 20000
+};
+
+static const clock::TICKS_TYPE TICKS_PER_BAR = clock::pp24_to_ticks(clock::PP24_1);
+static const clock::TICKS_TYPE OLD_STEP = clock::pp24_to_ticks(clock::PP24_32);
+static const clock::TICKS_TYPE NEW_STEP = clock::pp24_to_ticks(clock::PP24_8);
+
+// what was played in one ms
+typedef struct {
+	clock::TICKS_TYPE ticks;		// tick window of the ms
+	clock::TICKS_TYPE next_ticks;
+	int notes[2];					// note ons on each channel
+	int rises;						// rising edges on the layer 1 gate..
+	uint16_t rise_offset[2];		// ..and their fine timer offsets
+} PLAYED;
+
+// the new patch is already in the patch cache, so the I2C bus is not used
+extern "C" {
+void I2C_MasterTransferCreateHandle(I2C_Type *base, i2c_master_handle_t *handle,
+		i2c_master_transfer_callback_t callback, void *userData) {
+}
+status_t I2C_MasterTransferNonBlocking(I2C_Type *base, i2c_master_handle_t *handle, i2c_master_transfer_t *xfer) {
+	CHECK(0);
+	return kStatus_Fail;
+}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Set up layer 1 of the working patch to trig every step
+static void make_patch(V_SQL_STEP_RATE rate, byte chan, byte slide) {
+	g_sequence.init();
+	g_sequence.init_state();
+	CSequenceLayer& layer = g_sequence.get_layer(0);
+	layer.set(P_SQL_STEP_RATE, rate);
+	if(slide) {
+		layer.set(P_SQL_OFF_GRID_MODE, V_SQL_OFF_GRID_MODE_SLIDE);
+		layer.set(P_SQL_OFF_GRID_AMOUNT, OLD_SLIDE_AMOUNT);
+	}
+	layer.set(P_SQL_TRIG_DUR, V_SQL_NOTE_DUR_TRIG);
+	layer.set(P_SQL_MIDI_OUT, V_SQL_MIDI_OUT_NOTE);
+	layer.set(P_SQL_MIDI_OUT_CHAN, chan);
+	for(int i=0; i<CSequencePage::MAX_STEPS; ++i) {
+		CSequenceStep step;
+		step.set_value(60);
+		step.set(CSequenceStep::TRIG_POINT, 1);
+		layer.set_step(0, i, step);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Count the note ons that have been queued for MIDI output
+static void count_notes(PLAYED& played) {
+	static byte status = 0;
+	static byte data[2];
+	static int num_data = 0;
+	int ch;
+	while((ch = g_midi.next_tx_byte()) >= 0) {
+		if(ch >= 0xF8) {
+			continue;	// realtime
+		}
+		if(ch & 0x80) {
+			status = ch;
+			num_data = 0;
+			continue;
+		}
+		data[num_data++] = ch;
+		if(num_data == 2) {
+			num_data = 0;
+			if((status & 0xF0) == 0x90 && data[1] && (status & 0x0F) < 2) {
+				++played.notes[status & 0x0F];
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Record a rising edge (or a retrigger of an open gate) on the layer 1 gate
+static void check_rise(PLAYED& played, COuts::GATE_STATUS prev, uint16_t offset) {
+	COuts::GATE_STATUS gate = g_outs.m_chan[0].gate_status;
+	if((prev == COuts::GATE_CLOSED && gate != COuts::GATE_CLOSED) ||
+		(prev != COuts::GATE_TRIG && gate == COuts::GATE_TRIG)) {
+		if(played.rises < 2) {
+			played.rise_offset[played.rises] = offset;
+		}
+		++played.rises;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Run the sequencer for one ms as the main loop does, letting the fine timer
+// run through the ms to fire the gate changes that were scheduled
+static void run_ms(PLAYED& played) {
+	host_tick_ms();
+	g_event_queue.run();
+	memset(&played, 0, sizeof played);
+	g_clock.get_tick_window(played.ticks, played.next_ticks);
+	uint16_t stamp = g_clock.get_ms_stamp();
+
+	COuts::GATE_STATUS prev = g_outs.m_chan[0].gate_status;
+	g_sequence.run();
+	check_rise(played, prev, 0);
+	while(FTM1->CONTROLS[0].CnSC & FTM_CnSC_CHIE_MASK) {
+		prev = g_outs.m_chan[0].gate_status;
+		FTM1->CNT = FTM1->CONTROLS[0].CnV;
+		FTM1_IRQHandler();
+		check_rise(played, prev, (uint16_t)(FTM1->CNT - stamp));
+	}
+	FTM1->CNT = stamp;
+	g_outs.run();
+	count_notes(played);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Whenever the new patch is asked for, the old patch plays every step due
+// before the next bar line and the new patch plays every step from it, with
+// no step played twice or lost, and each step on its exact tick
+static void test_switch() {
+	static byte image[CPatchCache::SZ_MAX_IMAGE];
+	make_patch(V_SQL_STEP_RATE_8, NEW_CHAN, 0);
+	CHECK(g_sequence.encode_patch(image, sizeof image) > 0);
+	g_clock.set(P_CLOCK_BPM, BPM);
+
+	int early_steps = 0;	// old steps played in the ms of the bar line
+	for(int request_ms = 1000; request_ms < 25000; request_ms += 97) {
+		CHECK(g_patch_cache.store_image(SLOT_PATCH2, image));
+		make_patch(V_SQL_STEP_RATE_32, OLD_CHAN, 1);
+		handle_event(EV_SEQ_RESTART, 0);
+
+		clock::TICKS_TYPE bar = clock::TICKS_INFINITY;
+		clock::TICKS_TYPE ticks = 0;
+		int failures = g_host_failures;
+		for(int ms = 0; ms < MAX_MS + request_ms; ++ms) {
+			if(ms == request_ms) {
+				CHECK(g_sequence.load_patch(SLOT_PATCH2));
+			}
+			PLAYED played;
+			run_ms(played);
+			ticks = played.ticks;
+			if(ms == request_ms) {
+				bar = TICKS_PER_BAR * ((played.ticks + TICKS_PER_BAR - 1) / TICKS_PER_BAR);
+			}
+			else if(ms > request_ms && played.ticks > bar + 2 * TICKS_PER_BAR) {
+				break;
+			}
+			if(!ms) {
+				continue;	// first step after the restart
+			}
+
+			// the steps of each patch that fall in this ms
+			clock::TICKS_TYPE step[2];
+			int num_steps = 0;
+			int notes[2] = {0};
+			clock::TICKS_TYPE old_step = OLD_STEP * ((played.ticks - OLD_SLIDE + OLD_STEP - 1) / OLD_STEP) + OLD_SLIDE;
+			if(old_step < played.next_ticks && old_step < bar) {
+				step[num_steps++] = old_step;
+				++notes[OLD_CHAN];
+			}
+			if(played.next_ticks > bar) {
+				clock::TICKS_TYPE from = (played.ticks > bar)? played.ticks : bar;
+				clock::TICKS_TYPE new_step = bar + NEW_STEP * ((from - bar + NEW_STEP - 1) / NEW_STEP);
+				if(new_step < played.next_ticks) {
+					step[num_steps++] = new_step;
+					++notes[NEW_CHAN];
+				}
+			}
+			if(num_steps == 2) {
+				++early_steps;
+			}
+
+			CHECK_EQUAL(notes[OLD_CHAN], played.notes[OLD_CHAN]);
+			CHECK_EQUAL(notes[NEW_CHAN], played.notes[NEW_CHAN]);
+			CHECK_EQUAL(num_steps, played.rises);
+			for(int i=0; i<num_steps && i<played.rises; ++i) {
+				CHECK_EQUAL(g_clock.ticks_to_fine(step[i] - played.ticks), played.rise_offset[i]);
+			}
+			if(g_host_failures != failures) {
+				printf("patch change asked for at %d ms, failed at %d ms\n", request_ms, ms);
+				return;
+			}
+		}
+		CHECK(bar + 2 * TICKS_PER_BAR < ticks);
+		handle_event(EV_SEQ_STOP, 0);
+	}
+	CHECK(early_steps > 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main() {
+	host_init();
+	test_switch();
+	return test_result("patch_change");
+}
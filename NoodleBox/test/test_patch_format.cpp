@@ -0,0 +1,206 @@
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// TEST: PACKED PATCH FORMAT (CSequence::encode_patch, CPatchCache::decode)
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+#include "host.h"
+
+enum {
+	SZ_PATCH = CPatchCache::SZ_PATCH,
+	SZ_MAX_IMAGE = CPatchCache::SZ_MAX_IMAGE
+};
+
+static CPrng g_prng(1);
+
+///////////////////////////////////////////////////////////////////////////////
+static void random_steps(CSequenceLayer& layer, int page_no) {
+	// mix runs of values (which get run length coded) with noise
+	int runs = g_prng.range(2);
+	byte value = g_prng.range(128);
+	for(int i=0; i<CSequencePage::MAX_STEPS; ++i) {
+		CSequenceStep step;
+		if(!runs || !g_prng.range(6)) {
+			value = g_prng.range(128);
+		}
+		step.set_value(value);
+		step.set(CSequenceStep::DATA_POINT, !g_prng.range(3));
+		step.set(CSequenceStep::TRIG_POINT, g_prng.range(2));
+		step.set(CSequenceStep::TIE_POINT, !g_prng.range(4));
+		step.set(CSequenceStep::ACCENT_POINT, !g_prng.range(5));
+		step.set(CSequenceStep::IGNORE_POINT, !g_prng.range(7));
+		if(page_no & 1) {
+			step.set_prob(g_prng.range(3)? 0 : g_prng.range(16));
+			step.set_retrig(g_prng.range(5)? 0 : g_prng.range(16));
+		}
+		layer.set_step(page_no, i, step);
+	}
+	layer.set_loop_from(page_no, g_prng.range(32));
+	layer.set_loop_to(page_no, g_prng.range(32));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fill the patch with random settings and steps
+static void random_patch() {
+	g_sequence.set(P_SEQ_SCALE_TYPE, g_prng.range(V_SQL_SCALE_TYPE_MAX));
+	g_sequence.set(P_SEQ_SCALE_ROOT, g_prng.range(12));
+	for(int i=0; i<CSequence::NUM_LAYERS; ++i) {
+		CSequenceLayer& layer = g_sequence.get_layer(i);
+		layer.init_config();
+		layer.set(P_SQL_SEQ_MODE, g_prng.range(V_SQL_SEQ_MODE_MAX));
+		layer.set(P_SQL_QUANTIZE, g_prng.range(3));
+		layer.set(P_SQL_STEP_RATE, g_prng.range(V_SQL_STEP_RATE_MAX));
+		layer.set(P_SQL_OFF_GRID_MODE, g_prng.range(4));
+		layer.set(P_SQL_OFF_GRID_AMOUNT, CSequenceLayer::MOD_AMOUNT_MIN + g_prng.range(51));
+		layer.set(P_SQL_TRIG_DUR, g_prng.range(V_SQL_NOTE_DUR_MAX));
+		layer.set(P_SQL_MIDI_OUT, g_prng.range(V_SQL_MIDI_OUT_MAX));
+		layer.set(P_SQL_MIDI_OUT_CHAN, g_prng.range(16));
+		layer.set(P_SQL_MIDI_VEL, g_prng.range(128));
+		layer.set(P_SQL_MIDI_ACC_VEL, g_prng.range(128));
+		layer.set(P_SQL_MIDI_CC, g_prng.range(128));
+		layer.set(P_SQL_MIDI_CC_SMOOTH, g_prng.range(2));
+		layer.set(P_SQL_CVSCALE, g_prng.range(V_SQL_CVSCALE_MAX));
+		layer.set(P_SQL_CVGLIDE, g_prng.range(V_SQL_CVGLIDE_MAX));
+		layer.set(P_SQL_MIX, g_prng.range(V_SQL_COMBINE_MAX));
+		layer.set(P_SQL_CV_OCTAVE, g_prng.range(V_SQL_CVSHIFT_MAX));
+		layer.set(P_SQL_CV_TRANSPOSE, (int)g_prng.range(2001) - 1000);
+		layer.set(P_SQL_SCALED_VIEW, g_prng.range(2));
+		layer.set(P_SQL_CV_ALIAS, g_prng.range(V_SQL_CV_ALIAS_MAX));
+		layer.set(P_SQL_GATE_ALIAS, g_prng.range(V_SQL_GATE_ALIAS_MAX));
+		layer.set_max_page_no(g_prng.range(CSequenceLayer::NUM_PAGES));
+		layer.set(P_SQL_LOOP_PER_PAGE, g_prng.range(2));
+		for(int page_no=0; page_no<=layer.get_max_page_no(); ++page_no) {
+			random_steps(layer, page_no);
+		}
+		layer.set(P_SQL_FILL_MODE, g_prng.range(V_SQL_FILL_MODE_MAX));
+		switch(g_prng.range(4)) {
+		case 0:
+			layer.cue_cancel();
+			break;
+		case 1:
+			layer.cue_all();
+			break;
+		case 2:
+			layer.cue_random();
+			break;
+		default:
+			layer.cue_first(g_prng.range(layer.get_max_page_no() + 1));
+			for(int n = g_prng.range(CSequenceLayer::MAX_CUE_LIST); n; --n) {
+				layer.cue_next(g_prng.range(layer.get_max_page_no() + 1));
+			}
+			break;
+		}
+		layer.set_rand_seed(g_prng.next());
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void get_patch(byte *dest) {
+	memset(dest, 0, SZ_PATCH);
+	g_sequence.get_cfg(&dest);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Set the length and checksum of an image after its sections have changed
+static int fix_image(byte *image, int len) {
+	image[2] = (byte)len;
+	image[3] = (byte)(len >> 8);
+	len += SZ_PATCH_HEADER;
+	image[len] = patch_checksum(image, len);
+	return len + 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Every patch decodes to exactly the settings it was encoded from, and the
+// image always fits a patch slot
+static void test_round_trip() {
+	static byte image[SZ_MAX_IMAGE];
+	static byte expected[SZ_PATCH];
+	static byte decoded[SZ_PATCH];
+	int max_len = 0;
+	for(int i=0; i<500; ++i) {
+		random_patch();
+		get_patch(expected);
+		int len = g_sequence.encode_patch(image, sizeof image);
+		CHECK(len > 0 && len <= PATCH_SLOT_SIZE);
+		CHECK_EQUAL(len, patch_image_size(image));
+		memset(decoded, 0, sizeof decoded);
+		CHECK(CPatchCache::decode(image, sizeof image, decoded));
+		if(memcmp(expected, decoded, sizeof decoded)) {
+			printf("patch %d does not decode to the same settings\n", i);
+			++g_host_failures;
+			return;
+		}
+		if(len > max_len) {
+			max_len = len;
+		}
+	}
+	CHECK(max_len <= SZ_MAX_IMAGE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Damaged and incomplete images are rejected
+static void test_bad_image() {
+	static byte image[SZ_MAX_IMAGE];
+	static byte decoded[SZ_PATCH];
+	random_patch();
+	int len = g_sequence.encode_patch(image, sizeof image);
+
+	// too short to hold the whole image
+	CHECK(!CPatchCache::decode(image, len - 1, decoded));
+	CHECK(!CPatchCache::decode(image, SZ_PATCH_HEADER - 1, decoded));
+
+	// checksum
+	image[len/2] ^= 0x10;
+	CHECK(!CPatchCache::decode(image, len, decoded));
+	image[len/2] ^= 0x10;
+	CHECK(CPatchCache::decode(image, len, decoded));
+
+	// unknown cookie or version
+	image[0] ^= 0xFF;
+	CHECK_EQUAL(0, patch_image_size(image));
+	image[0] ^= 0xFF;
+	image[1] = PATCH_FORMAT_PACKED + 1;
+	CHECK_EQUAL(0, patch_image_size(image));
+	image[1] = PATCH_FORMAT_PACKED;
+
+	// missing the last page section
+	const byte *sections = image + SZ_PATCH_HEADER;
+	int last = 0;
+	for(int pos = 0; pos < len - SZ_PATCH_HEADER - 1; pos += 2 + sections[pos + 1]) {
+		last = pos;
+	}
+	CHECK_EQUAL(PATCH_SECTION_PAGE, sections[last]);
+	CHECK(!CPatchCache::decode(image, fix_image(image, last), decoded));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sections added by a later version are skipped
+static void test_unknown_section() {
+	static byte image[SZ_MAX_IMAGE];
+	static byte expected[SZ_PATCH];
+	static byte decoded[SZ_PATCH];
+	random_patch();
+	get_patch(expected);
+	int len = g_sequence.encode_patch(image, sizeof image) - SZ_PATCH_HEADER - 1;
+
+	// insert a section after the scale section
+	static const byte extra[] = { 0x7F, 3, 1, 2, 3 };
+	byte *first = image + SZ_PATCH_HEADER + 2 + image[SZ_PATCH_HEADER + 1];
+	memmove(first + sizeof extra, first, len - (first - image - SZ_PATCH_HEADER));
+	memcpy(first, extra, sizeof extra);
+	len = fix_image(image, len + sizeof extra);
+
+	memset(decoded, 0, sizeof decoded);
+	CHECK(CPatchCache::decode(image, len, decoded));
+	CHECK(!memcmp(expected, decoded, sizeof decoded));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main() {
+	host_init();
+	g_sequence.init();
+	test_round_trip();
+	test_bad_image();
+	test_unknown_section();
+	return test_result("patch_format");
+}
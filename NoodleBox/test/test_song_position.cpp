@@ -0,0 +1,167 @@
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// TEST: SONG POSITION CHASE (CSequenceLayer::chase)
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+#include "host.h"
+
+enum {
+	NUM_POSITIONS = 300,	// song positions (16th notes) to check
+	COMPARE_STEPS = 40		// steps played after the song position
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Play a layer over a range of ticks, a number of ticks at a time. Returns
+// the number of steps played
+static int play(CSequenceLayer& layer, clock::TICKS_TYPE from, clock::TICKS_TYPE to, clock::TICKS_TYPE chunk) {
+	int steps = 0;
+	CSequenceStep step;
+	for(clock::TICKS_TYPE t = from; t < to; t += chunk) {
+		if(layer.play(t, t + chunk, nullptr, step)) {
+			++steps;
+		}
+	}
+	return steps;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Play a copy of a layer from the start, one tick at a time, and at each
+// song position check that a layer chased to that position plays the same
+// steps from there on
+static void check_chase(const char *name, const CSequenceLayer& base) {
+	int failures = g_host_failures;
+	CSequenceLayer played = base;
+	played.reset();
+	clock::TICKS_TYPE ticks_per_step = clock::pp24_to_ticks(
+			clock::pp24_per_measure((V_SQL_STEP_RATE)played.get(P_SQL_STEP_RATE)));
+	clock::TICKS_TYPE chunk = ticks_per_step/8;
+	for(int pos = 0; pos < NUM_POSITIONS; ++pos) {
+		clock::TICKS_TYPE ticks = clock::pp24_to_ticks(pos * clock::PP24_16);
+		if(pos) {
+			play(played, ticks - clock::pp24_to_ticks(clock::PP24_16), ticks, 1);
+		}
+
+		CSequenceLayer expected = played;
+		CSequenceLayer chased = base;
+		chased.chase(pos);
+		CHECK_EQUAL(expected.get_play_page(), chased.get_play_page());
+		CHECK_EQUAL(expected.get_pos(), chased.get_pos());
+
+		// carry on playing both and check they stay together
+		CSequenceStep step;
+		for(clock::TICKS_TYPE t = ticks; t < ticks + COMPARE_STEPS * ticks_per_step; t += chunk) {
+			byte expected_play = expected.play(t, t + chunk, nullptr, step);
+			byte chased_play = chased.play(t, t + chunk, nullptr, step);
+			CHECK_EQUAL(expected_play, chased_play);
+			CHECK_EQUAL(expected.get_play_page(), chased.get_play_page());
+			CHECK_EQUAL(expected.get_pos(), chased.get_pos());
+			CHECK_EQUAL(expected.is_page_advanced(), chased.is_page_advanced());
+		}
+		if(g_host_failures != failures) {
+			printf("%s: song position %d does not match\n", name, pos);
+			return;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void init_layer(CSequenceLayer& layer) {
+	layer.set_id(0);
+	layer.init();
+	layer.set_rand_seed(1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void test_step_rates() {
+	static const V_SQL_STEP_RATE rate[] = {
+		V_SQL_STEP_RATE_16, V_SQL_STEP_RATE_8, V_SQL_STEP_RATE_8T,
+		V_SQL_STEP_RATE_16T, V_SQL_STEP_RATE_32, V_SQL_STEP_RATE_4D,
+		V_SQL_STEP_RATE_1
+	};
+	for(unsigned int i=0; i<sizeof(rate)/sizeof(rate[0]); ++i) {
+		CSequenceLayer layer;
+		init_layer(layer);
+		layer.set(P_SQL_STEP_RATE, rate[i]);
+		check_chase("step rate", layer);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void test_loops() {
+	CSequenceLayer layer;
+	init_layer(layer);
+	layer.set_loop_from(0, 3);
+	layer.set_loop_to(0, 9);
+	check_chase("loop", layer);
+
+	// running backwards
+	layer.set_loop_from(0, 12);
+	layer.set_loop_to(0, 2);
+	check_chase("reverse loop", layer);
+
+	// single step
+	layer.set_loop_from(0, 5);
+	layer.set_loop_to(0, 5);
+	check_chase("one step loop", layer);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void test_cueing() {
+	CSequenceLayer layer;
+	init_layer(layer);
+	layer.set_max_page_no(3);
+	layer.set_loop_per_page(1);
+	layer.set_loop_from(0, 0);
+	layer.set_loop_to(0, 7);
+	layer.set_loop_from(1, 4);
+	layer.set_loop_to(1, 6);
+	layer.set_loop_from(2, 15);
+	layer.set_loop_to(2, 5);
+	layer.set_loop_from(3, 1);
+	layer.set_loop_to(3, 1);
+
+	CSequenceLayer all = layer;
+	all.cue_all();
+	check_chase("cue all", all);
+
+	CSequenceLayer list = layer;
+	list.cue_first(2);
+	list.cue_next(0);
+	list.cue_next(2);
+	list.cue_next(3);
+	list.cue_next(1);
+	check_chase("cue list", list);
+
+	CSequenceLayer one = layer;
+	one.cue_first(1);
+	check_chase("cue one page", one);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+static void test_off_grid() {
+	static const V_SQL_OFF_GRID_MODE mode[] = {
+		V_SQL_OFF_GRID_MODE_SWING, V_SQL_OFF_GRID_MODE_SLIDE
+	};
+	static const int amount[] = { 25, 40, 60, 75 };
+	for(unsigned int i=0; i<sizeof(mode)/sizeof(mode[0]); ++i) {
+		for(unsigned int j=0; j<sizeof(amount)/sizeof(amount[0]); ++j) {
+			CSequenceLayer layer;
+			init_layer(layer);
+			layer.set(P_SQL_OFF_GRID_MODE, mode[i]);
+			layer.set(P_SQL_OFF_GRID_AMOUNT, amount[j]);
+			layer.set_loop_from(0, 1);
+			layer.set_loop_to(0, 10);
+			check_chase("off grid", layer);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main() {
+	host_init();
+	test_step_rates();
+	test_loops();
+	test_cueing();
+	test_off_grid();
+	return test_result("song_position");
+}
@@ -0,0 +1,292 @@
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// TEST: EXTERNAL CLOCK TRACKING (CTempoTracker, CMidiClockSource, CPulseClockSource)
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+#include "host.h"
+#include <math.h>
+
+using clock::CTempoTracker;
+
+enum {
+	PERIOD_120BPM = 20833,		// us between MIDI clock ticks at 120 BPM
+	PERIOD_90BPM = 27778,
+	PULSE_120BPM = 125000		// us between 16th note pulses at 120 BPM
+};
+
+static CPrng g_prng(1);
+
+///////////////////////////////////////////////////////////////////////////////
+// Random jitter in the range -amount..amount
+static int jitter(int amount) {
+	return amount? (int)g_prng.range(2 * amount + 1) - amount : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Feed edges at a steady period with jitter, returning the largest error
+// in the period estimate after the first settle edges. The RMS error over
+// the same edges is passed back in rms if it is wanted
+static int track(CTempoTracker& t, uint32_t& us, int period, int amount, int edges, int settle, double *rms = nullptr) {
+	int max_error = 0;
+	double sum_squares = 0;
+	for(int i=0; i<edges; ++i) {
+		us += period;
+		t.on_edge(us + jitter(amount));
+		if(i >= settle) {
+			int error = (int)t.get_period_us() - period;
+			sum_squares += (double)error * error;
+			if(error < 0) {
+				error = -error;
+			}
+			if(error > max_error) {
+				max_error = error;
+			}
+		}
+	}
+	if(rms) {
+		*rms = (edges > settle)? sqrt(sum_squares / (edges - settle)) : 0;
+	}
+	return max_error;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Without jitter the tracker locks on the second edge to the exact period,
+// and stays there, including when the us count wraps. The lock time is
+// reported for each filter setting
+static void test_lock() {
+	for(int filter=0; filter<V_CLOCK_IN_FILTER_MAX; ++filter) {
+		CTempoTracker t;
+		t.set_filter((V_CLOCK_IN_FILTER)filter);
+		uint32_t us = 0xFFFFFFFFU - 50 * PERIOD_120BPM;
+		t.on_edge(us);
+		int edges = 1;
+		while(edges < 10 && !t.is_locked()) {
+			us += PERIOD_120BPM;
+			t.on_edge(us);
+			++edges;
+		}
+		printf("filter %d: locked after %d edges (%d us at 120 BPM)\n", filter, edges, (edges - 1) * PERIOD_120BPM);
+		CHECK_EQUAL(2, edges);
+		CHECK_EQUAL(PERIOD_120BPM, t.get_period_us());
+		CHECK_EQUAL(0, track(t, us, PERIOD_120BPM, 0, 100, 0));
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Jitter on the edges is smoothed out, more so with more filtering. The
+// variation in the output tempo is reported for each filter setting
+static void test_jitter() {
+	static const int max_error[V_CLOCK_IN_FILTER_MAX] = { 2001, 400, 120, 50 };
+	int prev_error = 0;
+	for(int filter=0; filter<V_CLOCK_IN_FILTER_MAX; ++filter) {
+		CTempoTracker t;
+		t.set_filter((V_CLOCK_IN_FILTER)filter);
+		uint32_t us = 0;
+		t.on_edge(us);
+		double rms;
+		int error = track(t, us, PERIOD_120BPM, 1000, 5000, 200, &rms);
+		printf("filter %d, +/-1000 us jitter: tempo error %.3f%% RMS, %.3f%% max\n", filter,
+				100.0 * rms / PERIOD_120BPM, 100.0 * error / PERIOD_120BPM);
+		CHECK(error < max_error[filter]);
+		if(filter) {
+			CHECK(error < prev_error);
+		}
+		prev_error = error;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A jump in tempo is followed within two edges (as closely as the jitter
+// on those edges allows) and then settles, and a gradual change is followed
+// closely. The number of edges to settle within 1% of the new tempo is
+// reported for each filter setting
+static void test_tempo_change() {
+	for(int filter=V_CLOCK_IN_FILTER_LOW; filter<V_CLOCK_IN_FILTER_MAX; ++filter) {
+		CTempoTracker t;
+		t.set_filter((V_CLOCK_IN_FILTER)filter);
+		uint32_t us = 0;
+		t.on_edge(us);
+		track(t, us, PERIOD_120BPM, 500, 500, 0);
+		track(t, us, PERIOD_90BPM, 500, 2, 0);
+		CHECK(abs((int)t.get_period_us() - PERIOD_90BPM) <= 1000);
+		int edges = 2;
+		while(edges < 100 && abs((int)t.get_period_us() - PERIOD_90BPM) >= PERIOD_90BPM/100) {
+			track(t, us, PERIOD_90BPM, 500, 1, 0);
+			++edges;
+		}
+		printf("filter %d, 120 to 90 BPM: within 1%% after %d edges\n", filter, edges);
+		CHECK(track(t, us, PERIOD_90BPM, 500, 100, 50) < PERIOD_90BPM/100);
+
+		// slowing down by 2us per edge, from 90 to about 150 BPM
+		int period = PERIOD_90BPM;
+		int max_error = 0;
+		for(int i=0; i<5000; ++i) {
+			period -= 2;
+			us += period;
+			t.on_edge(us);
+			int error = abs((int)t.get_period_us() - period);
+			if(i > 200 && error > max_error) {
+				max_error = error;
+			}
+		}
+		CHECK(max_error < 64);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A single late or early edge, or a missing edge, does not upset the tempo
+static void test_outliers() {
+	for(int filter=V_CLOCK_IN_FILTER_LOW; filter<V_CLOCK_IN_FILTER_MAX; ++filter) {
+		CTempoTracker t;
+		t.set_filter((V_CLOCK_IN_FILTER)filter);
+		uint32_t us = 0;
+		t.on_edge(us);
+		track(t, us, PERIOD_120BPM, 0, 100, 0);
+		static const int shift[] = { PERIOD_120BPM/3, -PERIOD_120BPM/3, PERIOD_120BPM };
+		for(unsigned int i=0; i<sizeof(shift)/sizeof(shift[0]); ++i) {
+			t.on_edge(us + PERIOD_120BPM + shift[i]);
+			us += PERIOD_120BPM;
+			CHECK_EQUAL(PERIOD_120BPM, t.get_period_us());
+			CHECK_EQUAL(0, track(t, us, PERIOD_120BPM, 0, 100, 0));
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Ticks handed out per ms over a second
+static uint32_t ticks_per_second(clock::CTickRate& rate) {
+	uint32_t remainder = 0;
+	uint32_t ticks = 0;
+	for(int ms=0; ms<1000; ++ms) {
+		ticks += rate.next_ms(remainder);
+	}
+	return ticks;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A jittery MIDI clock gives a steady tick rate, which is kept over a stop
+// and continue
+static void test_midi_clock() {
+	const uint32_t expected = 2 * clock::pp24_to_ticks(clock::PP24_4);	// 120 BPM
+	clock::CMidiClockSource source;
+	uint32_t us = 1000;
+	for(int i=0; i<200; ++i, us += PERIOD_120BPM) {
+		source.on_midi_realtime(midi::MIDI_TICK, us + jitter(1000));
+	}
+	uint32_t ticks = ticks_per_second(source.ticks_per_ms());
+	CHECK(abs((int)(ticks - expected)) < (int)expected/200);
+
+	source.on_midi_realtime(midi::MIDI_STOP, us);
+	us += 5000000;
+	source.on_midi_realtime(midi::MIDI_CONTINUE, us);
+	source.on_midi_realtime(midi::MIDI_TICK, us);
+	CHECK_EQUAL(ticks, ticks_per_second(source.ticks_per_ms()));
+	for(int i=0; i<20; ++i) {
+		us += PERIOD_120BPM;
+		source.on_midi_realtime(midi::MIDI_TICK, us + jitter(1000));
+	}
+	ticks = ticks_per_second(source.ticks_per_ms());
+	CHECK(abs((int)(ticks - expected)) < (int)expected/50);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Start a pulse clock source running at 16th notes
+static void start_pulses(clock::CPulseClockSource& source, uint32_t& us, int pulses, int amount) {
+	source.event(EV_CLOCK_RESET, 0);
+	source.set_rate(V_CLOCK_IN_RATE_16);
+	source.set_filter(V_CLOCK_IN_FILTER_MED);
+	for(int i=0; i<pulses; ++i, us += PULSE_120BPM) {
+		source.on_pulse(us + jitter(amount));
+	}
+	us -= PULSE_120BPM;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A jittery pulse clock gives a steady tick rate
+static void test_pulse_rate() {
+	const uint32_t expected = 2 * clock::pp24_to_ticks(clock::PP24_4);	// 120 BPM
+	clock::CPulseClockSource source;
+	uint32_t us = 1000;
+	start_pulses(source, us, 100, 2000);
+	uint32_t ticks = ticks_per_second(source.ticks_per_ms());
+	CHECK(abs((int)(ticks - expected)) < (int)expected/200);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// While freewheeling, missing pulses are counted (up to the freewheel
+// period) so that the count carries on from the right place
+static void test_pulse_freewheel() {
+	const clock::TICKS_TYPE period = clock::pp24_to_ticks(clock::PP24_16);
+	const clock::TICKS_TYPE freewheel = clock::pp24_to_ticks(clock::PP24_4);
+	static const struct {
+		V_CLOCK_IN_FREEWHEEL freewheel;
+		int missing;
+		int counted;
+	} test[] = {
+		{ V_CLOCK_IN_FREEWHEEL_OFF, 2, 0 },
+		{ V_CLOCK_IN_FREEWHEEL_1, 1, 1 },
+		{ V_CLOCK_IN_FREEWHEEL_1, 2, 2 },
+		{ V_CLOCK_IN_FREEWHEEL_1, 3, 3 },
+		{ V_CLOCK_IN_FREEWHEEL_1, 6, 4 }
+	};
+	for(unsigned int i=0; i<sizeof(test)/sizeof(test[0]); ++i) {
+		clock::CPulseClockSource source;
+		source.set_freewheel(test[i].freewheel);
+		uint32_t us = 1000;
+		start_pulses(source, us, 20, 0);
+		clock::TICKS_TYPE ticks = source.min_ticks();
+		CHECK_EQUAL(ticks + period + (test[i].freewheel? freewheel : 0), source.max_ticks());
+
+		// a little early or late as well as missing pulses
+		us += (1 + test[i].missing) * PULSE_120BPM + ((i & 1)? -PULSE_120BPM/10 : PULSE_120BPM/10);
+		source.on_pulse(us);
+		CHECK_EQUAL(ticks + (1 + test[i].counted) * period, source.min_ticks());
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The clock is taken to have stopped when pulses have been missing for the
+// timeout plus the freewheel period, and then no longer freewheels
+static void test_pulse_timeout() {
+	const clock::TICKS_TYPE period = clock::pp24_to_ticks(clock::PP24_16);
+	static const struct {
+		V_CLOCK_IN_FREEWHEEL freewheel;
+		int pulses;		// missing pulses before the clock is stopped
+	} test[] = {
+		{ V_CLOCK_IN_FREEWHEEL_OFF, 4 },
+		{ V_CLOCK_IN_FREEWHEEL_1, 8 },
+		{ V_CLOCK_IN_FREEWHEEL_2, 12 }
+	};
+	for(unsigned int i=0; i<sizeof(test)/sizeof(test[0]); ++i) {
+		clock::CPulseClockSource source;
+		source.set_freewheel(test[i].freewheel);
+		uint32_t us = 1000;
+		start_pulses(source, us, 20, 0);
+		clock::TICKS_TYPE running = source.max_ticks();
+		source.run(us + test[i].pulses * PULSE_120BPM);
+		CHECK_EQUAL(running, source.max_ticks());
+		source.run(us + test[i].pulses * PULSE_120BPM + 1);
+		CHECK_EQUAL(source.min_ticks() + period, source.max_ticks());
+
+		// pulses start it again, freewheeling once it has locked
+		us += 100 * PULSE_120BPM;
+		source.on_pulse(us);
+		CHECK_EQUAL(source.min_ticks() + period, source.max_ticks());
+		source.on_pulse(us + PULSE_120BPM);
+		CHECK_EQUAL(source.min_ticks() + period + clock::freewheel_ticks(test[i].freewheel), source.max_ticks());
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main() {
+	host_init();
+	test_lock();
+	test_jitter();
+	test_tempo_change();
+	test_outliers();
+	test_midi_clock();
+	test_pulse_rate();
+	test_pulse_freewheel();
+	test_pulse_timeout();
+	return test_result("tempo_tracker");
+}
@@ -0,0 +1,119 @@
+//////////////////////////////////////////////////////////////////////////////
+//                                                                          //
+// TEST: FIXED POINT TEMPO ENGINE (CTickRate, CClock)
+//                                                                          //
+//////////////////////////////////////////////////////////////////////////////
+#include "host.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Whole ticks handed out over a number of ms must add up to the exact rate,
+// however long it runs
+static void test_no_drift() {
+	static const uint32_t rate[][2] = {
+		{ 120 * 6144, 60000 },		// 120 BPM
+		{ 97 * 6144, 60000 },		// a tempo that does not divide evenly
+		{ 300 * 6144, 60000 },		// fastest internal tempo
+		{ 1, 3 },					// less than one tick per ms
+		{ 256 * 24, 7919 },			// external clock with an odd period
+		{ 5, 1 }					// whole number of ticks per ms
+	};
+	for(unsigned int i=0; i<sizeof(rate)/sizeof(rate[0]); ++i) {
+		clock::CTickRate r;
+		r.set(rate[i][0], rate[i][1]);
+		uint32_t remainder = 0;
+		uint64_t ticks = 0;
+		const uint32_t ms = 10 * rate[i][1];
+		for(uint32_t t=0; t<ms; ++t) {
+			ticks += r.next_ms(remainder);
+		}
+		CHECK_EQUAL(10ULL * rate[i][0], ticks);
+		CHECK_EQUAL(0, remainder);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// No ms ever gets more than one tick more than another at a steady rate
+static void test_even_spread() {
+	clock::CTickRate r;
+	r.set(97 * 6144, 60000);
+	uint32_t remainder = 0;
+	clock::TICKS_TYPE lo = 0xFFFFFFFF;
+	clock::TICKS_TYPE hi = 0;
+	for(int t=0; t<60000; ++t) {
+		clock::TICKS_TYPE ticks = r.next_ms(remainder);
+		if(ticks < lo) {
+			lo = ticks;
+		}
+		if(ticks > hi) {
+			hi = ticks;
+		}
+	}
+	CHECK(hi - lo <= 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// A remainder left over from a slower rate does not give a burst of ticks
+static void test_rate_change() {
+	clock::CTickRate r;
+	r.set(1, 1000);
+	uint32_t remainder = 999;
+	r.set(1, 10);
+	CHECK_EQUAL(1, r.next_ms(remainder));
+	CHECK(remainder < 10);
+	r.clear();
+	CHECK(r.is_zero());
+	CHECK_EQUAL(0, r.next_ms(remainder));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// At every internal tempo the tick total after 24 hours is exact. The rate is
+// bpm * 6144 ticks per 60000 ms, so the fractional ticks carried from ms to
+// ms come back to zero every 60000 ms and the count repeats from there. One
+// period with an exact total and no remainder gives the exact 24 hour total
+static void test_24_hours() {
+	enum {
+		PERIOD_MS = 60000,
+		DAY_MS = 24 * 60 * 60 * 1000
+	};
+	for(int bpm=30; bpm<=300; ++bpm) {
+		clock::g_fixed_clock.set_bpm(bpm);
+		clock::CTickRate& r = clock::g_fixed_clock.ticks_per_ms();
+		uint32_t remainder = 0;
+		uint64_t ticks = 0;
+		for(int t=0; t<PERIOD_MS; ++t) {
+			ticks += r.next_ms(remainder);
+		}
+		CHECK_EQUAL(0, remainder);
+		ticks *= DAY_MS / PERIOD_MS;
+		if(ticks != (uint64_t)bpm * 6144 * 24 * 60) {
+			printf("%d BPM is %lld ticks out after 24 hours\n", bpm,
+					(long long)(ticks - (uint64_t)bpm * 6144 * 24 * 60));
+			++g_host_failures;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The master clock running from the internal source moves on by exactly one
+// quarter note (6144 ticks) per beat, at every tempo
+static void test_internal_clock() {
+	for(int bpm=30; bpm<=300; ++bpm) {
+		clock::g_fixed_clock.set_bpm(bpm);
+		g_clock.init_state();
+		for(int t=0; t<60000; ++t) {
+			host_tick_ms();
+		}
+		CHECK_EQUAL(bpm * 6144, g_clock.get_ticks());
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main() {
+	host_init();
+	test_no_drift();
+	test_even_spread();
+	test_rate_change();
+	test_24_hours();
+	test_internal_clock();
+	return test_result("tick_rate");
+}